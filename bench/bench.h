@@ -0,0 +1,113 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_BENCH_H_
+#define NCCL_BENCH_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <cuda_runtime.h>
+
+// Benchmarks abort on the first error : there is nothing to recover.
+#define BENCHCUDA(cmd) do {                                     \
+  cudaError_t e = cmd;                                          \
+  if (e != cudaSuccess) {                                       \
+    fprintf(stderr, "%s:%d Cuda failure '%s'\n", __FILE__, __LINE__, cudaGetErrorString(e)); \
+    exit(EXIT_FAILURE);                                         \
+  }                                                             \
+} while(0)
+
+#define BENCHNCCL(cmd) do {                                     \
+  ncclResult_t r = cmd;                                         \
+  if (r != ncclSuccess) {                                       \
+    fprintf(stderr, "%s:%d NCCL failure %d\n", __FILE__, __LINE__, r); \
+    exit(EXIT_FAILURE);                                         \
+  }                                                             \
+} while(0)
+
+static inline double benchTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// Parse sizes like 8, 64K, 128M, 1G
+static inline size_t benchParseSize(const char* str) {
+  char* end;
+  double v = strtod(str, &end);
+  switch (*end) {
+    case 'G': case 'g': v *= 1024; // fallthrough
+    case 'M': case 'm': v *= 1024; // fallthrough
+    case 'K': case 'k': v *= 1024; break;
+  }
+  return (size_t)v;
+}
+
+// Results are printed as an aligned table (default), CSV or JSON lines
+// output by all benchmarks in the same way, so that scripts can parse any
+// of them. Each result is a list of named columns.
+enum benchFormat { benchText, benchCsv, benchJson };
+
+static inline enum benchFormat benchParseFormat(const char* str) {
+  if (strcmp(str, "csv") == 0) return benchCsv;
+  if (strcmp(str, "json") == 0) return benchJson;
+  if (strcmp(str, "text") == 0) return benchText;
+  fprintf(stderr, "Unknown output format %s (text, csv or json)\n", str);
+  exit(EXIT_FAILURE);
+}
+
+#define BENCH_MAX_COLUMNS 16
+
+struct benchRow {
+  int n;
+  const char* names[BENCH_MAX_COLUMNS];
+  char values[BENCH_MAX_COLUMNS][64];
+  int quoted[BENCH_MAX_COLUMNS];
+};
+
+static inline void benchRowStr(struct benchRow* row, const char* name, const char* value) {
+  row->names[row->n] = name;
+  snprintf(row->values[row->n], 64, "%s", value);
+  row->quoted[row->n++] = 1;
+}
+
+static inline void benchRowInt(struct benchRow* row, const char* name, long long value) {
+  row->names[row->n] = name;
+  snprintf(row->values[row->n], 64, "%lld", value);
+  row->quoted[row->n++] = 0;
+}
+
+static inline void benchRowFloat(struct benchRow* row, const char* name, double value) {
+  row->names[row->n] = name;
+  snprintf(row->values[row->n], 64, "%.3f", value);
+  row->quoted[row->n++] = 0;
+}
+
+static inline void benchPrintRow(enum benchFormat format, struct benchRow* row, int* printedHeader) {
+  if (format == benchJson) {
+    printf("{");
+    for (int i=0; i<row->n; i++) {
+      printf(row->quoted[i] ? "%s\"%s\":\"%s\"" : "%s\"%s\":%s", i ? "," : "", row->names[i], row->values[i]);
+    }
+    printf("}\n");
+  } else {
+    const char* sep = format == benchCsv ? "," : " ";
+    if (*printedHeader == 0) {
+      for (int i=0; i<row->n; i++) printf(format == benchCsv ? "%s%s" : "%s%14s", i ? sep : "", row->names[i]);
+      printf("\n");
+      *printedHeader = 1;
+    }
+    for (int i=0; i<row->n; i++) printf(format == benchCsv ? "%s%s" : "%s%14s", i ? sep : "", row->values[i]);
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+#endif
@@ -0,0 +1,160 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+// Collective benchmark : sweeps all collectives over message sizes on the
+// GPUs of this process (ncclCommInitAll), and reports algorithm and bus
+// bandwidth computed as in nccl-tests, so that numbers can be compared.
+
+#include "nccl.h"
+#include "bench.h"
+#include <algorithm>
+
+#define MAX_GPUS 16
+
+enum { collAllReduce, collAllGather, collReduceScatter, collBroadcast, collReduce, collAllToAll, collCount };
+static const char* collNames[collCount] = { "allreduce", "allgather", "reducescatter", "broadcast", "reduce", "alltoall" };
+
+// Bus bandwidth factor (nccl-tests conventions). Sizes are the size of the
+// largest buffer : the output of AllGather, the input of ReduceScatter.
+static double busBwFactor(int coll, int nranks) {
+  switch (coll) {
+    case collAllReduce: return 2.0*(nranks-1)/nranks;
+    case collAllGather:
+    case collReduceScatter:
+    case collAllToAll: return (double)(nranks-1)/nranks;
+    default: return 1;
+  }
+}
+
+struct collBench {
+  int nranks;
+  ncclComm_t comms[MAX_GPUS];
+  cudaStream_t streams[MAX_GPUS];
+  float* sendbuffs[MAX_GPUS];
+  float* recvbuffs[MAX_GPUS];
+};
+
+// Launch one operation of size bytes (largest buffer) on all ranks
+static void collLaunch(struct collBench* b, int coll, size_t bytes) {
+  size_t count = bytes/sizeof(float);
+  size_t rankCount = count/b->nranks;
+  BENCHNCCL(ncclGroupStart());
+  for (int r=0; r<b->nranks; r++) {
+    const float* s = b->sendbuffs[r];
+    float* d = b->recvbuffs[r];
+    cudaStream_t st = b->streams[r];
+    switch (coll) {
+      case collAllReduce: BENCHNCCL(ncclAllReduce(s, d, count, ncclFloat, ncclSum, b->comms[r], st)); break;
+      case collAllGather: BENCHNCCL(ncclAllGather(s, d, rankCount, ncclFloat, b->comms[r], st)); break;
+      case collReduceScatter: BENCHNCCL(ncclReduceScatter(s, d, rankCount, ncclFloat, ncclSum, b->comms[r], st)); break;
+      case collBroadcast: BENCHNCCL(ncclBroadcast(s, d, count, ncclFloat, 0, b->comms[r], st)); break;
+      case collReduce: BENCHNCCL(ncclReduce(s, d, count, ncclFloat, ncclSum, 0, b->comms[r], st)); break;
+      case collAllToAll: BENCHNCCL(ncclAllToAll(s, d, rankCount, ncclFloat, b->comms[r], st)); break;
+    }
+  }
+  BENCHNCCL(ncclGroupEnd());
+}
+
+static void collSync(struct collBench* b) {
+  for (int r=0; r<b->nranks; r++) BENCHCUDA(cudaStreamSynchronize(b->streams[r]));
+}
+
+static void usage(const char* name) {
+  printf("Usage : %s [-g nGpus] [-c coll[,coll...]] [-b minBytes] [-e maxBytes] [-f factor] [-n iters] [-w warmup] [-o text|csv|json]\n"
+         "  colls : all", name);
+  for (int c=0; c<collCount; c++) printf(", %s", collNames[c]);
+  printf("\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+  int nGpus = 0;
+  int colls[collCount] = { 0 };
+  int anyColl = 0;
+  size_t minBytes = 8, maxBytes = 128*1024*1024;
+  int factor = 2, iters = 20, warmup = 5;
+  enum benchFormat format = benchText;
+  int c;
+  while ((c = getopt(argc, argv, "g:c:b:e:f:n:w:o:h")) != -1) {
+    switch (c) {
+      case 'g': nGpus = atoi(optarg); break;
+      case 'c': {
+        char* list = strdup(optarg);
+        for (char* tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+          int found = 0;
+          for (int i=0; i<collCount; i++) {
+            if (strcmp(tok, "all") == 0 || strcmp(tok, collNames[i]) == 0) { colls[i] = 1; found = 1; }
+          }
+          if (!found) usage(argv[0]);
+        }
+        free(list);
+        anyColl = 1;
+        break;
+      }
+      case 'b': minBytes = benchParseSize(optarg); break;
+      case 'e': maxBytes = benchParseSize(optarg); break;
+      case 'f': factor = atoi(optarg); break;
+      case 'n': iters = atoi(optarg); break;
+      case 'w': warmup = atoi(optarg); break;
+      case 'o': format = benchParseFormat(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (!anyColl) for (int i=0; i<collCount; i++) colls[i] = 1;
+  if (nGpus == 0) BENCHCUDA(cudaGetDeviceCount(&nGpus));
+  if (nGpus < 1 || nGpus > MAX_GPUS || factor < 2 || iters < 1) usage(argv[0]);
+
+  struct collBench b;
+  memset(&b, 0, sizeof(struct collBench));
+  b.nranks = nGpus;
+  BENCHNCCL(ncclCommInitAll(b.comms, nGpus, NULL));
+  for (int r=0; r<nGpus; r++) {
+    BENCHCUDA(cudaSetDevice(r));
+    BENCHCUDA(cudaStreamCreateWithFlags(b.streams+r, cudaStreamNonBlocking));
+    BENCHCUDA(cudaMalloc(b.sendbuffs+r, maxBytes));
+    BENCHCUDA(cudaMalloc(b.recvbuffs+r, maxBytes));
+    BENCHCUDA(cudaMemset(b.sendbuffs[r], 0, maxBytes));
+  }
+
+  int version;
+  BENCHNCCL(ncclGetVersion(&version));
+  int printedHeader = 0;
+  for (int coll=0; coll<collCount; coll++) {
+    if (colls[coll] == 0) continue;
+    for (size_t bytes=minBytes; bytes<=maxBytes; bytes*=factor) {
+      // Per rank counts must not be empty
+      size_t unit = ((coll == collAllReduce || coll == collBroadcast || coll == collReduce) ? 1 : nGpus)*sizeof(float);
+      size_t size = std::max(bytes - bytes%unit, unit);
+      for (int i=0; i<warmup; i++) collLaunch(&b, coll, size);
+      collSync(&b);
+      double start = benchTime();
+      for (int i=0; i<iters; i++) collLaunch(&b, coll, size);
+      collSync(&b);
+      double us = (benchTime() - start)*1e6/iters;
+      double algBw = size/(us*1e3);
+
+      struct benchRow row = { 0 };
+      benchRowStr(&row, "bench", "coll");
+      benchRowStr(&row, "coll", collNames[coll]);
+      benchRowInt(&row, "nranks", nGpus);
+      benchRowInt(&row, "bytes", size);
+      benchRowFloat(&row, "time_us", us);
+      benchRowFloat(&row, "algbw_GBps", algBw);
+      benchRowFloat(&row, "busbw_GBps", algBw*busBwFactor(coll, nGpus));
+      benchRowInt(&row, "version", version);
+      benchPrintRow(format, &row, &printedHeader);
+    }
+  }
+
+  for (int r=0; r<nGpus; r++) {
+    BENCHCUDA(cudaSetDevice(r));
+    BENCHCUDA(cudaFree(b.sendbuffs[r]));
+    BENCHCUDA(cudaFree(b.recvbuffs[r]));
+    BENCHCUDA(cudaStreamDestroy(b.streams[r]));
+    ncclCommDestroy(b.comms[r]);
+  }
+  return 0;
+}
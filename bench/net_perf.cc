@@ -0,0 +1,203 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+// Network benchmark : drives the internal ncclNet (IB or sockets) directly
+// with isend/irecv/test, keeping a window of requests in flight like the
+// proxy does. Without -s/-c, sends to itself through one NIC. With -s on one
+// node and -c on another, the handle is exchanged through a shared file.
+
+#include "core.h"
+#include "net.h"
+#include "bench.h"
+#include <limits.h>
+#include <stdarg.h>
+
+#define MAX_WINDOW 64
+
+struct netBench {
+  void* sendComm;
+  void* recvComm;
+  void* sendMhandle;
+  void* recvMhandle;
+  char* sendBuff;
+  char* recvBuff;
+  int window;
+};
+
+static void netLog(ncclDebugLogLevel level, unsigned long flags, const char *file, int line, const char *fmt, ...) {
+  if (level != NCCL_LOG_WARN) return;
+  va_list vargs;
+  va_start(vargs, fmt);
+  fprintf(stderr, "%s:%d NET WARN ", file, line);
+  vfprintf(stderr, fmt, vargs);
+  fprintf(stderr, "\n");
+  va_end(vargs);
+}
+
+// Run iters transfers of size bytes, each side keeping up to window
+// requests posted. Returns the elapsed time in seconds.
+static double netRun(struct netBench* b, size_t size, int iters) {
+  void* sreqs[MAX_WINDOW] = { NULL };
+  void* rreqs[MAX_WINDOW] = { NULL };
+  int sPosted = 0, sDone = 0, rPosted = 0, rDone = 0;
+  int nSends = b->sendComm ? iters : 0;
+  int nRecvs = b->recvComm ? iters : 0;
+  double start = benchTime();
+  while (sDone < nSends || rDone < nRecvs) {
+    // Receives first, so that the sender never has to wait for them
+    if (rPosted < nRecvs && rPosted - rDone < b->window) {
+      void** req = rreqs+rPosted%b->window;
+      BENCHNCCL(ncclNetIrecv(b->recvComm, b->recvBuff, size, b->recvMhandle, req));
+      if (*req) rPosted++;
+    }
+    if (sPosted < nSends && sPosted - sDone < b->window) {
+      void** req = sreqs+sPosted%b->window;
+      BENCHNCCL(ncclNetIsend(b->sendComm, b->sendBuff, size, b->sendMhandle, req));
+      if (*req) sPosted++;
+    }
+    // Requests complete in order on a given comm
+    int done;
+    if (rDone < rPosted) {
+      BENCHNCCL(ncclNetTest(rreqs[rDone%b->window], &done, NULL));
+      if (done) rDone++;
+    }
+    if (sDone < sPosted) {
+      BENCHNCCL(ncclNetTest(sreqs[sDone%b->window], &done, NULL));
+      if (done) sDone++;
+    }
+  }
+  return benchTime() - start;
+}
+
+static char* netAlloc(int cuda, size_t size) {
+  void* ptr;
+  if (cuda) {
+    BENCHCUDA(cudaMalloc(&ptr, size));
+  } else if (posix_memalign(&ptr, 4096, size) != 0) {
+    fprintf(stderr, "Could not allocate %ld bytes\n", size);
+    exit(EXIT_FAILURE);
+  }
+  return (char*)ptr;
+}
+
+static void usage(const char* name) {
+  printf("Usage : %s [-N ib|socket] [-d netDev] [-b minBytes] [-e maxBytes] [-f factor] [-n iters] [-w warmup]\n"
+         "          [-W window] [-g (use GPU memory)] [-s|-c handleFile] [-o text|csv|json]\n", name);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+  const char* netName = "ib";
+  const char* handleFile = NULL;
+  int server = 0, client = 0, cuda = 0, dev = 0;
+  size_t minBytes = 8, maxBytes = 64*1024*1024;
+  int factor = 2, iters = 100, warmup = 10, window = 8;
+  enum benchFormat format = benchText;
+  int c;
+  while ((c = getopt(argc, argv, "N:d:b:e:f:n:w:W:gs:c:o:h")) != -1) {
+    switch (c) {
+      case 'N': netName = optarg; break;
+      case 'd': dev = atoi(optarg); break;
+      case 'b': minBytes = benchParseSize(optarg); break;
+      case 'e': maxBytes = benchParseSize(optarg); break;
+      case 'f': factor = atoi(optarg); break;
+      case 'n': iters = atoi(optarg); break;
+      case 'w': warmup = atoi(optarg); break;
+      case 'W': window = atoi(optarg); break;
+      case 'g': cuda = 1; break;
+      case 's': server = 1; handleFile = optarg; break;
+      case 'c': client = 1; handleFile = optarg; break;
+      case 'o': format = benchParseFormat(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (window < 1 || window > MAX_WINDOW || factor < 2 || maxBytes > INT_MAX) usage(argv[0]);
+  initDebug();
+
+  ncclNet = strcmp(netName, "socket") == 0 ? &ncclNetSocket : &ncclNetIb;
+  if (ncclNet->init(netLog) != ncclSuccess) {
+    fprintf(stderr, "Could not initialize NET/%s\n", ncclNet->name);
+    return EXIT_FAILURE;
+  }
+  int ndev;
+  BENCHNCCL(ncclNetDevices(&ndev));
+  if (dev >= ndev) {
+    fprintf(stderr, "NET/%s has %d devices, cannot use device %d\n", ncclNet->name, ndev, dev);
+    return EXIT_FAILURE;
+  }
+  int ptrSupport;
+  BENCHNCCL(ncclNetPtrSupport(dev, &ptrSupport));
+  int ptrType = cuda ? NCCL_PTR_CUDA : NCCL_PTR_HOST;
+  if ((ptrSupport & ptrType) == 0) {
+    fprintf(stderr, "NET/%s device %d does not support %s memory\n", ncclNet->name, dev, cuda ? "GPU" : "host");
+    return EXIT_FAILURE;
+  }
+
+  struct netBench b;
+  memset(&b, 0, sizeof(struct netBench));
+  b.window = window;
+  ncclNetHandle_t handle;
+  void* listenComm = NULL;
+  if (!client) {
+    BENCHNCCL(ncclNetListen(dev, handle, &listenComm));
+    if (server) {
+      // Write then rename, so that the client never reads a partial handle
+      char tmpFile[PATH_MAX];
+      snprintf(tmpFile, PATH_MAX, "%s.tmp", handleFile);
+      FILE* f = fopen(tmpFile, "w");
+      if (f == NULL || fwrite(handle, sizeof(handle), 1, f) != 1 || fclose(f) != 0 || rename(tmpFile, handleFile) != 0) {
+        fprintf(stderr, "Could not write handle to %s\n", handleFile);
+        return EXIT_FAILURE;
+      }
+    }
+  } else {
+    FILE* f;
+    while ((f = fopen(handleFile, "r")) == NULL) usleep(100000);
+    if (fread(handle, sizeof(handle), 1, f) != 1) {
+      fprintf(stderr, "Could not read handle from %s\n", handleFile);
+      return EXIT_FAILURE;
+    }
+    fclose(f);
+  }
+  if (!server) BENCHNCCL(ncclNetConnect(dev, handle, &b.sendComm));
+  if (!client) BENCHNCCL(ncclNetAccept(listenComm, &b.recvComm));
+
+  if (b.sendComm) {
+    b.sendBuff = netAlloc(cuda, maxBytes);
+    BENCHNCCL(ncclNetRegMr(b.sendComm, b.sendBuff, maxBytes, ptrType, &b.sendMhandle));
+  }
+  if (b.recvComm) {
+    b.recvBuff = netAlloc(cuda, maxBytes);
+    BENCHNCCL(ncclNetRegMr(b.recvComm, b.recvBuff, maxBytes, ptrType, &b.recvMhandle));
+  }
+
+  int printedHeader = 0;
+  for (size_t size=minBytes; size<=maxBytes; size*=factor) {
+    netRun(&b, size, warmup);
+    double t = netRun(&b, size, iters);
+    struct benchRow row = { 0 };
+    benchRowStr(&row, "bench", "net");
+    benchRowStr(&row, "net", ncclNet->name);
+    benchRowStr(&row, "side", server ? "recv" : client ? "send" : "loopback");
+    benchRowInt(&row, "bytes", size);
+    benchRowInt(&row, "window", window);
+    benchRowFloat(&row, "time_us", t*1e6/iters);
+    benchRowFloat(&row, "bw_GBps", size*iters/(t*1e9));
+    benchPrintRow(format, &row, &printedHeader);
+  }
+
+  if (b.sendComm) {
+    BENCHNCCL(ncclNetDeregMr(b.sendComm, b.sendMhandle));
+    BENCHNCCL(ncclNetCloseSend(b.sendComm));
+  }
+  if (b.recvComm) {
+    BENCHNCCL(ncclNetDeregMr(b.recvComm, b.recvMhandle));
+    BENCHNCCL(ncclNetCloseRecv(b.recvComm));
+  }
+  if (listenComm) BENCHNCCL(ncclNetCloseListen(listenComm));
+  if (server) unlink(handleFile);
+  return 0;
+}
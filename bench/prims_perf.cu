@@ -0,0 +1,159 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+// Primitives benchmark : runs the ncclPrimitives send/recv loops on a single
+// GPU, through a connection looped back onto itself. Block 0 sends its input
+// into the FIFO, block 1 receives it (copy), or receives it and adds its own
+// input to it (reduce), which are the inner loops of all collectives.
+
+#include "bench.h"
+#include "devcomm.h"
+#include "primitives.h"
+#include "collectives.h"
+
+#define PRIMS_SLICESPERCHUNK (ALLREDUCE_CHUNKSTEPS/ALLREDUCE_SLICESTEPS)
+typedef ncclPrimitives<COLL_UNROLL, PRIMS_SLICESPERCHUNK, ALLREDUCE_SLICESTEPS, float, 1, 1, FuncSum<float> > benchPrims;
+
+template<int REDUCE>
+__global__ void primsKernel(struct ncclDevComm* comm, struct ncclChannel* channel, const float* src, const float* src2, float* dst, size_t count, int iters) {
+  const int tid = threadIdx.x;
+  const int nthreads = blockDim.x - 1;
+  const int stepSize = channel->buffSize / (sizeof(float)*NCCL_STEPS);
+  const int chunkSize = stepSize * ALLREDUCE_CHUNKSTEPS;
+  int self = 0, none = -1;
+
+  if (blockIdx.x == 0) {
+    benchPrims prims(tid, nthreads, &none, &self, NULL, stepSize, channel, comm, 0);
+    for (int i=0; i<iters; i++) {
+      for (size_t offset=0; offset<count; offset += chunkSize) {
+        int nelem = min((size_t)chunkSize, count-offset);
+        prims.send(src+offset, nelem);
+      }
+    }
+  } else {
+    benchPrims prims(tid, nthreads, &self, &none, NULL, stepSize, channel, comm, 0);
+    for (int i=0; i<iters; i++) {
+      for (size_t offset=0; offset<count; offset += chunkSize) {
+        int nelem = min((size_t)chunkSize, count-offset);
+        if (REDUCE) prims.recvReduceCopy(src2+offset, dst+offset, nelem);
+        else prims.recv(dst+offset, nelem);
+      }
+    }
+  }
+}
+
+// A channel with a single peer (ourselves) whose send and recv connectors
+// share the same buffer, head and tail.
+static void setupLoopback(int buffSize, struct ncclDevComm** devComm, struct ncclChannel** devChannel) {
+  char* buff;
+  uint64_t* ptrs;
+  BENCHCUDA(cudaMalloc(&buff, buffSize));
+  BENCHCUDA(cudaMalloc(&ptrs, 4*sizeof(uint64_t)));
+  BENCHCUDA(cudaMemset(ptrs, 0, 4*sizeof(uint64_t)));
+
+  struct ncclPeer peer;
+  memset(&peer, 0, sizeof(struct ncclPeer));
+  struct ncclConnInfo* conns[2] = { &peer.send.conn, &peer.recv.conn };
+  for (int i=0; i<2; i++) {
+    conns[i]->buff = buff;
+    conns[i]->tail = ptrs;
+    conns[i]->head = ptrs+1;
+    conns[i]->opCountLoc = ptrs+2+i;
+    conns[i]->opCountRem = ptrs+3-i;
+  }
+  struct ncclPeer* devPeer;
+  BENCHCUDA(cudaMalloc(&devPeer, sizeof(struct ncclPeer)));
+  BENCHCUDA(cudaMemcpy(devPeer, &peer, sizeof(struct ncclPeer), cudaMemcpyHostToDevice));
+
+  struct ncclChannel channel;
+  memset(&channel, 0, sizeof(struct ncclChannel));
+  channel.buffSize = buffSize;
+  channel.devPeers = devPeer;
+  BENCHCUDA(cudaMalloc(devChannel, sizeof(struct ncclChannel)));
+  BENCHCUDA(cudaMemcpy(*devChannel, &channel, sizeof(struct ncclChannel), cudaMemcpyHostToDevice));
+
+  struct ncclDevComm comm;
+  memset(&comm, 0, sizeof(struct ncclDevComm));
+  comm.nRanks = 1;
+  BENCHCUDA(cudaMalloc((void**)&comm.abortFlag, sizeof(uint32_t)));
+  BENCHCUDA(cudaMemset((void*)comm.abortFlag, 0, sizeof(uint32_t)));
+  BENCHCUDA(cudaMalloc((void**)&comm.fatalDevError, sizeof(ncclDevError_t)));
+  BENCHCUDA(cudaMemset((void*)comm.fatalDevError, 0, sizeof(ncclDevError_t)));
+  comm.channels = *devChannel;
+  BENCHCUDA(cudaMalloc(devComm, sizeof(struct ncclDevComm)));
+  BENCHCUDA(cudaMemcpy(*devComm, &comm, sizeof(struct ncclDevComm), cudaMemcpyHostToDevice));
+}
+
+static void usage(const char* name) {
+  printf("Usage : %s [-b minBytes] [-e maxBytes] [-f factor] [-n iters] [-w warmup] [-t threads] [-p buffSize] [-d dev] [-o text|csv|json]\n", name);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+  size_t minBytes = 64*1024, maxBytes = 256*1024*1024;
+  int factor = 2, iters = 20, warmup = 5, nthreads = MAXTHREADS, buffSize = 1<<22, dev = 0;
+  enum benchFormat format = benchText;
+  int c;
+  while ((c = getopt(argc, argv, "b:e:f:n:w:t:p:d:o:h")) != -1) {
+    switch (c) {
+      case 'b': minBytes = benchParseSize(optarg); break;
+      case 'e': maxBytes = benchParseSize(optarg); break;
+      case 'f': factor = atoi(optarg); break;
+      case 'n': iters = atoi(optarg); break;
+      case 'w': warmup = atoi(optarg); break;
+      case 't': nthreads = atoi(optarg); break;
+      case 'p': buffSize = benchParseSize(optarg); break;
+      case 'd': dev = atoi(optarg); break;
+      case 'o': format = benchParseFormat(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (nthreads % WARP_SIZE || nthreads <= WARP_SIZE || nthreads > MAXTHREADS || factor < 2) usage(argv[0]);
+  BENCHCUDA(cudaSetDevice(dev));
+
+  struct ncclDevComm* devComm;
+  struct ncclChannel* devChannel;
+  setupLoopback(buffSize, &devComm, &devChannel);
+
+  float *src, *src2, *dst;
+  BENCHCUDA(cudaMalloc(&src, maxBytes));
+  BENCHCUDA(cudaMalloc(&src2, maxBytes));
+  BENCHCUDA(cudaMalloc(&dst, maxBytes));
+  BENCHCUDA(cudaMemset(src, 0, maxBytes));
+  BENCHCUDA(cudaMemset(src2, 0, maxBytes));
+  cudaEvent_t start, stop;
+  BENCHCUDA(cudaEventCreate(&start));
+  BENCHCUDA(cudaEventCreate(&stop));
+
+  int printedHeader = 0;
+  for (int reduce=0; reduce<2; reduce++) {
+    for (size_t bytes=minBytes; bytes<=maxBytes; bytes*=factor) {
+      size_t count = bytes/sizeof(float);
+      if (count == 0) continue;
+      void (*kernel)(struct ncclDevComm*, struct ncclChannel*, const float*, const float*, float*, size_t, int) =
+        reduce ? primsKernel<1> : primsKernel<0>;
+      kernel<<<2, nthreads+1>>>(devComm, devChannel, src, src2, dst, count, warmup);
+      BENCHCUDA(cudaEventRecord(start));
+      kernel<<<2, nthreads+1>>>(devComm, devChannel, src, src2, dst, count, iters);
+      BENCHCUDA(cudaEventRecord(stop));
+      BENCHCUDA(cudaEventSynchronize(stop));
+      BENCHCUDA(cudaGetLastError());
+      float ms;
+      BENCHCUDA(cudaEventElapsedTime(&ms, start, stop));
+      double us = ms*1000/iters;
+
+      struct benchRow row = { 0 };
+      benchRowStr(&row, "bench", "prims");
+      benchRowStr(&row, "op", reduce ? "recvReduceCopy" : "recv");
+      benchRowInt(&row, "bytes", count*sizeof(float));
+      benchRowInt(&row, "threads", nthreads);
+      benchRowFloat(&row, "time_us", us);
+      benchRowFloat(&row, "bw_GBps", count*sizeof(float)/(us*1e3));
+      benchPrintRow(format, &row, &printedHeader);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,104 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+// Proxy benchmark : posts empty operations to a real proxy thread, through
+// a connector whose transport has a proxy that completes at once, and
+// measures the time until the proxy runs the operation (pickup) and until
+// the operation is returned to the launching thread (done). Operations are
+// posted with increasing gaps to go through the spin, yield and sleep
+// phases of the proxy idle policy (NCCL_PROXY_SPIN/YIELD/SLEEP_TIME).
+
+#include "core.h"
+#include "bench.h"
+#include <algorithm>
+#include <vector>
+
+static double pickupTime;
+
+static ncclResult_t pingProxy(struct ncclProxyArgs* args) {
+  __atomic_store_n(&pickupTime, benchTime(), __ATOMIC_RELEASE);
+  args->state = ncclProxyOpNone;
+  return ncclSuccess;
+}
+
+static struct ncclTransportComm pingComm = { NULL, NULL, NULL, pingProxy };
+
+static void usage(const char* name) {
+  printf("Usage : %s [-n iters] [-g maxGapUs] [-o text|csv|json]\n", name);
+  exit(EXIT_FAILURE);
+}
+
+static double percentile(std::vector<double>& v, double p) {
+  return v[std::min(v.size()-1, (size_t)(p*v.size()))];
+}
+
+int main(int argc, char* argv[]) {
+  int iters = 1000, maxGap = 10000;
+  enum benchFormat format = benchText;
+  int c;
+  while ((c = getopt(argc, argv, "n:g:o:h")) != -1) {
+    switch (c) {
+      case 'n': iters = atoi(optarg); break;
+      case 'g': maxGap = atoi(optarg); break;
+      case 'o': format = benchParseFormat(optarg); break;
+      default: usage(argv[0]);
+    }
+  }
+  if (iters < 1) usage(argv[0]);
+  initDebug();
+
+  // Just enough of a communicator for the proxy : one channel, one peer
+  struct ncclComm* comm;
+  BENCHNCCL(ncclCalloc(&comm, 1));
+  static uint32_t abortFlag = 0;
+  comm->abortFlag = &abortFlag;
+  comm->nChannels = 1;
+  struct ncclChannel* channel = comm->channels;
+  channel->buffSize = 1 << 22;
+  BENCHNCCL(ncclCalloc(&channel->peers, 1));
+  struct ncclConnector* connector = &channel->peers[0].send;
+  connector->comm = comm;
+  connector->transportComm = &pingComm;
+  connector->conn.buffSize = channel->buffSize;
+  BENCHNCCL(transportCreateProxy(comm, NULL));
+
+  struct ncclProxyArgs args;
+  memset(&args, 0, sizeof(struct ncclProxyArgs));
+  args.channel = channel;
+  args.nsteps = 1;
+
+  int printedHeader = 0;
+  for (int gap=0; gap<=maxGap; gap = gap ? gap*10 : 1) {
+    std::vector<double> pickup, done;
+    for (int i=0; i<iters; i++) {
+      if (gap) usleep(gap);
+      uint64_t posted = comm->proxyOps.posted;
+      __atomic_store_n(&pickupTime, 0, __ATOMIC_RELAXED);
+      double start = benchTime();
+      BENCHNCCL(transportSaveP2pProxy(&args, 0, 1));
+      BENCHNCCL(transportStartProxy(comm));
+      while (__atomic_load_n(&comm->proxyOps.done, __ATOMIC_ACQUIRE) != posted+1) sched_yield();
+      double end = benchTime();
+      pickup.push_back((__atomic_load_n(&pickupTime, __ATOMIC_ACQUIRE) - start)*1e6);
+      done.push_back((end - start)*1e6);
+    }
+    std::sort(pickup.begin(), pickup.end());
+    std::sort(done.begin(), done.end());
+    struct benchRow row = { 0 };
+    benchRowStr(&row, "bench", "proxy");
+    benchRowInt(&row, "gap_us", gap);
+    benchRowFloat(&row, "pickup_p50_us", percentile(pickup, 0.5));
+    benchRowFloat(&row, "pickup_p99_us", percentile(pickup, 0.99));
+    benchRowFloat(&row, "done_p50_us", percentile(done, 0.5));
+    benchRowFloat(&row, "done_p99_us", percentile(done, 0.99));
+    benchPrintRow(format, &row, &printedHeader);
+  }
+
+  BENCHNCCL(transportDestroyProxy(comm));
+  free(channel->peers);
+  free(comm);
+  return 0;
+}
@@ -0,0 +1,149 @@
+#!/usr/bin/env python
+#
+# Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+#
+# See LICENSE.txt for license information
+#
+
+# Performance regression harness : runs a fixed coll_perf sweep and compares
+# the bus bandwidth of each (collective, size) bucket with a baseline stored
+# in baselines/<topology hash>.json. Fails when a bucket is slower than the
+# baseline by more than the tolerance.
+#
+# The topology hash covers what the results depend on : GPU models, the GPU
+# interconnect matrix and the NICs. Machines with the same hash share a
+# baseline, a new topology gets a new baseline (use --update to record it).
+# Baselines are not part of the tree : CI keeps them on persistent storage
+# (--baselines or NCCL_PERF_BASELINES) and runs with --require-baseline.
+
+from __future__ import print_function
+import argparse
+import hashlib
+import json
+import os
+import subprocess
+import sys
+
+BENCHDIR = os.path.dirname(os.path.abspath(__file__))
+COLLS = "allreduce,allgather,reducescatter,broadcast,reduce,alltoall"
+
+def run(cmd):
+    try:
+        return subprocess.check_output(cmd, stderr=subprocess.STDOUT).decode()
+    except (OSError, subprocess.CalledProcessError):
+        return ""
+
+def topology():
+    gpus = run(["nvidia-smi", "--query-gpu=name", "--format=csv,noheader"]).strip().splitlines()
+    # Drop the CPU affinity columns : they change with the CPU numbering only
+    matrix = [" ".join(l.split("\t")[:len(gpus)+1]).strip()
+              for l in run(["nvidia-smi", "topo", "-m"]).splitlines()[:len(gpus)+1]]
+    nics = []
+    ibdir = "/sys/class/infiniband"
+    if os.path.isdir(ibdir):
+        for dev in sorted(os.listdir(ibdir)):
+            ports = os.path.join(ibdir, dev, "ports")
+            for port in sorted(os.listdir(ports)) if os.path.isdir(ports) else []:
+                try:
+                    with open(os.path.join(ports, port, "rate")) as f:
+                        nics.append("%s:%s %s" % (dev, port, f.read().strip()))
+                except IOError:
+                    pass
+    return {"gpus": gpus, "matrix": matrix, "nics": nics}
+
+def topologyHash(topo):
+    return hashlib.sha1(json.dumps(topo, sort_keys=True).encode()).hexdigest()[:16]
+
+# Run the sweep repeats times and keep the best bandwidth of each bucket, to
+# filter out transient noise (other jobs, clocks ramping up).
+def sweep(args):
+    results = {}
+    cmd = [args.coll_perf, "-c", args.colls, "-b", args.min_bytes, "-e", args.max_bytes,
+           "-f", "2", "-n", str(args.iters), "-w", str(args.warmup), "-o", "json"]
+    if args.ngpus:
+        cmd += ["-g", str(args.ngpus)]
+    for i in range(args.repeats):
+        output = subprocess.check_output(cmd).decode()
+        for line in output.splitlines():
+            if not line.startswith("{"):
+                continue
+            row = json.loads(line)
+            bucket = results.setdefault(row["coll"], {})
+            bytes = str(row["bytes"])
+            bucket[bytes] = max(bucket.get(bytes, 0), row["busbw_GBps"])
+            results["nranks"] = row["nranks"]
+            results["version"] = row["version"]
+    return results
+
+def compare(baseline, current, tolerance, colls):
+    failures = 0
+    print("%-14s %12s %12s %12s %8s" % ("coll", "bytes", "base_GBps", "cur_GBps", "delta"))
+    for coll in colls.split(","):
+        for bytes, base in sorted(baseline.get(coll, {}).items(), key=lambda x: int(x[0])):
+            cur = current.get(coll, {}).get(bytes)
+            if cur is None:
+                # A bucket which no longer runs must not pass silently
+                print("%-14s %12s %12.3f %12s %8s MISSING" % (coll, bytes, base, "-", "-"))
+                failures += 1
+                continue
+            delta = (cur - base) / base if base > 0 else 0
+            status = ""
+            if delta < -tolerance:
+                status = "REGRESSION"
+                failures += 1
+            print("%-14s %12s %12.3f %12.3f %+7.1f%% %s" % (coll, bytes, base, cur, delta*100, status))
+    return failures
+
+def main():
+    parser = argparse.ArgumentParser(description="NCCL performance regression harness")
+    parser.add_argument("--coll-perf", default=os.path.join(BENCHDIR, "..", "build", "bench", "coll_perf"))
+    parser.add_argument("--baselines", default=os.environ.get("NCCL_PERF_BASELINES", os.path.join(BENCHDIR, "baselines")))
+    parser.add_argument("--tolerance", type=float, default=float(os.environ.get("NCCL_PERF_TOLERANCE", "0.05")),
+                        help="allowed relative busbw drop per bucket (default 0.05)")
+    parser.add_argument("--ngpus", type=int, default=0)
+    parser.add_argument("--colls", default=COLLS)
+    parser.add_argument("--min-bytes", default="8")
+    parser.add_argument("--max-bytes", default="256M")
+    parser.add_argument("--iters", type=int, default=20)
+    parser.add_argument("--warmup", type=int, default=5)
+    parser.add_argument("--repeats", type=int, default=3)
+    parser.add_argument("--update", action="store_true", help="record the results as the new baseline")
+    parser.add_argument("--require-baseline", action="store_true",
+                        help="fail instead of recording a baseline when none exists for this topology")
+    args = parser.parse_args()
+
+    topo = topology()
+    if not topo["gpus"]:
+        print("No GPU found, %s performance regression tests" % ("can't run" if args.require_baseline else "skipping"))
+        return 1 if args.require_baseline else 0
+    path = os.path.join(args.baselines, topologyHash(topo) + ".json")
+    print("Topology %s : %d x %s, baseline %s" % (topologyHash(topo), len(topo["gpus"]), topo["gpus"][0], path))
+    if args.require_baseline and not args.update and not os.path.exists(path):
+        # Recording one would let the run pass without comparing anything
+        print("No baseline for this topology : record one with --update")
+        return 1
+
+    current = sweep(args)
+    if args.update or not os.path.exists(path):
+        if not os.path.isdir(args.baselines):
+            os.makedirs(args.baselines)
+        with open(path, "w") as f:
+            json.dump({"topology": topo, "results": current}, f, indent=2, sort_keys=True)
+        print("Recorded baseline %s%s" % (path, "" if args.update else " (no baseline for this topology)"))
+        return 0
+
+    with open(path) as f:
+        baseline = json.load(f)["results"]
+    if baseline.get("nranks") != current.get("nranks"):
+        print("Baseline was recorded with %s ranks, not %s : use --ngpus or --update" % (baseline.get("nranks"), current.get("nranks")))
+        return 1
+    failures = compare(baseline, current, args.tolerance, args.colls)
+    if failures:
+        print("%d bucket(s) missing or regressed by more than %.1f%% (baseline version %s, current %s)" %
+              (failures, args.tolerance*100, baseline.get("version"), current.get("version")))
+        return 1
+    print("No regression beyond %.1f%%" % (args.tolerance*100))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
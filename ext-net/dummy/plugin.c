@@ -16,9 +16,11 @@ __hidden ncclResult_t pluginPtrSupport(int dev, int* supportedTypes) { return nc
 __hidden ncclResult_t pluginListen(int dev, void* handle, void** listenComm) { return ncclInternalError; }
 __hidden ncclResult_t pluginConnect(int dev, void* handle, void** sendComm) { return ncclInternalError; }
 __hidden ncclResult_t pluginAccept(void* listenComm, void** recvComm) { return ncclInternalError; }
-__hidden ncclResult_t pluginIsend(void* sendComm, void* data, int size, int type, void** request) { return ncclInternalError; }
-__hidden ncclResult_t pluginIrecv(void* recvComm, void* data, int size, int type, void** request) { return ncclInternalError; }
-__hidden ncclResult_t pluginFlush(void* recvComm, void* data, int size) { return ncclInternalError; }
+__hidden ncclResult_t pluginRegMr(void* comm, void* data, int size, int type, void** mhandle) { return ncclInternalError; }
+__hidden ncclResult_t pluginDeregMr(void* comm, void* mhandle) { return ncclInternalError; }
+__hidden ncclResult_t pluginIsend(void* sendComm, void* data, int size, void* mhandle, void** request) { return ncclInternalError; }
+__hidden ncclResult_t pluginIrecv(void* recvComm, void* data, int size, void* mhandle, void** request) { return ncclInternalError; }
+__hidden ncclResult_t pluginIflush(void* recvComm, void* data, int size, void* mhandle, void** request) { return ncclInternalError; }
 __hidden ncclResult_t pluginTest(void* request, int* done, int* size) { return ncclInternalError; }
 __hidden ncclResult_t pluginCloseSend(void* sendComm) { return ncclInternalError; }
 __hidden ncclResult_t pluginCloseRecv(void* recvComm) { return ncclInternalError; }
@@ -33,11 +35,17 @@ ncclNet_t NCCL_PLUGIN_SYMBOL = {
   pluginListen,
   pluginConnect,
   pluginAccept,
+  pluginRegMr,
+  pluginDeregMr,
   pluginIsend,
   pluginIrecv,
-  pluginFlush,
+  pluginIflush,
   pluginTest,
   pluginCloseSend,
   pluginCloseRecv,
-  pluginCloseListen
+  pluginCloseListen,
+  NULL, // getProperties
+  NULL, // isendv
+  NULL, // irecvv
+  NULL  // testAny
 };
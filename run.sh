@@ -1,4 +1,21 @@
 #!/bin/sh
+#
+# CI entry point (see build/build_configuration.json). NCCL_CI_STAGE selects
+# what to run : "build" (default) builds the library and the benchmarks,
+# "perf" also compares them with the baseline of this machine's topology,
+# kept in NCCL_PERF_BASELINES ; the stage fails when there is none.
 
-echo "NGCI tester"
-echo "PARAM1: $PARAM1"
+set -e
+
+echo "NGCI tester, stage ${NCCL_CI_STAGE:=build}"
+
+make -j src.build
+make bench
+
+if [ "$NCCL_CI_STAGE" = "perf" ]; then
+  if [ -z "$NCCL_PERF_BASELINES" ]; then
+    echo "NCCL_PERF_BASELINES must point to the persistent baseline directory"
+    exit 1
+  fi
+  python bench/regress.py --require-baseline --baselines "$NCCL_PERF_BASELINES" --tolerance "${NCCL_PERF_TOLERANCE:-0.05}"
+fi
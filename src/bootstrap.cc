@@ -177,13 +177,18 @@ static ncclResult_t setFilesLimit() {
   return ncclSuccess;
 }
 
+/* The root collects the listen handles of all ranks, then sends the whole
+ * table to rank 0 only. Ranks forward it down a binary tree, so the root
+ * opens a single connection instead of one per rank.
+ */
 static void *bootstrapRoot(void* commId) {
   struct extInfo info;
   struct extId* id = (struct extId*)commId;
   ncclNetHandle_t *rankHandles = NULL;
-  ncclNetHandle_t *rankHandlesRoot = NULL; // for initial rank <-> root information exchange
+  ncclNetHandle_t rank0HandleRoot;
   ncclNetHandle_t zero = { 0 }; // for sanity checking
   void* tmpComm;
+  void *tmpSendComm;
   ncclResult_t res;
   setFilesLimit();
 
@@ -198,7 +203,6 @@ static void *bootstrapRoot(void* commId) {
     if (c == 0) {
       nranks = info.nranks;
       NCCLCHECKGOTO(ncclCalloc(&rankHandles, nranks), res, out);
-      NCCLCHECKGOTO(ncclCalloc(&rankHandlesRoot, nranks), res, out);
     }
 
     if (nranks != info.nranks) {
@@ -206,34 +210,28 @@ static void *bootstrapRoot(void* commId) {
       goto out;
     }
 
-    if (memcmp(&zero, &rankHandlesRoot[info.rank], sizeof(ncclNetHandle_t)) != 0) {
+    if (memcmp(&zero, &rankHandles[info.rank], sizeof(ncclNetHandle_t)) != 0) {
       WARN("Bootstrap Root : rank %d of %d ranks has already checked in", info.rank, nranks);
       goto out;
     }
 
     // Save the connection handle for that rank
-    memcpy(rankHandlesRoot+info.rank, info.extHandleListenRoot, sizeof(ncclNetHandle_t));
     memcpy(rankHandles+info.rank, info.extHandleListen, sizeof(ncclNetHandle_t));
+    if (info.rank == 0) memcpy(rank0HandleRoot, info.extHandleListenRoot, sizeof(ncclNetHandle_t));
 
     ++c;
   } while (c < nranks);
   TRACE(NCCL_INIT, "COLLECTED HANDLES");
 
-  // Send the connect handle for the next rank in the AllGather ring
-  for (int r=0; r<nranks; ++r) {
-    int next = (r+1) % nranks;
-    void *tmpSendComm;
-    NCCLCHECKGOTO(bootstrapNetConnect(0, rankHandlesRoot[r], &tmpSendComm), res, out);
-    NCCLCHECKGOTO(bootstrapNetSend(tmpSendComm, rankHandles+next, sizeof(ncclNetHandle_t)), res, out);
-    NCCLCHECKGOTO(bootstrapNetCloseSend(tmpSendComm), res, out);
-  }
+  NCCLCHECKGOTO(bootstrapNetConnect(0, rank0HandleRoot, &tmpSendComm), res, out);
+  NCCLCHECKGOTO(bootstrapNetSend(tmpSendComm, rankHandles, nranks*sizeof(ncclNetHandle_t)), res, out);
+  NCCLCHECKGOTO(bootstrapNetCloseSend(tmpSendComm), res, out);
   TRACE(NCCL_INIT, "SENT OUT HANDLES");
 
 out:
   bootstrapNetCloseListen(id->extListenComm);
   free(commId);
   if (rankHandles) free(rankHandles);
-  if (rankHandlesRoot) free(rankHandlesRoot);
 
   TRACE(NCCL_INIT, "DONE");
   return NULL;
@@ -277,13 +275,14 @@ struct unexConn {
 
 struct extState {
   void* extBstrapListenComm;
-  void* extBstrapRingRecvComm;
-  void* extBstrapRingSendComm;
   ncclNetHandle_t* peerBstrapHandles;
   struct unexConn* unexpectedConnections;
   int rank;
   int nranks;
   int dev;
+  // Added to the ranks peers identify themselves with, so that the messages
+  // of a shrunk communicator can't be mistaken for those of its parent.
+  int peerOffset;
 };
 
 ncclResult_t bootstrapInit(ncclUniqueId* commId, int rank, int nranks, void** commState) {
@@ -308,13 +307,15 @@ ncclResult_t bootstrapInit(ncclUniqueId* commId, int rank, int nranks, void** co
   }
   // listen will return the local address via info (specify interface type 'findSubnetIf')
   state->dev = idFromEnv ? findSubnetIf : 0;
-  void* extBstrapListenCommRoot;
+  void* extBstrapListenCommRoot = NULL;
   NCCLCHECK(bootstrapNetListen(state->dev, &info.extHandleListen, &state->extBstrapListenComm));
-  NCCLCHECK(bootstrapNetListen(state->dev, &info.extHandleListenRoot, &extBstrapListenCommRoot));
+  // Only rank 0 hears from the root
+  if (rank == 0) NCCLCHECK(bootstrapNetListen(state->dev, &info.extHandleListenRoot, &extBstrapListenCommRoot));
 
-  // stagger connection times to avoid an overload of the root at very high rank counts
+  // stagger connection times to avoid an overload of the root at very high
+  // rank counts, 128 ranks at a time
   if (nranks > 128) {
-    long msec = rank;
+    long msec = rank/128;
     struct timespec tv;
     tv.tv_sec = msec / 1000;
     tv.tv_nsec = 1000000 * (msec % 1000);
@@ -327,58 +328,163 @@ ncclResult_t bootstrapInit(ncclUniqueId* commId, int rank, int nranks, void** co
   NCCLCHECK(bootstrapNetSend(tmpSendComm, &info, sizeof(info)));
   NCCLCHECK(bootstrapNetCloseSend(tmpSendComm));
 
-  // get info on my "next" rank in the bootstrap ring from root
-  ncclNetHandle_t extHandleNext;
-  NCCLCHECK(bootstrapNetAccept(extBstrapListenCommRoot, &tmpRecvComm));
-  NCCLCHECK(bootstrapNetRecv(tmpRecvComm, &extHandleNext, sizeof(extHandleNext)));
-  NCCLCHECK(bootstrapNetCloseRecv(tmpRecvComm));
-  NCCLCHECK(bootstrapNetCloseListen(extBstrapListenCommRoot));
+  // Get the listen handles of all ranks, from the root for rank 0 and from
+  // our parent in the binary tree otherwise, then forward them to our
+  // children.
+  int size = nranks*sizeof(ncclNetHandle_t);
+  NCCLCHECK(ncclCalloc(&state->peerBstrapHandles, nranks));
+  if (rank == 0) {
+    NCCLCHECK(bootstrapNetAccept(extBstrapListenCommRoot, &tmpRecvComm));
+    NCCLCHECK(bootstrapNetRecv(tmpRecvComm, state->peerBstrapHandles, size));
+    NCCLCHECK(bootstrapNetCloseRecv(tmpRecvComm));
+    NCCLCHECK(bootstrapNetCloseListen(extBstrapListenCommRoot));
+  } else {
+    NCCLCHECK(bootstrapRecv(state, (rank-1)/2, state->peerBstrapHandles, size));
+  }
+  for (int child=2*rank+1; child<=2*rank+2 && child<nranks; child++) {
+    NCCLCHECK(bootstrapSend(state, child, state->peerBstrapHandles, size));
+  }
 
-  NCCLCHECK(bootstrapNetConnect(state->dev, extHandleNext, &state->extBstrapRingSendComm));
-  // Accept the connect request from the previous rank in the AllGather ring
-  NCCLCHECK(bootstrapNetAccept(state->extBstrapListenComm, &state->extBstrapRingRecvComm));
+  TRACE(NCCL_INIT, "rank %d nranks %d - DONE", rank, nranks);
 
-  // AllGather all listen handlers
-  NCCLCHECK(ncclCalloc(&state->peerBstrapHandles, nranks));
-  memcpy(state->peerBstrapHandles+rank, info.extHandleListen, sizeof(ncclNetHandle_t));
-  NCCLCHECK(bootstrapAllGather(state, state->peerBstrapHandles, sizeof(ncclNetHandle_t)));
+  return ncclSuccess;
+}
+
+ncclResult_t bootstrapSplitListen(void* parentState, void* handle, void** listenComm) {
+  struct extState* parent = (struct extState*)parentState;
+  NCCLCHECK(bootstrapNetListen(parent->dev, handle, listenComm));
+  return ncclSuccess;
+}
+
+ncclResult_t bootstrapSplitCloseListen(void* listenComm) {
+  NCCLCHECK(bootstrapNetCloseListen(listenComm));
+  return ncclSuccess;
+}
 
+ncclResult_t bootstrapSplitInit(void* parentState, void* listenComm, int rank, int nranks, void* handles, void** commState) {
+  struct extState* parent = (struct extState*)parentState;
+  struct extState* state;
+  NCCLCHECK(ncclCalloc(&state, 1));
+  state->rank = rank;
+  state->nranks = nranks;
+  state->dev = parent->dev;
+  state->extBstrapListenComm = listenComm;
+  // Everyone already knows the listen handles of the others, no need for a root
+  NCCLCHECK(ncclCalloc(&state->peerBstrapHandles, nranks));
+  memcpy(state->peerBstrapHandles, handles, nranks*sizeof(ncclNetHandle_t));
+  *commState = state;
   TRACE(NCCL_INIT, "rank %d nranks %d - DONE", rank, nranks);
+  return ncclSuccess;
+}
 
+ncclResult_t bootstrapShrinkInit(void* parentState, int rank, int nranks, int* parentRanks, void** commState) {
+  struct extState* parent = (struct extState*)parentState;
+  // Quiescing is local : wait for the remaining ranks to be done with the
+  // parent before taking its socket over. Excluded ranks don't take part.
+  int root = parentRanks[0], token = 0;
+  if (parent->rank == root) {
+    for (int r=1; r<nranks; r++) NCCLCHECK(bootstrapRecv(parent, parentRanks[r], &token, sizeof(int)));
+    for (int r=1; r<nranks; r++) NCCLCHECK(bootstrapSend(parent, parentRanks[r], &token, sizeof(int)));
+  } else {
+    NCCLCHECK(bootstrapSend(parent, root, &token, sizeof(int)));
+    NCCLCHECK(bootstrapRecv(parent, root, &token, sizeof(int)));
+  }
+  // Ranks released first may already have sent to us for the new
+  // communicator. Anything else was left over by the parent.
+  int peerOffset = parent->peerOffset + parent->nranks;
+  for (struct unexConn* unex = parent->unexpectedConnections; unex; unex = unex->next) {
+    if (unex->peer < peerOffset) {
+      WARN("Bootstrap : pending connections, the communicator is still in use");
+      return ncclInvalidUsage;
+    }
+  }
+  struct extState* state;
+  NCCLCHECK(ncclCalloc(&state, 1));
+  state->rank = rank;
+  state->nranks = nranks;
+  state->dev = parent->dev;
+  state->peerOffset = peerOffset;
+  state->unexpectedConnections = parent->unexpectedConnections;
+  parent->unexpectedConnections = NULL;
+  // Everyone keeps listening on the same socket. Peers identify themselves
+  // with their new rank (plus peerOffset), so surviving ranks never talk to
+  // the excluded ones. The parent can't use its bootstrap anymore.
+  state->extBstrapListenComm = parent->extBstrapListenComm;
+  parent->extBstrapListenComm = NULL;
+  NCCLCHECK(ncclCalloc(&state->peerBstrapHandles, nranks));
+  for (int r=0; r<nranks; r++) memcpy(state->peerBstrapHandles+r, parent->peerBstrapHandles+parentRanks[r], sizeof(ncclNetHandle_t));
+  *commState = state;
+  TRACE(NCCL_INIT, "rank %d nranks %d - DONE", rank, nranks);
   return ncclSuccess;
 }
 
+struct bootstrapSendArgs {
+  void* commState;
+  int peer;
+  void* data;
+  int size;
+  ncclResult_t ret;
+};
+
+static void* bootstrapSendThread(void* args_) {
+  struct bootstrapSendArgs* args = (struct bootstrapSendArgs*)args_;
+  args->ret = bootstrapSend(args->commState, args->peer, args->data, args->size);
+  return NULL;
+}
+
 ncclResult_t bootstrapAllGather(void* commState, void* allData, int size) {
   struct extState* state = (struct extState*)commState;
   char* data = (char*)allData;
   int rank = state->rank;
   int nranks = state->nranks;
+  if (nranks == 1) return ncclSuccess;
 
   TRACE(NCCL_INIT, "rank %d nranks %d size %d", rank, nranks, size);
 
-  /* Simple ring based AllGather
-   * At each step i receive data from (rank-i-1) from left
-   * and send previous step's data from (rank-i) to right
+  /* Bruck AllGather, in log2(nranks) steps. We keep the slices of ranks
+   * rank, rank+1, ... contiguous in a temporary buffer. At each step, we send
+   * all the slices we have to rank-dist and receive as many from rank+dist.
+   * Sends are done by a helper thread : both sides of a step send at the
+   * same time, which would deadlock on large slices.
    */
-  for (int i=0; i<nranks-1; i++) {
-    size_t rslice = (rank - i - 1 + nranks) % nranks;
-    size_t sslice = (rank - i + nranks) % nranks;
-
-    // Send slice to the right
-    NCCLCHECK(bootstrapNetSend(state->extBstrapRingSendComm, data+sslice*size, size));
-    // Recv slice from the left
-    NCCLCHECK(bootstrapNetRecv(state->extBstrapRingRecvComm, data+rslice*size, size));
+  char* tmp;
+  NCCLCHECK(ncclCalloc(&tmp, (size_t)nranks*size));
+  memcpy(tmp, data+(size_t)rank*size, size);
+  ncclResult_t ret = ncclSuccess;
+  for (int dist=1; dist<nranks; dist*=2) {
+    int count = std::min(dist, nranks-dist);
+    struct bootstrapSendArgs args = { state, (rank-dist+nranks)%nranks, tmp, count*size, ncclSuccess };
+    pthread_t thread;
+    pthread_create(&thread, NULL, bootstrapSendThread, &args);
+    ret = bootstrapRecv(state, (rank+dist)%nranks, tmp+(size_t)dist*size, count*size);
+    pthread_join(thread, NULL);
+    if (ret == ncclSuccess) ret = args.ret;
+    if (ret != ncclSuccess) goto end;
   }
+  for (int i=0; i<nranks; i++) memcpy(data+(size_t)((rank+i)%nranks)*size, tmp+(size_t)i*size, size);
 
   TRACE(NCCL_INIT, "rank %d nranks %d size %d - DONE", rank, nranks, size);
+end:
+  free(tmp);
+  return ret;
+}
+
+// The listening socket of a communicator is taken over when it is shrunk
+static ncclResult_t bootstrapCheckUsable(struct extState* state) {
+  if (state->extBstrapListenComm == NULL) {
+    WARN("Bootstrap : communicator was shrunk, only the new communicator can be used");
+    return ncclInvalidUsage;
+  }
   return ncclSuccess;
 }
 
 ncclResult_t bootstrapSend(void* commState, int peer, void* data, int size) {
   struct extState* state = (struct extState*)commState;
+  NCCLCHECK(bootstrapCheckUsable(state));
   void* tmpSendComm;
+  int id = state->rank + state->peerOffset;
   NCCLCHECK(bootstrapNetConnect(state->dev, state->peerBstrapHandles[peer], &tmpSendComm));
-  NCCLCHECK(bootstrapNetSend(tmpSendComm, &state->rank, sizeof(int)));
+  NCCLCHECK(bootstrapNetSend(tmpSendComm, &id, sizeof(int)));
   NCCLCHECK(bootstrapNetSend(tmpSendComm, data, size));
   NCCLCHECK(bootstrapNetCloseSend(tmpSendComm));
   return ncclSuccess;
@@ -425,6 +531,8 @@ void* unexpectedDequeue(struct extState* state, int peer) {
 // We can't know who we'll receive from, so we need to receive everything at once
 ncclResult_t bootstrapRecv(void* commState, int peer, void* data, int size) {
   struct extState* state = (struct extState*)commState;
+  NCCLCHECK(bootstrapCheckUsable(state));
+  peer += state->peerOffset;
 
   void* tmpRecvComm;
 
@@ -456,9 +564,8 @@ ncclResult_t bootstrapClose(void* commState) {
     WARN("Unexpected connections are not empty.\n");
     return ncclInternalError;
   }
-  NCCLCHECK(bootstrapNetCloseListen(state->extBstrapListenComm));
-  NCCLCHECK(bootstrapNetCloseSend(state->extBstrapRingSendComm));
-  NCCLCHECK(bootstrapNetCloseRecv(state->extBstrapRingRecvComm));
+  // Taken over by a communicator shrunk from this one
+  if (state->extBstrapListenComm) NCCLCHECK(bootstrapNetCloseListen(state->extBstrapListenComm));
 
   free(state->peerBstrapHandles);
   free(state);
@@ -8,20 +8,58 @@
 #include "param.h"
 
 NCCL_PARAM(Buffsize, "BUFFSIZE", DEFAULT_BUFFER_SIZE_BYTES);
+// Per transport sizes, NCCL_BUFFSIZE when not set
+NCCL_PARAM(BuffsizeP2p, "BUFFSIZE_P2P", -2);
+NCCL_PARAM(BuffsizeCe, "BUFFSIZE_CE", -2);
+NCCL_PARAM(BuffsizeShm, "BUFFSIZE_SHM", -2);
+NCCL_PARAM(BuffsizeNet, "BUFFSIZE_NET", -2);
+// Initial size of Send/Recv connections (0 : size of the transport)
+NCCL_PARAM(SendRecvBuffsize, "SENDRECV_BUFFSIZE", 1 << 18);
+
+// In the order of ncclTransports
+static int64_t (*buffSizeParams[NTRANSPORTS])() = { ncclParamBuffsizeP2p, ncclParamBuffsizeCe, ncclParamBuffsizeShm, ncclParamBuffsizeNet };
+
+int ncclTransportBuffSize(int transport) {
+  int64_t size = transport >= 0 && transport < NTRANSPORTS ? buffSizeParams[transport]() : -2;
+  if (size <= 0) size = ncclParamBuffsize();
+  // Keep steps aligned to cache lines
+  ALIGN_SIZE(size, NCCL_STEPS*CACHE_LINE_SIZE);
+  return size;
+}
+
+// The FIFO holds the largest message, when the transport allows
+int ncclSendRecvBuffSize(int transport, int current, ssize_t nBytes) {
+  int max = ncclTransportBuffSize(transport);
+  int64_t size = ncclParamSendRecvBuffsize();
+  if (size <= 0 || size >= max) return max;
+  ALIGN_SIZE(size, NCCL_STEPS*CACHE_LINE_SIZE);
+  while (size < nBytes && size < max) size *= 2;
+  return std::max(current, (int)std::min<int64_t>(size, max));
+}
+
+int ncclChannelBuffSize(int nranks, int* ringRanks, int* connectTransport) {
+  if (connectTransport == NULL || nranks == 1) return ncclParamBuffsize();
+  int size = 0;
+  for (int i=0; i<nranks; i++) {
+    int from = ringRanks[i], to = ringRanks[(i+1)%nranks];
+    size = std::max(size, ncclTransportBuffSize(connectTransport[from*nranks+to]));
+  }
+  return size;
+}
 
 ncclResult_t initChannel(struct ncclComm* comm, int channelid) {
   struct ncclChannel* channel = comm->channels+channelid;
   channel->id = channelid;
 
-  // Setup intermediate buffering
+  // Setup intermediate buffering, see ncclChannelBuffSize
   channel->buffSize = ncclParamBuffsize();
 
   // Ring index to user rank table.
-  NCCLCHECK(ncclCudaCalloc(&channel->ring.devUserRanks, comm->nRanks));
+  NCCLCHECK(ncclPoolCudaCalloc(&comm->memPool, &channel->ring.devUserRanks, comm->nRanks));
   NCCLCHECK(ncclCalloc(&channel->ring.userRanks, comm->nRanks));
 
   // Communication structures with peers.
-  NCCLCHECK(ncclCudaCalloc(&channel->devPeers, comm->nRanks));
+  NCCLCHECK(ncclPoolCudaCalloc(&comm->memPool, &channel->devPeers, comm->nRanks));
   NCCLCHECK(ncclCalloc(&channel->peers, comm->nRanks));
   for (size_t i=0; i<comm->nRanks; ++i) {
     channel->peers[i].send.comm = comm;
@@ -29,27 +67,35 @@ ncclResult_t initChannel(struct ncclComm* comm, int channelid) {
   }
 
   // Per-channel operation list.
-  NCCLCHECK(ncclCudaHostAlloc((void**)&channel->collectives, (void**)&channel->devCollectives, sizeof(struct ncclColl)*NCCL_MAX_OPS));
+  NCCLCHECK(ncclPoolHostAlloc(&comm->memPool, (void**)&channel->collectives, (void**)&channel->devCollectives, sizeof(struct ncclColl)*NCCL_MAX_OPS));
   return ncclSuccess;
 }
 
 ncclResult_t freeChannel(struct ncclChannel* channel, int nRanks) {
   // Operation list
-  NCCLCHECK(ncclCudaHostFree(channel->collectives));
+  NCCLCHECK(ncclMemPoolFree(channel->collectives));
 
   // Free Ring index to rank tables
   free(channel->ring.userRanks);
-  CUDACHECK(cudaFree(channel->ring.devUserRanks));
+  NCCLCHECK(ncclMemPoolFree(channel->ring.devUserRanks));
+
+  // Free tree parents
+  free(channel->treeUps);
+  NCCLCHECK(ncclMemPoolFree(channel->devTreeUps));
 
   // Free transport proxy resources
   for (int r=0; r<nRanks; r++) {
-    struct ncclPeer* peer = channel->peers+r;
-    if (peer->send.transportResources) NCCLCHECK(peer->send.transportComm->free(peer->send.transportResources));
-    if (peer->recv.transportResources) NCCLCHECK(peer->recv.transportComm->free(peer->recv.transportResources));
+    struct ncclConnector* connectors[2] = { &channel->peers[r].send, &channel->peers[r].recv };
+    for (int d=0; d<2; d++) {
+      if (connectors[d]->transportResources == NULL) continue;
+      int last;
+      NCCLCHECK(ncclConnectorRelease(connectors[d], &last));
+      if (last) NCCLCHECK(connectors[d]->transportComm->free(connectors[d]->transportResources));
+    }
   }
 
   // Free the peer structures.
-  CUDACHECK(cudaFree(channel->devPeers));
+  NCCLCHECK(ncclMemPoolFree(channel->devPeers));
   free(channel->peers);
 
   return ncclSuccess;
@@ -16,3 +16,23 @@ ncclResult_t ncclAllGather(const void* sendbuff, void* recvbuff, size_t sendcoun
     ALLGATHER_CHUNKSTEPS, ALLGATHER_SLICESTEPS };
   return ncclEnqueueCheck(&info);
 }
+
+NCCL_API(ncclResult_t, ncclAllGatherv, const void* sendbuff, void* recvbuff, const size_t* recvcounts,
+    const size_t* displs, ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclAllGatherv(const void* sendbuff, void* recvbuff, const size_t* recvcounts,
+    const size_t* displs, ncclDataType_t datatype, ncclComm_t comm, cudaStream_t stream) {
+  NCCLCHECK(PtrCheck(comm, "AllGatherv", "comm"));
+  NCCLCHECK(PtrCheck((void*)recvcounts, "AllGatherv", "recvcounts"));
+  NCCLCHECK(PtrCheck((void*)displs, "AllGatherv", "displs"));
+  // Kernels loop over the largest count
+  size_t count = 0;
+  for (int r=0; r<comm->nRanks; r++) count = std::max(count, recvcounts[r]);
+  struct ncclInfo info = { ncclCollAllGather, "AllGatherv",
+    sendbuff, recvbuff, count, datatype, ncclSum, 0, comm, stream, /* Args */
+    ALLGATHER_CHUNKSTEPS, ALLGATHER_SLICESTEPS };
+  if (count > 0) {
+    info.counts = recvcounts;
+    info.displs = displs;
+  }
+  return ncclEnqueueCheck(&info);
+}
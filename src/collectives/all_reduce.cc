@@ -16,3 +16,29 @@ ncclResult_t ncclAllReduce(const void* sendbuff, void* recvbuff, size_t count,
     ALLREDUCE_CHUNKSTEPS, ALLREDUCE_SLICESTEPS };
   return ncclEnqueueCheck(&info);
 }
+
+NCCL_API(ncclResult_t, ncclAllReduceStreaming, const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, ncclRedOp_t op, ncclReadyFlags_t flags, ncclComm* comm, cudaStream_t stream);
+ncclResult_t ncclAllReduceStreaming(const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, ncclRedOp_t op, ncclReadyFlags_t flags, ncclComm* comm, cudaStream_t stream) {
+  NCCLCHECK(PtrCheck(comm, "AllReduceStreaming", "comm"));
+  if (flags < 0 || flags >= NCCL_MAX_READY_FLAGS || (comm->userReadyFlags & (1U<<flags)) == 0) {
+    WARN("AllReduceStreaming : %d was not created by ncclReadyFlagsCreate on this communicator", flags);
+    return ncclInvalidArgument;
+  }
+  struct ncclInfo info = { ncclCollAllReduce, "AllReduceStreaming",
+    sendbuff, recvbuff, count, datatype, op, 0, comm, stream, /* Args */
+    ALLREDUCE_CHUNKSTEPS, ALLREDUCE_SLICESTEPS };
+  info.readySlot = flags+1;
+  return ncclEnqueueCheck(&info);
+}
+
+NCCL_API(ncclResult_t, ncclAllReduceInit, const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, ncclRedOp_t op, ncclComm* comm, ncclRequest_t* request);
+ncclResult_t ncclAllReduceInit(const void* sendbuff, void* recvbuff, size_t count,
+    ncclDataType_t datatype, ncclRedOp_t op, ncclComm* comm, ncclRequest_t* request) {
+  struct ncclInfo info = { ncclCollAllReduce, "AllReduce",
+    sendbuff, recvbuff, count, datatype, op, 0, comm, NULL, /* Args */
+    ALLREDUCE_CHUNKSTEPS, ALLREDUCE_SLICESTEPS };
+  return ncclPersistentInit(&info, request);
+}
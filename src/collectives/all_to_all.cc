@@ -0,0 +1,60 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "enqueue.h"
+#include "collectives.h"
+
+// All-to-all is a set of pairwise Send/Recv within a group. The group puts
+// the exchange with rank+delta on channel delta%nChannels, which spreads
+// peers over all channels and hence over all NICs.
+
+NCCL_API(ncclResult_t, ncclAllToAll, const void* sendbuff, void* recvbuff, size_t count, ncclDataType_t datatype,
+    ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclAllToAll(const void* sendbuff, void* recvbuff, size_t count, ncclDataType_t datatype,
+    ncclComm_t comm, cudaStream_t stream) {
+  NCCLCHECK(PtrCheck(comm, "AllToAll", "comm"));
+  if (datatype < 0 || datatype >= ncclNumTypes) {
+    WARN("AllToAll : invalid type %d", datatype);
+    return ncclInvalidArgument;
+  }
+  size_t rankOffset = count * ncclTypeSize(datatype);
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECK(ncclGroupStart());
+  for (int r=0; r<comm->nRanks; r++) {
+    NCCLCHECKGOTO(ncclSend(((char*)sendbuff)+r*rankOffset, count, datatype, r, comm, stream), ret, end);
+    NCCLCHECKGOTO(ncclRecv(((char*)recvbuff)+r*rankOffset, count, datatype, r, comm, stream), ret, end);
+  }
+end:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
+
+NCCL_API(ncclResult_t, ncclAllToAllv, const void* sendbuff, const size_t* sendcounts, const size_t* sdispls,
+    void* recvbuff, const size_t* recvcounts, const size_t* rdispls, ncclDataType_t datatype,
+    ncclComm_t comm, cudaStream_t stream);
+ncclResult_t ncclAllToAllv(const void* sendbuff, const size_t* sendcounts, const size_t* sdispls,
+    void* recvbuff, const size_t* recvcounts, const size_t* rdispls, ncclDataType_t datatype,
+    ncclComm_t comm, cudaStream_t stream) {
+  NCCLCHECK(PtrCheck(comm, "AllToAllv", "comm"));
+  NCCLCHECK(PtrCheck((void*)sendcounts, "AllToAllv", "sendcounts"));
+  NCCLCHECK(PtrCheck((void*)sdispls, "AllToAllv", "sdispls"));
+  NCCLCHECK(PtrCheck((void*)recvcounts, "AllToAllv", "recvcounts"));
+  NCCLCHECK(PtrCheck((void*)rdispls, "AllToAllv", "rdispls"));
+  if (datatype < 0 || datatype >= ncclNumTypes) {
+    WARN("AllToAllv : invalid type %d", datatype);
+    return ncclInvalidArgument;
+  }
+  size_t typeSize = ncclTypeSize(datatype);
+  ncclResult_t ret = ncclSuccess;
+  NCCLCHECK(ncclGroupStart());
+  for (int r=0; r<comm->nRanks; r++) {
+    NCCLCHECKGOTO(ncclSend(((char*)sendbuff)+sdispls[r]*typeSize, sendcounts[r], datatype, r, comm, stream), ret, end);
+    NCCLCHECKGOTO(ncclRecv(((char*)recvbuff)+rdispls[r]*typeSize, recvcounts[r], datatype, r, comm, stream), ret, end);
+  }
+end:
+  NCCLCHECK(ncclGroupEnd());
+  return ret;
+}
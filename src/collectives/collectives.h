@@ -7,7 +7,8 @@
 #ifndef NCCL_COLLECTIVES_H_
 #define NCCL_COLLECTIVES_H_
 
-#define FUNC_INDEX(coll, redop, dtype, ll, al) ((((((coll)*ncclNumOps + (redop))*ncclNumTypes) + (dtype))*2+(al))*2+(ll))
+// proto is one of NCCL_PROTO_*, al is 1 for trees
+#define FUNC_INDEX(coll, redop, dtype, proto, al) ((((((coll)*NCCL_NUM_DEVOPS + (redop))*ncclNumTypes) + (dtype))*2+(al))*NCCL_NUM_PROTOCOLS+(proto))
 
 #define NCCL_COLL_NAME(coll, op, dtype) \
   coll##_##op##_##dtype
@@ -21,13 +22,27 @@
   extern __global__ void NCCL_KERN_NAME(coll, op, dtype)(struct ncclColl c); \
 
 #define DECL_COLL4(coll, op, dtype) \
+  DECL_COLL5(coll##LL, op, dtype) \
   DECL_COLL5(coll, op, dtype) \
-  DECL_COLL5(coll##LL, op, dtype)
+  DECL_COLL5(coll##LL128, op, dtype)
 
 #define DECL_COLL3(coll, op, dtype) \
   DECL_COLL4(coll##Ring, op, dtype) \
   DECL_COLL4(coll##Tree, op, dtype)
 
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+#define DECL_COLL2(coll, op) \
+  DECL_COLL3(coll, op, i8) \
+  DECL_COLL3(coll, op, u8) \
+  DECL_COLL3(coll, op, i32) \
+  DECL_COLL3(coll, op, u32) \
+  DECL_COLL3(coll, op, i64) \
+  DECL_COLL3(coll, op, u64) \
+  DECL_COLL3(coll, op, f16) \
+  DECL_COLL3(coll, op, f32) \
+  DECL_COLL3(coll, op, f64) \
+  DECL_COLL3(coll, op, bf16)
+#else
 #define DECL_COLL2(coll, op) \
   DECL_COLL3(coll, op, i8) \
   DECL_COLL3(coll, op, u8) \
@@ -38,12 +53,15 @@
   DECL_COLL3(coll, op, f16) \
   DECL_COLL3(coll, op, f32) \
   DECL_COLL3(coll, op, f64)
+#endif
 
 #define DECL_COLL(coll) \
   DECL_COLL2(coll, sum) \
   DECL_COLL2(coll, prod) \
   DECL_COLL2(coll, min) \
-  DECL_COLL2(coll, max)
+  DECL_COLL2(coll, max) \
+  DECL_COLL2(coll, avg) \
+  DECL_COLL2(coll, premulsum)
 
 #define DECL_ALL_COLLS \
   DECL_COLL2(ncclBroadcast, copy) \
@@ -51,9 +69,16 @@
   DECL_COLL2(ncclAllGather, copy) \
   DECL_COLL(ncclReduceScatter) \
   DECL_COLL(ncclAllReduce) \
+  DECL_COLL2(ncclSendRecv, copy) \
 
 DECL_ALL_COLLS
 
+// Runs all operations through the function table
+extern __global__ void ncclGenericKernel(struct ncclColl c);
+
+// Single-hop allreduce kernels, indexed by devOp*ncclNumTypes+datatype
+extern void* ncclOneShotKerns[];
+
 // CHUNKSIZE must be a multiple of SLICESIZE
 #define ALLREDUCE_SLICESTEPS (NCCL_STEPS/4)
 #define ALLREDUCE_CHUNKSTEPS (NCCL_STEPS/2)
@@ -65,5 +90,7 @@ DECL_ALL_COLLS
 #define BROADCAST_CHUNKSTEPS 1
 #define REDUCE_SLICESTEPS 1
 #define REDUCE_CHUNKSTEPS 1
+#define SENDRECV_SLICESTEPS (NCCL_STEPS/4)
+#define SENDRECV_CHUNKSTEPS (NCCL_STEPS/2)
 
 #endif
@@ -17,7 +17,7 @@ __device__ void ncclBroadcastRingKernel(struct CollectiveArgs* args) {
   struct ncclChannel* channel = comm->channels+blockIdx.x;
   struct ncclRing* ring = &channel->ring;
   const ssize_t size = args->N;
-  const int stepSize = channel->buffSize / (sizeof(T)*NCCL_STEPS);
+  const int stepSize = (channel->buffSize / (sizeof(T)*NCCL_STEPS)) >> args->stepShift;
   const int chunkSize = stepSize * BROADCAST_CHUNKSTEPS;
   const ssize_t loopSize = args->nChannels*(ssize_t)chunkSize;
   const int rank = ring->devUserRanks[0];
@@ -52,7 +52,42 @@ __device__ void ncclBroadcastRingKernel(struct CollectiveArgs* args) {
 }
 
 template<int UNROLL, class FUNC, typename T>
-__device__ void ncclBroadcastTreeKernel(struct CollectiveArgs* args) { }
+__device__ void ncclBroadcastTreeKernel(struct CollectiveArgs* args) {
+  const int tid = threadIdx.x;
+  const int nthreads = blockDim.x - 1;
+  const int bid = args->bid;
+  struct ncclDevComm* comm = args->comm;
+  struct ncclChannel* channel = comm->channels+blockIdx.x;
+  const ssize_t size = args->N;
+  const int stepSize = channel->buffSize / (sizeof(T)*NCCL_STEPS);
+  const int chunkSize = args->lastChunkSize;
+  const ssize_t loopSize = args->nChannels*chunkSize;
+
+  // Compute pointers
+  const T * __restrict__ thisInput = (const T*)args->ThisInput;
+  T * __restrict__ thisOutput = (T*)args->ThisOutput;
+
+  // Max number of recv is 1, max number of send is 4 (binary tree + local + former parent)
+  int up, down[NCCL_MAX_TREE_ARITY+1];
+  ncclTreeReroot(channel, comm->rank, args->root, &up, down);
+  ncclPrimitives<UNROLL, 1, 1, T, 1, NCCL_MAX_TREE_ARITY+1, FUNC> prims(tid, nthreads, &up, down, NULL, stepSize, channel, comm, args->opCount);
+
+  for (ssize_t gridOffset = 0; gridOffset < size; gridOffset += loopSize) {
+    ssize_t offset = gridOffset + bid*chunkSize;
+    int nelem = min(chunkSize, size-offset);
+    if (up == -1) {
+      if (thisInput == thisOutput) {
+        prims.send(thisInput+offset, nelem);
+      } else {
+        prims.copySend(thisInput+offset, thisOutput+offset, nelem);
+      }
+    } else if (down[0] == -1) {
+      prims.recv(thisOutput+offset, nelem);
+    } else {
+      prims.recvCopySend(thisOutput+offset, nelem);
+    }
+  }
+}
 
 template<int UNUSED, class FUNC, typename T>
 __device__ void ncclBroadcastRingLLKernel(struct CollectiveArgs* args) {
@@ -99,4 +134,117 @@ __device__ void ncclBroadcastRingLLKernel(struct CollectiveArgs* args) {
 }
 
 template<int UNUSED, class FUNC, typename T>
-__device__ void ncclBroadcastTreeLLKernel(struct CollectiveArgs* args) { }
+__device__ void ncclBroadcastTreeLLKernel(struct CollectiveArgs* args) {
+  const int tid = threadIdx.x;
+  const int nthreads = args->nThreads;
+  const int bid = args->bid;
+  struct ncclDevComm* comm = args->comm;
+  struct ncclChannel* channel = comm->channels+blockIdx.x;
+  const ssize_t size = args->N;
+  ssize_t chunkSize = NCCL_LL_SLICE_LINES * sizeof(uint64_t) / sizeof(T);
+  const ssize_t loopSize = args->nChannels*chunkSize;
+
+  // Compute pointers
+  const T * __restrict__ thisInput = (const T*)args->ThisInput;
+  T * __restrict__ thisOutput = (T*)args->ThisOutput;
+
+  int up, down[NCCL_MAX_TREE_ARITY+1];
+  ncclTreeReroot(channel, comm->rank, args->root, &up, down);
+  ncclLLPrimitives<T, FUNC, 1, NCCL_MAX_TREE_ARITY+1> LLprims(tid, nthreads, &up, down, channel, comm, args->opCount);
+
+  for (ssize_t gridOffset = 0; gridOffset < size; gridOffset += loopSize) {
+    ssize_t offset = gridOffset + bid*chunkSize;
+    int nelem = min(chunkSize, size-offset);
+    if (up == -1) {
+      if (thisInput == thisOutput) {
+        LLprims.send(thisInput+offset, nelem);
+      } else {
+        LLprims.copySend(thisInput+offset, thisOutput+offset, nelem);
+      }
+    } else if (down[0] == -1) {
+      LLprims.recv(thisOutput+offset, nelem);
+    } else {
+      LLprims.recvCopySend(thisOutput+offset, nelem);
+    }
+  }
+}
+
+template<int UNUSED, class FUNC, typename T>
+__device__ void ncclBroadcastRingLL128Kernel(struct CollectiveArgs* args) {
+  const int tid = threadIdx.x;
+  const int bid = args->bid;
+  const int nthreads = args->nThreads;
+  struct ncclDevComm* comm = args->comm;
+  struct ncclChannel* channel = comm->channels+blockIdx.x;
+  struct ncclRing* ring = &channel->ring;
+
+  ncclLL128Primitives<T, FUNC, 1, 1> LLprims(tid, nthreads, &ring->prev, &ring->next, channel, comm, args->opCount);
+
+  const ssize_t size = args->N;
+  const int rank = ring->devUserRanks[0];
+  const int nextRank = ring->devUserRanks[1];
+  const int root = args->root;
+
+  ssize_t chunkSize = NCCL_LL128_SLICE_DATA * sizeof(uint64_t) / sizeof(T);
+  const ssize_t loopSize = args->nChannels*chunkSize;
+
+  // Compute pointers
+  const T * __restrict__ thisInput = (const T*)args->ThisInput;
+  T * __restrict__ thisOutput = (T*)args->ThisOutput;
+
+  for (ssize_t gridOffset = 0; gridOffset < size; gridOffset += loopSize) {
+    if (size-gridOffset < loopSize) {
+      chunkSize = args->lastChunkSize;
+    }
+    ssize_t offset = gridOffset + bid*chunkSize;
+
+    int nelem = min(chunkSize, size-offset);
+    if (rank == root) {
+      if (thisInput == thisOutput) {
+        LLprims.send(thisInput+offset, nelem);
+      } else {
+        LLprims.copySend(thisInput + offset, thisOutput + offset, nelem);
+      }
+    } else if (nextRank == root) {
+      LLprims.recv(thisOutput + offset, nelem);
+    } else {
+      LLprims.recvCopySend(thisOutput + offset, nelem);
+    }
+  }
+}
+
+template<int UNUSED, class FUNC, typename T>
+__device__ void ncclBroadcastTreeLL128Kernel(struct CollectiveArgs* args) {
+  const int tid = threadIdx.x;
+  const int nthreads = args->nThreads;
+  const int bid = args->bid;
+  struct ncclDevComm* comm = args->comm;
+  struct ncclChannel* channel = comm->channels+blockIdx.x;
+  const ssize_t size = args->N;
+  ssize_t chunkSize = NCCL_LL128_SLICE_DATA * sizeof(uint64_t) / sizeof(T);
+  const ssize_t loopSize = args->nChannels*chunkSize;
+
+  // Compute pointers
+  const T * __restrict__ thisInput = (const T*)args->ThisInput;
+  T * __restrict__ thisOutput = (T*)args->ThisOutput;
+
+  int up, down[NCCL_MAX_TREE_ARITY+1];
+  ncclTreeReroot(channel, comm->rank, args->root, &up, down);
+  ncclLL128Primitives<T, FUNC, 1, NCCL_MAX_TREE_ARITY+1> LLprims(tid, nthreads, &up, down, channel, comm, args->opCount);
+
+  for (ssize_t gridOffset = 0; gridOffset < size; gridOffset += loopSize) {
+    ssize_t offset = gridOffset + bid*chunkSize;
+    int nelem = min(chunkSize, size-offset);
+    if (up == -1) {
+      if (thisInput == thisOutput) {
+        LLprims.send(thisInput+offset, nelem);
+      } else {
+        LLprims.copySend(thisInput+offset, thisOutput+offset, nelem);
+      }
+    } else if (down[0] == -1) {
+      LLprims.recv(thisOutput+offset, nelem);
+    } else {
+      LLprims.recvCopySend(thisOutput+offset, nelem);
+    }
+  }
+}
@@ -42,50 +42,83 @@ static __device__ void load_coll(struct ncclColl* localColl, struct ncclColl* ho
   if (tid == 0) hostColl->active = 0;
 }
 
+static __device__ __forceinline__ uint64_t globalTimer() {
+  uint64_t t;
+  asm volatile("mov.u64 %0, %%globaltimer;" : "=l"(t));
+  return t;
+}
+
 /* Functions for aggregation case */
 #define IMPL_COLL_FUNC(coll, op, ncclFunc, dtype, ctype) \
 __device__ void NCCL_COLL_NAME(coll, op, dtype)(struct CollectiveArgs* args) { \
   coll##Kernel<COLL_UNROLL, ncclFunc<ctype>, ctype>(args); \
 }
 
-#if NCCL_OP == 0
-/* Kernels with the first operation inlined */
+/* Run the operations of this block, starting with firstColl. Operations of
+ * index FINDEX call INLINED directly, others go through ncclFuncs. */
+template<int FINDEX, void (*INLINED)(struct CollectiveArgs*)>
+__device__ __forceinline__ void ncclKernelLoop(struct ncclColl& firstColl) {
+  int tid = threadIdx.x;
+  int bid = blockIdx.x;
+  __shared__ struct ncclColl localColl;
+
+  struct ncclDevComm* comm = firstColl.args.comm;
+  struct ncclChannel* channel = comm->channels+bid;
+  struct ncclColl* c;
+  if (bid == 0) {
+    /* To optimize for latency, (only) the first operation is passed as argument.*/
+    c = &firstColl;
+  } else if (firstColl.active == NCCL_COLL_GRAPH) {
+    /* Graph launch : all channels run the operation passed as argument */
+    c = &localColl;
+    if (tid == 0) {
+      localColl = firstColl;
+      localColl.args.bid = bid;
+    }
+    __syncthreads();
+  } else {
+    c = &localColl;
+    load_coll(c, channel->devCollectives+channel->collFifoHead, tid);
+  }
+  /* Timeline profiler : start and end of each FIFO operation, as seen by thread 0 */
+  uint64_t* timestamps = channel->devTimestamps;
+  int opIndex = channel->collFifoHead;
+  while (1) {
+    int timed = tid == 0 && timestamps && c->active != NCCL_COLL_GRAPH;
+    if (timed) timestamps[2*opIndex] = globalTimer();
+    if (tid < c->args.nThreads) {
+      if (FINDEX >= 0 && c->funcIndex == FINDEX) {
+        INLINED(&c->args);
+      } else {
+        ncclFuncs[c->funcIndex](&c->args);
+      }
+    }
+    if (timed) timestamps[2*opIndex+1] = globalTimer();
+    /* Graph launches do not use the FIFO */
+    if (c->active == NCCL_COLL_GRAPH) return;
+    int nextIndex = c->nextIndex;
+    if (tid == 0) channel->collFifoHead = nextIndex;
+    opIndex = nextIndex;
+
+    if (c->active == 2) {
+      return;
+    }
+
+    /* Load next collective operation*/
+    c = &localColl; /* for bid 0 */
+    load_coll(c, channel->devCollectives+nextIndex, tid);
+  }
+}
+
+/* Kernels with the first operation inlined are only built for the most common
+ * combinations : sums of floating point types, and of 8-bit integers which
+ * also carry all copy operations. The others are launched through
+ * ncclGenericKernel, see ncclKerns in enqueue.cc. */
+#if NCCL_OP == 0 && (NCCL_TYPE == 0 || NCCL_TYPE == 6 || NCCL_TYPE == 7 || NCCL_TYPE == 9)
 #define IMPL_COLL_KERN(coll, op, ncclFunc, dtype, ctype, fIndex) \
 __launch_bounds__(MAXTHREADS+WARP_SIZE, 1) \
 __global__ void NCCL_KERN_NAME(coll, op, dtype)(struct ncclColl firstColl) { \
-  int tid = threadIdx.x; \
-  int bid = blockIdx.x; \
-  __shared__ struct ncclColl localColl; \
- \
-  struct ncclDevComm* comm = firstColl.args.comm; \
-  struct ncclChannel* channel = comm->channels+bid; \
-  struct ncclColl* c; \
-  if (bid == 0) { \
-    /* To optimize for latency, (only) the first operation is passed as argument.*/ \
-    c = &firstColl; \
-  } else { \
-    c = &localColl; \
-    load_coll(c, channel->devCollectives+channel->collFifoHead, tid); \
-  } \
-  while (1) { \
-    if (tid < c->args.nThreads) { \
-      if (c->funcIndex == fIndex) { \
-        coll##Kernel<COLL_UNROLL, ncclFunc<ctype>, ctype>(&c->args); \
-      } else { \
-        ncclFuncs[c->funcIndex](&c->args); \
-      } \
-    } \
-    int nextIndex = c->nextIndex; \
-    if (tid == 0) channel->collFifoHead = nextIndex; \
- \
-    if (c->active == 2) { \
-      return; \
-    } \
- \
-    /* Load next collective operation*/ \
-    c = &localColl; /* for bid 0 */ \
-    load_coll(c, channel->devCollectives+nextIndex, tid); \
-  } \
+  ncclKernelLoop<fIndex, NCCL_COLL_NAME(coll, op, dtype)>(firstColl); \
 }
 #else
 #define IMPL_COLL_KERN(coll, op, ncclFunc, dtype, ctype, fIndex)
@@ -95,7 +128,8 @@ __global__ void NCCL_KERN_NAME(coll, op, dtype)(struct ncclColl firstColl) { \
 #define IMPL_COLL4(coll, op, ncclFunc, dtype, ctype, ncclColl, ncclOp, ncclType, al) \
   IMPL_COLL_FUNC(coll, op, ncclFunc, dtype, ctype) \
   IMPL_COLL_FUNC(coll##LL, op, ncclFunc, dtype, ctype) \
-  IMPL_COLL_KERN(coll##LL, op, ncclFunc, dtype, ctype, FUNC_INDEX(ncclColl, ncclOp, ncclType, 1, al)) \
+  IMPL_COLL_FUNC(coll##LL128, op, ncclFunc, dtype, ctype) \
+  IMPL_COLL_KERN(coll##LL, op, ncclFunc, dtype, ctype, FUNC_INDEX(ncclColl, ncclOp, ncclType, NCCL_PROTO_LL, al)) \
 
 #define IMPL_COLL3(coll, op, ncclFunc, dtype, ctype, ncclColl, ncclOp, ncclType) \
   IMPL_COLL4(coll##Ring, op, ncclFunc, dtype, ctype, ncclColl, ncclOp, ncclType, 0) \
@@ -128,6 +162,9 @@ __global__ void NCCL_KERN_NAME(coll, op, dtype)(struct ncclColl firstColl) { \
 #elif NCCL_TYPE == 8
 #define IMPL_COLL2(coll, op, ncclFunc, ncclColl, ncclOp) \
   IMPL_COLL3(coll, op, ncclFunc, f64, double,   ncclColl, ncclOp, ncclFloat64)
+#elif NCCL_TYPE == 9
+#define IMPL_COLL2(coll, op, ncclFunc, ncclColl, ncclOp) \
+  IMPL_COLL3(coll, op, ncclFunc, bf16, __nv_bfloat16, ncclColl, ncclOp, ncclBfloat16)
 #endif
 
 // Reduction define all functions
@@ -143,6 +180,12 @@ __global__ void NCCL_KERN_NAME(coll, op, dtype)(struct ncclColl firstColl) { \
 #elif NCCL_OP == 3
 #define IMPL_COLL_R(collf, colln) \
   IMPL_COLL2(collf, max,  FuncMax,  colln, ncclMax);
+#elif NCCL_OP == 4
+#define IMPL_COLL_R(collf, colln) \
+  IMPL_COLL2(collf, avg,  FuncAvg,  colln, ncclAvg);
+#elif NCCL_OP == 5
+#define IMPL_COLL_R(collf, colln) \
+  IMPL_COLL2(collf, premulsum, FuncPreMulSum, colln, NCCL_DEVOP_PREMULSUM);
 #endif
 
 // Copy primitives only define one
@@ -139,6 +139,29 @@ struct MULTI<FUNC, half> {
   }
 };
 
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+template<class FUNC>
+struct MULTI<FUNC, __nv_bfloat16> {
+  static_assert(sizeof(PackType) == 4 * sizeof(__nv_bfloat16),
+      "PackType must be four times the size of __nv_bfloat16.");
+
+  struct PackBfloat162 {
+    __nv_bfloat162 a, b;
+  };
+
+  __device__ PackType operator()(const PackType x, const PackType y) const {
+    struct PackBfloat162 cx, cy, cr;
+    cx = *(reinterpret_cast<const struct PackBfloat162*>(&x));
+    cy = *(reinterpret_cast<const struct PackBfloat162*>(&y));
+
+    cr.a = FUNC()(cx.a, cy.a);
+    cr.b = FUNC()(cx.b, cy.b);
+
+    return *(reinterpret_cast<PackType*>(&cr));
+  }
+};
+#endif
+
 template<class FUNC>
 struct MULTI<FUNC, float> {
   static_assert(sizeof(PackType) == 2 * sizeof(float),
@@ -228,6 +251,20 @@ void vStore<half>(volatile half* ptr, const half val) {
 }
 #endif
 
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+template<> inline __device__
+__nv_bfloat16 vFetch<__nv_bfloat16>(const volatile __nv_bfloat16* ptr) {
+  __nv_bfloat16 r;
+  r = ((__nv_bfloat16*)ptr)[0];
+  return r;
+}
+
+template<> inline __device__
+void vStore<__nv_bfloat16>(volatile __nv_bfloat16* ptr, const __nv_bfloat16 val) {
+  ((__nv_bfloat16*)ptr)[0] = val;
+}
+#endif
+
 typedef ulong2 Pack128;
 
 template<class FUNC, typename T>
@@ -238,6 +275,45 @@ struct MULTI128 {
   }
 };
 
+// fp16 : reduce the 16 bytes as four half2 to use the paired instructions
+template<class FUNC>
+struct MULTI128<FUNC, half> {
+  struct PackHalf2x4 {
+    half2 a, b, c, d;
+  };
+  static_assert(sizeof(struct PackHalf2x4) == sizeof(Pack128),
+      "Pack128 must be the size of four half2.");
+
+  __device__ void operator()(Pack128& x, Pack128& y) {
+    struct PackHalf2x4* cx = reinterpret_cast<struct PackHalf2x4*>(&x);
+    const struct PackHalf2x4* cy = reinterpret_cast<const struct PackHalf2x4*>(&y);
+    cx->a = FUNC()(cx->a, cy->a);
+    cx->b = FUNC()(cx->b, cy->b);
+    cx->c = FUNC()(cx->c, cy->c);
+    cx->d = FUNC()(cx->d, cy->d);
+  }
+};
+
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+template<class FUNC>
+struct MULTI128<FUNC, __nv_bfloat16> {
+  struct PackBfloat162x4 {
+    __nv_bfloat162 a, b, c, d;
+  };
+  static_assert(sizeof(struct PackBfloat162x4) == sizeof(Pack128),
+      "Pack128 must be the size of four __nv_bfloat162.");
+
+  __device__ void operator()(Pack128& x, Pack128& y) {
+    struct PackBfloat162x4* cx = reinterpret_cast<struct PackBfloat162x4*>(&x);
+    const struct PackBfloat162x4* cy = reinterpret_cast<const struct PackBfloat162x4*>(&y);
+    cx->a = FUNC()(cx->a, cy->a);
+    cx->b = FUNC()(cx->b, cy->b);
+    cx->c = FUNC()(cx->c, cy->c);
+    cx->d = FUNC()(cx->d, cy->d);
+  }
+};
+#endif
+
 inline __device__ void Fetch128(Pack128& v, const Pack128* p) {
   asm volatile("ld.volatile.global.v2.u64 {%0,%1}, [%2];" : "=l"(v.x), "=l"(v.y) : "l"(p) : "memory");
 }
@@ -245,16 +321,27 @@ inline __device__ void Store128(Pack128* p, Pack128& v) {
   asm volatile("st.volatile.global.v2.u64 [%0], {%1,%2};" :: "l"(p), "l"(v.x), "l"(v.y) : "memory");
 }
 
-template<class FUNC, typename T, int MINSRCS, int MAXSRCS, int MINDSTS, int MAXDSTS>
+// Apply the post-reduction operation (see PostOp) to each element of a pack
+template<typename T, class POST, typename P>
+__device__ __forceinline__ P PostPack(const POST* post, P v) {
+  T* e = reinterpret_cast<T*>(&v);
+  #pragma unroll
+  for (int i=0; i<sizeof(P)/sizeof(T); i++) e[i] = (*post)(e[i]);
+  return v;
+}
+
+// post, when not NULL, is applied to the reduced values before they are stored
+template<class FUNC, typename T, int MINSRCS, int MAXSRCS, int MINDSTS, int MAXDSTS, class POST>
 __device__ __forceinline__ void ReduceCopyMulti(const int tid, const int nthreads,
     int nsrcs, const T* srcs[MAXSRCS], int ndsts, T* dsts[MAXDSTS],
-    const int offset, const int N) {
+    const int offset, const int N, const POST* post) {
   for (int idx = offset+tid; idx < offset+N; idx += nthreads) {
     T val = vFetch(srcs[0]+idx);
     #pragma unroll
     for (int i=1; i<MINSRCS; i++) val = FUNC()(val, vFetch(srcs[i]+idx));
     #pragma unroll 1
     for (int i=MINSRCS; i<MAXSRCS && i<nsrcs; i++) val = FUNC()(val, vFetch(srcs[i]+idx));
+    if (POST::enabled && post) val = (*post)(val);
 
     #pragma unroll
     for (int i=0; i<MINDSTS; i++) vStore(dsts[i]+idx, val);
@@ -263,12 +350,52 @@ __device__ __forceinline__ void ReduceCopyMulti(const int tid, const int nthread
   }
 }
 
+// Conversions between the reduction type and the wire type of compressed
+// operations (see NCCL_COMPRESS_*)
+template<typename W>
+struct WireCast {
+  __device__ static W to(const float v);
+  __device__ static float from(const W v);
+};
+
+template<>
+struct WireCast<half> {
+  __device__ static half to(const float v) { return __float2half(v); }
+  __device__ static float from(const half v) { return __half2float(v); }
+};
+
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+template<>
+struct WireCast<__nv_bfloat16> {
+  __device__ static __nv_bfloat16 to(const float v) { return __float2bfloat16(v); }
+  __device__ static float from(const __nv_bfloat16 v) { return __bfloat162float(v); }
+};
+#endif
+
+// Reduce/copy with a single connection on each side, the user buffers being
+// of type T and the connection buffers of type W.
+template<class FUNC, typename T, typename W, int RECV, int SEND, int SRC, int DST, class POST>
+__device__ __forceinline__ void ReduceCopyWireScalar(const int tid, const int nthreads,
+    const T* src, const W* recv, T* dst, W* send, const int offset, const int N, const POST* post) {
+  for (int idx = offset+tid; idx < offset+N; idx += nthreads) {
+    T val;
+    if (SRC) val = vFetch(src+idx);
+    if (RECV) {
+      T r = WireCast<W>::from(vFetch(recv+idx));
+      val = SRC ? FUNC()(val, r) : r;
+    }
+    if (POST::enabled && post) val = (*post)(val);
+    if (DST) vStore(dst+idx, val);
+    if (SEND) vStore(send+idx, WireCast<W>::to(val));
+  }
+}
+
 #define WARP_SIZE 32
 
-template<class FUNC, typename T, int UNROLL, int MINSRCS, int MAXSRCS, int MINDSTS, int MAXDSTS>
+template<class FUNC, typename T, int UNROLL, int MINSRCS, int MAXSRCS, int MINDSTS, int MAXDSTS, class POST>
 __device__ __forceinline__ void ReduceCopy128bMulti( const int w, const int nw, const int t,
     int nsrcs, const T* s[MAXSRCS], int ndsts, T* d[MAXDSTS],
-    const int elemOffset, const int Npack) {
+    const int elemOffset, const int Npack, const POST* post) {
   const int inc = nw * UNROLL * WARP_SIZE;
   int offset = w * UNROLL * WARP_SIZE + t;
 
@@ -293,6 +420,9 @@ __device__ __forceinline__ void ReduceCopy128bMulti( const int w, const int nw,
       for (int u = 0; u < UNROLL; ++u) Fetch128(vals2[u], srcs[i]+u*WARP_SIZE);
       for (int u = 0; u < UNROLL; ++u) MULTI128<FUNC, T>()(vals[u], vals2[u]);
     }
+    if (POST::enabled && post) {
+      for (int u = 0; u < UNROLL; ++u) vals[u] = PostPack<T>(post, vals[u]);
+    }
 
     // Store
     for (int i = 0; i < MINDSTS; i++) {
@@ -315,10 +445,10 @@ __device__ int ptrAlign128(T* ptr) { return (uint64_t)ptr % alignof(Pack128); }
 // Use UNROLL 8 when we have a single source and a single destination, 4 otherwise
 #define AUTOUNROLL (UNROLL*(4/(MINDSTS+MINSRCS)))
 
-template<int UNROLL, class FUNC, typename T, int MINSRCS, int MAXSRCS, int MINDSTS, int MAXDSTS>
+template<int UNROLL, class FUNC, typename T, int MINSRCS, int MAXSRCS, int MINDSTS, int MAXDSTS, class POST>
 __device__ __forceinline__ void ReduceOrCopyMulti(const int tid, const int nthreads,
     int nsrcs, const T* srcs[MAXSRCS], int ndsts, T* dsts[MAXDSTS],
-    int N) {
+    int N, const POST* post) {
   int Nrem = N;
   if (Nrem <= 0) return;
 
@@ -331,14 +461,17 @@ __device__ __forceinline__ void ReduceOrCopyMulti(const int tid, const int nthre
   for (int i=0; i<MINDSTS; i++) alignDiff |= (align ^ ptrAlign128(dsts[i]));
   for (int i=MINDSTS; i<MAXDSTS && i<ndsts; i++) alignDiff |= (align ^ ptrAlign128(dsts[i]));
 
+  // The preamble is counted in elements. Pointers which are not even aligned
+  // on the element size can never reach 128-bit alignment.
+  if (align % sizeof(T)) alignDiff = 1;
   int Npreamble = alignDiff ? Nrem :
     N < alignof(Pack128) ? N :
-    (alignof(Pack128) - align) % alignof(Pack128);
+    ((alignof(Pack128) - align) % alignof(Pack128)) / sizeof(T);
 
   // stage 1: preamble: handle any elements up to the point of everything coming
   // into alignment
   if (Npreamble) {
-    ReduceCopyMulti<FUNC, T, MINSRCS, MAXSRCS, MINDSTS, MAXDSTS>(tid, nthreads, nsrcs, srcs, ndsts, dsts, 0, Npreamble);
+    ReduceCopyMulti<FUNC, T, MINSRCS, MAXSRCS, MINDSTS, MAXDSTS>(tid, nthreads, nsrcs, srcs, ndsts, dsts, 0, Npreamble, post);
     Nrem -= Npreamble;
     if (Nrem == 0) return;
   }
@@ -357,7 +490,7 @@ __device__ __forceinline__ void ReduceOrCopyMulti(const int tid, const int nthre
       * (AUTOUNROLL * WARP_SIZE); // round down
   int Nelem2a = Npack2a * packFactor;
 
-  ReduceCopy128bMulti<FUNC, T, AUTOUNROLL, MINSRCS, MAXSRCS, MINDSTS, MAXDSTS>(w, nw, t, nsrcs, srcs, ndsts, dsts, offset, Npack2a);
+  ReduceCopy128bMulti<FUNC, T, AUTOUNROLL, MINSRCS, MAXSRCS, MINDSTS, MAXDSTS>(w, nw, t, nsrcs, srcs, ndsts, dsts, offset, Npack2a, post);
 
   Nrem -= Nelem2a;
   if (Nrem == 0) return;
@@ -369,14 +502,93 @@ __device__ __forceinline__ void ReduceOrCopyMulti(const int tid, const int nthre
   int Npack2b = Nrem / packFactor;
   int Nelem2b = Npack2b * packFactor;
 
-  ReduceCopy128bMulti<FUNC, T, 1, MINSRCS, MAXSRCS, MINDSTS, MAXDSTS>(w, nw, t, nsrcs, srcs, ndsts, dsts, offset, Npack2b);
+  ReduceCopy128bMulti<FUNC, T, 1, MINSRCS, MAXSRCS, MINDSTS, MAXDSTS>(w, nw, t, nsrcs, srcs, ndsts, dsts, offset, Npack2b, post);
 
   Nrem -= Nelem2b;
   if (Nrem == 0) return;
   offset += Nelem2b;
 
   // stage 2c: tail
-  ReduceCopyMulti<FUNC, T, MINSRCS, MAXSRCS, MINDSTS, MAXDSTS>(tid, nthreads, nsrcs, srcs, ndsts, dsts, offset, Nrem);
+  ReduceCopyMulti<FUNC, T, MINSRCS, MAXSRCS, MINDSTS, MAXDSTS>(tid, nthreads, nsrcs, srcs, ndsts, dsts, offset, Nrem, post);
+}
+
+// Each 128-bit pack of W on the connection matches sizeof(T)/sizeof(W) packs
+// of T in the user buffers.
+template<class FUNC, typename T, typename W, int RECV, int SEND, int SRC, int DST, class POST>
+__device__ __forceinline__ void ReduceCopyWire128b(const int tid, const int nthreads,
+    const T* src, const W* recv, T* dst, W* send, const int elemOffset, const int Npack, const POST* post) {
+  const int packFactor = sizeof(Pack128) / sizeof(W);
+  const int tPacks = sizeof(T) / sizeof(W);
+  static_assert(sizeof(T) % sizeof(W) == 0, "Wire type must not be larger than the reduction type");
+
+  for (int offset = tid; offset < Npack; offset += nthreads) {
+    const int idx = elemOffset + offset*packFactor;
+    Pack128 vals[tPacks];
+    T* v = reinterpret_cast<T*>(vals);
+    if (SRC) {
+      #pragma unroll
+      for (int p=0; p<tPacks; p++) Fetch128(vals[p], ((const Pack128*)(src+idx))+p);
+    }
+    if (RECV) {
+      Pack128 r;
+      Fetch128(r, (const Pack128*)(recv+idx));
+      const W* w = reinterpret_cast<const W*>(&r);
+      #pragma unroll
+      for (int e=0; e<packFactor; e++) {
+        T rv = WireCast<W>::from(w[e]);
+        v[e] = SRC ? FUNC()(v[e], rv) : rv;
+      }
+    }
+    if (POST::enabled && post) {
+      #pragma unroll
+      for (int p=0; p<tPacks; p++) vals[p] = PostPack<T>(post, vals[p]);
+    }
+    if (DST) {
+      #pragma unroll
+      for (int p=0; p<tPacks; p++) Store128(((Pack128*)(dst+idx))+p, vals[p]);
+    }
+    if (SEND) {
+      Pack128 s;
+      W* w = reinterpret_cast<W*>(&s);
+      #pragma unroll
+      for (int e=0; e<packFactor; e++) w[e] = WireCast<W>::to(v[e]);
+      Store128((Pack128*)(send+idx), s);
+    }
+  }
+}
+
+template<class FUNC, typename T, typename W, int RECV, int SEND, int SRC, int DST, class POST>
+__device__ __forceinline__ void ReduceCopyWire(const int tid, const int nthreads,
+    const T* src, const W* recv, T* dst, W* send, const int N, const POST* post) {
+  if (N <= 0) return;
+
+  // The preamble brings the connection buffers to 128-bit alignment. The user
+  // buffers must reach it at the same element, otherwise everything goes
+  // through the scalar path.
+  int Npreamble = N;
+  if (RECV || SEND) {
+    int align = RECV ? ptrAlign128(recv) : ptrAlign128(send);
+    int n = ((alignof(Pack128) - align) % alignof(Pack128)) / sizeof(W);
+    bool aligned = (align % sizeof(W)) == 0;
+    if (RECV && SEND) aligned &= ptrAlign128(send) == align;
+    if (SRC) aligned &= (ptrAlign128(src) + n*sizeof(T)) % alignof(Pack128) == 0;
+    if (DST) aligned &= (ptrAlign128(dst) + n*sizeof(T)) % alignof(Pack128) == 0;
+    if (aligned) Npreamble = min(n, N);
+  }
+
+  ReduceCopyWireScalar<FUNC, T, W, RECV, SEND, SRC, DST>(tid, nthreads, src, recv, dst, send, 0, Npreamble, post);
+  int Nrem = N - Npreamble;
+  if (Nrem == 0) return;
+  int offset = Npreamble;
+
+  const int packFactor = sizeof(Pack128) / sizeof(W);
+  int Npack = Nrem / packFactor;
+  ReduceCopyWire128b<FUNC, T, W, RECV, SEND, SRC, DST>(tid, nthreads, src, recv, dst, send, offset, Npack, post);
+  offset += Npack*packFactor;
+  Nrem -= Npack*packFactor;
+
+  // Tail
+  ReduceCopyWireScalar<FUNC, T, W, RECV, SEND, SRC, DST>(tid, nthreads, src, recv, dst, send, offset, Nrem, post);
 }
 
 #endif // COMMON_KERNEL_H_
@@ -8,15 +8,22 @@
 #include "collectives.h"
 #include "common.h"
 
+// Indexed by NCCL_PROTO_*
 #define NCCL_FUNC5(coll, op, dtype) \
+  NCCL_COLL_NAME(coll##LL, op, dtype), \
   NCCL_COLL_NAME(coll, op, dtype), \
-  NCCL_COLL_NAME(coll##LL, op, dtype)
+  NCCL_COLL_NAME(coll##LL128, op, dtype)
 
 #define NCCL_FUNC4(coll, op, dtype) \
   NCCL_FUNC5(coll##Ring, op, dtype), \
   NCCL_FUNC5(coll##Tree, op, dtype)
 
 // Must be consistent with ncclDataType_t
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+#define NCCL_FUNC4_BF16(coll, op, dtype) , NCCL_FUNC4(coll, op, dtype)
+#else
+#define NCCL_FUNC4_BF16(coll, op, dtype)
+#endif
 #define NCCL_FUNCS3A(coll, op) \
   NCCL_FUNC4(coll, op,  i8), \
   NCCL_FUNC4(coll, op,  u8), \
@@ -26,7 +33,21 @@
   NCCL_FUNC4(coll, op, u64), \
   NCCL_FUNC4(coll, op, f16), \
   NCCL_FUNC4(coll, op, f32), \
-  NCCL_FUNC4(coll, op, f64)
+  NCCL_FUNC4(coll, op, f64) \
+  NCCL_FUNC4_BF16(coll, op, bf16)
+// Sums and products give the same bits for signed and unsigned integers, so
+// only the signed versions are built (see gen_rules.sh)
+#define NCCL_FUNCS3S(coll, op) \
+  NCCL_FUNC4(coll, op,  i8), \
+  NCCL_FUNC4(coll, op,  i8), \
+  NCCL_FUNC4(coll, op, i32), \
+  NCCL_FUNC4(coll, op, i32), \
+  NCCL_FUNC4(coll, op, i64), \
+  NCCL_FUNC4(coll, op, i64), \
+  NCCL_FUNC4(coll, op, f16), \
+  NCCL_FUNC4(coll, op, f32), \
+  NCCL_FUNC4(coll, op, f64) \
+  NCCL_FUNC4_BF16(coll, op, bf16)
 #define NCCL_FUNCS3B(coll, op) \
   NCCL_FUNC4(coll, op,  i8), \
   NCCL_FUNC4(coll, op,  i8), \
@@ -36,15 +57,20 @@
   NCCL_FUNC4(coll, op,  i8), \
   NCCL_FUNC4(coll, op,  i8), \
   NCCL_FUNC4(coll, op,  i8), \
-  NCCL_FUNC4(coll, op,  i8)
+  NCCL_FUNC4(coll, op,  i8) \
+  NCCL_FUNC4_BF16(coll, op, i8)
 
-// Must be consistent with ncclRedOp_t
+// Must be consistent with ncclRedOp_t, then NCCL_DEVOP_PREMULSUM
 #define NCCL_FUNCS2A(coll) \
-  NCCL_FUNCS3A(coll, sum ), \
-  NCCL_FUNCS3A(coll, prod), \
+  NCCL_FUNCS3S(coll, sum ), \
+  NCCL_FUNCS3S(coll, prod), \
   NCCL_FUNCS3A(coll, max ), \
-  NCCL_FUNCS3A(coll, min )
+  NCCL_FUNCS3A(coll, min ), \
+  NCCL_FUNCS3A(coll, avg ), \
+  NCCL_FUNCS3S(coll, premulsum)
 #define NCCL_FUNCS2B(coll) \
+  NCCL_FUNCS3B(coll, copy), \
+  NCCL_FUNCS3B(coll, copy), \
   NCCL_FUNCS3B(coll, copy), \
   NCCL_FUNCS3B(coll, copy), \
   NCCL_FUNCS3B(coll, copy), \
@@ -56,10 +82,11 @@
   NCCL_FUNCS2A(ncclReduce), \
   NCCL_FUNCS2B(ncclAllGather), \
   NCCL_FUNCS2A(ncclReduceScatter), \
-  NCCL_FUNCS2A(ncclAllReduce) }
+  NCCL_FUNCS2A(ncclAllReduce), \
+  NCCL_FUNCS2B(ncclSendRecv) }
 
 // Must be consistent with the ncclFuncSet enum
-__device__ ncclKern_t ncclFuncs[ncclCollCount*ncclNumOps*ncclNumTypes*2*2] = {
+__device__ ncclKern_t ncclFuncs[ncclCollCount*NCCL_NUM_DEVOPS*ncclNumTypes*2*NCCL_NUM_PROTOCOLS] = {
 // Don't try to initialize the host shadow copy of this device-side global
 // variable. There is no host pointer to a device-side function, which
 // confuses clang. This will be fixed in the next clang release.
@@ -68,9 +95,18 @@ __device__ ncclKern_t ncclFuncs[ncclCollCount*ncclNumOps*ncclNumTypes*2*2] = {
   NCCL_FUNCS2A(ncclReduce),
   NCCL_FUNCS2B(ncclAllGather),
   NCCL_FUNCS2A(ncclReduceScatter),
-  NCCL_FUNCS2A(ncclAllReduce)
+  NCCL_FUNCS2A(ncclAllReduce),
+  NCCL_FUNCS2B(ncclSendRecv)
 #endif
 };
 
+static __device__ void ncclFuncNone(struct CollectiveArgs* args) { }
+
+// Kernel for the combinations without their own (see IMPL_COLL_KERN)
+__launch_bounds__(MAXTHREADS+WARP_SIZE, 1)
+__global__ void ncclGenericKernel(struct ncclColl firstColl) {
+  ncclKernelLoop<-1, ncclFuncNone>(firstColl);
+}
+
 // Workaround for https://reviews.llvm.org/D55580
 __device__ void ncclWorkaroundClangD55580() {}
@@ -7,13 +7,31 @@
 
 dir=$1
 
+datatypes="i8 u8 i32 u32 i64 u64 f16 f32 f64"
+if [ "${CUDA_MAJOR:-0}" -ge 11 ]; then
+  datatypes+=" bf16"
+fi
+
 targets="GENOBJS := \\\\\n"
 
-for base in all_reduce all_gather broadcast reduce reduce_scatter; do
+for base in all_reduce all_gather broadcast reduce reduce_scatter sendrecv; do
   opn=0
-  for op in sum prod min max; do
+  for op in sum prod min max avg premulsum; do
     dtn=0
-    for dt in i8 u8 i32 u32 i64 u64 f16 f32 f64; do
+    for dt in ${datatypes}; do
+      skip=0
+      # Sums and products of unsigned integers use the signed versions
+      case "${op}_${dt}" in
+        sum_u*|prod_u*|premulsum_u*) skip=1;;
+      esac
+      # Copy collectives only have one version (see IMPL_COLL_C)
+      case "${base}" in
+        all_gather|broadcast|sendrecv) [ "${op}_${dt}" != "sum_i8" ] && skip=1;;
+      esac
+      if [ $skip == 1 ]; then
+        dtn=$(($dtn + 1))
+        continue
+      fi
       echo "${dir}/${base}_${op}_${dt}.o : ${base}.cu ${dir}/${base}.dep"
       echo "	@printf \"Compiling  %-35s > %s\\\\n\" ${base}.cu ${dir}/${base}_${op}_${dt}.o"
       echo "	mkdir -p ${dir}"
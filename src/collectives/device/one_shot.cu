@@ -0,0 +1,113 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "devcomm.h"
+#include "collectives.h"
+#include "reduce_kernel.h"
+#include "common_kernel.h"
+
+#define SPINS_BEFORE_CHECK_ABORT 1000000
+
+static __device__ void oneShotStoreLL(union ncclLLFifoLine* dst, uint64_t val, uint32_t flag) {
+  asm volatile("st.volatile.global.v4.u32 [%0], {%1,%2,%3,%4};" :: "l"(&dst->i4), "r"((uint32_t)val), "r"(flag), "r"((uint32_t)(val >> 32)), "r"(flag));
+}
+
+static __device__ uint64_t oneShotReadLL(union ncclLLFifoLine* src, uint32_t flag, volatile uint32_t* abortFlag) {
+  uint32_t data1, flag1, data2, flag2;
+  int spins = 0;
+  do {
+    asm volatile("ld.volatile.global.v4.u32 {%0,%1,%2,%3}, [%4];" : "=r"(data1), "=r"(flag1), "=r"(data2), "=r"(flag2) : "l"(&src->i4));
+    if (++spins == SPINS_BEFORE_CHECK_ABORT) {
+      if (*abortFlag) break;
+      spins = 0;
+    }
+  } while ((flag1 != flag) || (flag2 != flag));
+  return data1 + (((uint64_t)data2) << 32);
+}
+
+// Each rank stores its data in LL format into its slot of every rank's
+// buffer, then reduces all slots of its own buffer, in rank order so that
+// all ranks get the same result. The flag of the operation is kept in device
+// memory, and consecutive operations alternate between two halves of the
+// buffers, so that a rank only overwrites data its peers have consumed.
+template<typename T, class FUNC>
+__global__ void ncclOneShotAllReduceKernel(struct ncclOneShotArgs args) {
+  const uint32_t flag = args.counter[0] + 1;
+  const int rank = args.rank;
+  const int nranks = args.nRanks;
+  const int halfOffset = (flag & 1) * nranks * args.slotLines;
+  const size_t npack = DIVUP(args.nBytes, sizeof(uint64_t));
+  const int lastBytes = args.nBytes % sizeof(uint64_t);
+  const char* src = (const char*)args.sendbuff;
+  char* dst = (char*)args.recvbuff;
+  const size_t first = blockIdx.x*blockDim.x + threadIdx.x;
+  const size_t stride = gridDim.x*blockDim.x;
+
+  for (size_t o=first; o<npack; o+=stride) {
+    int nbytes = (o == npack-1 && lastBytes) ? lastBytes : sizeof(uint64_t);
+    uint64_t val = 0;
+    // Using memcpy handles misaligned pointers.
+    memcpy((char*)&val, src+o*sizeof(uint64_t), nbytes);
+    for (int i=0; i<nranks; i++) {
+      // Start with the next rank to spread the stores across NVSwitch ports
+      int peer = (rank+1+i) % nranks;
+      oneShotStoreLL(args.buffs[peer]+halfOffset+rank*args.slotLines+o, val, flag);
+    }
+  }
+
+  const PostOp<FUNC, T> postOp(args.comm, args.redOpSlot);
+  volatile uint32_t* abortFlag = args.comm->abortFlag;
+  union ncclLLFifoLine* buff = args.buffs[rank]+halfOffset;
+  for (size_t o=first; o<npack; o+=stride) {
+    int nbytes = (o == npack-1 && lastBytes) ? lastBytes : sizeof(uint64_t);
+    uint64_t val = oneShotReadLL(buff+o, flag, abortFlag);
+    for (int r=1; r<nranks; r++) {
+      val = MULTI<FUNC, T>()(val, oneShotReadLL(buff+r*args.slotLines+o, flag, abortFlag));
+    }
+    if (PostOp<FUNC, T>::enabled) val = PostPack<T>(&postOp, val);
+    memcpy(dst+o*sizeof(uint64_t), (char*)&val, nbytes);
+  }
+
+  // The last block to finish publishes the flag for the next operation
+  __syncthreads();
+  if (threadIdx.x == 0) {
+    __threadfence();
+    if (atomicAdd(args.counter+1, 1) == gridDim.x-1) {
+      args.counter[1] = 0;
+      args.counter[0] = flag;
+    }
+  }
+}
+
+#define ONESHOT_KERN(func, type) (void*)ncclOneShotAllReduceKernel<type, func<type> >
+
+// Must be consistent with ncclDataType_t
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+#define ONESHOT_KERN_BF16(func) , ONESHOT_KERN(func, __nv_bfloat16)
+#else
+#define ONESHOT_KERN_BF16(func)
+#endif
+#define ONESHOT_KERNS(func) \
+  ONESHOT_KERN(func, int8_t), \
+  ONESHOT_KERN(func, uint8_t), \
+  ONESHOT_KERN(func, int32_t), \
+  ONESHOT_KERN(func, uint32_t), \
+  ONESHOT_KERN(func, int64_t), \
+  ONESHOT_KERN(func, uint64_t), \
+  ONESHOT_KERN(func, half), \
+  ONESHOT_KERN(func, float), \
+  ONESHOT_KERN(func, double) \
+  ONESHOT_KERN_BF16(func)
+
+// Must be consistent with ncclRedOp_t, then NCCL_DEVOP_PREMULSUM
+void* ncclOneShotKerns[NCCL_NUM_DEVOPS*ncclNumTypes] = {
+  ONESHOT_KERNS(FuncSum),
+  ONESHOT_KERNS(FuncProd),
+  ONESHOT_KERNS(FuncMax),
+  ONESHOT_KERNS(FuncMin),
+  ONESHOT_KERNS(FuncAvg),
+  ONESHOT_KERNS(FuncPreMulSum)
+};
@@ -13,6 +13,22 @@
 
 #define SPINS_BEFORE_CHECK_ABORT 1000000
 
+// Sleep between LL polls of host memory, from MIN to MAX ns
+#define LL_BACKOFF_MIN_NS 32
+#define LL_BACKOFF_MAX_NS 1024
+
+#if __CUDACC_VER_MAJOR__ >= 9
+#define WARP_ANY(pred) __any_sync(0xffffffff, pred)
+#else
+#define WARP_ANY(pred) __any(pred)
+#endif
+
+// Connectors shared with other communicators keep their state in one place
+static inline __device__ struct ncclConnInfo* ncclDevConn(struct ncclConnector* connector) {
+  struct ncclConnInfo* conn = &connector->conn;
+  return conn->sharedConn ? conn->sharedConn : conn;
+}
+
 // Unroll unconditionally the first send/recv since nsend/nrecv should be at
 // least 1 if SEND/RECV is set.
 #define FOR_SEND(func, ...) do { \
@@ -31,8 +47,60 @@
   } \
 } while (0)
 
-// Implementation of primitive types
-template <int UNROLL, int SLICESPERCHUNK, int SLICESTEPS, typename T, int NRECV, int NSEND, class FUNC>
+// Neighbors of rank in the tree re-rooted at root : the edges on the path
+// from root to the tree root are reversed. Must match treeReroot on the host.
+static __device__ void ncclTreeReroot(struct ncclChannel* channel, int rank, int root, int* up, int* down) {
+  struct ncclTree* tree = &channel->tree;
+  const int* ups = channel->devTreeUps;
+  // Find the child of rank which leads to root, if any
+  int pathChild = -2;
+  if (rank == root) pathChild = -1;
+  for (int r=root; pathChild == -2 && ups[r] != -1; r=ups[r]) {
+    if (ups[r] == rank) pathChild = r;
+  }
+  int n = 0;
+  for (int i=0; i<NCCL_MAX_TREE_ARITY && tree->down[i] >= 0; i++) {
+    if (tree->down[i] != pathChild) down[n++] = tree->down[i];
+  }
+  if (pathChild == -2) {
+    *up = tree->up;
+  } else {
+    *up = pathChild;
+    if (tree->up >= 0) down[n++] = tree->up;
+  }
+  for (; n<NCCL_MAX_TREE_ARITY+1; n++) down[n] = -1;
+}
+
+// Where the block of each rank lies in the buffer of ReduceScatter/AllGather :
+// size elements at rank*size, or the layout of a ReduceScatterv/AllGatherv,
+// size then being the largest count.
+struct ncclVLayout {
+  const size_t* counts;
+  const size_t* displs;
+  const ssize_t size;
+
+  __device__ ncclVLayout(struct CollectiveArgs* args, ssize_t size) : size(size) {
+    struct ncclDevComm* comm = args->comm;
+    counts = args->vSlot ? comm->vLayouts+(args->vSlot-1)*2*comm->nRanks : NULL;
+    displs = args->vSlot ? counts+comm->nRanks : NULL;
+  }
+  __device__ ssize_t offset(int rank) { return counts ? displs[rank] : rank*size; }
+  // Elements of the block of rank in the chunk at chunkOffset
+  __device__ int nelem(int rank, ssize_t chunkOffset, int realChunkSize) {
+    return min((ssize_t)realChunkSize, (counts ? (ssize_t)counts[rank] : size)-chunkOffset);
+  }
+  // Called by all threads once done : the host can then reuse the slot
+  __device__ void release(struct CollectiveArgs* args, int tid) {
+    if (counts == NULL) return;
+    __syncthreads();
+    if (tid == 0) args->comm->vBusy[(args->vSlot-1)*MAXCHANNELS+args->bid] = 0;
+  }
+};
+
+// Implementation of primitive types. Connection buffers hold elements of
+// type W, which can be narrower than T for compressed operations. In that case
+// there is a single peer on each side and no direct access.
+template <int UNROLL, int SLICESPERCHUNK, int SLICESTEPS, typename T, int NRECV, int NSEND, class FUNC, typename W = T>
 class ncclPrimitives {
  private:
   const int tid;
@@ -46,16 +114,24 @@ class ncclPrimitives {
   uint64_t recvStep[NRECV];
   uint64_t sendStep[NSEND];
   uint64_t sendConnHead[NSEND];
+  // Step where the previous operation stopped, when its steps had another
+  // size : their slots overlap ours, so the first send waits until they
+  // were all consumed. Zero otherwise.
+  uint64_t sendDrainStep[NSEND];
   const T* recvDirectBuff[NRECV];
   T* sendDirectBuff[NSEND];
   const T* recvBuff[NRECV];
   T* sendBuff[NSEND];
   struct ncclDevComm* comm;
+  // Applied by the operations which store the final result of a reduction
+  const PostOp<FUNC, T> postOp;
 
   inline __device__ int recvOffset(int i) { return (recvStep[i]%NCCL_STEPS)*stepSize; }
   inline __device__ int sendOffset(int i) { return (sendStep[i]%NCCL_STEPS)*stepSize; }
   inline __device__ const T* recvPtr(int i) { return ((const T*)recvBuff[i])+recvOffset(i); }
   inline __device__ T* sendPtr(int i) { return ((T*)sendBuff[i])+sendOffset(i); }
+  inline __device__ const W* wireRecvPtr(int i) { return ((const W*)recvBuff[i])+recvOffset(i); }
+  inline __device__ W* wireSendPtr(int i) { return ((W*)sendBuff[i])+sendOffset(i); }
 
   inline __device__ void barrier() {
     asm volatile ("bar.sync 1, %0;" :: "r"(nthreads));
@@ -63,12 +139,13 @@ class ncclPrimitives {
 
   uint32_t mismatch = 0;
   const uint64_t opCount;
+  const bool opCountValid; // Send/Recv don't follow comm->opCount : no mismatch checks
 
   inline __device__ void checkMismatch(volatile uint64_t* remoteOpCount) {
     if (mismatch) {
       // In non-LL, we use _threadfence_system before incrementing opCount, yet we are still waiting for credits here, so there must be a size mismatch
       *(comm->fatalDevError) = ncclDevAssertedMismatch;
-    } else if (remoteOpCount && *remoteOpCount > opCount) {
+    } else if (opCountValid && remoteOpCount && *remoteOpCount > opCount) {
       mismatch += 1;
     }
   }
@@ -102,7 +179,7 @@ class ncclPrimitives {
     mismatch = 0;
     sendStep[i] += SLICESTEPS;
     if (tid == WARP_SIZE+i) {
-      while (sendConnHead[i] + NCCL_STEPS < sendStep[i]) {
+      while (sendConnHead[i] + NCCL_STEPS < sendStep[i] || sendConnHead[i] < sendDrainStep[i]) {
         sendConnHead[i] = *waitPtr;
         if (checkAbort(sendConn[i]->opCountRem)) break;
       }
@@ -134,6 +211,10 @@ class ncclPrimitives {
   template <int DIRECTRECV, int DIRECTSEND, int RECV, int SEND, int SRC, int DST>
   inline __device__ void
   GenericOp(const T* srcPtr, T* dstPtr, int nelem, int directOffset) {
+    if (!std::is_same<T, W>::value) {
+      WireOp<RECV, SEND, SRC, DST>(srcPtr, dstPtr, nelem);
+      return;
+    }
     int offset = 0;
     int sliceSize = stepSize * SLICESTEPS;
 
@@ -151,6 +232,8 @@ class ncclPrimitives {
       for (int i=1; i<NSEND && i<nsend; i++) dsts[DST+i] = directSendPtr<DIRECTSEND>(i, directOffset);
     }
 
+    const PostOp<FUNC, T>* post = (RECV && SRC && DST) ? &postOp : NULL;
+
     #pragma unroll 1
     for (int slice=0; slice<SLICESPERCHUNK; ++slice) {
       int realSize = max(0, min(sliceSize, nelem-offset));
@@ -162,10 +245,10 @@ class ncclPrimitives {
           if (DIRECTRECV && recvDirectBuff[0]) {
             // We can only have one direct receive. Since srcs[0] == dstPtr+offset, skip one copy
             if (SEND) {
-              ReduceOrCopyMulti<UNROLL, FUNC, T, 1, 1, 1, NSEND>(tid, nthreads, 1, srcs, nsend, dsts+1, realSize);
+              ReduceOrCopyMulti<UNROLL, FUNC, T, 1, 1, 1, NSEND>(tid, nthreads, 1, srcs, nsend, dsts+1, realSize, (const PostOp<FUNC, T>*)NULL);
             }
           } else {
-            ReduceOrCopyMulti<UNROLL, FUNC, T, RECV+SRC, RECV*NRECV+SRC, SEND+DST, SEND*NSEND+DST>(tid, nthreads, RECV*nrecv+SRC, srcs, SEND*nsend+DST, dsts, realSize);
+            ReduceOrCopyMulti<UNROLL, FUNC, T, RECV+SRC, RECV*NRECV+SRC, SEND+DST, SEND*NSEND+DST>(tid, nthreads, RECV*nrecv+SRC, srcs, SEND*nsend+DST, dsts, realSize, post);
           }
         }
         exitIfAbortBarrier(abort);
@@ -182,6 +265,67 @@ class ncclPrimitives {
     }
   }
 
+  template <int RECV, int SEND, int SRC, int DST>
+  inline __device__ void
+  WireOp(const T* srcPtr, T* dstPtr, int nelem) {
+    int offset = 0;
+    int sliceSize = stepSize * SLICESTEPS;
+
+    // Steps advance in waitRecv/waitSend, get the pointers first
+    const W* recvWire = RECV ? wireRecvPtr(0) : NULL;
+    W* sendWire = SEND ? wireSendPtr(0) : NULL;
+    const PostOp<FUNC, T>* post = (RECV && SRC && DST) ? &postOp : NULL;
+
+    #pragma unroll 1
+    for (int slice=0; slice<SLICESPERCHUNK; ++slice) {
+      int realSize = max(0, min(sliceSize, nelem-offset));
+      if (tid < nthreads) {
+        FOR_SEND(waitSend);
+        FOR_RECV(waitRecv);
+        if (realSize > 0) {
+          barrier();
+          ReduceCopyWire<FUNC, T, W, RECV, SEND, SRC, DST>(tid, nthreads,
+              SRC ? srcPtr+offset : NULL, recvWire, DST ? dstPtr+offset : NULL, sendWire, realSize, post);
+        }
+        exitIfAbortBarrier(abort);
+      } else {
+        exitIfAbortBarrier(abort);
+        FOR_SEND(postSendSize, realSize*sizeof(W));
+        if (SEND) __threadfence_system();
+        FOR_SEND(postSend);
+        FOR_RECV(postRecv);
+      }
+      if (RECV) recvWire += sliceSize;
+      if (SEND) sendWire += sliceSize;
+      offset += sliceSize;
+    }
+  }
+
+  // Zero-copy : the proxy moves the data to/from the user buffer, only
+  // follow the steps so that the proxy knows when the buffer can be used.
+  template <int RECV, int SEND>
+  inline __device__ void
+  SyncOp(int nelem) {
+    int offset = 0;
+    int sliceSize = stepSize * SLICESTEPS;
+
+    #pragma unroll 1
+    for (int slice=0; slice<SLICESPERCHUNK; ++slice) {
+      int realSize = max(0, min(sliceSize, nelem-offset));
+      if (tid < nthreads) {
+        FOR_SEND(waitSend);
+        FOR_RECV(waitRecv);
+        exitIfAbortBarrier(abort);
+      } else {
+        exitIfAbortBarrier(abort);
+        FOR_SEND(postSendSize, realSize*sizeof(T));
+        FOR_SEND(postSend);
+        FOR_RECV(postRecv);
+      }
+      offset += sliceSize;
+    }
+  }
+
   __device__ __forceinline__ void loadRecvConn(struct ncclConnInfo* conn, int i, T* directBuff) {
     recvConn[i] = conn;
     recvBuff[i] = (const T*)recvConn[i]->buff;
@@ -191,7 +335,7 @@ class ncclPrimitives {
     if (tid == nthreads) *recvConn[i]->head = recvStep[i];
     if (tid == i) {
       waitPtr = recvConn[i]->tail;
-      *(recvConn[i]->opCountLoc) = opCount;
+      if (opCountValid) *(recvConn[i]->opCountLoc) = opCount;
     }
     recvDirectBuff[i] = NULL;
     if (directBuff && recvConn[i]->direct) {
@@ -204,12 +348,13 @@ class ncclPrimitives {
   __device__ __forceinline__ void loadSendConn(struct ncclConnInfo* conn, int i, T* directBuff) {
     sendConn[i] = conn;
     sendBuff[i] = (T*)sendConn[i]->buff;
+    sendDrainStep[i] = sendConn[i]->stepSize == stepSize*sizeof(W) ? 0 : sendConn[i]->step;
     sendStep[i] = sendConn[i]->step;
     sendStep[i] = ROUNDUP(sendStep[i], SLICESPERCHUNK*SLICESTEPS);
     if (tid == WARP_SIZE+i) {
       waitPtr = sendConn[i]->head;
       sendConnHead[i] = *waitPtr;
-      *(sendConn[i]->opCountLoc) = opCount;
+      if (opCountValid) *(sendConn[i]->opCountLoc) = opCount;
     }
     sendDirectBuff[i] = NULL;
     if (directBuff && sendConn[i]->direct) {
@@ -225,27 +370,28 @@ class ncclPrimitives {
     if (tid == i) {
       recvConn[i]->step = recvStep[i];
       __threadfence_system();
-      *(recvConn[i]->opCountLoc) += 1;
+      if (opCountValid) *(recvConn[i]->opCountLoc) += 1;
     }
   }
 
   __device__ __forceinline__ void saveSendConn(int i) {
     if (tid == WARP_SIZE+i) {
       sendConn[i]->step = sendStep[i];
+      sendConn[i]->stepSize = stepSize*sizeof(W);
       __threadfence_system();
-      *(sendConn[i]->opCountLoc) += 1;
+      if (opCountValid) *(sendConn[i]->opCountLoc) += 1;
     }
   }
 
  public:
   __device__ __forceinline__
-  ncclPrimitives(const int tid, const int nthreads, int* recvPeers, int* sendPeers, T* directBuff, int stepSize, struct ncclChannel* channel, struct ncclDevComm* comm, const uint64_t opCount)
-    : comm(comm), tid(tid), nthreads(nthreads), stepSize(stepSize), opCount(opCount) {
+  ncclPrimitives(const int tid, const int nthreads, int* recvPeers, int* sendPeers, T* directBuff, int stepSize, struct ncclChannel* channel, struct ncclDevComm* comm, const uint64_t opCount, int redOpSlot = 0, bool opCountValid = true)
+    : comm(comm), postOp(comm, redOpSlot), tid(tid), nthreads(nthreads), stepSize(stepSize), opCount(opCount), opCountValid(opCountValid) {
     // Make sure step is updated before we read it
     __syncthreads();
 
-    for (int i=0; i<NRECV && recvPeers[i] >= 0; i++) loadRecvConn(&channel->devPeers[recvPeers[i]].recv.conn, i, directBuff);
-    for (int i=0; i<NSEND && sendPeers[i] >= 0; i++) loadSendConn(&channel->devPeers[sendPeers[i]].send.conn, i, directBuff);
+    for (int i=0; i<NRECV && recvPeers[i] >= 0; i++) loadRecvConn(ncclDevConn(&channel->devPeers[recvPeers[i]].recv), i, directBuff);
+    for (int i=0; i<NSEND && sendPeers[i] >= 0; i++) loadSendConn(ncclDevConn(&channel->devPeers[sendPeers[i]].send), i, directBuff);
   }
 
   __device__ __forceinline__ void
@@ -304,6 +450,31 @@ class ncclPrimitives {
     GenericOp<0, 1, 1, 1, 1, 1>(src, dst, nelem, directOffset);
   }
 
+  __device__ __forceinline__ void
+  zcopySend(int nelem) {
+    SyncOp<0, 1>(nelem);
+  }
+
+  __device__ __forceinline__ void
+  zcopyRecv(int nelem) {
+    SyncOp<1, 0>(nelem);
+  }
+
+  // Wait until the proxy is done reading the user buffer, as it can be
+  // modified as soon as the kernel completes.
+  __device__ __forceinline__ void
+  zcopySendWait() {
+    if (tid == WARP_SIZE) {
+      spins = 0;
+      mismatch = 0;
+      while (sendConnHead[0] < sendStep[0]) {
+        sendConnHead[0] = *waitPtr;
+        if (checkAbort(sendConn[0]->opCountRem)) break;
+      }
+    }
+    exitIfAbortBarrier(abort);
+  }
+
   __device__ __forceinline__ ~ncclPrimitives() {
     // Save steps for next collective. Have thread 0 do it to be compatible
     // with the way LL works.
@@ -324,12 +495,17 @@ class ncclLLPrimitives {
   volatile uint64_t* waitPtr;
   volatile uint64_t* postPtr;
   volatile int* fifoPtr;
+  volatile uint64_t* doorbellPtr;
   uint64_t recvStep[NRECV];
   uint64_t sendStep[NSEND];
   uint64_t sendConnHead;
   union ncclLLFifoLine* recvBuff[NRECV];
   union ncclLLFifoLine* sendBuff[NSEND];
+  int recvHostMem[NRECV];
+  int warpPoll;
   struct ncclDevComm* comm;
+  // Applied by the operations which store the final result of a reduction
+  const PostOp<FUNC, T> postOp;
 
   inline __device__ int recvOffset(int i) { return (recvStep[i]%NCCL_STEPS)*NCCL_LL_SLICE_LINES; }
   inline __device__ int sendOffset(int i) { return (sendStep[i]%NCCL_STEPS)*NCCL_LL_SLICE_LINES; }
@@ -361,13 +537,14 @@ class ncclLLPrimitives {
 
   uint32_t mismatch = 0;
   const uint64_t opCount;
+  const bool opCountValid; // Send/Recv don't follow comm->opCount : no mismatch checks
 
   inline __device__ void checkMismatch(volatile uint64_t* remoteOpCount) {
     if (mismatch > 20) {
       // We have seen that the peer advanced opcount so many times yet we are still waiting for credit of current op, so it is _most likely_ a mismatch
       // Note that we are not using _threadfence_system in LL so the error cannot be asserted
       *(comm->fatalDevError) = ncclDevSuspectedMismatch;
-    } else if (remoteOpCount && *remoteOpCount > opCount) {
+    } else if (opCountValid && remoteOpCount && *remoteOpCount > opCount) {
       mismatch += 1;
     }
   }
@@ -400,6 +577,14 @@ class ncclLLPrimitives {
     }
   }
 
+  // Tell the proxy the step is complete, once all threads stored their lines
+  inline __device__ void ringDoorbell(int i) {
+    if (tid == WARP_SIZE+i && doorbellPtr) {
+      __threadfence_system();
+      *doorbellPtr = sendStep[i];
+    }
+  }
+
   inline __device__ void postRecv(int i) {
     recvStep[i]++;
     if (tid == i) *postPtr = recvStep[i];
@@ -410,20 +595,59 @@ class ncclLLPrimitives {
     // data corruption when flag loops over.
     if ((sendStep[i] & NCCL_LL_CLEAN_MASK) == NCCL_LL_CLEAN_MASK) {
       for (int o = offset; o<NCCL_LL_SLICE_LINES; o+=nthreads) storeLL(sendPtr(i)+o, 0, sendFlag(i));
+      // The proxy sends them too : they must be there before the doorbell
+      barrier();
     }
     sendStep[i]++;
+    ringDoorbell(i);
+  }
+
+  // Polls of host memory go through PCIe : space them out so that they don't
+  // slow down the rest of the GPU.
+  inline __device__ void backoff(int i, uint32_t* ns) {
+#if __CUDA_ARCH__ >= 700 && __CUDACC_VER_MAJOR__ >= 10
+    if (recvHostMem[i]) {
+      __nanosleep(*ns);
+      *ns = min(*ns*2, LL_BACKOFF_MAX_NS);
+    }
+#endif
+  }
+
+  // One lane polls the last line the warp reads, the others wait for it
+  // instead of polling their own line. The sender writes lines a warp at a
+  // time, so the other lines are most likely there too : readLL still checks
+  // them. Must be called by whole warps.
+  __device__ void waitWarpLL(int i, int offset, int last) {
+    union ncclLLFifoLine* src = recvPtr(i) + last;
+    uint32_t flag = recvFlag(i);
+    uint32_t ns = LL_BACKOFF_MIN_NS;
+    int wait;
+    spins = 0;
+    mismatch = 0;
+    do {
+      wait = 0;
+      if (offset == last) {
+        uint32_t data1, flag1, data2, flag2;
+        asm volatile("ld.volatile.global.v4.u32 {%0,%1,%2,%3}, [%4];" : "=r"(data1), "=r"(flag1), "=r"(data2), "=r"(flag2) : "l"(&src->i4));
+        wait = ((flag1 != flag) || (flag2 != flag)) && checkAbort(recvConn[i]->opCountRem) == 0;
+        if (wait) backoff(i, &ns);
+      }
+    } while (WARP_ANY(wait));
   }
 
   __device__ uint64_t readLL(int i, int offset) {
     union ncclLLFifoLine* src = recvPtr(i) + offset;
     uint32_t flag = recvFlag(i);
     uint32_t data1, flag1, data2, flag2;
+    uint32_t ns = LL_BACKOFF_MIN_NS;
     spins = 0;
     mismatch = 0;
-    do {
+    while (1) {
       asm volatile("ld.volatile.global.v4.u32 {%0,%1,%2,%3}, [%4];" : "=r"(data1), "=r"(flag1), "=r"(data2), "=r"(flag2) : "l"(&src->i4));
       if (checkAbort(recvConn[i]->opCountRem)) break;
-    } while ((flag1 != flag) || (flag2 != flag));
+      if ((flag1 == flag) && (flag2 == flag)) break;
+      backoff(i, &ns);
+    }
     uint64_t val64 = data1 + (((uint64_t)data2) << 32);
     return val64;
   }
@@ -451,10 +675,18 @@ class ncclLLPrimitives {
     uint32_t npack = DIVUP(nbytes, sizeof(uint64_t));
     uint64_t* srcPack = (uint64_t*)srcPtr;
     uint64_t* dstPack = (uint64_t*)dstPtr;
+    const int lane = tid%WARP_SIZE;
     int offset = tid;
-    // Do multiples of 64 bits
+    // Do multiples of 64 bits. Warps go through the loop together so that
+    // they can wait for their lines together.
     #pragma unroll 2
-    for (; offset<npack; offset+=nthreads) {
+    for (; offset-lane<(int)npack; offset+=nthreads) {
+      if (warpPoll) {
+        int last = min(offset-lane+WARP_SIZE-1, (int)npack-1);
+        if (RECV || !SRC) waitWarpLL(0, offset, last);
+        if (RECV) for (int i=1; i<NRECV && i<nrecv; i++) waitWarpLL(i, offset, last);
+      }
+      if (offset >= (int)npack) continue;
       // Recv : local, then intra-node, then inter-node
       uint64_t val = SRC ? readAL(srcPack+offset) : readLL(0, offset);
       if (RECV) {
@@ -463,6 +695,7 @@ class ncclLLPrimitives {
           val = MULTI<FUNC, T>()(readLL(i, offset), val);
         }
       }
+      if (PostOp<FUNC, T>::enabled && RECV && SRC && DST) val = PostPack<T>(&postOp, val);
 
       // Send : inter-node, then intra-node, then local
       if (SEND) {
@@ -478,6 +711,8 @@ class ncclLLPrimitives {
         }
       }
     }
+    // Lanes past the end went through the last iteration of their warp
+    if (offset-nthreads >= (int)npack) offset -= nthreads;
     exitIfAbortLocalBarrier();
     FOR_RECV(postRecv);
     FOR_SEND(postSend, offset);
@@ -487,9 +722,10 @@ class ncclLLPrimitives {
     recvConn[i] = conn;
     recvBuff[i] = recvConn[i]->llBuff;
     recvStep[i] = recvConn[i]->step;
+    recvHostMem[i] = recvConn[i]->llHostMem;
     if (tid == i) {
       postPtr = recvConn[i]->head;
-      *(recvConn[i]->opCountLoc) = opCount;
+      if (opCountValid) *(recvConn[i]->opCountLoc) = opCount;
     }
     nrecv++;
   }
@@ -501,8 +737,9 @@ class ncclLLPrimitives {
     if (tid == WARP_SIZE+i) {
       waitPtr = sendConn[i]->head;
       fifoPtr = sendConn[i]->fifo;
+      doorbellPtr = sendConn[i]->doorbell;
       sendConnHead = *waitPtr;
-      *(sendConn[i]->opCountLoc) = opCount;
+      if (opCountValid) *(sendConn[i]->opCountLoc) = opCount;
     }
     nsend++;
   }
@@ -510,7 +747,7 @@ class ncclLLPrimitives {
   __device__ __forceinline__ void saveRecvConn(int i) {
     if (tid == i) {
       recvConn[i]->step = recvStep[i];
-      *(recvConn[i]->opCountLoc) += 1;
+      if (opCountValid) *(recvConn[i]->opCountLoc) += 1;
       __threadfence_block();
     }
   }
@@ -518,20 +755,21 @@ class ncclLLPrimitives {
   __device__ __forceinline__ void saveSendConn(int i) {
     if (tid == WARP_SIZE+i) {
       sendConn[i]->step = sendStep[i];
-      *(sendConn[i]->opCountLoc) += 1;
+      if (opCountValid) *(sendConn[i]->opCountLoc) += 1;
       __threadfence_block();
     }
   }
 
  public:
   __device__ __forceinline__
-  ncclLLPrimitives(const int tid, const int nthreads, int* recvPeers, int* sendPeers, struct ncclChannel* channel, struct ncclDevComm* comm, const uint64_t opCount)
-    : comm(comm), tid(tid), nthreads(nthreads), opCount(opCount) {
+  ncclLLPrimitives(const int tid, const int nthreads, int* recvPeers, int* sendPeers, struct ncclChannel* channel, struct ncclDevComm* comm, const uint64_t opCount, int redOpSlot = 0, bool opCountValid = true)
+    : comm(comm), postOp(comm, redOpSlot), tid(tid), nthreads(nthreads), opCount(opCount), opCountValid(opCountValid) {
     // Make sure step is updated before we read it.
     barrier();
 
-    for (int i=0; i<NRECV && recvPeers[i] >= 0; i++) loadRecvConn(&channel->devPeers[recvPeers[i]].recv.conn, i);
-    for (int i=0; i<NSEND && sendPeers[i] >= 0; i++) loadSendConn(&channel->devPeers[sendPeers[i]].send.conn, i);
+    warpPoll = comm->llWarpPoll;
+    for (int i=0; i<NRECV && recvPeers[i] >= 0; i++) loadRecvConn(ncclDevConn(&channel->devPeers[recvPeers[i]].recv), i);
+    for (int i=0; i<NSEND && sendPeers[i] >= 0; i++) loadSendConn(ncclDevConn(&channel->devPeers[sendPeers[i]].send), i);
   }
 
   __device__ void send(const T* src, int nelem) {
@@ -568,4 +806,304 @@ class ncclLLPrimitives {
     for (int i=0; i<NSEND && i<nsend; i++) saveSendConn(i);
   }
 };
+// LL128 (see NCCL_LL128_LINESIZE). Warps go through the lines of a step 4 at
+// a time : 8 threads per line, each with 2 elements of 64 bits. The last
+// thread of each line carries one element of data and the flag. Data is
+// packed in lines of NCCL_LL128_DATAELEMS elements.
+#define NCCL_LL128_LINE_THREADS (NCCL_LL128_LINEELEMS/2)
+#define NCCL_LL128_WARP_LINES (WARP_SIZE/NCCL_LL128_LINE_THREADS)
+
+template <typename T, class FUNC, int NRECV, int NSEND>
+class ncclLL128Primitives {
+ private:
+  const int tid;
+  const int nthreads;
+  const int warp;
+  const int lineThread;
+  const bool flagThread;
+  int nrecv = 0;
+  int nsend = 0;
+  struct ncclConnInfo* recvConn[NRECV];
+  struct ncclConnInfo* sendConn[NSEND];
+  volatile uint64_t* waitPtr;
+  volatile uint64_t* postPtr;
+  volatile int* fifoPtr;
+  volatile uint64_t* doorbellPtr;
+  uint64_t recvStep[NRECV];
+  uint64_t sendStep[NSEND];
+  uint64_t sendConnHead;
+  uint64_t* recvBuff[NRECV];
+  uint64_t* sendBuff[NSEND];
+  struct ncclDevComm* comm;
+  // Applied by the operations which store the final result of a reduction
+  const PostOp<FUNC, T> postOp;
+
+  inline __device__ int recvOffset(int i) { return (recvStep[i]%NCCL_STEPS)*NCCL_LL128_SLICE_ELEMS; }
+  inline __device__ int sendOffset(int i) { return (sendStep[i]%NCCL_STEPS)*NCCL_LL128_SLICE_ELEMS; }
+  inline __device__ uint64_t* recvPtr(int i) { return recvBuff[i]+recvOffset(i); }
+  inline __device__ uint64_t* sendPtr(int i) { return sendBuff[i]+sendOffset(i); }
+  inline __device__ uint64_t recvFlag(int i) { return recvStep[i]+1; }
+  inline __device__ uint64_t sendFlag(int i) { return sendStep[i]+1; }
+
+  // See ncclLLPrimitives
+  inline __device__ void exitIfAbortLocalBarrier() {
+    uint32_t popc;
+    asm ("{");
+    asm volatile ("   .reg .pred barr_pred;");
+    asm volatile ("   setp.eq.u32 barr_pred,%0,1;" :: "r"(abort));
+    asm volatile ("   bar.red.popc.u32 %0, 14, %1, barr_pred;" : "=r"(popc) : "r"(nthreads));
+    asm ("}");
+    if (popc) {
+      exitIfAbortBarrier(1);
+    }
+  }
+
+  inline __device__ void barrier() {
+    asm volatile ("bar.sync 1, %0;" :: "r"(nthreads));
+  }
+
+  uint32_t mismatch = 0;
+  const uint64_t opCount;
+
+  inline __device__ void checkMismatch(volatile uint64_t* remoteOpCount) {
+    if (mismatch > 20) {
+      // As with LL, there is no fence before the opCount update
+      *(comm->fatalDevError) = ncclDevSuspectedMismatch;
+    } else if (remoteOpCount && *remoteOpCount > opCount) {
+      mismatch += 1;
+    }
+  }
+
+  uint32_t spins = 0;
+  uint32_t abort = 0;
+
+  inline __device__ int checkAbort(volatile uint64_t* remoteOpCount) {
+    spins++;
+    if (spins == SPINS_BEFORE_CHECK_ABORT) {
+      abort = *(comm->abortFlag);
+      checkMismatch(remoteOpCount);
+      spins = 0;
+    }
+    return abort;
+  }
+
+  inline __device__ void waitSend(int i, int nbytes) {
+    spins = 0;
+    mismatch = 0;
+    if (tid == WARP_SIZE+i) {
+      while (sendConnHead + NCCL_STEPS < sendStep[i] + 1) {
+        sendConnHead = *waitPtr;
+        if (checkAbort(sendConn[i]->opCountRem)) break;
+      }
+      if (fifoPtr) fifoPtr[sendStep[i]%NCCL_STEPS] = nbytes;
+    }
+  }
+
+  // See ncclLLPrimitives
+  inline __device__ void ringDoorbell(int i) {
+    if (tid == WARP_SIZE+i && doorbellPtr) {
+      __threadfence_system();
+      *doorbellPtr = sendStep[i];
+    }
+  }
+
+  inline __device__ void postRecv(int i) {
+    recvStep[i]++;
+    if (tid == i) *postPtr = recvStep[i];
+  }
+
+  inline __device__ void postSend(int i) {
+    sendStep[i]++;
+    ringDoorbell(i);
+  }
+
+  // All threads of the warp load their part of the lines until the flag
+  // threads see the flag of the step.
+  __device__ void readLL128(int i, int offset, bool active, uint64_t& v0, uint64_t& v1) {
+    const uint64_t* src = recvPtr(i) + offset;
+    uint64_t flag = recvFlag(i);
+    bool needReload;
+    spins = 0;
+    mismatch = 0;
+    do {
+      if (active) asm volatile("ld.volatile.global.v2.u64 {%0,%1}, [%2];" : "=l"(v0), "=l"(v1) : "l"(src));
+      needReload = active && flagThread && v1 != flag;
+      if (needReload) checkAbort(recvConn[i]->opCountRem);
+    } while (WARP_ANY(needReload && abort == 0));
+  }
+
+  __device__ void storeLL128(uint64_t* dst, uint64_t v0, uint64_t v1) {
+    asm volatile("st.volatile.global.v2.u64 [%0], {%1,%2};" :: "l"(dst), "l"(v0), "l"(v1));
+  }
+
+  // Using memcpy handles misaligned pointers.
+  __device__ uint64_t readAL(const uint64_t* src) {
+    uint64_t val;
+    memcpy((char*)&val, (char*)src, sizeof(uint64_t));
+    return val;
+  }
+
+  __device__ void storeAL(uint64_t* dst, uint64_t val, uint32_t nbytes) {
+    memcpy((char*)dst, (char*)&val, nbytes);
+  }
+
+  // Store element e of the user buffer, the last one can be incomplete
+  __device__ void storeData(uint64_t* dstPack, int e, uint64_t val, uint32_t nbytes) {
+    if ((e+1)*sizeof(uint64_t) > nbytes) {
+      storeAL(dstPack+e, val, nbytes & 0x7);
+    } else {
+      storeAL(dstPack+e, val, sizeof(uint64_t));
+    }
+  }
+
+  template <int RECV, int SEND, int SRC, int DST>
+  __device__ void LL128GenericOp(const T* srcPtr, T* dstPtr, int nelem) {
+    uint32_t nbytes = nelem < 0 ? 0 : nelem*sizeof(T);
+    int npack = DIVUP(nbytes, sizeof(uint64_t));
+    int nlines = DIVUP(npack, NCCL_LL128_DATAELEMS);
+    FOR_SEND(waitSend, nlines*NCCL_LL128_LINESIZE);
+    barrier();
+    const uint64_t* srcPack = (const uint64_t*)srcPtr;
+    uint64_t* dstPack = (uint64_t*)dstPtr;
+    const int nwarps = nthreads/WARP_SIZE;
+    // Lines are handled by the whole warp, so that it can vote on flags
+    #pragma unroll 2
+    for (int base = warp*NCCL_LL128_WARP_LINES; base < nlines; base += nwarps*NCCL_LL128_WARP_LINES) {
+      const int line = base + threadIdx.x%WARP_SIZE/NCCL_LL128_LINE_THREADS;
+      const bool active = line < nlines;
+      const int elem = line*NCCL_LL128_LINEELEMS + 2*lineThread;
+      // Elements of data of this thread in the user buffers
+      const int e0 = line*NCCL_LL128_DATAELEMS + 2*lineThread;
+      const bool has0 = active && e0 < npack;
+      const bool has1 = active && !flagThread && e0+1 < npack;
+
+      uint64_t v0 = 0, v1 = 0;
+      if (SRC) {
+        if (has0) v0 = readAL(srcPack+e0);
+        if (has1) v1 = readAL(srcPack+e0+1);
+      }
+      if (RECV) {
+        // Recv : local, then intra-node, then inter-node
+        uint64_t r0, r1;
+        readLL128(0, elem, active, r0, r1);
+        if (SRC) {
+          v0 = MULTI<FUNC, T>()(r0, v0);
+          v1 = MULTI<FUNC, T>()(r1, v1);
+        } else {
+          v0 = r0;
+          v1 = r1;
+        }
+        for (int i=1; i<NRECV && i<nrecv; i++) {
+          readLL128(i, elem, active, r0, r1);
+          v0 = MULTI<FUNC, T>()(r0, v0);
+          v1 = MULTI<FUNC, T>()(r1, v1);
+        }
+      }
+      if (PostOp<FUNC, T>::enabled && RECV && SRC && DST) {
+        v0 = PostPack<T>(&postOp, v0);
+        v1 = PostPack<T>(&postOp, v1);
+      }
+
+      // Send : inter-node, then intra-node, then local
+      if (SEND && active) {
+        for (int i=1; i<NSEND && i<nsend; i++) storeLL128(sendPtr(i)+elem, v0, flagThread ? sendFlag(i) : v1);
+        storeLL128(sendPtr(0)+elem, v0, flagThread ? sendFlag(0) : v1);
+      }
+      if (DST) {
+        if (has0) storeData(dstPack, e0, v0, nbytes);
+        if (has1) storeData(dstPack, e0+1, v1, nbytes);
+      }
+    }
+    exitIfAbortLocalBarrier();
+    FOR_RECV(postRecv);
+    FOR_SEND(postSend);
+  }
+
+  __device__ __forceinline__ void loadRecvConn(struct ncclConnInfo* conn, int i) {
+    recvConn[i] = conn;
+    recvBuff[i] = recvConn[i]->ll128Buff;
+    recvStep[i] = recvConn[i]->step;
+    if (tid == i) {
+      postPtr = recvConn[i]->head;
+      *(recvConn[i]->opCountLoc) = opCount;
+    }
+    nrecv++;
+  }
+
+  __device__ __forceinline__ void loadSendConn(struct ncclConnInfo* conn, int i) {
+    sendConn[i] = conn;
+    sendBuff[i] = sendConn[i]->ll128Buff;
+    sendStep[i] = sendConn[i]->step;
+    if (tid == WARP_SIZE+i) {
+      waitPtr = sendConn[i]->head;
+      fifoPtr = sendConn[i]->fifo;
+      doorbellPtr = sendConn[i]->doorbell;
+      sendConnHead = *waitPtr;
+      *(sendConn[i]->opCountLoc) = opCount;
+    }
+    nsend++;
+  }
+
+  __device__ __forceinline__ void saveRecvConn(int i) {
+    if (tid == i) {
+      recvConn[i]->step = recvStep[i];
+      *(recvConn[i]->opCountLoc) += 1;
+      __threadfence_block();
+    }
+  }
+
+  __device__ __forceinline__ void saveSendConn(int i) {
+    if (tid == WARP_SIZE+i) {
+      sendConn[i]->step = sendStep[i];
+      *(sendConn[i]->opCountLoc) += 1;
+      __threadfence_block();
+    }
+  }
+
+ public:
+  __device__ __forceinline__
+  ncclLL128Primitives(const int tid, const int nthreads, int* recvPeers, int* sendPeers, struct ncclChannel* channel, struct ncclDevComm* comm, const uint64_t opCount, int redOpSlot = 0)
+    : comm(comm), postOp(comm, redOpSlot), tid(tid), nthreads(nthreads), warp(tid/WARP_SIZE),
+      lineThread(tid%NCCL_LL128_LINE_THREADS), flagThread(tid%NCCL_LL128_LINE_THREADS == NCCL_LL128_LINE_THREADS-1), opCount(opCount) {
+    // Make sure step is updated before we read it.
+    barrier();
+
+    for (int i=0; i<NRECV && recvPeers[i] >= 0; i++) loadRecvConn(ncclDevConn(&channel->devPeers[recvPeers[i]].recv), i);
+    for (int i=0; i<NSEND && sendPeers[i] >= 0; i++) loadSendConn(ncclDevConn(&channel->devPeers[sendPeers[i]].send), i);
+  }
+
+  __device__ void send(const T* src, int nelem) {
+    return LL128GenericOp<0, 1, 1, 0>(src, NULL, nelem);
+  }
+
+  __device__ void recv(T* dst, int nelem) {
+    return LL128GenericOp<1, 0, 0, 1>(NULL, dst, nelem);
+  }
+
+  __device__ void recvReduceSend(const T* src, int nelem) {
+    return LL128GenericOp<1, 1, 1, 0>(src, NULL, nelem);
+  }
+
+  __device__ void recvReduceCopy(const T* src, T* dst, int nelem) {
+    return LL128GenericOp<1, 0, 1, 1>(src, dst, nelem);
+  }
+
+  __device__ void copySend(const T* src, T* dst, int nelem) {
+    return LL128GenericOp<0, 1, 1, 1>(src, dst, nelem);
+  }
+
+  __device__ void recvCopySend(T* dst, int nelem) {
+    return LL128GenericOp<1, 1, 0, 1>(NULL, dst, nelem);
+  }
+
+  __device__ void recvReduceCopySend(const T* src, T* dst, int nelem) {
+    return LL128GenericOp<1, 1, 1, 1>(src, dst, nelem);
+  }
+
+  __device__ __forceinline__ ~ncclLL128Primitives() {
+    // Save steps for the next operation
+    for (int i=0; i<NRECV && i<nrecv; i++) saveRecvConn(i);
+    for (int i=0; i<NSEND && i<nsend; i++) saveSendConn(i);
+  }
+};
 #endif
@@ -299,4 +299,146 @@ struct FuncMin<half> {
     return __float2half(fm);
   }
 };
+
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+// bfloat16 : native paired instructions on sm_80 and later, float otherwise
+template<>
+struct FuncSum<__nv_bfloat16> {
+  __device__ __nv_bfloat162 operator()(const __nv_bfloat162 x, const __nv_bfloat162 y) const {
+#if __CUDA_ARCH__ >= 800
+    return __hadd2(x, y);
+#else
+    float2 fx, fy, fr;
+    fx = __bfloat1622float2(x);
+    fy = __bfloat1622float2(y);
+    fr.x = fx.x + fy.x;
+    fr.y = fx.y + fy.y;
+    return __float22bfloat162_rn(fr);
+#endif
+  }
+  __device__ __nv_bfloat16 operator()(const __nv_bfloat16 x, const __nv_bfloat16 y) const {
+#if __CUDA_ARCH__ >= 800
+    return __hadd(x, y);
+#else
+    return __float2bfloat16( __bfloat162float(x) + __bfloat162float(y) );
+#endif
+  }
+};
+
+template<>
+struct FuncProd<__nv_bfloat16> {
+  __device__ __nv_bfloat162 operator()(const __nv_bfloat162 x, const __nv_bfloat162 y) const {
+#if __CUDA_ARCH__ >= 800
+    return __hmul2(x, y);
+#else
+    float2 fx, fy, fr;
+    fx = __bfloat1622float2(x);
+    fy = __bfloat1622float2(y);
+    fr.x = fx.x * fy.x;
+    fr.y = fx.y * fy.y;
+    return __float22bfloat162_rn(fr);
+#endif
+  }
+  __device__ __nv_bfloat16 operator()(const __nv_bfloat16 x, const __nv_bfloat16 y) const {
+#if __CUDA_ARCH__ >= 800
+    return __hmul(x, y);
+#else
+    return __float2bfloat16( __bfloat162float(x) * __bfloat162float(y) );
+#endif
+  }
+};
+
+template<>
+struct FuncMax<__nv_bfloat16> {
+  __device__ __nv_bfloat162 operator()(const __nv_bfloat162 x, const __nv_bfloat162 y) const {
+#if __CUDA_ARCH__ >= 800
+    return __hmax2(x, y);
+#else
+    float2 fx, fy, fr;
+    fx = __bfloat1622float2(x);
+    fy = __bfloat1622float2(y);
+    fr.x = fmaxf(fx.x, fy.x);
+    fr.y = fmaxf(fx.y, fy.y);
+    return __float22bfloat162_rn(fr);
+#endif
+  }
+  __device__ __nv_bfloat16 operator()(const __nv_bfloat16 x, const __nv_bfloat16 y) const {
+#if __CUDA_ARCH__ >= 800
+    return __hmax(x, y);
+#else
+    return __float2bfloat16( fmaxf(__bfloat162float(x), __bfloat162float(y)) );
+#endif
+  }
+};
+
+template<>
+struct FuncMin<__nv_bfloat16> {
+  __device__ __nv_bfloat162 operator()(const __nv_bfloat162 x, const __nv_bfloat162 y) const {
+#if __CUDA_ARCH__ >= 800
+    return __hmin2(x, y);
+#else
+    float2 fx, fy, fr;
+    fx = __bfloat1622float2(x);
+    fy = __bfloat1622float2(y);
+    fr.x = fminf(fx.x, fy.x);
+    fr.y = fminf(fx.y, fy.y);
+    return __float22bfloat162_rn(fr);
+#endif
+  }
+  __device__ __nv_bfloat16 operator()(const __nv_bfloat16 x, const __nv_bfloat16 y) const {
+#if __CUDA_ARCH__ >= 800
+    return __hmin(x, y);
+#else
+    return __float2bfloat16( fminf(__bfloat162float(x), __bfloat162float(y)) );
+#endif
+  }
+};
+#endif
+
+// Avg and PreMulSum reduce with a sum. The result is then scaled by the
+// step producing it (see PostOp), so that data is only read and written once.
+template<typename T>
+struct FuncAvg : FuncSum<T> {};
+
+template<typename T>
+struct FuncPreMulSum : FuncSum<T> {};
+
+// Applied to the final result of a reduction
+template<class FUNC, typename T>
+struct PostOp {
+  static const int enabled = 0;
+  __device__ PostOp(struct ncclDevComm* comm, int slot) {}
+  __device__ T operator()(const T x) const { return x; }
+};
+
+template<typename T>
+__device__ T avgDivide(const T x, const int n) { return (T)(x / n); }
+template<>
+__device__ half avgDivide<half>(const half x, const int n) {
+  return __float2half(__half2float(x) / n);
+}
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+template<>
+__device__ __nv_bfloat16 avgDivide<__nv_bfloat16>(const __nv_bfloat16 x, const int n) {
+  return __float2bfloat16(__bfloat162float(x) / n);
+}
+#endif
+
+template<typename T>
+struct PostOp<FuncAvg<T>, T> {
+  static const int enabled = 1;
+  const int nRanks;
+  __device__ PostOp(struct ncclDevComm* comm, int slot) : nRanks(comm->nRanks) {}
+  __device__ T operator()(const T x) const { return avgDivide<T>(x, nRanks); }
+};
+
+template<typename T>
+struct PostOp<FuncPreMulSum<T>, T> {
+  static const int enabled = 1;
+  T scalar;
+  __device__ PostOp(struct ncclDevComm* comm, int slot) {
+    scalar = *(const T*)(comm->redOpScalars+slot);
+  }
+  __device__ T operator()(const T x) const { return FuncProd<T>()(x, scalar); }
+};
 #endif // REDUCE_KERNEL_H_
@@ -0,0 +1,97 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "devcomm.h"
+#include "primitives.h"
+#include "collectives.h"
+
+// Send to rank+delta and receive from rank-delta, one chunk of each at a
+// time. Interleaving both directions within the same operation ensures
+// that exchanges between peers cannot deadlock on the buffer size.
+// In zero-copy mode the network proxy reads/writes the user buffers and
+// the kernel only synchronizes with it.
+template<int UNROLL, class FUNC, typename T>
+__device__ void ncclSendRecvRingKernel(struct CollectiveArgs* args) {
+  const int tid = threadIdx.x;
+  const int nthreads = blockDim.x - 1;
+  struct ncclDevComm* comm = args->comm;
+  struct ncclChannel* channel = comm->channels+blockIdx.x;
+  const ssize_t sendCount = args->sendCount;
+  const ssize_t recvCount = args->recvCount;
+
+  int sendPeer = sendCount ? (comm->rank + args->delta) % comm->nRanks : -1;
+  int recvPeer = recvCount ? (comm->rank - args->delta + comm->nRanks) % comm->nRanks : -1;
+  int noPeer = -1;
+
+  // Each connection has its own FIFO size (see ncclSendRecvBuffSize), hence
+  // one set of primitives per direction.
+  const int sendStepSize = sendPeer >= 0 ? channel->devPeers[sendPeer].send.conn.buffSize / (sizeof(T)*NCCL_STEPS) : 0;
+  const int recvStepSize = recvPeer >= 0 ? channel->devPeers[recvPeer].recv.conn.buffSize / (sizeof(T)*NCCL_STEPS) : 0;
+  const int sendChunkSize = sendStepSize * SENDRECV_CHUNKSTEPS;
+  const int recvChunkSize = recvStepSize * SENDRECV_CHUNKSTEPS;
+
+  // Compute pointers
+  const T * __restrict__ thisInput = (const T*)args->ThisInput;
+  T * __restrict__ thisOutput = (T*)args->ThisOutput;
+
+  ncclPrimitives<UNROLL, SENDRECV_CHUNKSTEPS/SENDRECV_SLICESTEPS, SENDRECV_SLICESTEPS, T, 1, 1, FUNC>
+    sendPrims(tid, nthreads, &noPeer, &sendPeer, NULL, sendStepSize, channel, comm, 0, 0, false);
+  ncclPrimitives<UNROLL, SENDRECV_CHUNKSTEPS/SENDRECV_SLICESTEPS, SENDRECV_SLICESTEPS, T, 1, 1, FUNC>
+    recvPrims(tid, nthreads, &recvPeer, &noPeer, NULL, recvStepSize, channel, comm, 0, 0, false);
+
+  const int zcopy = args->zcopy;
+  ssize_t sendOffset = 0, recvOffset = 0;
+  while (sendOffset < sendCount || recvOffset < recvCount) {
+    if (sendOffset < sendCount) {
+      int nelem = min((ssize_t)sendChunkSize, sendCount-sendOffset);
+      if (zcopy & NCCL_ZCOPY_SEND) sendPrims.zcopySend(nelem); else sendPrims.send(thisInput+sendOffset, nelem);
+      sendOffset += sendChunkSize;
+    }
+    if (recvOffset < recvCount) {
+      int nelem = min((ssize_t)recvChunkSize, recvCount-recvOffset);
+      if (zcopy & NCCL_ZCOPY_RECV) recvPrims.zcopyRecv(nelem); else recvPrims.recv(thisOutput+recvOffset, nelem);
+      recvOffset += recvChunkSize;
+    }
+  }
+  if (zcopy & NCCL_ZCOPY_SEND) sendPrims.zcopySendWait();
+}
+
+template<int UNROLL, class FUNC, typename T>
+__device__ void ncclSendRecvTreeKernel(struct CollectiveArgs* args) { }
+
+template<int UNUSED, class FUNC, typename T>
+__device__ void ncclSendRecvRingLLKernel(struct CollectiveArgs* args) {
+  const int tid = threadIdx.x;
+  const int nthreads = args->nThreads;
+  struct ncclDevComm* comm = args->comm;
+  struct ncclChannel* channel = comm->channels+blockIdx.x;
+  const ssize_t sendCount = args->sendCount;
+  const ssize_t recvCount = args->recvCount;
+  const ssize_t chunkSize = NCCL_LL_SLICE_LINES * sizeof(uint64_t) / sizeof(T);
+
+  int sendPeer = sendCount ? (comm->rank + args->delta) % comm->nRanks : -1;
+  int recvPeer = recvCount ? (comm->rank - args->delta + comm->nRanks) % comm->nRanks : -1;
+
+  ncclLLPrimitives<T, FUNC, 1, 1> LLprims(tid, nthreads, &recvPeer, &sendPeer, channel, comm, 0, 0, false);
+
+  // Compute pointers
+  const T * __restrict__ thisInput = (const T*)args->ThisInput;
+  T * __restrict__ thisOutput = (T*)args->ThisOutput;
+
+  for (ssize_t offset = 0; offset < sendCount || offset < recvCount; offset += chunkSize) {
+    if (offset < sendCount) LLprims.send(thisInput+offset, min(chunkSize, sendCount-offset));
+    if (offset < recvCount) LLprims.recv(thisOutput+offset, min(chunkSize, recvCount-offset));
+  }
+}
+
+template<int UNUSED, class FUNC, typename T>
+__device__ void ncclSendRecvTreeLLKernel(struct CollectiveArgs* args) { }
+
+template<int UNUSED, class FUNC, typename T>
+__device__ void ncclSendRecvRingLL128Kernel(struct CollectiveArgs* args) { }
+
+template<int UNUSED, class FUNC, typename T>
+__device__ void ncclSendRecvTreeLL128Kernel(struct CollectiveArgs* args) { }
@@ -16,3 +16,23 @@ ncclResult_t ncclReduceScatter(const void* sendbuff, void* recvbuff, size_t recv
     REDUCESCATTER_CHUNKSTEPS, REDUCESCATTER_SLICESTEPS };
   return ncclEnqueueCheck(&info);
 }
+
+NCCL_API(ncclResult_t, ncclReduceScatterv, const void* sendbuff, void* recvbuff, const size_t* recvcounts,
+    const size_t* displs, ncclDataType_t datatype, ncclRedOp_t op, ncclComm* comm, cudaStream_t stream);
+ncclResult_t ncclReduceScatterv(const void* sendbuff, void* recvbuff, const size_t* recvcounts,
+    const size_t* displs, ncclDataType_t datatype, ncclRedOp_t op, ncclComm* comm, cudaStream_t stream) {
+  NCCLCHECK(PtrCheck(comm, "ReduceScatterv", "comm"));
+  NCCLCHECK(PtrCheck((void*)recvcounts, "ReduceScatterv", "recvcounts"));
+  NCCLCHECK(PtrCheck((void*)displs, "ReduceScatterv", "displs"));
+  // Kernels loop over the largest count
+  size_t count = 0;
+  for (int r=0; r<comm->nRanks; r++) count = std::max(count, recvcounts[r]);
+  struct ncclInfo info = { ncclCollReduceScatter, "ReduceScatterv",
+    sendbuff, recvbuff, count, datatype, op, 0, comm, stream, /* Args */
+    REDUCESCATTER_CHUNKSTEPS, REDUCESCATTER_SLICESTEPS };
+  if (count > 0) {
+    info.counts = recvcounts;
+    info.displs = displs;
+  }
+  return ncclEnqueueCheck(&info);
+}
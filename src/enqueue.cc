@@ -6,12 +6,21 @@
 
 #include "enqueue.h"
 #include "checks.h"
+#include "channel.h"
 #include "param.h"
+#include "tuning.h"
+#include "copyengine.h"
+#include "oneshot.h"
+#include "hierarchy.h"
+#include "collnet.h"
+#include "timeline.h"
+#include "profiler.h"
 
 #include "collectives/collectives.h"
 
 // Only generate inline kernels for LL
 #define NCCL_FUNC5(coll, op, dtype) \
+  (void*)NCCL_KERN_NAME(coll##LL, op, dtype), \
   (void*)NCCL_KERN_NAME(coll##LL, op, dtype), \
   (void*)NCCL_KERN_NAME(coll##LL, op, dtype)
 
@@ -19,17 +28,29 @@
   (void*)NCCL_FUNC5(coll##Ring, op, dtype), \
   (void*)NCCL_FUNC5(coll##Tree, op, dtype)
 
+// Only some combinations have their own kernel, the others are launched with
+// ncclGenericKernel (see IMPL_COLL_KERN in device/common.h).
+#define NCCL_GENERIC4 \
+  (void*)ncclGenericKernel, (void*)ncclGenericKernel, (void*)ncclGenericKernel, \
+  (void*)ncclGenericKernel, (void*)ncclGenericKernel, (void*)ncclGenericKernel
+
 // Must be consistent with ncclDataType_t
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+#define NCCL_FUNC4_BF16(coll, op, dtype) , (void*)NCCL_FUNC4(coll, op, dtype)
+#else
+#define NCCL_FUNC4_BF16(coll, op, dtype)
+#endif
 #define NCCL_FUNCS3A(coll, op) \
   (void*)NCCL_FUNC4(coll, op,  i8), \
-  (void*)NCCL_FUNC4(coll, op,  u8), \
-  (void*)NCCL_FUNC4(coll, op, i32), \
-  (void*)NCCL_FUNC4(coll, op, u32), \
-  (void*)NCCL_FUNC4(coll, op, i64), \
-  (void*)NCCL_FUNC4(coll, op, u64), \
+  NCCL_GENERIC4, \
+  NCCL_GENERIC4, \
+  NCCL_GENERIC4, \
+  NCCL_GENERIC4, \
+  NCCL_GENERIC4, \
   (void*)NCCL_FUNC4(coll, op, f16), \
   (void*)NCCL_FUNC4(coll, op, f32), \
-  (void*)NCCL_FUNC4(coll, op, f64)
+  NCCL_GENERIC4 \
+  NCCL_FUNC4_BF16(coll, op, bf16)
 #define NCCL_FUNCS3B(coll, op) \
   (void*)NCCL_FUNC4(coll, op,  i8), \
   (void*)NCCL_FUNC4(coll, op,  i8), \
@@ -39,27 +60,34 @@
   (void*)NCCL_FUNC4(coll, op,  i8), \
   (void*)NCCL_FUNC4(coll, op,  i8), \
   (void*)NCCL_FUNC4(coll, op,  i8), \
-  (void*)NCCL_FUNC4(coll, op,  i8)
+  (void*)NCCL_FUNC4(coll, op,  i8) \
+  NCCL_FUNC4_BF16(coll, op, i8)
 
-// Must be consistent with ncclRedOp_t -- but we only generate kernel for sums.
+// Must be consistent with ncclRedOp_t, then NCCL_DEVOP_PREMULSUM -- but we
+// only generate kernel for sums.
 #define NCCL_FUNCS2A(coll) \
+  NCCL_FUNCS3A(coll, sum), \
+  NCCL_FUNCS3A(coll, sum), \
   NCCL_FUNCS3A(coll, sum), \
   NCCL_FUNCS3A(coll, sum), \
   NCCL_FUNCS3A(coll, sum), \
   NCCL_FUNCS3A(coll, sum)
 #define NCCL_FUNCS2B(coll) \
+  NCCL_FUNCS3B(coll, copy), \
+  NCCL_FUNCS3B(coll, copy), \
   NCCL_FUNCS3B(coll, copy), \
   NCCL_FUNCS3B(coll, copy), \
   NCCL_FUNCS3B(coll, copy), \
   NCCL_FUNCS3B(coll, copy)
 
 // Must be consistent with the ncclFuncSet enum
-static void* const ncclKerns[ncclCollCount*ncclNumOps*ncclNumTypes*2*2] = {
+static void* const ncclKerns[ncclCollCount*NCCL_NUM_DEVOPS*ncclNumTypes*2*NCCL_NUM_PROTOCOLS] = {
   NCCL_FUNCS2B(ncclBroadcast),
   NCCL_FUNCS2A(ncclReduce),
   NCCL_FUNCS2B(ncclAllGather),
   NCCL_FUNCS2A(ncclReduceScatter),
-  NCCL_FUNCS2A(ncclAllReduce)
+  NCCL_FUNCS2A(ncclAllReduce),
+  NCCL_FUNCS2B(ncclSendRecv)
 };
 
 /*****************************************************************************/
@@ -102,6 +130,19 @@ ncclResult_t setupLaunch(struct ncclComm* comm, struct cudaLaunchParams* params)
   // As we pass that coll directly, we can free it immediately.
   coll->active = 0;
 
+  if (comm->userStreamCapturing) {
+    // The graph will be replayed without us : pass the (single) operation
+    // to all blocks and give the FIFO entries back.
+    comm->args.active = NCCL_COLL_GRAPH;
+    // Replays are not ordered with other operations
+    comm->args.args.opCount = ~0ULL;
+    for (int r=0; r<params->gridDim.x; r++) {
+      struct ncclChannel* channel = comm->channels+r;
+      channel->collectives[channel->collStart].active = 0;
+      channel->collFifoTail = channel->collStart;
+    }
+  }
+
   params->func = ncclKerns[coll->funcIndex];
   return ncclSuccess;
 }
@@ -145,18 +186,39 @@ ncclResult_t ncclCpuBarrierOut(struct ncclComm* comm) {
   return ncclSuccess;
 }
 
+// Each rank launches its own kernel, rather than the last rank of the process
+// launching for all of them. This is always the case when we are the only
+// rank in the process, which then needs no CPU barrier either.
+static bool directLaunch(struct ncclComm* comm) {
+  return comm->launchMode != ncclComm::GROUP || comm->intraRanks == 1 || comm->userStreamCapturing;
+}
+
+// Use internal NCCL stream for CGMD/GROUP launch if required or if the user
+// stream is NULL, and when the group uses several streams
+static bool useGroupStream(struct ncclComm* comm) {
+  return comm->nExtraStreams > 0 ||
+    (directLaunch(comm) == false && (comm->groupCudaStream || comm->userStream == NULL));
+}
+
 ncclResult_t ncclBarrierEnqueue(struct ncclComm* comm) {
   if (comm->nRanks == 1) return ncclSuccess;
   struct cudaLaunchParams* params = comm->myParams;
 
   NCCLCHECK(setupLaunch(comm, params));
 
-  // Use internal NCCL stream for CGMD/GROUP launch if required or if the user stream is NULL
-  if (comm->launchMode == ncclComm::GROUP && (comm->groupCudaStream || comm->userStream == NULL)) {
+  if (comm->userStreamCapturing) {
+    // Launch directly in the captured stream ; doneEvent was recorded
+    // outside of the capture and can't be waited on.
+    params->stream = comm->userStream;
+  } else if (useGroupStream(comm)) {
     // Enqueue event in user stream
     CUDACHECK(cudaEventRecord(comm->doneEvent, comm->userStream));
     // Create dependency between user stream and internal NCCL stream
     CUDACHECK(cudaStreamWaitEvent(comm->groupStream, comm->doneEvent, 0));
+    for (int s=0; s<comm->nExtraStreams; s++) {
+      CUDACHECK(cudaEventRecord(comm->doneEvent, comm->extraStreams[s]));
+      CUDACHECK(cudaStreamWaitEvent(comm->groupStream, comm->doneEvent, 0));
+    }
     params->stream = comm->groupStream;
   } else {
     if (comm->userStream != params->stream) {
@@ -166,11 +228,13 @@ ncclResult_t ncclBarrierEnqueue(struct ncclComm* comm) {
     params->stream = comm->userStream;
   }
 
+  if (comm->intraRanks == 1) return ncclSuccess;
+
   int isLast = 0;
   NCCLCHECK(ncclCpuBarrierIn(comm, &isLast));
 
   if (isLast) {
-    if (comm->launchMode == ncclComm::GROUP) {
+    if (directLaunch(comm) == false) {
       // I'm the last. Launch all operations.
       NCCLCHECK(ncclLaunchCooperativeKernelMultiDevice(comm->intraParams, comm->intraCudaDevs, comm->intraRanks, *comm->intraCGMode));
     }
@@ -185,15 +249,15 @@ ncclResult_t ncclBarrierEnqueueWait(ncclComm_t comm) {
   if (comm->rank == 0 && *comm->intraCGMode & 0x10) {
     *comm->intraCGMode ^= 0x10;
     INFO(NCCL_INIT,"Launch mode %s%s%s",
-        comm->launchMode == ncclComm::GROUP ? "Group" : "Parallel",
+        comm->launchMode == ncclComm::GROUP ? "Group" : comm->launchMode == ncclComm::PARALLEL ? "Parallel" : "Pipeline",
         *comm->intraCGMode ? "/CGMD" : "",
         (comm->launchMode == ncclComm::GROUP && comm->groupCudaStream) ? "/Stream" : "");
   }
 
-  NCCLCHECK(ncclCpuBarrierOut(comm));
+  if (comm->intraRanks > 1) NCCLCHECK(ncclCpuBarrierOut(comm));
 
   struct cudaLaunchParams *params = comm->myParams;
-  if (comm->launchMode == ncclComm::PARALLEL) {
+  if (directLaunch(comm)) {
     CUDACHECK(cudaLaunchKernel(params->func, params->gridDim, params->blockDim, params->args, params->sharedMem, params->stream));
   }
   // Start the network proxies as soon as the kernel has been launched. We can't
@@ -207,36 +271,197 @@ ncclResult_t ncclBarrierEnqueueWait(ncclComm_t comm) {
     channel->collCount = 0;
   }
   params->gridDim.x = params->blockDim.x = 0;
+  // Launched kernels release their layout slots themselves
+  comm->vPending = 0;
   NCCLCHECK(transportStartProxy(comm));
   return ncclSuccess;
 }
 
 ncclResult_t ncclEnqueueEvents(ncclComm_t comm) {
   struct cudaLaunchParams *params = comm->myParams;
+  if (comm->userStreamCapturing) {
+    comm->userStreamCapturing = false;
+    comm->userStreamSet = false;
+    return ncclSuccess;
+  }
   // Enqueue event after NCCL kernel
   CUDACHECK(cudaEventRecord(comm->doneEvent, params->stream));
-  // Use internal NCCL stream for CGMD/GROUP launch if required or if the user stream is NULL
-  if (comm->launchMode == ncclComm::GROUP && (comm->groupCudaStream || comm->userStream == NULL)) {
-    // Create dependency between NCCL internal stream and user stream
+  if (useGroupStream(comm)) {
+    // Create dependency between NCCL internal stream and user streams
     CUDACHECK(cudaStreamWaitEvent(comm->userStream, comm->doneEvent, 0));
+    for (int s=0; s<comm->nExtraStreams; s++)
+      CUDACHECK(cudaStreamWaitEvent(comm->extraStreams[s], comm->doneEvent, 0));
   }
   comm->userStreamSet = false;
   return ncclSuccess;
 }
 
+/*****************************************************************************/
+/*   Pipelined launch (NCCL_LAUNCH_MODE=PIPELINE) : one thread per device    */
+/*****************************************************************************/
+
+// ncclGroupEnd hands each communicator over to its launcher thread, which
+// stays on the device of the communicator. Launches on all devices of the
+// process then happen in parallel, without cudaSetDevice. As in PARALLEL
+// mode, each thread launches its own kernel and the ranks of the process
+// still meet in the CPU barrier, so that none of them makes CUDA calls which
+// could block until all kernels are launched.
+struct ncclLauncher {
+  pthread_t thread;
+  struct ncclComm* comm;
+  // Launches posted and done. The caller waits for each launch before
+  // posting the next one, so the communicator is only used by one thread.
+  uint64_t posted;
+  uint64_t done;
+  ncclResult_t ret;
+  int stop;
+  // Set while the thread waits on cond, see launcherWake
+  int sleeping;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+// Polls of posted before the launcher thread goes to sleep
+#define NCCL_LAUNCHER_SPINS 100000
+
+static ncclResult_t launchComm(struct ncclComm* comm) {
+  NCCLCHECK(ncclBarrierEnqueue(comm));
+  NCCLCHECK(ncclBarrierEnqueueWait(comm));
+  NCCLCHECK(ncclEnqueueEvents(comm));
+  if (comm->nFusionOps) NCCLCHECK(ncclFusionCopyOut(comm));
+  return ncclSuccess;
+}
+
+static void* launcherThread(void* arg) {
+  struct ncclLauncher* launcher = (struct ncclLauncher*)arg;
+  struct ncclComm* comm = launcher->comm;
+  if (cudaSetDevice(comm->cudaDev) != cudaSuccess) {
+    WARN("Launcher thread failed to set device %d", comm->cudaDev);
+    launcher->ret = ncclUnhandledCudaError;
+  }
+  uint64_t done = 0;
+  while (1) {
+    int spins = 0;
+    while (__atomic_load_n(&launcher->posted, __ATOMIC_ACQUIRE) == done && __atomic_load_n(&launcher->stop, __ATOMIC_ACQUIRE) == 0) {
+      if (++spins < NCCL_LAUNCHER_SPINS) continue;
+      // Pairs with launcherWake : either we see the new post, or the poster
+      // sees us sleeping
+      pthread_mutex_lock(&launcher->mutex);
+      __atomic_store_n(&launcher->sleeping, 1, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&launcher->posted, __ATOMIC_SEQ_CST) == done && launcher->stop == 0)
+        pthread_cond_wait(&launcher->cond, &launcher->mutex);
+      __atomic_store_n(&launcher->sleeping, 0, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&launcher->mutex);
+      spins = 0;
+    }
+    if (__atomic_load_n(&launcher->stop, __ATOMIC_ACQUIRE)) break;
+    if (launcher->ret == ncclSuccess) launcher->ret = launchComm(comm);
+    __atomic_store_n(&launcher->done, ++done, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+static void launcherWake(struct ncclLauncher* launcher) {
+  if (__atomic_load_n(&launcher->sleeping, __ATOMIC_SEQ_CST) == 0) return;
+  pthread_mutex_lock(&launcher->mutex);
+  pthread_cond_signal(&launcher->cond);
+  pthread_mutex_unlock(&launcher->mutex);
+}
+
+bool ncclLaunchPipelined(struct ncclComm* comm) {
+  // Captures are kept on the capturing thread
+  return comm->launchMode == ncclComm::PIPELINE && comm->nRanks > 1 && comm->userStreamCapturing == false;
+}
+
+ncclResult_t ncclLaunchPost(struct ncclComm* comm) {
+  struct ncclLauncher* launcher = comm->launcher;
+  if (launcher == NULL) {
+    NCCLCHECK(ncclCalloc(&launcher, 1));
+    launcher->comm = comm;
+    pthread_mutex_init(&launcher->mutex, NULL);
+    pthread_cond_init(&launcher->cond, NULL);
+    if (pthread_create(&launcher->thread, NULL, launcherThread, launcher) != 0) {
+      WARN("Failed to create the launcher thread of device %d", comm->cudaDev);
+      free(launcher);
+      return ncclSystemError;
+    }
+    comm->launcher = launcher;
+  }
+  __atomic_store_n(&launcher->posted, launcher->posted+1, __ATOMIC_SEQ_CST);
+  launcherWake(launcher);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclLaunchWait(struct ncclComm* comm) {
+  struct ncclLauncher* launcher = comm->launcher;
+  while (__atomic_load_n(&launcher->done, __ATOMIC_ACQUIRE) != launcher->posted) {
+    if (*comm->abortFlag) return ncclSystemError;
+    if (comm->fatalError != ncclSuccess) return comm->fatalError;
+    sched_yield();
+  }
+  // Errors are sticky, as they leave the communicator in an unknown state
+  return launcher->ret;
+}
+
+ncclResult_t ncclLauncherDestroy(struct ncclComm* comm) {
+  struct ncclLauncher* launcher = comm->launcher;
+  if (launcher == NULL) return ncclSuccess;
+  pthread_mutex_lock(&launcher->mutex);
+  __atomic_store_n(&launcher->stop, 1, __ATOMIC_RELEASE);
+  pthread_cond_signal(&launcher->cond);
+  pthread_mutex_unlock(&launcher->mutex);
+  pthread_join(launcher->thread, NULL);
+  pthread_mutex_destroy(&launcher->mutex);
+  pthread_cond_destroy(&launcher->cond);
+  free(launcher);
+  comm->launcher = NULL;
+  return ncclSuccess;
+}
+
 /*****************************************************************************/
 /* Enqueueing system : computation of kernel and proxy operations parameters */
 /*****************************************************************************/
 
+// Whether the tuning model expects the tree to beat the ring
+static bool treeFaster(struct ncclInfo* info) {
+  float best[NCCL_NUM_ALGORITHMS];
+  for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
+    best[a] = -1.0;
+    for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+      float time = ncclTuningTime(info->comm, info->coll, a, p, info->comm->nChannels, info->nBytes);
+      if (time >= 0 && (best[a] < 0 || time < best[a])) best[a] = time;
+    }
+  }
+  return best[NCCL_ALGO_TREE] >= 0 && (best[NCCL_ALGO_RING] < 0 || best[NCCL_ALGO_TREE] < best[NCCL_ALGO_RING]);
+}
+
+// Trees are connected after the first operation which picks them (see
+// ncclTreeConnect) : connecting needs all ranks, and the operation may be
+// part of a group or a graph capture, where we can't talk to the other ranks
+// yet. That operation, and the others until the trees are connected, fall
+// back to rings. All ranks make the same decision.
+static bool treeConnected(struct ncclInfo* info) {
+  struct ncclComm* comm = info->comm;
+  if (comm->treeConnected) return true;
+  if (comm->treeRequested == false) INFO(NCCL_COLL, "%s : trees not connected yet, using rings", info->opName);
+  comm->treeRequested = true;
+  return false;
+}
+
 static ncclResult_t getPatternInfo(struct ncclInfo* info) {
-  if (info->coll == ncclCollBroadcast) info->pattern = ncclPatternPipelineFrom;
-  else if (info->coll == ncclCollReduce) info->pattern = ncclPatternPipelineTo;
+  if (info->coll == ncclCollBroadcast || info->coll == ncclCollReduce) {
+    // Rooted collectives run on the tree re-rooted at their root, in
+    // log(nNodes) steps instead of nRanks
+    bool tree = info->config ? info->config->algorithm == NCCL_ALGO_TREE : treeFaster(info);
+    tree = tree && treeConnected(info);
+    if (info->coll == ncclCollBroadcast) info->pattern = tree ? ncclPatternTreeDown : ncclPatternPipelineFrom;
+    else info->pattern = tree ? ncclPatternTreeUp : ncclPatternPipelineTo;
+  }
   else if (info->coll == ncclCollAllGather || info->coll == ncclCollReduceScatter) info->pattern = ncclPatternRing;
   else if (info->coll == ncclCollAllReduce) {
-    if (info->nBytes <= info->comm->treeThreshold)
-      info->pattern = ncclPatternTreeUpDown;
-    else
-      info->pattern = ncclPatternRingTwice;
+    bool tree = info->config ? info->config->algorithm == NCCL_ALGO_TREE : info->nBytes <= info->comm->treeThreshold;
+    tree = tree && treeConnected(info);
+    info->pattern = tree ? ncclPatternTreeUpDown : ncclPatternRingTwice;
   }
   else {
     WARN("Unknown collective %d", info->coll);
@@ -264,10 +489,27 @@ static ncclResult_t getLoopInfo(struct ncclInfo* info) {
   return ncclSuccess;
 }
 
-static void getKernelInfo(struct ncclInfo* info, uint8_t* nChannels, uint16_t* nThreads, int* llMode) {
+// When users cap the number of CTAs, they want SMs back for their own
+// kernels : use the fewest channels the tuning model expects within 10% of
+// the time on all allowed channels.
+static int getSimpleChannels(struct ncclInfo* info, int proto, int maxChannels) {
+  if (info->comm->maxCTAs <= 0) return maxChannels;
+  int algo = info->pattern >= ncclPatternTreeUp ? NCCL_ALGO_TREE : NCCL_ALGO_RING;
+  float maxTime = ncclTuningTime(info->comm, info->coll, algo, proto, maxChannels, info->nBytes);
+  if (maxTime < 0) return maxChannels;
+  for (int nc=1; nc<maxChannels; nc++) {
+    float time = ncclTuningTime(info->comm, info->coll, algo, proto, nc, info->nBytes);
+    if (time >= 0 && time <= maxTime*1.1) return nc;
+  }
+  return maxChannels;
+}
+
+static void getKernelInfo(struct ncclInfo* info, uint8_t* nChannels, uint16_t* nThreads, int* protocol) {
   // Compute thresholds and limits that users can override
   ssize_t perThreadLLThreshold = std::min<ssize_t>(info->comm->threadThreshold, NCCL_LL_CHANNEL_THRESHOLD);
   int maxLLNthreads = std::min(NCCL_LL_MAX_NTHREADS, info->comm->nThreads);
+  int maxChannels = info->config ? info->config->nChannels : info->comm->nChannels;
+  if (info->comm->maxCTAs > 0) maxChannels = std::min(maxChannels, info->comm->maxCTAs);
 
   // First compute nThreads
   int nt = NCCL_LL_MIN_NTHREADS;
@@ -276,26 +518,79 @@ static void getKernelInfo(struct ncclInfo* info, uint8_t* nChannels, uint16_t* n
   // Then compute nChannels
   int nc = DIVUP(info->nBytes, nt*info->nchunksPerLoop*perThreadLLThreshold);
   if (nc == 0) nc = 1;
-  if (nc > info->comm->nChannels) nc = info->comm->nChannels;
+  if (nc > maxChannels) nc = maxChannels;
 
-  // Check if we have a fixed LL threshold, otherwise compute it.
-  int perThreadThreshold = info->comm->threadThreshold;
-  if (info->pattern >= ncclPatternTreeUp) perThreadThreshold *= 4;
-  ssize_t llThreshold = info->comm->llThreshold >= 0 ?
-    info->comm->llThreshold :
-    nc*nt*info->nchunksPerLoop*perThreadThreshold;
+  // Check if we have a fixed LL threshold, otherwise ask the tuning model
+  // which of LL on nc channels, simple and LL128 on all channels is fastest.
+  // A fixed threshold only decides about LL : above it, LL128 still competes
+  // with the simple protocol.
+  int algo = info->pattern >= ncclPatternTreeUp ? NCCL_ALGO_TREE : NCCL_ALGO_RING;
+  int proto;
+  if (info->counts) {
+    // Only the ring kernels of the simple protocol handle per-rank counts
+    proto = NCCL_PROTO_SIMPLE;
+  } else if (info->config) {
+    proto = info->config->protocol;
+  } else if (info->comm->llThreshold >= 0 && info->nBytes <= info->comm->llThreshold) {
+    proto = NCCL_PROTO_LL;
+  } else {
+    float simpleTime = ncclTuningTime(info->comm, info->coll, algo, NCCL_PROTO_SIMPLE, maxChannels, info->nBytes);
+    float ll128Time = info->comm->ll128 ? ncclTuningTime(info->comm, info->coll, algo, NCCL_PROTO_LL128, maxChannels, info->nBytes) : -1;
+    float llTime = info->comm->llThreshold >= 0 ? -1 : ncclTuningTime(info->comm, info->coll, algo, NCCL_PROTO_LL, nc, info->nBytes);
+    proto = NCCL_PROTO_SIMPLE;
+    float time = simpleTime;
+    if (ll128Time >= 0 && (time < 0 || ll128Time < time)) { proto = NCCL_PROTO_LL128; time = ll128Time; }
+    if (llTime >= 0 && (time < 0 || llTime <= time)) proto = NCCL_PROTO_LL;
+  }
 
-  if (info->nBytes <= llThreshold) {
-    *llMode = 1;
+  *protocol = proto;
+  if (proto == NCCL_PROTO_LL) {
     *nChannels = nc;
     *nThreads = nt;
   } else {
-    *llMode = 0;
-    *nChannels = info->comm->nChannels;
-    *nThreads = info->comm->nThreads+1;
+    *nChannels = info->config ? maxChannels : getSimpleChannels(info, proto, maxChannels);
+    // LL128 has no extra thread, and needs whole warps
+    *nThreads = proto == NCCL_PROTO_LL128 ? info->comm->nThreads : info->comm->nThreads+1;
   }
 }
 
+NCCL_PARAM(StepShift, "STEP_SHIFT", -2);
+
+#define NCCL_MAX_STEP_SHIFT 5
+#define NCCL_MIN_STEP_SIZE (16*1024)
+
+// Ring steps of the simple protocol are buffSize/NCCL_STEPS bytes by default,
+// which leaves mid-size messages with one or two slices per rank : they then
+// cross the ring with little pipelining. Each slice goes through nstages
+// steps (ring) or hops (chain), so the operation takes about
+//   (nstages + nslices - 1) * (step latency + slice size / channel bandwidth)
+// and we pick the step size minimizing it. All ranks get the same result
+// since they share the tuning model.
+static int getStepShift(struct ncclInfo* info, int nChannels, int stepSize, int sliceSteps) {
+  int shift = ncclParamStepShift();
+  if (shift != -2) return std::min(std::max(shift, 0), NCCL_MAX_STEP_SHIFT);
+  struct ncclComm* comm = info->comm;
+  int nstages = info->pattern == ncclPatternPipelineFrom || info->pattern == ncclPatternPipelineTo ?
+    comm->nRanks-1 : info->nstepsPerLoop;
+  float bw = comm->bandwidths[info->coll][NCCL_ALGO_RING][NCCL_PROTO_SIMPLE][nChannels-1];
+  if (bw == 0 || nstages < 2) return 0;
+  float stepLat = comm->latencies[info->coll][NCCL_ALGO_RING][NCCL_PROTO_SIMPLE] / nstages;
+  float channelBw = bw / nChannels;
+  ssize_t rankBytes = DIVUP(info->nBytes, nChannels*info->nchunksPerLoop);
+  int best = 0;
+  float bestTime = -1;
+  for (int s=0; s<=NCCL_MAX_STEP_SHIFT && (stepSize>>s) >= NCCL_MIN_STEP_SIZE; s++) {
+    ssize_t sliceBytes = (ssize_t)(stepSize>>s)*sliceSteps;
+    ssize_t nslices = DIVUP(rankBytes, sliceBytes);
+    float time = (nstages+nslices-1) * (stepLat + std::min(sliceBytes, rankBytes)/channelBw);
+    if (bestTime < 0 || time < bestTime) {
+      best = s;
+      bestTime = time;
+    }
+  }
+  return best;
+}
+
 static ncclResult_t computeColl(struct ncclInfo* info /* input */, struct ncclColl* coll, struct ncclProxyArgs* proxyArgs /* output */) {
   // Set nstepsPerLoop and nchunksPerLoop
   NCCLCHECK(getPatternInfo(info));
@@ -308,26 +603,39 @@ static ncclResult_t computeColl(struct ncclInfo* info /* input */, struct ncclCo
   coll->args.comm = info->comm->devComm;
   coll->args.opCount = info->comm->opCount;
 
-  // Compute llMode, nChannels, nThreads
-  int llMode;
-  getKernelInfo(info, &coll->args.nChannels, &coll->args.nThreads, &llMode);
+  // Compute protocol, nChannels, nThreads
+  int proto;
+  getKernelInfo(info, &coll->args.nChannels, &coll->args.nThreads, &proto);
+  int llMode = proto == NCCL_PROTO_LL;
 
   int treeMode = info->pattern >= ncclPatternTreeUp ? 1 : 0;
-  coll->funcIndex = FUNC_INDEX(info->coll, info->op, info->datatype, llMode, treeMode);
+  // PreMulSum operations share their kernels and find their scalar by slot
+  int devOp = info->op < ncclNumOps ? info->op : NCCL_DEVOP_PREMULSUM;
+  coll->args.redOpSlot = info->op < ncclNumOps ? 0 : info->op - ncclNumOps;
+  coll->args.readySlot = info->readySlot;
+  coll->funcIndex = FUNC_INDEX(info->coll, devOp, info->datatype, proto, treeMode);
 
-  int stepSize   = ( llMode ? NCCL_LL_BUFF_SIZE : info->comm->channels[0].buffSize ) / NCCL_STEPS;
-  int chunkSteps = (llMode|treeMode) ? 1 : info->chunkSteps;
-  int sliceSteps = (llMode|treeMode) ? 1 : info->sliceSteps;
+  int stepSize   = proto == NCCL_PROTO_LL ? NCCL_LL_BUFF_SIZE/NCCL_STEPS :
+                   proto == NCCL_PROTO_LL128 ? NCCL_LL128_SLICE_DATA*sizeof(uint64_t) :
+                   info->comm->channels[0].buffSize/NCCL_STEPS;
+  int chunkSteps = (proto != NCCL_PROTO_SIMPLE || treeMode) ? 1 : info->chunkSteps;
+  int sliceSteps = (proto != NCCL_PROTO_SIMPLE || treeMode) ? 1 : info->sliceSteps;
+  // Ring kernels of the simple protocol can use smaller steps, see getStepShift
+  coll->args.stepShift = (proto == NCCL_PROTO_SIMPLE && treeMode == 0) ? getStepShift(info, coll->args.nChannels, stepSize, sliceSteps) : 0;
+  stepSize >>= coll->args.stepShift;
   int chunkSize  = stepSize*chunkSteps;
 
+  // Ring allreduces on floats can be sent in half precision, still reduced in
+  // fp32. LL lines only carry 8 bytes of data, so keep them as they are.
+  coll->args.compress = (info->coll == ncclCollAllReduce && info->datatype == ncclFloat32 &&
+      treeMode == 0 && proto == NCCL_PROTO_SIMPLE) ? info->comm->allReduceCompress : NCCL_COMPRESS_NONE;
+
   // Compute lastChunkSize
-  if (treeMode == 1 && llMode == 0) {
-    if (info->pattern == ncclPatternTreeUpDown) {
-      // Optimize chunkSize / nSteps
-      while (info->nBytes / (coll->args.nChannels*chunkSize) < info->comm->channels[0].tree.depth*8 && chunkSize > 131072) chunkSize /= 2;
-      while (info->nBytes / (coll->args.nChannels*chunkSize) < info->comm->channels[0].tree.depth*4 && chunkSize > 65536) chunkSize /= 2;
-      while (info->nBytes / (coll->args.nChannels*chunkSize) < info->comm->channels[0].tree.depth && chunkSize > 32768) chunkSize /= 2;
-    }
+  if (treeMode == 1 && proto == NCCL_PROTO_SIMPLE) {
+    // Optimize chunkSize / nSteps
+    while (info->nBytes / (coll->args.nChannels*chunkSize) < info->comm->channels[0].tree.depth*8 && chunkSize > 131072) chunkSize /= 2;
+    while (info->nBytes / (coll->args.nChannels*chunkSize) < info->comm->channels[0].tree.depth*4 && chunkSize > 65536) chunkSize /= 2;
+    while (info->nBytes / (coll->args.nChannels*chunkSize) < info->comm->channels[0].tree.depth && chunkSize > 32768) chunkSize /= 2;
     // Use lastChunkSize as chunkSize
     coll->args.lastChunkSize = chunkSize / ncclTypeSize(info->datatype);
   } else if (llMode == 1) {
@@ -336,6 +644,12 @@ static ncclResult_t computeColl(struct ncclInfo* info /* input */, struct ncclCo
     coll->args.lastChunkSize = DIVUP((info->nBytes-(info->nBytes/loopSize)*loopSize), coll->args.nChannels*info->nchunksPerLoop);
     ALIGN_SIZE(coll->args.lastChunkSize, coll->args.nThreads*sizeof(uint64_t));
     coll->args.lastChunkSize /= ncclTypeSize(info->datatype);
+  } else if (proto == NCCL_PROTO_LL128 && treeMode == 0) {
+    // Each warp handles whole lines, 8 threads per line
+    const ssize_t loopSize = coll->args.nChannels*info->nchunksPerLoop*(ssize_t)stepSize;
+    coll->args.lastChunkSize = DIVUP((info->nBytes-(info->nBytes/loopSize)*loopSize), coll->args.nChannels*info->nchunksPerLoop);
+    ALIGN_SIZE(coll->args.lastChunkSize, (coll->args.nThreads/8)*NCCL_LL128_DATAELEMS*sizeof(uint64_t));
+    coll->args.lastChunkSize /= ncclTypeSize(info->datatype);
   }
 
   // Compute nSteps for proxies
@@ -345,18 +659,165 @@ static ncclResult_t computeColl(struct ncclInfo* info /* input */, struct ncclCo
   proxyArgs->nsteps = info->nstepsPerLoop * nLoops * chunkSteps;
   proxyArgs->sliceSteps = sliceSteps;
   proxyArgs->chunkSteps = chunkSteps;
-  proxyArgs->llMode = llMode;
+  proxyArgs->protocol = proto;
+  proxyArgs->stepShift = coll->args.stepShift;
   proxyArgs->opCount = info->comm->opCount;
-  TRACE(NCCL_NET,"opCount %lx slicesteps %d spl %d cpl %d nbytes %zi -> llmode %d nchannels %d nthreads %d, nloops %d nsteps %d comm %p",
-      coll->args.opCount, proxyArgs->sliceSteps, info->nstepsPerLoop, info->nchunksPerLoop, nBytes, llMode, coll->args.nChannels, coll->args.nThreads,
+  proxyArgs->opCountValid = 1;
+  TRACE(NCCL_NET,"opCount %lx slicesteps %d spl %d cpl %d nbytes %zi -> protocol %d stepshift %d nchannels %d nthreads %d, nloops %d nsteps %d comm %p",
+      coll->args.opCount, proxyArgs->sliceSteps, info->nstepsPerLoop, info->nchunksPerLoop, nBytes, proto, coll->args.stepShift, coll->args.nChannels, coll->args.nThreads,
       nLoops, proxyArgs->nsteps, info->comm);
   return ncclSuccess;
 }
 
+// Whether the stream is being captured into a CUDA graph
+static ncclResult_t streamIsCapturing(cudaStream_t stream, bool* capturing) {
+  *capturing = false;
+#if CUDART_VERSION >= 10000
+  cudaStreamCaptureStatus status;
+  CUDACHECK(cudaStreamIsCapturing(stream, &status));
+  *capturing = status == cudaStreamCaptureStatusActive;
+#endif
+  return ncclSuccess;
+}
+
+// Captured launches are replayed without going through the host, so they
+// must not need the proxy, and can only hold a single operation.
+static ncclResult_t checkCapture(struct ncclInfo* info) {
+  struct ncclComm* comm = info->comm;
+  if (comm->userStreamCapturing == false) return ncclSuccess;
+  if (info->coll == ncclCollSendRecv) {
+    WARN("%s : Send/Recv operations can't be captured in a CUDA graph", info->opName);
+    return ncclInvalidUsage;
+  }
+  if (comm->proxyState != NULL) {
+    WARN("%s : operations using the network can't be captured in a CUDA graph", info->opName);
+    return ncclInvalidUsage;
+  }
+  if (comm->myParams->gridDim.x != 0) {
+    WARN("%s : only one operation per group can be captured in a CUDA graph", info->opName);
+    return ncclInvalidUsage;
+  }
+  if (comm->launchMode == ncclComm::GROUP && comm->intraRanks > 1) {
+    WARN("%s : capturing in a CUDA graph requires NCCL_LAUNCH_MODE=PARALLEL or PIPELINE with multiple GPUs per process", info->opName);
+    return ncclInvalidUsage;
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t saveUserStream(struct ncclInfo* info) {
+  struct ncclComm* comm = info->comm;
+  if (comm->userStreamSet == false) {
+    comm->userStream = info->stream;
+    comm->nExtraStreams = 0;
+    NCCLCHECK(streamIsCapturing(info->stream, &comm->userStreamCapturing));
+    comm->userStreamSet = true;
+  } else if (info->stream != comm->userStream) {
+    for (int s=0; s<comm->nExtraStreams; s++) {
+      if (comm->extraStreams[s] == info->stream) return ncclSuccess;
+    }
+    bool capturing;
+    NCCLCHECK(streamIsCapturing(info->stream, &capturing));
+    if (comm->userStreamCapturing || capturing) {
+      WARN("Error : mixing different streams within a group call is not supported when capturing a CUDA graph.");
+      return ncclInvalidUsage;
+    }
+    if (comm->nExtraStreams == NCCL_GROUP_MAX_STREAMS) {
+      WARN("Error : too many different streams within a group call (%d max).", NCCL_GROUP_MAX_STREAMS+1);
+      return ncclInvalidUsage;
+    }
+    comm->extraStreams[comm->nExtraStreams++] = info->stream;
+  }
+  return ncclSuccess;
+}
+
+// Append an operation to the channel FIFO
+static void saveColl(struct ncclComm* comm, struct ncclChannel* channel, struct ncclColl* coll) {
+  int opIndex = channel->collFifoTail;
+  struct ncclColl* c = channel->collectives+opIndex;
+  volatile uint8_t* activePtr = (volatile uint8_t*)&c->active;
+  while (activePtr[0] != 0) sched_yield();
+  if (comm->timeline) ncclTimelineSaveColl(comm, channel, opIndex, coll);
+
+  memcpy(c, coll, sizeof(struct ncclColl));
+
+  c->active = 1;
+  opIndex = (opIndex+1)%NCCL_MAX_OPS;
+  c->nextIndex = opIndex;
+  channel->collFifoTail = opIndex;
+  channel->collCount++;
+}
+
+static ncclResult_t saveColls(struct ncclInfo* info, struct ncclColl* coll, struct ncclProxyArgs* proxyArgs);
+
+// Largest per-rank count, in elements of the user datatype
+static size_t vMaxCount(struct ncclInfo* info) {
+  size_t maxCount = 0;
+  for (int r=0; r<info->comm->nRanks; r++) maxCount = std::max(maxCount, info->counts[r]);
+  return maxCount;
+}
+
+// ReduceScatterv/AllGatherv : ncclColl has no room for the layout, so it is
+// copied to a slot of hostDevComm.vLayouts on the stream the kernel will be
+// launched on. A slot is reused once all channels of its last operation are
+// done with it.
+static ncclResult_t saveVLayout(struct ncclInfo* info, struct ncclColl* coll) {
+  struct ncclComm* comm = info->comm;
+  NCCLCHECK(saveUserStream(info));
+  if (comm->userStreamCapturing) {
+    // Replays would read whatever layout the slot holds by then
+    WARN("%s : per-rank counts can't be captured in a CUDA graph", info->opName);
+    return ncclInvalidUsage;
+  }
+  if (comm->vPending == NCCL_MAX_VOPS) {
+    WARN("%s : too many operations with per-rank counts in a group (%d max)", info->opName, NCCL_MAX_VOPS);
+    return ncclInvalidUsage;
+  }
+  int slot = comm->vNext;
+  volatile uint8_t* busy = comm->vBusy+slot*MAXCHANNELS;
+  for (int bid=0; bid<MAXCHANNELS; bid++) {
+    while (busy[bid]) {
+      if (*comm->abortFlag) return ncclSystemError;
+      if (comm->fatalError != ncclSuccess) return comm->fatalError;
+      sched_yield();
+    }
+  }
+
+  // AllGather counts are in bytes at this point
+  const int nRanks = comm->nRanks;
+  size_t unit = info->count / vMaxCount(info);
+  size_t* layout = comm->vLayouts+slot*2*nRanks;
+  for (int r=0; r<nRanks; r++) {
+    layout[r] = info->counts[r]*unit;
+    layout[nRanks+r] = info->displs[r]*unit;
+  }
+  CUDACHECK(cudaMemcpyAsync(comm->hostDevComm.vLayouts+slot*2*nRanks, layout, 2*nRanks*sizeof(size_t), cudaMemcpyHostToDevice, comm->userStream));
+  for (int bid=0; bid<coll->args.nChannels; bid++) busy[bid] = 1;
+  coll->args.vSlot = slot+1;
+  comm->vNext = (slot+1)%NCCL_MAX_VOPS;
+  comm->vPending++;
+  return ncclSuccess;
+}
+
+void ncclVLayoutsCancel(struct ncclComm* comm) {
+  for (; comm->vPending > 0; comm->vPending--) {
+    comm->vNext = (comm->vNext+NCCL_MAX_VOPS-1)%NCCL_MAX_VOPS;
+    memset((void*)(comm->vBusy+comm->vNext*MAXCHANNELS), 0, MAXCHANNELS);
+  }
+}
+
 static ncclResult_t saveKernel(struct ncclInfo* info) {
   if (info->comm->nRanks == 1) {
-    if (info->sendbuff != info->recvbuff)
-      CUDACHECK(cudaMemcpyAsync(info->recvbuff, info->sendbuff, info->nBytes, cudaMemcpyDeviceToDevice, info->stream));
+    const char* sendbuff = (const char*)info->sendbuff;
+    char* recvbuff = (char*)info->recvbuff;
+    size_t nBytes = info->nBytes;
+    if (info->counts) {
+      size_t typeSize = info->nBytes / vMaxCount(info);
+      nBytes = info->counts[0]*typeSize;
+      if (info->coll == ncclCollReduceScatter) sendbuff += info->displs[0]*typeSize;
+      else recvbuff += info->displs[0]*typeSize;
+    }
+    if (sendbuff != recvbuff)
+      CUDACHECK(cudaMemcpyAsync(recvbuff, sendbuff, nBytes, cudaMemcpyDeviceToDevice, info->stream));
     return ncclSuccess;
   }
 
@@ -364,15 +825,39 @@ static ncclResult_t saveKernel(struct ncclInfo* info) {
   struct ncclProxyArgs proxyArgs;
   memset(&proxyArgs, 0, sizeof(struct ncclProxyArgs));
   NCCLCHECK(computeColl(info, &coll, &proxyArgs));
+  if (info->counts) NCCLCHECK(saveVLayout(info, &coll));
+  ncclResult_t ret = saveColls(info, &coll, &proxyArgs);
+  // Kernels which will not run can't release their slots
+  if (ret != ncclSuccess) ncclVLayoutsCancel(info->comm);
+  return ret;
+}
+
+// Count an operation launched on nChannels channels, for ncclCommGetStats
+static void statsAddOp(struct ncclComm* comm, int funcIndex, int nChannels, size_t nBytes) {
+  int proto = funcIndex%NCCL_NUM_PROTOCOLS;
+  int tree = (funcIndex/NCCL_NUM_PROTOCOLS)%2;
+  int coll = funcIndex/(NCCL_NUM_DEVOPS*ncclNumTypes*2*NCCL_NUM_PROTOCOLS);
+  int algo = tree ? NCCL_ALGO_TREE : NCCL_ALGO_RING;
+  ncclStatsAdd(&comm->stats.ops[coll][algo][proto], nChannels);
+  ncclStatsAdd(&comm->stats.opBytes[coll][algo][proto], nBytes);
+}
 
+// Same for the operations which don't go through saveColls (copy engine,
+// one-shot, collective network and hierarchical), counted once under the
+// closest algorithm and protocol
+static ncclResult_t statsAddColl(struct ncclInfo* info, int algo, int proto) {
+  ncclStatsAdd(&info->comm->stats.ops[info->coll][algo][proto], 1);
+  ncclStatsAdd(&info->comm->stats.opBytes[info->coll][algo][proto], info->nBytes);
+  return ncclSuccess;
+}
+
+// Save an operation on each of its channels, along with its proxy operations
+static ncclResult_t saveColls(struct ncclInfo* info, struct ncclColl* collPtr, struct ncclProxyArgs* proxyArgsPtr) {
+  struct ncclColl coll = *collPtr;
+  struct ncclProxyArgs proxyArgs = *proxyArgsPtr;
   info->comm->myParams->blockDim.x = std::max<unsigned>(info->comm->myParams->blockDim.x, coll.args.nThreads);
-  if (info->comm->userStreamSet == false) {
-    info->comm->userStream = info->stream;
-    info->comm->userStreamSet = true;
-  } else if (info->stream != info->comm->userStream) {
-    WARN("Error : mixing different streams within a group call is not supported.");
-    return ncclInvalidUsage;
-  }
+  NCCLCHECK(saveUserStream(info));
+  NCCLCHECK(checkCapture(info));
   for (int bid=0; bid<coll.args.nChannels; bid++) {
     struct ncclChannel* channel = info->comm->channels+(info->comm->myParams->gridDim.x % info->comm->nChannels);
 
@@ -387,27 +872,408 @@ static ncclResult_t saveKernel(struct ncclInfo* info) {
 
     info->comm->myParams->gridDim.x++;
 
-    int opIndex = channel->collFifoTail;
-    struct ncclColl* c = channel->collectives+opIndex;
-    volatile uint8_t* activePtr = (volatile uint8_t*)&c->active;
-    while (activePtr[0] != 0) sched_yield();
+    coll.args.bid = bid;
+    saveColl(info->comm, channel, &coll);
+  }
+  statsAddOp(info->comm, coll.funcIndex, coll.args.nChannels, info->nBytes);
+  /*if (llMode == 0)*/ info->comm->opCount++;
+  return ncclSuccess;
+}
+
+/*****************************************************************************/
+/*     Send/Recv : operations are queued per peer until ncclGroupEnd         */
+/*****************************************************************************/
 
-    memcpy(c, &coll, sizeof(struct ncclColl));
+static ncclResult_t saveP2p(struct ncclInfo* info) {
+  struct ncclComm* comm = info->comm;
+  NCCLCHECK(saveUserStream(info));
+  NCCLCHECK(checkCapture(info));
+  struct ncclP2Pinfo* p2p;
+  NCCLCHECK(ncclCalloc(&p2p, 1));
+  p2p->buff = info->p2pSend ? (void*)info->sendbuff : info->recvbuff;
+  p2p->nBytes = info->nBytes;
+  struct ncclP2Plist* list = info->p2pSend ? comm->p2pSends+info->root : comm->p2pRecvs+info->root;
+  if (list->tail) list->tail->next = p2p; else list->head = p2p;
+  list->tail = p2p;
+  comm->p2pCount++;
+  return ncclSuccess;
+}
+
+static struct ncclP2Pinfo* popP2p(struct ncclP2Plist* list) {
+  struct ncclP2Pinfo* p2p = list->head;
+  if (p2p == NULL) return NULL;
+  list->head = p2p->next;
+  if (list->head == NULL) list->tail = NULL;
+  return p2p;
+}
 
-    c->args.bid = bid;
-    c->active = 1;
-    opIndex = (opIndex+1)%NCCL_MAX_OPS;
-    c->nextIndex = opIndex;
-    channel->collFifoTail = opIndex;
-    channel->collCount++;
+void ncclP2pFree(struct ncclComm* comm) {
+  for (int peer=0; peer<comm->nRanks; peer++) {
+    struct ncclP2Pinfo* p2p;
+    while ((p2p = popP2p(comm->p2pSends+peer)) != NULL) free(p2p);
+    while ((p2p = popP2p(comm->p2pRecvs+peer)) != NULL) free(p2p);
   }
-  /*if (llMode == 0)*/ info->comm->opCount++;
+  comm->p2pCount = 0;
+}
+
+// We send to rank+delta and receive from rank-delta on channel delta%nChannels,
+// so that both sides of a connection agree on the channel to use.
+static int p2pChannel(struct ncclComm* comm, int delta) {
+  return delta % comm->nChannels;
+}
+
+// Size of the FIFO needed by the pending operations with peer. Both sides
+// see the same operations, hence make the same decision.
+static int p2pBuffSize(struct ncclComm* comm, int peer, struct ncclP2Plist* list, struct ncclConnector* connector) {
+  ssize_t nBytes = 0;
+  for (struct ncclP2Pinfo* p2p = list->head; p2p; p2p = p2p->next) nBytes = std::max(nBytes, p2p->nBytes);
+  int transport = comm->connectTransport ? comm->connectTransport[peer] : -1;
+  return ncclSendRecvBuffSize(transport, connector->connected ? connector->conn.buffSize : 0, nBytes);
+}
+
+// New connection, or one to grow. Connectors of rings and trees keep the size
+// of the channel.
+static bool p2pNeedsConnect(struct ncclConnector* connector, int buffSize) {
+  return connector->connected == 0 || (connector->coll == 0 && connector->conn.buffSize < buffSize);
+}
+
+ncclResult_t ncclP2pConnect(struct ncclComm* comm) {
+  // Connecting allocates memory, which can't be done while capturing. The
+  // request stays, the next operation outside of a capture connects them.
+  if (comm->treeRequested && !comm->userStreamCapturing) NCCLCHECK(ncclTreeConnect(comm));
+  if (comm->p2pCount == 0 || comm->nRanks == 1) return ncclSuccess;
+  int nranks = comm->nRanks;
+  int* peerSend = NULL;
+  int* peerRecv = NULL;
+  int* sendSizes = NULL;
+  int* recvSizes = NULL;
+  ncclResult_t ret = ncclSuccess;
+  bool newPeers[MAXCHANNELS] = { false };
+  NCCLCHECKGOTO(ncclCalloc(&peerSend, nranks), ret, end);
+  NCCLCHECKGOTO(ncclCalloc(&peerRecv, nranks), ret, end);
+  NCCLCHECKGOTO(ncclCalloc(&sendSizes, nranks), ret, end);
+  NCCLCHECKGOTO(ncclCalloc(&recvSizes, nranks), ret, end);
+  for (int c=0; c<comm->nChannels; c++) {
+    struct ncclChannel* channel = comm->channels+c;
+    int nsend = 0, nrecv = 0;
+    for (int delta=c; delta<nranks; delta+=comm->nChannels) {
+      if (delta == 0) continue;
+      int sendPeer = (comm->rank+delta)%nranks;
+      int recvPeer = (comm->rank-delta+nranks)%nranks;
+      if (comm->p2pSends[sendPeer].head) {
+        struct ncclConnector* send = &channel->peers[sendPeer].send;
+        int size = p2pBuffSize(comm, sendPeer, comm->p2pSends+sendPeer, send);
+        if (p2pNeedsConnect(send, size)) { sendSizes[nsend] = size; peerSend[nsend++] = sendPeer; }
+      }
+      if (comm->p2pRecvs[recvPeer].head) {
+        struct ncclConnector* recv = &channel->peers[recvPeer].recv;
+        int size = p2pBuffSize(comm, recvPeer, comm->p2pRecvs+recvPeer, recv);
+        if (p2pNeedsConnect(recv, size)) { recvSizes[nrecv] = size; peerRecv[nrecv++] = recvPeer; }
+      }
+    }
+    if (nsend+nrecv == 0) continue;
+    if (comm->bootstrap == NULL) {
+      WARN("Send/Recv : cannot connect to new peers on communicators created with ncclCommInitAll");
+      ret = ncclInvalidUsage;
+      goto end;
+    }
+    NCCLCHECKGOTO(p2pPrepare(comm, channel, nrecv, peerRecv, recvSizes, nsend, peerSend, sendSizes), ret, end);
+    newPeers[c] = true;
+    INFO(NCCL_P2P, "Channel %02d : connecting to %d new send peers and %d new receive peers", c, nsend, nrecv);
+  }
+  NCCLCHECKGOTO(p2pSetup(comm), ret, end);
+  for (int c=0; c<comm->nChannels; c++) {
+    if (newPeers[c]) NCCLCHECKGOTO(ncclCudaMemcpy(comm->channels[c].devPeers, comm->channels[c].peers, nranks), ret, end);
+  }
+end:
+  free(peerSend);
+  free(peerRecv);
+  free(sendSizes);
+  free(recvSizes);
+  return ret;
+}
+
+// Registered user buffer covering a large send or receive over a connection
+// that can access GPU memory directly, or NULL.
+static struct ncclRegBuffer* p2pZcopyReg(struct ncclComm* comm, struct ncclConnector* connector, struct ncclP2Pinfo* p2p) {
+  if (comm->netZcopyThreshold < 0 || p2p->nBytes < comm->netZcopyThreshold || connector->zcopy == 0) return NULL;
+  for (struct ncclRegBuffer* reg = comm->regBuffers; reg; reg = reg->next) {
+    // Network registrations are limited to 2GB
+    if (reg->size > INT_MAX) continue;
+    if ((char*)reg->buff <= (char*)p2p->buff && (char*)p2p->buff+p2p->nBytes <= (char*)reg->buff+reg->size) return reg;
+  }
+  return NULL;
+}
+
+static ncclResult_t saveP2pKernel(struct ncclComm* comm, int delta, struct ncclP2Pinfo* send, struct ncclP2Pinfo* recv) {
+  int channelId = delta ? p2pChannel(comm, delta) : 0;
+  struct ncclChannel* channel = comm->channels+channelId;
+  if (channel->collCount == NCCL_MAX_OPS) {
+    WARN("Too many aggregated operations (%d max)", NCCL_MAX_OPS);
+    return ncclInvalidUsage;
+  }
+  ssize_t sendBytes = send ? send->nBytes : 0;
+  ssize_t recvBytes = recv ? recv->nBytes : 0;
+  ssize_t nBytes = std::max(sendBytes, recvBytes);
+
+  // Use the same rules as collectives to pick the protocol
+  int llMode;
+  if (comm->llThreshold >= 0) {
+    llMode = nBytes <= comm->llThreshold;
+  } else {
+    float llTime = ncclTuningTime(comm, ncclCollSendRecv, NCCL_ALGO_RING, NCCL_PROTO_LL, 1, nBytes);
+    float simpleTime = ncclTuningTime(comm, ncclCollSendRecv, NCCL_ALGO_RING, NCCL_PROTO_SIMPLE, 1, nBytes);
+    llMode = llTime >= 0 && (simpleTime < 0 || llTime <= simpleTime);
+  }
+
+  int sendPeer = (comm->rank+delta)%comm->nRanks;
+  int recvPeer = (comm->rank-delta+comm->nRanks)%comm->nRanks;
+  struct ncclRegBuffer* sendReg = NULL;
+  struct ncclRegBuffer* recvReg = NULL;
+  if (llMode == 0 && delta != 0) {
+    if (sendBytes) sendReg = p2pZcopyReg(comm, &channel->peers[sendPeer].send, send);
+    if (recvBytes) recvReg = p2pZcopyReg(comm, &channel->peers[recvPeer].recv, recv);
+  }
+
+  struct ncclColl coll;
+  memset(&coll, 0, sizeof(struct ncclColl));
+  coll.args.comm = comm->devComm;
+  // Send/Recv operations are not called by all ranks, so comm->opCount can
+  // differ between peers : they carry no opCount (see opCountValid).
+  coll.args.ThisInput = send ? send->buff : NULL;
+  coll.args.ThisOutput = recv ? recv->buff : NULL;
+  coll.args.delta = delta;
+  coll.args.sendCount = sendBytes;
+  coll.args.recvCount = recvBytes;
+  coll.args.zcopy = (sendReg ? NCCL_ZCOPY_SEND : 0) | (recvReg ? NCCL_ZCOPY_RECV : 0);
+  coll.args.bid = 0;
+  if (llMode) {
+    ssize_t perThreadLLThreshold = std::min<ssize_t>(comm->threadThreshold, NCCL_LL_CHANNEL_THRESHOLD);
+    int maxLLNthreads = std::min(NCCL_LL_MAX_NTHREADS, comm->nThreads);
+    int nt = NCCL_LL_MIN_NTHREADS;
+    while (DIVUP(nBytes, nt) > perThreadLLThreshold && nt*2 <= maxLLNthreads) nt *= 2;
+    coll.args.nThreads = nt;
+  } else {
+    coll.args.nThreads = comm->nThreads+1;
+  }
+  coll.funcIndex = FUNC_INDEX(ncclCollSendRecv, ncclSum, ncclInt8, llMode ? NCCL_PROTO_LL : NCCL_PROTO_SIMPLE, 0);
+
+  // Proxies. Each chunk is a separate send (or receive) on the connection.
+  struct ncclProxyArgs proxyArgs;
+  memset(&proxyArgs, 0, sizeof(struct ncclProxyArgs));
+  proxyArgs.channel = channel;
+  proxyArgs.chunkSteps = llMode ? 1 : SENDRECV_CHUNKSTEPS;
+  proxyArgs.sliceSteps = llMode ? 1 : SENDRECV_SLICESTEPS;
+  proxyArgs.protocol = llMode ? NCCL_PROTO_LL : NCCL_PROTO_SIMPLE;
+  // Chunks are as large as the FIFO of each connection allows
+  ssize_t chunkSize = NCCL_LL_SLICE_LINES*sizeof(uint64_t);
+  if (sendBytes) {
+    if (llMode == 0) chunkSize = (channel->peers[sendPeer].send.conn.buffSize/NCCL_STEPS)*SENDRECV_CHUNKSTEPS;
+    proxyArgs.nsteps = DIVUP(sendBytes, chunkSize)*proxyArgs.chunkSteps;
+    proxyArgs.zcopyReg = sendReg;
+    proxyArgs.zcopyBuff = sendReg ? (char*)send->buff : NULL;
+    proxyArgs.zcopyBytes = sendBytes;
+    NCCLCHECK(transportSaveP2pProxy(&proxyArgs, sendPeer, 1));
+  }
+  if (recvBytes) {
+    if (llMode == 0) chunkSize = (channel->peers[recvPeer].recv.conn.buffSize/NCCL_STEPS)*SENDRECV_CHUNKSTEPS;
+    proxyArgs.nsteps = DIVUP(recvBytes, chunkSize)*proxyArgs.chunkSteps;
+    proxyArgs.zcopyReg = recvReg;
+    proxyArgs.zcopyBuff = recvReg ? (char*)recv->buff : NULL;
+    proxyArgs.zcopyBytes = recvBytes;
+    NCCLCHECK(transportSaveP2pProxy(&proxyArgs, recvPeer, 0));
+  }
+  TRACE(NCCL_P2P,"delta %d channel %d sendBytes %ld recvBytes %ld llmode %d zcopy %d nthreads %d comm %p",
+      delta, channelId, sendBytes, recvBytes, llMode, coll.args.zcopy, coll.args.nThreads, comm);
+
+  // Blocks are mapped to channels and the launch covers channels 0 to
+  // gridDim.x-1, so every channel before ours needs an operation too.
+  struct cudaLaunchParams* params = comm->myParams;
+  for (int c=params->gridDim.x; c<channelId; c++) {
+    struct ncclColl empty;
+    memset(&empty, 0, sizeof(struct ncclColl));
+    empty.args.comm = comm->devComm;
+    empty.args.nThreads = NCCL_LL_MIN_NTHREADS;
+    empty.funcIndex = FUNC_INDEX(ncclCollSendRecv, ncclSum, ncclInt8, NCCL_PROTO_LL, 0);
+    saveColl(comm, comm->channels+c, &empty);
+  }
+  if (params->gridDim.x <= channelId) params->gridDim.x = channelId+1;
+  params->blockDim.x = std::max<unsigned>(params->blockDim.x, coll.args.nThreads);
+  saveColl(comm, channel, &coll);
+  statsAddOp(comm, coll.funcIndex, 1, sendBytes+recvBytes);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSaveP2pKernels(struct ncclComm* comm) {
+  if (comm->p2pCount == 0) return ncclSuccess;
+  int nranks = comm->nRanks;
+  ncclResult_t ret = ncclSuccess;
+  for (int delta=0; delta<nranks; delta++) {
+    struct ncclP2Plist* sends = comm->p2pSends+(comm->rank+delta)%nranks;
+    struct ncclP2Plist* recvs = comm->p2pRecvs+(comm->rank-delta+nranks)%nranks;
+    // Pair the n-th send to rank+delta with the n-th receive from rank-delta
+    while (sends->head || recvs->head) {
+      struct ncclP2Pinfo* send = popP2p(sends);
+      struct ncclP2Pinfo* recv = popP2p(recvs);
+      if (delta == 0) {
+        if (send == NULL || recv == NULL || send->nBytes != recv->nBytes) {
+          WARN("Send/Recv : sends to self must be matched by a receive of the same size");
+          ret = ncclInvalidUsage;
+        } else if (send->buff != recv->buff) {
+          CUDACHECKGOTO(cudaMemcpyAsync(recv->buff, send->buff, send->nBytes, cudaMemcpyDeviceToDevice, comm->userStream), ret, next);
+        }
+      } else {
+        NCCLCHECKGOTO(saveP2pKernel(comm, delta, send, recv), ret, next);
+      }
+next:
+      free(send);
+      free(recv);
+      if (ret != ncclSuccess) {
+        ncclP2pFree(comm);
+        return ret;
+      }
+    }
+  }
+  comm->p2pCount = 0;
+  // We still need a kernel for the intra-process barrier if everything was
+  // local copies.
+  if (nranks > 1 && comm->myParams->gridDim.x == 0) NCCLCHECK(saveP2pKernel(comm, 0, NULL, NULL));
   return ncclSuccess;
 }
 
+/*****************************************************************************/
+/*  Fusion : small allreduces in a group are packed into a staging buffer    */
+/*****************************************************************************/
 
-ncclResult_t ncclEnqueueCheck(struct ncclInfo* info) {
-  if (info->comm == NULL) return ncclInvalidArgument;
+static bool fusionEligible(struct ncclInfo* info) {
+  return info->coll == ncclCollAllReduce && info->comm->fusionThreshold > 0 &&
+    info->nBytes <= info->comm->fusionThreshold;
+}
+
+static ncclResult_t saveFusion(struct ncclInfo* info) {
+  struct ncclComm* comm = info->comm;
+  NCCLCHECK(saveUserStream(info));
+  if (comm->nFusionOps == comm->maxFusionOps) {
+    int maxFusionOps = comm->maxFusionOps ? comm->maxFusionOps*2 : 64;
+    struct ncclFusionOp* fusionOps = (struct ncclFusionOp*)realloc(comm->fusionOps, maxFusionOps*sizeof(struct ncclFusionOp));
+    if (fusionOps == NULL) {
+      WARN("Failed to grow the fusion list to %d operations", maxFusionOps);
+      return ncclSystemError;
+    }
+    comm->fusionOps = fusionOps;
+    comm->maxFusionOps = maxFusionOps;
+  }
+  struct ncclFusionOp* op = comm->fusionOps+comm->nFusionOps++;
+  op->sendbuff = info->sendbuff;
+  op->recvbuff = info->recvbuff;
+  op->count = info->count;
+  op->datatype = info->datatype;
+  op->op = info->op;
+  op->stream = info->stream;
+  op->chunkSteps = info->chunkSteps;
+  op->sliceSteps = info->sliceSteps;
+  op->batch = -1;
+  op->offset = -1;
+  return ncclSuccess;
+}
+
+static ncclResult_t saveFusedKernel(struct ncclComm* comm, struct ncclFusionOp* op, const void* sendbuff, void* recvbuff, size_t count) {
+  struct ncclInfo info = { ncclCollAllReduce, "AllReduce",
+    sendbuff, recvbuff, count, op->datatype, op->op, 0, comm, comm->userStream, /* Args */
+    op->chunkSteps, op->sliceSteps };
+  info.nBytes = count * ncclTypeSize(op->datatype);
+  // Only use decisions already tuned ; we can't time operations in a group
+  int trial;
+  NCCLCHECK(ncclAutoTuneStart(&info, 0, &trial));
+  return saveKernel(&info);
+}
+
+ncclResult_t ncclSaveFusedColls(struct ncclComm* comm) {
+  int nOps = comm->nFusionOps;
+  struct ncclFusionOp* ops = comm->fusionOps;
+  // Captured graphs can only hold a single operation, and the copies out of
+  // the fusion buffer would make replays race with the next group.
+  bool fuse = comm->userStreamCapturing == false;
+  bool waited = false;
+  size_t used = 0;
+  for (int first=0; first<nOps; first++) {
+    struct ncclFusionOp* f = ops+first;
+    if (f->batch != -1) continue;
+    // Gather all remaining operations of the same type and reduction, as long
+    // as they fit in the buffer. Others go to a later batch.
+    size_t start = used;
+    ALIGN_SIZE(start, 16);
+    size_t nBytes = 0;
+    int nBatch = 0;
+    for (int i=first; fuse && i<nOps; i++) {
+      struct ncclFusionOp* o = ops+i;
+      if (o->batch != -1 || o->datatype != f->datatype || o->op != f->op) continue;
+      size_t bytes = o->count * ncclTypeSize(o->datatype);
+      if (start+nBytes+bytes > comm->fusionBuffSize) continue;
+      o->batch = first;
+      o->offset = start+nBytes;
+      nBytes += bytes;
+      nBatch++;
+    }
+    if (nBatch <= 1) {
+      // Nothing to fuse it with, or no room left in the buffer
+      f->batch = first;
+      f->offset = -1;
+      NCCLCHECK(saveFusedKernel(comm, f, f->sendbuff, f->recvbuff, f->count));
+      continue;
+    }
+    if (waited == false) {
+      if (comm->fusionStream != NULL && comm->fusionStream != comm->userStream) {
+        // Don't overwrite the buffer before the last group copied its results out
+        CUDACHECK(cudaStreamWaitEvent(comm->userStream, comm->fusionEvent, 0));
+      }
+      // Copies run on the user stream : wait for the producers of the inputs
+      // on the other streams of the group
+      for (int s=0; s<comm->nExtraStreams; s++) {
+        CUDACHECK(cudaEventRecord(comm->fusionStreamsEvent, comm->extraStreams[s]));
+        CUDACHECK(cudaStreamWaitEvent(comm->userStream, comm->fusionStreamsEvent, 0));
+      }
+    }
+    waited = true;
+    for (int i=first; i<nOps; i++) {
+      struct ncclFusionOp* o = ops+i;
+      if (o->batch != first) continue;
+      CUDACHECK(cudaMemcpyAsync(comm->fusionBuff+o->offset, o->sendbuff, o->count * ncclTypeSize(o->datatype), cudaMemcpyDeviceToDevice, comm->userStream));
+    }
+    TRACE(NCCL_COLL,"Fused %d allreduces, %zi bytes at offset %zi, comm %p", nBatch, nBytes, start, comm);
+    void* buff = comm->fusionBuff+start;
+    NCCLCHECK(saveFusedKernel(comm, f, buff, buff, nBytes / ncclTypeSize(f->datatype)));
+    used = start+nBytes;
+  }
+  return ncclSuccess;
+}
+
+// Must be called once the user streams wait for the fused operations. Each
+// result is copied out on the stream of its operation.
+ncclResult_t ncclFusionCopyOut(struct ncclComm* comm) {
+  bool copied = false;
+  for (int i=0; i<comm->nFusionOps; i++) {
+    struct ncclFusionOp* o = comm->fusionOps+i;
+    if (o->offset == -1) continue;
+    CUDACHECK(cudaMemcpyAsync(o->recvbuff, comm->fusionBuff+o->offset, o->count * ncclTypeSize(o->datatype), cudaMemcpyDeviceToDevice, o->stream));
+    copied = true;
+  }
+  if (copied) {
+    // Have a single event cover the copies of all streams
+    for (int s=0; s<comm->nExtraStreams; s++) {
+      CUDACHECK(cudaEventRecord(comm->fusionEvent, comm->extraStreams[s]));
+      CUDACHECK(cudaStreamWaitEvent(comm->userStream, comm->fusionEvent, 0));
+    }
+    CUDACHECK(cudaEventRecord(comm->fusionEvent, comm->userStream));
+    comm->fusionStream = comm->userStream;
+  }
+  comm->nFusionOps = 0;
+  return ncclSuccess;
+}
+
+
+
+static ncclResult_t enqueueCheck(struct ncclInfo* info) {
 
   INFO(NCCL_COLL,"%s: opCount %lx sendbuff %p recvbuff %p count %zi datatype %d op %d root %d comm %p [nranks=%d] stream %p",
        info->opName, info->comm->opCount, info->sendbuff, info->recvbuff, info->count,
@@ -423,20 +1289,198 @@ ncclResult_t ncclEnqueueCheck(struct ncclInfo* info) {
     }
     // Check arguments
     NCCLCHECKGOTO(ArgsCheck(info), ret, end);
+    if (info->readySlot) {
+      // Flags are reset after the operation on its stream, before a group
+      // would launch it
+      WARN("%s : can't be called within a group", info->opName);
+      ret = ncclInvalidUsage;
+      goto end;
+    }
+    if (info->coll == ncclCollSendRecv) {
+      NCCLCHECKGOTO(ncclAsyncColl(info->comm), ret, end);
+      NCCLCHECKGOTO(saveP2p(info), ret, end);
+      goto end;
+    }
+    {
+      // Only use decisions already tuned ; we can't time operations in a group
+      int trial;
+      NCCLCHECKGOTO(ncclAutoTuneStart(info, 0, &trial), ret, end);
+    }
     // Always register comm even in case of error to make sure ncclGroupEnd
     // cleans it up.
     NCCLCHECKGOTO(ncclAsyncColl(info->comm), ret, end);
-    NCCLCHECKGOTO(saveKernel(info), ret, end);
+    if (fusionEligible(info)) {
+      NCCLCHECKGOTO(saveFusion(info), ret, end);
+    } else {
+      NCCLCHECKGOTO(saveKernel(info), ret, end);
+    }
 end:
     if (savedDev != -1) CUDACHECK(cudaSetDevice(savedDev));
     ncclAsyncErrCheck(ret);
     return ret;
+  } else if (info->coll == ncclCollSendRecv) {
+    // Send/Recv are only launched by ncclGroupEnd
+    NCCLCHECK(ncclGroupStart());
+    ncclResult_t ret = enqueueCheck(info);
+    NCCLCHECK(ncclGroupEnd());
+    return ret;
+  } else if (info->readySlot) {
+    // Streaming AllReduce : only the ring kernel of the simple protocol waits
+    // for its input
+    NCCLCHECK(ArgsCheck(info));
+    struct ncclTuneConfig config = { NCCL_ALGO_RING, NCCL_PROTO_SIMPLE, info->comm->nChannels };
+    info->config = &config;
+    NCCLCHECK(saveKernel(info));
+    NCCLCHECK(ncclBarrierEnqueue(info->comm));
+    NCCLCHECK(ncclBarrierEnqueueWait(info->comm));
+    NCCLCHECK(ncclEnqueueEvents(info->comm));
+    struct ncclReadyFlags* ready = info->comm->readyFlags+info->readySlot-1;
+    CUDACHECK(cudaMemsetAsync((void*)ready->flags, 0, DIVUP(info->count, ready->chunkCount)*sizeof(uint32_t), info->stream));
+    return ncclSuccess;
   } else {
     NCCLCHECK(ArgsCheck(info));
+    bool capturing;
+    NCCLCHECK(streamIsCapturing(info->stream, &capturing));
+    // Copy engine operations synchronize ranks on the host, not on replay
+    if (!capturing) {
+      bool copyEngine;
+      NCCLCHECK(ncclCopyEngineCheck(info, &copyEngine));
+      if (copyEngine) {
+        NCCLCHECK(ncclCopyEngineColl(info));
+        return statsAddColl(info, NCCL_ALGO_RING, NCCL_PROTO_SIMPLE);
+      }
+    }
+    bool oneShot;
+    NCCLCHECK(ncclOneShotCheck(info, capturing, &oneShot));
+    if (oneShot) {
+      NCCLCHECK(ncclOneShotColl(info));
+      return statsAddColl(info, NCCL_ALGO_RING, NCCL_PROTO_LL);
+    }
+    // The steps of these two are also counted by their sub-communicators
+    bool collNet;
+    NCCLCHECK(ncclCollNetCheck(info, capturing, &collNet));
+    if (collNet) {
+      NCCLCHECK(ncclCollNetAllReduce(info));
+      return statsAddColl(info, NCCL_ALGO_TREE, NCCL_PROTO_SIMPLE);
+    }
+    bool hier;
+    NCCLCHECK(ncclHierCheck(info, capturing, &hier));
+    if (hier) {
+      NCCLCHECK(ncclHierAllReduce(info));
+      return statsAddColl(info, NCCL_ALGO_RING, NCCL_PROTO_SIMPLE);
+    }
+    // Trials are timed with events, which can't be done while capturing
+    int trial;
+    // Per-rank counts would skew the timings of their collective
+    NCCLCHECK(ncclAutoTuneStart(info, (capturing || info->counts) ? 0 : 1, &trial));
     NCCLCHECK(saveKernel(info));
     NCCLCHECK(ncclBarrierEnqueue(info->comm));
     NCCLCHECK(ncclBarrierEnqueueWait(info->comm));
     NCCLCHECK(ncclEnqueueEvents(info->comm));
+    if (trial != -1) NCCLCHECK(ncclAutoTuneEnd(info, trial));
+    // Connecting allocates memory, which can't be done while capturing
+    if (info->comm->treeRequested && !capturing) NCCLCHECK(ncclTreeConnect(info->comm));
     return ncclSuccess;
   }
 }
+
+ncclResult_t ncclEnqueueCheck(struct ncclInfo* info) {
+  if (info->comm == NULL) return ncclInvalidArgument;
+  NCCLCHECK(ncclCommCheckReady(info->comm));
+  struct ncclComm* comm = info->comm;
+  struct ncclTimeline* tl = comm->timeline;
+  if (tl == NULL && comm->profiler == NULL) return enqueueCheck(info);
+  uint64_t opCount = comm->opCount;
+  void* eHandle = NULL;
+  if (comm->profiler) {
+    ncclProfilerEventDescr_t eDescr = {};
+    eDescr.type = ncclProfileColl;
+    eDescr.opCount = opCount;
+    eDescr.func = info->coll;
+    eDescr.count = info->count;
+    eDescr.datatype = info->datatype;
+    eDescr.op = info->op;
+    eDescr.root = info->root;
+    eDescr.channel = eDescr.peer = -1;
+    ncclProfilerStart(comm, &eHandle, &eDescr);
+  }
+  uint64_t start = tl ? ncclTimelineClock() : 0;
+  ncclResult_t ret = enqueueCheck(info);
+  if (tl) ncclTimelineAdd(tl, ncclTimelineEnqueue, 0, info->coll, opCount, info->nBytes, start, ncclTimelineClock());
+  if (comm->profiler) ncclProfilerStop(comm, &eHandle, info->nBytes);
+  return ret;
+}
+
+/*****************************************************************************/
+/*   Persistent operations : arguments are checked and computed only once    */
+/*****************************************************************************/
+
+ncclResult_t ncclPersistentInit(struct ncclInfo* info, ncclRequest_t* request) {
+  NCCLCHECK(PtrCheck(info->comm, info->opName, "comm"));
+  NCCLCHECK(PtrCheck(request, info->opName, "request"));
+  ncclResult_t ret = ncclSuccess;
+  int savedDev = -1;
+  struct ncclRequest* req = NULL;
+  if (info->comm->checkPointers) {
+    CUDACHECKGOTO(cudaGetDevice(&savedDev), ret, end);
+    CUDACHECKGOTO(cudaSetDevice(info->comm->cudaDev), ret, end);
+  }
+  NCCLCHECKGOTO(ArgsCheck(info), ret, end);
+  {
+    // Only use decisions already tuned ; the operation is computed once
+    int trial;
+    NCCLCHECKGOTO(ncclAutoTuneStart(info, 0, &trial), ret, end);
+  }
+  NCCLCHECKGOTO(ncclCalloc(&req, 1), ret, end);
+  req->info = *info;
+  if (info->comm->nRanks > 1) NCCLCHECKGOTO(computeColl(&req->info, &req->coll, &req->proxyArgs), ret, end);
+  INFO(NCCL_COLL,"%sInit: request %p sendbuff %p recvbuff %p count %zi datatype %d op %d root %d comm %p [nranks=%d]",
+       info->opName, req, info->sendbuff, info->recvbuff, info->count,
+       info->datatype, info->op, info->root, info->comm, info->comm->nRanks);
+  *request = req;
+end:
+  if (ret != ncclSuccess) free(req);
+  if (savedDev != -1) CUDACHECK(cudaSetDevice(savedDev));
+  return ret;
+}
+
+static ncclResult_t startRequest(struct ncclRequest* req, cudaStream_t stream) {
+  struct ncclInfo* info = &req->info;
+  struct ncclComm* comm = info->comm;
+  info->stream = stream;
+  if (comm->nRanks == 1) {
+    if (info->sendbuff != info->recvbuff)
+      CUDACHECK(cudaMemcpyAsync(info->recvbuff, info->sendbuff, info->nBytes, cudaMemcpyDeviceToDevice, stream));
+    return ncclSuccess;
+  }
+  // Only the operation count changes from one start to the next
+  req->coll.args.opCount = req->proxyArgs.opCount = comm->opCount;
+  return saveColls(info, &req->coll, &req->proxyArgs);
+}
+
+NCCL_API(ncclResult_t, ncclStart, ncclRequest_t request, cudaStream_t stream);
+ncclResult_t ncclStart(ncclRequest_t request, cudaStream_t stream) {
+  NCCLCHECK(PtrCheck(request, "Start", "request"));
+  struct ncclComm* comm = request->info.comm;
+  if (ncclAsyncMode()) {
+    ncclResult_t ret = ncclSuccess;
+    // Always register comm even in case of error to make sure ncclGroupEnd
+    // cleans it up.
+    NCCLCHECKGOTO(ncclAsyncColl(comm), ret, end);
+    NCCLCHECKGOTO(startRequest(request, stream), ret, end);
+end:
+    ncclAsyncErrCheck(ret);
+    return ret;
+  }
+  NCCLCHECK(startRequest(request, stream));
+  NCCLCHECK(ncclBarrierEnqueue(comm));
+  NCCLCHECK(ncclBarrierEnqueueWait(comm));
+  NCCLCHECK(ncclEnqueueEvents(comm));
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclRequestFree, ncclRequest_t request);
+ncclResult_t ncclRequestFree(ncclRequest_t request) {
+  free(request);
+  return ncclSuccess;
+}
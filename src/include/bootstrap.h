@@ -13,6 +13,18 @@ ncclResult_t bootstrapNetInit();
 ncclResult_t bootstrapCreateRoot(ncclUniqueId* commId, bool idFromEnv);
 ncclResult_t bootstrapGetUniqueId(ncclUniqueId* out);
 ncclResult_t bootstrapInit(ncclUniqueId* id, int rank, int nranks, void** commState);
+// Bootstrap of a communicator split from another one. Each rank listens
+// first, then the handles (NCCL_NET_HANDLE_MAXSIZE bytes each, ordered by
+// new rank) are exchanged through the parent.
+ncclResult_t bootstrapSplitListen(void* parentState, void* handle, void** listenComm);
+// Close a listenComm which could not be passed to bootstrapSplitInit
+ncclResult_t bootstrapSplitCloseListen(void* listenComm);
+ncclResult_t bootstrapSplitInit(void* parentState, void* listenComm, int rank, int nranks, void* handles, void** commState);
+// Bootstrap of a communicator shrunk from another one, with the ranks
+// parentRanks of the parent. Synchronizes these ranks, then takes over the
+// listening socket of the parent bootstrap : the parent bootstrap returns
+// ncclInvalidUsage afterwards, and can only be closed.
+ncclResult_t bootstrapShrinkInit(void* parentState, int rank, int nranks, int* parentRanks, void** commState);
 ncclResult_t bootstrapAllGather(void* commState, void* allData, int size);
 ncclResult_t bootstrapSend(void* commState, int peer, void* data, int size);
 ncclResult_t bootstrapRecv(void* commState, int peer, void* data, int size);
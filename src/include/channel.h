@@ -11,4 +11,13 @@
 ncclResult_t initChannel(struct ncclComm* comm, int channelid);
 ncclResult_t freeChannel(struct ncclChannel* channel, int nRanks);
 
+// Size of the FIFOs of connections using transport (NCCL_BUFFSIZE_<transport>)
+int ncclTransportBuffSize(int transport);
+// Collectives use the same step size on all the connections of a channel,
+// on all ranks : use the largest size needed by the transports of the ring.
+int ncclChannelBuffSize(int nranks, int* ringRanks, int* connectTransport);
+// Send/Recv connections start with NCCL_SENDRECV_BUFFSIZE bytes and double,
+// up to the size of their transport, as larger messages show up.
+int ncclSendRecvBuffSize(int transport, int current, ssize_t nBytes);
+
 #endif
@@ -0,0 +1,46 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_COLLNET_H_
+#define NCCL_COLLNET_H_
+
+#include "core.h"
+#include "info.h"
+
+// AllReduce offloaded to the collective network of the net plugin
+// (NCCL_COLLNET_ENABLE=1) : reduce to the first rank of each node, allreduce
+// between these leaders inside the network, then broadcast within the node.
+// Unlike other transports it connects a group of ranks, not a pair of peers.
+struct ncclCollNetComm {
+  int enabled;
+  int leader; // First rank of the node, the only one using the collective network
+  // Ranks of the node, the leader being rank 0
+  ncclComm_t nodeComm;
+  // Leaders only : collective comm, and the host buffer data goes through.
+  // It holds two slots of buffSize bytes, used alternately by consecutive
+  // steps so that the network step of one overlaps the reduce of the next.
+  void* collComm;
+  char* hostBuff; // Registered with the network
+  char* devBuff;  // Same memory, for the kernels of the node
+  void* mhandle;
+  size_t buffSize;
+  // Network steps run on their own stream, between reduced[slot] and
+  // netDone[slot]
+  cudaStream_t stream;
+  cudaEvent_t reduced[2];
+  cudaEvent_t netDone[2];
+  // Last operation using the buffer
+  cudaEvent_t doneEvent;
+  struct ncclComm* comm;
+};
+
+// Return whether info should use the collective network. The first eligible
+// operation connects it, and must be called by all ranks.
+ncclResult_t ncclCollNetCheck(struct ncclInfo* info, bool capturing, bool* use);
+ncclResult_t ncclCollNetAllReduce(struct ncclInfo* info);
+ncclResult_t ncclCollNetFree(struct ncclComm* comm);
+
+#endif
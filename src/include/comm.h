@@ -7,6 +7,8 @@
 #ifndef NCCL_COMM_H_
 #define NCCL_COMM_H_
 
+#include "nccl_profiler.h"
+
 #if CUDART_VERSION < 9000
 struct cudaLaunchParams {
   void *func;
@@ -22,6 +24,7 @@ struct cudaLaunchParams {
 #define DEFAULT_BUFFER_SIZE_BYTES (1LL << 22) /* 4MiB */
 
 #define CACHE_LINE_SIZE 128
+#define NCCL_DOORBELLS_PER_CHANNEL (CACHE_LINE_SIZE/sizeof(uint64_t))
 #define MEM_ALIGN 4096
 #define CUDA_IPC_MIN 2097152UL /* 2MiB - not currently used */
 
@@ -50,13 +53,75 @@ struct ncclRecvMem {
     char pad4[MEM_ALIGN];
   };
   ncclLLFifoLine llBuff[NCCL_LL_BUFF_LINES];
+  uint64_t ll128Buff[NCCL_LL128_BUFF_ELEMS];
   char buff[1]; // Actually larger than that
 };
 
+// Send/Recv operations are queued per peer until the end of the group
+struct ncclP2Pinfo {
+  void* buff;
+  ssize_t nBytes;
+  struct ncclP2Pinfo* next;
+};
+
+struct ncclP2Plist {
+  struct ncclP2Pinfo* head;
+  struct ncclP2Pinfo* tail;
+};
+
+// Network registration of a user buffer, one per network connection
+struct ncclRegNetHandle {
+  void* netComm;
+  void* mhandle;
+  struct ncclRegNetHandle* next;
+};
+
+// Small allreduce deferred to ncclGroupEnd so that it can be fused with
+// others of the same type and operation
+struct ncclFusionOp {
+  const void* sendbuff;
+  void* recvbuff;
+  size_t count;
+  ncclDataType_t datatype;
+  ncclRedOp_t op;
+  cudaStream_t stream;
+  int chunkSteps;
+  int sliceSteps;
+  int batch;      // Index of the first op of its batch, -1 if not saved yet
+  ssize_t offset; // Offset in the fusion buffer, -1 if saved on its own
+};
+
+#define NCCL_VALID_PTRS 16
+#define NCCL_GROUP_MAX_STREAMS 16
+
+// Connector replaced by one with a different buffer size (see p2pPrepare)
+struct ncclRetiredConnector {
+  struct ncclTransportComm* transportComm;
+  void* transportResources;
+  struct ncclRetiredConnector* next;
+};
+
+// User buffer registered with ncclCommRegister. Network registrations are
+// added lazily by the proxy threads, hence the mutex.
+struct ncclRegBuffer {
+  void* buff;
+  size_t size;
+  pthread_mutex_t mutex;
+  struct ncclRegNetHandle* netHandles;
+  struct ncclRegBuffer* next;
+};
+
 struct ncclComm {
   struct ncclChannel channels[MAXCHANNELS];
 
   struct ncclPeerInfo* peerInfo;
+  // Transport and value to connect to each peer, from this rank
+  int* connectTransport;
+  ncclTvalue_t* connectValue;
+  // Channels with connections to set up with each peer (see p2pPrepare)
+  uint32_t* connectSend;
+  uint32_t* connectRecv;
+  struct ncclRetiredConnector* retiredConnectors;
 
   void* bootstrap;
 
@@ -64,12 +129,25 @@ struct ncclComm {
   int nRanks;  // number of GPUs in communicator
   int cudaDev; // my cuda device index
   int nvmlDev; // my NVML device number
+  // CPU affinity of the application when it created the communicator
+  cpu_set_t cpuAffinity;
 
-  enum { GROUP, PARALLEL } launchMode;
+  enum { GROUP, PARALLEL, PIPELINE } launchMode;
+  // Thread launching the groups of NCCL_LAUNCH_MODE=PIPELINE, created by the
+  // first one
+  struct ncclLauncher* launcher;
   cudaStream_t userStream;
   bool userStreamSet;
+  bool userStreamCapturing; // userStream is being captured in a CUDA graph
+  // Other streams used by operations of the current group. We then launch on
+  // groupStream, after all user streams, and make them all wait for it.
+  cudaStream_t extraStreams[NCCL_GROUP_MAX_STREAMS];
+  int nExtraStreams;
   cudaEvent_t doneEvent;
   bool checkPointers;
+  // Pointers recently validated by NCCL_CHECK_POINTERS
+  const void* validPtrs[NCCL_VALID_PTRS];
+  int validPtrsNext;
 
   // Counter to make sure collectives match (needed for bcast/reduce
   // where syncs are not symmetric).
@@ -82,11 +160,29 @@ struct ncclComm {
   // Low-latency algorithm threshold
   ssize_t llThreshold;
   ssize_t threadThreshold;
+  // Whether collectives can use LL128 (NCCL_LL128_ENABLE), the same on all ranks
+  int ll128;
 
   // Tree algorithm threshold
   ssize_t treeThreshold;
+  // Trees are only connected once an operation asked for them. That
+  // operation still runs on rings (see getPatternInfo).
+  bool treeConnected;
+  bool treeRequested;
+
+  // Send/Recv size above which the network reads/writes registered user
+  // buffers directly (-1 to disable)
+  ssize_t netZcopyThreshold;
 
-  // An internal CUDA stream for NCCL kernel CGMD launches
+  // Tuning model (see tuning.cc). Latencies are in us, bandwidths in MB/s
+  // (i.e. B/us), indexed by nChannels-1. A zero bandwidth means unsupported.
+  float latencies[ncclCollCount][NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS];
+  float bandwidths[ncclCollCount][NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS][MAXCHANNELS];
+  // Decisions measured at runtime, NULL unless NCCL_AUTOTUNE=1
+  struct ncclAutoTune* autoTune;
+
+  // An internal CUDA stream for NCCL kernel CGMD launches, and for groups
+  // using several streams
   int groupCudaStream;
   cudaStream_t groupStream;
 
@@ -119,9 +215,118 @@ struct ncclComm {
   struct ncclColl args;
   void* argsptr;
 
-  // Global proxy thread
-  pthread_t proxyThread;
-  struct ncclProxyState proxyState;
+  // Proxy threads (NCCL_PROXY_NTHREADS), NULL if we don't use the network
+  struct ncclProxyState* proxyState;
+  struct ncclProxyOps proxyOps;
+  // Steps posted by LL/LL128 kernels for the network send proxies : one
+  // cache line of NCCL_DOORBELLS_PER_CHANNEL slots per channel, in mapped
+  // host memory. doorbellMask are the slots in use by connections.
+  uint64_t* doorbells;
+  uint64_t* devDoorbells;
+  uint32_t doorbellMask[MAXCHANNELS];
+
+  // ncclInProgress while ncclCommInitRankAsync runs, then its result
+  ncclResult_t initState;
+
+  // Pending Send/Recv operations, indexed by peer
+  struct ncclP2Plist* p2pSends;
+  struct ncclP2Plist* p2pRecvs;
+  int p2pCount;
+
+  // PreMulSum operations : slots of hostDevComm.redOpScalars in use, and
+  // the datatype each was created for. Destroyed slots may still be read by
+  // kernels in flight, and are only reused once these have completed.
+  uint64_t userRedOps;
+  uint64_t userRedOpsDestroyed;
+  ncclDataType_t userRedOpTypes[NCCL_MAX_USER_REDOPS];
+
+  // Streaming AllReduce : slots of hostDevComm.readyFlags in use, and their
+  // host copy
+  uint32_t userReadyFlags;
+  struct ncclReadyFlags readyFlags[NCCL_MAX_READY_FLAGS];
+
+  // ReduceScatterv/AllGatherv : host copy of hostDevComm.vLayouts and busy
+  // flags of its slots, next slot to use and slots used by operations not
+  // launched yet
+  size_t* vLayouts;
+  volatile uint8_t* vBusy;
+  int vNext;
+  int vPending;
+
+  // Maximum number of channels (CTAs) collectives may use (0 : unlimited)
+  int maxCTAs;
+
+  // Hierarchical allreduce (NCCL_HIER_ALLREDUCE), see hierarchy.h
+  int hierAllReduce;
+  struct ncclHier* hier;
+
+  // AllReduce offloaded to the collective network (NCCL_COLLNET_ENABLE),
+  // see collnet.h
+  int collNetEnable;
+  struct ncclCollNetComm* collNet;
+
+  // AllReduces up to oneShotThreshold bytes use the single-hop algorithm
+  // (0 to disable), see oneshot.h
+  ssize_t oneShotThreshold;
+  struct ncclOneShot* oneShot;
+
+  // AllGather/Broadcast of ceThreshold bytes and more (per rank for
+  // AllGather) are done with copy engines when possible (0 to disable), see
+  // copyengine.h
+  ssize_t ceThreshold;
+  struct ncclCopyEngine* copyEngine;
+
+  // Wire format of ring allreduces on floats (NCCL_COMPRESS_*)
+  int allReduceCompress;
+
+  // Allreduces up to fusionThreshold bytes called within a group are packed
+  // into fusionBuff and reduced as one operation (0 to disable)
+  ssize_t fusionThreshold;
+  char* fusionBuff;
+  size_t fusionBuffSize;
+  struct ncclFusionOp* fusionOps;
+  int nFusionOps;
+  int maxFusionOps;
+  // Stream and event of the last copies out of fusionBuff
+  cudaStream_t fusionStream;
+  cudaEvent_t fusionEvent;
+  // Orders the copies into fusionBuff after the other streams of the group
+  cudaEvent_t fusionStreamsEvent;
+
+  // Buffers registered by the user
+  struct ncclRegBuffer* regBuffers;
+
+  // Event recorder, NULL unless NCCL_TIMELINE_FILE is set
+  struct ncclTimeline* timeline;
+  // Profiler plugin, NULL unless one was loaded and accepted this communicator
+  ncclProfiler_t* profiler;
+  void* profilerContext;
+
+  // Counters returned by ncclCommGetStats, updated with ncclStatsAdd
+  ncclStats_t stats;
+
+  // Device and mapped host memory of channels and transports, see mempool.h
+  struct ncclMemPool memPool;
 };
 
+// Communicators from ncclCommInitRankAsync can only be used once initialized
+static inline ncclResult_t ncclCommCheckReady(struct ncclComm* comm) {
+  ncclResult_t state = __atomic_load_n(&comm->initState, __ATOMIC_ACQUIRE);
+  if (state == ncclInProgress) WARN("comm %p is still being initialized", comm);
+  else if (state != ncclSuccess) WARN("comm %p failed to initialize", comm);
+  return state;
+}
+
+// Give the doorbell slot of a connection (conn.doorbell) back to comm
+static inline void ncclDoorbellRelease(struct ncclComm* comm, uint64_t* devDoorbell) {
+  if (devDoorbell == NULL) return;
+  int index = devDoorbell - comm->devDoorbells;
+  uint32_t bit = 1U << (index%NCCL_DOORBELLS_PER_CHANNEL);
+  __atomic_fetch_and(comm->doorbellMask+index/NCCL_DOORBELLS_PER_CHANNEL, ~bit, __ATOMIC_RELAXED);
+}
+
+static inline void ncclStatsAdd(unsigned long long* counter, unsigned long long value) {
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
 #endif
@@ -0,0 +1,37 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_COPYENGINE_H_
+#define NCCL_COPYENGINE_H_
+
+#include "core.h"
+#include "info.h"
+
+// Large intra-node AllGather/Broadcast operations can be done with
+// cudaMemcpyAsync, on the copy engines, leaving all SMs to compute kernels.
+// Each rank stages its data in a buffer mapped by all peers through CUDA IPC,
+// and peers pull from it. Inter-process events order the copies, and a
+// bootstrap barrier makes sure events are recorded before peers wait on them.
+struct ncclCopyEngine {
+  int enabled;
+  char* buff;
+  size_t buffSize;
+  // Staging buffers and events of all ranks, opened through CUDA IPC
+  char** peerBuffs;
+  cudaEvent_t readyEvent;
+  cudaEvent_t doneEvent;
+  cudaEvent_t* peerReadyEvents;
+  cudaEvent_t* peerDoneEvents;
+  int* barrier;
+};
+
+// Return whether info should go through the copy engines. The first eligible
+// operation sets the path up, and must be called by all ranks.
+ncclResult_t ncclCopyEngineCheck(struct ncclInfo* info, bool* use);
+ncclResult_t ncclCopyEngineColl(struct ncclInfo* info);
+ncclResult_t ncclCopyEngineFree(struct ncclComm* comm);
+
+#endif
@@ -13,6 +13,7 @@
 #include "debug.h"
 #include "checks.h"
 #include "alloc.h"
+#include "mempool.h"
 #include "transport.h"
 #include "devcomm.h"
 #include "comm.h"
@@ -48,6 +49,9 @@ static __inline__ int ncclTypeSize(ncclDataType_t type) {
     case ncclUint8:
       return 1;
     case ncclFloat16:
+#if defined(__CUDA_BF16_TYPES_EXIST__)
+    case ncclBfloat16:
+#endif
       return 2;
     case ncclInt32:
     case ncclUint32:
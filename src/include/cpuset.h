@@ -7,6 +7,10 @@
 #ifndef NCCL_CPUSET_H_
 #define NCCL_CPUSET_H_
 
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
 // Convert local_cpus, e.g. 0003ff,f0003fff to cpu_set_t
 
 static int hexToInt(char c) {
@@ -19,7 +23,7 @@ static int hexToInt(char c) {
 
 #define CPU_SET_N_U32 (sizeof(cpu_set_t)/sizeof(uint32_t))
 
-ncclResult_t ncclStrToCpuset(char* str, cpu_set_t* mask) {
+static ncclResult_t ncclStrToCpuset(char* str, cpu_set_t* mask) {
   uint32_t cpumasks[CPU_SET_N_U32];
   int m = CPU_SET_N_U32-1;
   cpumasks[m] = 0;
@@ -42,7 +46,7 @@ ncclResult_t ncclStrToCpuset(char* str, cpu_set_t* mask) {
   return ncclSuccess;
 }
 
-ncclResult_t ncclCpusetToStr(cpu_set_t* mask, char* str) {
+static ncclResult_t ncclCpusetToStr(cpu_set_t* mask, char* str) {
   int c = 0;
   uint8_t* m8 = (uint8_t*)mask;
   for (int o=sizeof(cpu_set_t)-1; o>=0; o--) {
@@ -58,4 +62,20 @@ ncclResult_t ncclCpusetToStr(cpu_set_t* mask, char* str) {
   return ncclSuccess;
 }
 
+// CPUs close to a PCI device, from its local_cpus in sysfs
+static ncclResult_t ncclPciCpuset(const char* pciPath, cpu_set_t* mask) {
+  CPU_ZERO_S(sizeof(cpu_set_t), mask);
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/local_cpus", pciPath);
+  int fd;
+  SYSCHECKVAL(open(path, O_RDONLY), "open", fd);
+  char affinityStr[sizeof(cpu_set_t)*2 + 1];
+  int r = read(fd, affinityStr, sizeof(cpu_set_t)*2);
+  close(fd);
+  if (r <= 0) return ncclSystemError;
+  affinityStr[r] = '\0';
+  NCCLCHECK(ncclStrToCpuset(affinityStr, mask));
+  return ncclSuccess;
+}
+
 #endif
@@ -13,7 +13,31 @@
 #define NCCL_MAX_OPS 2048
 #define NCCL_STEPS 8
 
-typedef enum { ncclCollBroadcast, ncclCollReduce, ncclCollAllGather, ncclCollReduceScatter, ncclCollAllReduce, ncclCollCount } ncclColl_t;
+// Operations created by ncclRedOpCreatePreMulSum all use the same kernels,
+// which come after the builtin ones.
+#define NCCL_DEVOP_PREMULSUM ncclNumOps
+#define NCCL_NUM_DEVOPS (ncclNumOps+1)
+#define NCCL_MAX_USER_REDOPS 64
+#define NCCL_MAX_READY_FLAGS 16
+// ReduceScatterv/AllGatherv launched and not done yet
+#define NCCL_MAX_VOPS 64
+
+// Chunks of the input of a streaming AllReduce, ready once their flag is set
+struct ncclReadyFlags {
+  volatile uint32_t* flags;
+  size_t chunkCount;
+};
+
+typedef enum { ncclCollBroadcast, ncclCollReduce, ncclCollAllGather, ncclCollReduceScatter, ncclCollAllReduce, ncclCollSendRecv, ncclCollCount } ncclColl_t;
+
+#define NCCL_NUM_ALGORITHMS 2 // Tree/Ring
+#define NCCL_ALGO_TREE 0
+#define NCCL_ALGO_RING 1
+
+#define NCCL_NUM_PROTOCOLS 3 // LL/Simple/LL128
+#define NCCL_PROTO_LL 0
+#define NCCL_PROTO_SIMPLE 1
+#define NCCL_PROTO_LL128 2
 
 #define DIVUP(x, y) \
     (((x)+(y)-1)/(y))
@@ -55,9 +79,26 @@ union ncclLLFifoLine {
 // Make sure the clean mask will last for at least NCCL_NSTEPS
 static_assert(NCCL_LL_CLEAN_MASK % NCCL_STEPS == 0, "Invalid NCCL_LL_CLEAN_MASK value");
 
+/* LL128 : lines of 128 bytes, 120 bytes of data followed by a 64-bit flag.
+   Each line is written by 8 threads of a warp, 16 bytes each, in a single
+   store instruction, which NVLink delivers as a whole : the flag cannot be
+   seen before the data of its line. Flags are 64 bits and never wrap, so
+   the FIFO does not need cleaning. */
+#define NCCL_LL128_LINESIZE 128
+#define NCCL_LL128_LINEELEMS (NCCL_LL128_LINESIZE/sizeof(uint64_t))
+#define NCCL_LL128_DATAELEMS (NCCL_LL128_LINEELEMS-1)
+#define NCCL_LL128_MAX_NTHREADS MAXTHREADS
+#define NCCL_LL128_ELEMS_PER_THREAD 64
+#define NCCL_LL128_SLICE_ELEMS (NCCL_LL128_ELEMS_PER_THREAD*NCCL_LL128_MAX_NTHREADS)
+#define NCCL_LL128_BUFF_ELEMS (NCCL_LL128_SLICE_ELEMS*NCCL_STEPS)
+#define NCCL_LL128_BUFF_SIZE (NCCL_LL128_BUFF_ELEMS*sizeof(uint64_t))
+// Data carried by a step, in 64-bit elements
+#define NCCL_LL128_SLICE_DATA (NCCL_LL128_SLICE_ELEMS/NCCL_LL128_LINEELEMS*NCCL_LL128_DATAELEMS)
+
 struct ncclConnInfo {
   // Regular comm mechanism
   char *buff;         // Local for recv, remote for send
+  int buffSize;       // Size of buff, the same on both sides
   uint64_t *tail;     // Local for recv, remote for send
   uint64_t *head;     // Local for send, remote for recv
   uint64_t *opCountLoc; // opCount of local rank
@@ -69,19 +110,32 @@ struct ncclConnInfo {
   int *fifo;          // Size fifo for proxy
 
   uint64_t step;      // Keep where we are
+  int stepSize;       // Bytes per step of the last simple operation (0 : none yet)
 
   // Low latency mechanism
   union ncclLLFifoLine *llBuff; // Local for recv, remote for send
   uint64_t llLastCleaning;
+
+  // LL128 lines
+  uint64_t *ll128Buff; // Local for recv, remote for send
+
+  int llHostMem;      // LL lines are received in host memory (poll with backoff)
+  uint64_t *doorbell; // LL/LL128 : last step sent, for the proxy (NULL if none)
+
+  struct ncclConnInfo *sharedConn; // Connection shared with other communicators : its state lives there
 };
 
 struct ncclConnector {
   int connected;
+  int zcopy; // The network can read/write user buffers directly
+  int coll;  // Used by rings or trees : buff has the size of the channel
   struct ncclProxyArgs *proxyAppend;
   struct ncclTransportComm* transportComm;
+  int transport; // Index in ncclTransports
   void* transportResources; // Host-side resources
   struct ncclConnInfo conn;
   struct ncclComm *comm;
+  struct ncclSharedConnector *shared; // NULL unless shared with other communicators
 };
 
 struct ncclRing {
@@ -114,6 +168,11 @@ struct ncclDevComm;
 /* CollectiveArgs + ncclColl are to be a power of two, currently 64 bytes, */
 /* to make sure reads to host from the CUDA kernel are aligned. */
 /* Make sure to adjust padding at the end of ncclColl. */
+// Send/Recv : the network reads the send buffer and/or writes the receive
+// buffer directly, the kernel only synchronizes with the proxy.
+#define NCCL_ZCOPY_SEND 0x1
+#define NCCL_ZCOPY_RECV 0x2
+
 struct CollectiveArgs {
   struct ncclDevComm* comm;
   uint64_t opCount;
@@ -123,14 +182,46 @@ struct CollectiveArgs {
   void * ThisOutput;
 
   // general parameters
-  size_t N;
-  uint32_t root;
   uint8_t bid;
-  uint8_t nChannels;
+  union {
+    uint8_t nChannels;
+    uint8_t zcopy; // Send/Recv (always one channel) : NCCL_ZCOPY_SEND/RECV
+  };
   uint16_t nThreads;
-
-  int lastChunkSize;
+  union {
+    uint32_t root;
+    int32_t delta; // Send/Recv : send to rank+delta, receive from rank-delta
+  };
+  union {
+    struct {
+      size_t N;
+      int lastChunkSize;
+      union {
+        uint8_t compress; // Ring AllReduce on floats : NCCL_COMPRESS_*
+        uint8_t vSlot; // ReduceScatterv/AllGatherv : 1 + index in ncclDevComm.vLayouts, 0 otherwise
+      };
+      uint8_t redOpSlot; // PreMulSum : index of the scalar in ncclDevComm.redOpScalars
+      uint8_t stepShift; // Ring simple protocol : steps are buffSize/NCCL_STEPS >> stepShift bytes
+      uint8_t readySlot; // Streaming AllReduce : 1 + index in ncclDevComm.readyFlags, 0 otherwise
+    };
+    // Send/Recv, in bytes. Zero means nothing to send (or receive).
+    struct {
+      size_t sendCount;
+      size_t recvCount;
+    };
+  };
 };
+// Ring AllReduce on floats : data is sent as fp16/bf16 between ranks but
+// reduced in fp32 (NCCL_ALLREDUCE_COMPRESS)
+#define NCCL_COMPRESS_NONE 0
+#define NCCL_COMPRESS_FP16 1
+#define NCCL_COMPRESS_BF16 2
+
+// ncclColl.active : 1 for operations followed by others in the FIFO, 2 for
+// the last one. Operations captured in a CUDA graph are passed as kernel
+// argument to all blocks and never go through the FIFO.
+#define NCCL_COLL_GRAPH 3
+
 struct ncclColl {
   union {
     struct {
@@ -158,6 +249,11 @@ struct ncclChannel {
       struct ncclPeer* peers;
       struct ncclPeer* devPeers;
 
+      // Parent of every rank in the tree, so that rooted collectives can
+      // re-root it (set when trees get connected)
+      int* treeUps;
+      int* devTreeUps;
+
       // Operation list for aggregation
       struct ncclColl* collectives;
       struct ncclColl* devCollectives;
@@ -165,6 +261,11 @@ struct ncclChannel {
       int collCount;
       int collFifoHead; // Only used by GPU
       int collFifoTail; // Only used by CPU
+
+      // Start/end time of the operation of each FIFO slot, NULL unless the
+      // timeline is recorded (see timeline.h)
+      uint64_t* timestamps;
+      uint64_t* devTimestamps;
     };
     int data[0x80];
   };
@@ -189,6 +290,37 @@ struct ncclDevComm {
 
   // Channels, device side
   struct ncclChannel* channels;
+
+  // Scalars of PreMulSum operations, NCCL_MAX_USER_REDOPS slots
+  uint64_t* redOpScalars;
+
+  // Flags of streaming AllReduces, NCCL_MAX_READY_FLAGS slots
+  struct ncclReadyFlags* readyFlags;
+
+  // Per-rank counts then displacements of ReduceScatterv/AllGatherv,
+  // NCCL_MAX_VOPS slots of 2*nRanks elements. The kernel clears the busy
+  // flag of its channel (MAXCHANNELS per slot, host memory) once done.
+  size_t* vLayouts;
+  volatile uint8_t* vBusy;
+
+  // LL receives wait for one line per warp before reading (NCCL_LL_WARP_POLL)
+  int llWarpPoll;
+};
+
+// Single-hop allreduce across NVSwitch (see oneshot.h)
+struct ncclOneShotArgs {
+  struct ncclDevComm* comm;
+  const void* sendbuff;
+  void* recvbuff;
+  size_t nBytes;
+  // LL buffers of all ranks, 2 halves of nRanks slots of slotLines lines
+  union ncclLLFifoLine** buffs;
+  // Flag of the last operation, and number of blocks done with the current one
+  uint32_t* counter;
+  int rank;
+  int nRanks;
+  int slotLines;
+  int redOpSlot;
 };
 
 #endif
@@ -23,5 +23,33 @@ ncclResult_t ncclCpuBarrierOut(ncclComm_t comm);
 ncclResult_t ncclBarrierEnqueue(ncclComm_t comm);
 ncclResult_t ncclBarrierEnqueueWait(ncclComm_t comm);
 ncclResult_t ncclEnqueueEvents(ncclComm_t comm);
+// NCCL_LAUNCH_MODE=PIPELINE : the launch of a group (ncclBarrierEnqueue,
+// ncclBarrierEnqueueWait then ncclEnqueueEvents) done by the launcher thread
+// of the communicator. Each post must be waited for.
+bool ncclLaunchPipelined(ncclComm_t comm);
+ncclResult_t ncclLaunchPost(ncclComm_t comm);
+ncclResult_t ncclLaunchWait(ncclComm_t comm);
+ncclResult_t ncclLauncherDestroy(ncclComm_t comm);
+// Send/Recv : connect to new peers (and to trees if requested), then save
+// the queued operations
+ncclResult_t ncclP2pConnect(ncclComm_t comm);
+ncclResult_t ncclSaveP2pKernels(ncclComm_t comm);
+void ncclP2pFree(ncclComm_t comm);
+// Fusion : save the small allreduces of the group, then copy their results
+// out of the fusion buffer after the launch
+ncclResult_t ncclSaveFusedColls(ncclComm_t comm);
+ncclResult_t ncclFusionCopyOut(ncclComm_t comm);
+// ReduceScatterv/AllGatherv : release the layout slots of operations which
+// will not be launched
+void ncclVLayoutsCancel(ncclComm_t comm);
+
+// Persistent operation, computed once by ncclPersistentInit and enqueued
+// by every ncclStart.
+struct ncclRequest {
+  struct ncclInfo info;
+  struct ncclColl coll;
+  struct ncclProxyArgs proxyArgs;
+};
+ncclResult_t ncclPersistentInit(struct ncclInfo* info, ncclRequest_t* request);
 
 #endif // End include guard
@@ -0,0 +1,32 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_HIERARCHY_H_
+#define NCCL_HIERARCHY_H_
+
+#include "core.h"
+#include "info.h"
+
+// Hierarchical allreduce (NCCL_HIER_ALLREDUCE=1) : reduce-scatter within
+// each node, allreduce of 1/localRanks of the data across nodes, with one
+// ring per local rank so that all NICs work in parallel, then allgather
+// within the node.
+struct ncclHier {
+  int enabled;
+  int localRank;
+  int localRanks;
+  // Ranks of the node, and ranks with the same local rank on all nodes
+  ncclComm_t nodeComm;
+  ncclComm_t railComm;
+};
+
+// Return whether info should use the hierarchical allreduce. The first
+// eligible operation splits the communicator, and must be called by all ranks.
+ncclResult_t ncclHierCheck(struct ncclInfo* info, bool capturing, bool* use);
+ncclResult_t ncclHierAllReduce(struct ncclInfo* info);
+ncclResult_t ncclHierFree(struct ncclComm* comm);
+
+#endif
@@ -40,6 +40,16 @@ struct ncclInfo {
   size_t nBytes;
   int nstepsPerLoop;
   int nchunksPerLoop;
+  // Set by the auto-tuner to force an algorithm/protocol/nChannels
+  const struct ncclTuneConfig* config;
+  // Send/Recv : 1 for ncclSend, 0 for ncclRecv. The peer is passed as root.
+  int p2pSend;
+  // Streaming AllReduce : 1 + slot of the ready flags, 0 otherwise
+  int readySlot;
+  // ReduceScatterv/AllGatherv : count and displacement of each rank, in
+  // elements of the user datatype. count is the largest of the counts.
+  const size_t* counts;
+  const size_t* displs;
 };
 
 #endif
@@ -0,0 +1,68 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_MEMPOOL_H_
+#define NCCL_MEMPOOL_H_
+
+#include "nccl.h"
+#include "checks.h"
+
+/* Per-communicator pools of device and mapped host memory, for the channel
+ * structures and transport buffers. Memory is allocated in blocks of
+ * NCCL_MEM_POOL_BLOCK_SIZE bytes, zeroed once, and handed out in aligned
+ * pieces. Blocks are refcounted by the pieces they hold and freed with their
+ * last piece, so that pieces can outlive the pool (connectors reused by
+ * ncclCommShrink). NCCL_MEM_POOL=0 gives each piece its own block.
+ *
+ * A piece shared with another process is exported as the IPC handle of its
+ * block plus its offset : each block has one handle, and is opened once per
+ * peer process (see ncclMemPoolIpcOpen).
+ *
+ * Host pieces can be asked for on a NUMA node : they come from blocks placed
+ * on that node (see ncclNumaAllocId). */
+
+enum ncclMemPoolType { ncclMemPoolDevice = 0, ncclMemPoolHost = 1, ncclMemPoolTypes = 2 };
+#define NCCL_MEM_POOL_MAX_NUMA 8
+
+struct ncclMemPoolBlock;
+
+struct ncclMemPool {
+  // Blocks new pieces are taken from, NULL until the first allocation
+  struct ncclMemPoolBlock* current[ncclMemPoolTypes];
+  // Same for host pieces placed on a NUMA node
+  struct ncclMemPoolBlock* numaCurrent[NCCL_MEM_POOL_MAX_NUMA];
+};
+
+// Allocate size zeroed bytes aligned to align. devPtr is the device address
+// of host pieces, and the same as ptr for device pieces. Host pieces are
+// placed on NUMA node numaId, unless it is -1.
+ncclResult_t ncclMemPoolAlloc(struct ncclMemPool* pool, int type, size_t size, size_t align, void** ptr, void** devPtr, int numaId = -1);
+// Release a piece (NULL is ignored)
+ncclResult_t ncclMemPoolFree(void* ptr);
+// Release the blocks held by the pool. Pieces allocated remain valid.
+ncclResult_t ncclMemPoolDestroy(struct ncclMemPool* pool);
+
+// IPC handle of the device block holding ptr, offset and size of the block
+ncclResult_t ncclMemPoolIpcGet(void* ptr, cudaIpcMemHandle_t* handle, size_t* offset, size_t* blockSize);
+// Map the piece at offset of a remote block, opening the block only once
+ncclResult_t ncclMemPoolIpcOpen(cudaIpcMemHandle_t* handle, size_t offset, size_t blockSize, void** ptr);
+ncclResult_t ncclMemPoolIpcClose(void* ptr);
+
+#define NCCL_MEM_POOL_ALIGN 128 /* CACHE_LINE_SIZE */
+
+template <typename T>
+static ncclResult_t ncclPoolCudaCalloc(struct ncclMemPool* pool, T** ptr, size_t nelem, size_t align = NCCL_MEM_POOL_ALIGN) {
+  void* devPtr;
+  NCCLCHECK(ncclMemPoolAlloc(pool, ncclMemPoolDevice, nelem*sizeof(T), align, &devPtr, &devPtr));
+  *ptr = (T*)devPtr;
+  return ncclSuccess;
+}
+
+static inline ncclResult_t ncclPoolHostAlloc(struct ncclMemPool* pool, void** ptr, void** devPtr, size_t size, size_t align = NCCL_MEM_POOL_ALIGN, int numaId = -1) {
+  return ncclMemPoolAlloc(pool, ncclMemPoolHost, size, align, ptr, devPtr, numaId);
+}
+
+#endif
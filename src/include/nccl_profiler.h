@@ -0,0 +1,64 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_PROFILER_H_
+#define NCCL_PROFILER_H_
+
+#include "nccl.h"
+#include "nccl_net.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+  ncclProfileColl = 0,      // NCCL call, from entry to the end of the enqueue
+  ncclProfileProxySend = 1, // Proxy operation, from post to its last step completed
+  ncclProfileProxyRecv = 2,
+  ncclProfileNetSend = 3,   // Network request, from post to test completion
+  ncclProfileNetRecv = 4,
+  ncclProfileNetFlush = 5
+} ncclProfilerEventType_v1_t;
+
+typedef struct {
+  ncclProfilerEventType_v1_t type;
+  uint64_t opCount;
+  // Collectives : the ncclColl_t of the call, and its arguments
+  int func;
+  size_t count;
+  ncclDataType_t datatype;
+  ncclRedOp_t op;
+  int root;
+  // Proxy and network events : channel and peer rank. Proxy events also
+  // give the number of steps.
+  int channel;
+  int peer;
+  int nSteps;
+  // Network events : size of the request (known at completion for receives)
+  size_t bytes;
+} ncclProfilerEventDescr_v1_t;
+
+typedef struct {
+  // Name of the profiler (mainly for logs)
+  const char* name;
+  // Initialize the profiler for a new communicator. context is passed back
+  // with all the events of that communicator.
+  ncclResult_t (*init)(void** context, int rank, int nRanks, int cudaDev, ncclDebugLogger_t logFunction);
+  // Start an event and return a handle to stop it. Proxy and network events
+  // are started and stopped from the proxy threads, concurrently with the
+  // collectives of the application thread. A NULL handle drops the event.
+  ncclResult_t (*startEvent)(void* context, void** eHandle, ncclProfilerEventDescr_v1_t* eDescr);
+  // Stop an event. Network receives carry their final size in bytes.
+  ncclResult_t (*stopEvent)(void* eHandle, size_t bytes);
+  // Finalize the profiler of a communicator, called from ncclCommDestroy.
+  ncclResult_t (*finalize)(void* context);
+} ncclProfiler_v1_t;
+
+typedef ncclProfiler_v1_t ncclProfiler_t;
+typedef ncclProfilerEventDescr_v1_t ncclProfilerEventDescr_t;
+
+#define NCCL_PROFILER_PLUGIN_SYMBOL ncclProfilerPlugin_v1
+
+#endif // end include guard
@@ -25,12 +25,58 @@ static ncclResult_t ncclNetRegMr(void* comm, void* data, int size, int type, voi
 static ncclResult_t ncclNetDeregMr(void* comm, void* mhandle) { NCCLCHECK(ncclNet->deregMr(comm, mhandle)); return ncclSuccess; }
 static ncclResult_t ncclNetIsend(void* sendComm, void* data, int size, void* mhandle, void** request) { NCCLCHECK(ncclNet->isend(sendComm, data, size, mhandle, request)); return ncclSuccess; }
 static ncclResult_t ncclNetIrecv(void* recvComm, void* data, int size, void* mhandle, void** request) { NCCLCHECK(ncclNet->irecv(recvComm, data, size, mhandle, request)); return ncclSuccess; }
-static ncclResult_t ncclNetFlush(void* recvComm, void* data, int size, void* mhandle) { NCCLCHECK(ncclNet->flush(recvComm, data, size, mhandle)); return ncclSuccess; }
+static ncclResult_t ncclNetIflush(void* recvComm, void* data, int size, void* mhandle, void** request) { NCCLCHECK(ncclNet->iflush(recvComm, data, size, mhandle, request)); return ncclSuccess; }
 static ncclResult_t ncclNetTest(void* request, int* done, int* size) { NCCLCHECK(ncclNet->test(request, done, size)); return ncclSuccess; }
 static ncclResult_t ncclNetCloseSend(void* sendComm) { NCCLCHECK(ncclNet->closeSend(sendComm)); return ncclSuccess; }
 static ncclResult_t ncclNetCloseRecv(void* recvComm) { NCCLCHECK(ncclNet->closeRecv(recvComm)); return ncclSuccess; }
 static ncclResult_t ncclNetCloseListen(void* listenComm) { NCCLCHECK(ncclNet->closeListen(listenComm)); return ncclSuccess; }
 
+// Optional functions, emulated when the network does not provide them
+static ncclResult_t ncclNetGetProperties(int dev, ncclNetProperties_t* props) {
+  memset(props, 0, sizeof(ncclNetProperties_t));
+  if (ncclNet->getProperties) NCCLCHECK(ncclNet->getProperties(dev, props));
+  return ncclSuccess;
+}
+static int ncclNetMaxIovs() { return ncclNet->isendv && ncclNet->irecvv ? NCCL_NET_MAX_IOVS : 1; }
+static ncclResult_t ncclNetIsendv(void* sendComm, ncclNetIov_t* iovs, int niov, void** request) {
+  if (ncclNet->isendv) { NCCLCHECK(ncclNet->isendv(sendComm, iovs, niov, request)); return ncclSuccess; }
+  if (niov != 1) return ncclInternalError;
+  NCCLCHECK(ncclNet->isend(sendComm, iovs[0].data, iovs[0].size, iovs[0].mhandle, request));
+  return ncclSuccess;
+}
+static ncclResult_t ncclNetIrecvv(void* recvComm, ncclNetIov_t* iovs, int niov, void** request) {
+  if (ncclNet->irecvv) { NCCLCHECK(ncclNet->irecvv(recvComm, iovs, niov, request)); return ncclSuccess; }
+  if (niov != 1) return ncclInternalError;
+  NCCLCHECK(ncclNet->irecv(recvComm, iovs[0].data, iovs[0].size, iovs[0].mhandle, request));
+  return ncclSuccess;
+}
+static ncclResult_t ncclNetTestAny(int n, void** requests, int* index, int* size) {
+  if (ncclNet->testAny) { NCCLCHECK(ncclNet->testAny(n, requests, index, size)); return ncclSuccess; }
+  *index = -1;
+  for (int i=0; i<n; i++) {
+    int done;
+    if (requests[i] == NULL) continue;
+    NCCLCHECK(ncclNet->test(requests[i], &done, size));
+    if (done) { *index = i; break; }
+  }
+  return ncclSuccess;
+}
+
+// Collective network, NULL unless the plugin provides one
+extern ncclCollNet_t* ncclCollNet;
+static ncclResult_t ncclCollNetDevices(int* ndev) { NCCLCHECK(ncclCollNet->devices(ndev)); return ncclSuccess; }
+static ncclResult_t ncclCollNetPtrSupport(int dev, int* supportedTypes) { NCCLCHECK(ncclCollNet->ptrSupport(dev, supportedTypes)); return ncclSuccess; }
+static ncclResult_t ncclCollNetListen(int dev, void* handle, void** listenComm) { NCCLCHECK(ncclCollNet->listen(dev, handle, listenComm)); return ncclSuccess; }
+static ncclResult_t ncclCollNetConnect(void* handles[], int nranks, int rank, void* listenComm, void** collComm) { NCCLCHECK(ncclCollNet->connect(handles, nranks, rank, listenComm, collComm)); return ncclSuccess; }
+static ncclResult_t ncclCollNetReduceSupport(ncclDataType_t dataType, ncclRedOp_t redOp, int* supported) { NCCLCHECK(ncclCollNet->reduceSupport(dataType, redOp, supported)); return ncclSuccess; }
+static ncclResult_t ncclCollNetRegMr(void* comm, void* data, int size, int type, void** mhandle) { NCCLCHECK(ncclCollNet->regMr(comm, data, size, type, mhandle)); return ncclSuccess; }
+static ncclResult_t ncclCollNetDeregMr(void* comm, void* mhandle) { NCCLCHECK(ncclCollNet->deregMr(comm, mhandle)); return ncclSuccess; }
+static ncclResult_t ncclCollNetIallreduce(void* collComm, void* sendData, void* recvData, int count, ncclDataType_t dataType, ncclRedOp_t redOp, void* sendMhandle, void* recvMhandle, void** request) {
+  NCCLCHECK(ncclCollNet->iallreduce(collComm, sendData, recvData, count, dataType, redOp, sendMhandle, recvMhandle, request)); return ncclSuccess; }
+static ncclResult_t ncclCollNetTest(void* request, int* done, int* size) { NCCLCHECK(ncclCollNet->test(request, done, size)); return ncclSuccess; }
+static ncclResult_t ncclCollNetCloseColl(void* collComm) { NCCLCHECK(ncclCollNet->closeColl(collComm)); return ncclSuccess; }
+static ncclResult_t ncclCollNetCloseListen(void* listenComm) { NCCLCHECK(ncclCollNet->closeListen(listenComm)); return ncclSuccess; }
+
 extern ncclNet_t ncclNetIb;
 extern ncclNet_t ncclNetSocket;
 
@@ -0,0 +1,39 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_ONESHOT_H_
+#define NCCL_ONESHOT_H_
+
+#include "core.h"
+#include "info.h"
+
+// When all GPUs of a node are one NVSwitch hop apart, small allreduces skip
+// the ring and its nRanks-1 steps : each rank stores its data into all other
+// ranks' buffers, then reduces them locally (see one_shot.cu).
+#define NCCL_ONESHOT_THRESHOLD (64*1024)
+#define NCCL_ONESHOT_NTHREADS 256
+
+struct ncclOneShot {
+  int enabled;
+  int slotLines;
+  union ncclLLFifoLine* buff;
+  // Buffers of all ranks, on the host to release them, and on the device
+  union ncclLLFifoLine** peerBuffs;
+  union ncclLLFifoLine** devPeerBuffs;
+  uint32_t* counter;
+};
+
+// Set comm->oneShotThreshold from the topology (nranks x nranks transports
+// and values) and NCCL_ONESHOT_THRESHOLD
+ncclResult_t ncclOneShotInit(struct ncclComm* comm, int* connectTransport, ncclTvalue_t* connectValue);
+// Return whether info should use the single-hop allreduce. The first eligible
+// operation which is not captured sets the buffers up, and must be called by
+// all ranks.
+ncclResult_t ncclOneShotCheck(struct ncclInfo* info, bool capturing, bool* use);
+ncclResult_t ncclOneShotColl(struct ncclInfo* info);
+ncclResult_t ncclOneShotFree(struct ncclComm* comm);
+
+#endif
@@ -0,0 +1,32 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_PROFILER_INT_H_
+#define NCCL_PROFILER_INT_H_
+
+#include "core.h"
+#include "nccl_profiler.h"
+
+// Profiler plugin (libnccl-profiler.so), NULL when none was loaded. Each
+// communicator keeps its own copy in comm->profiler, set only once the
+// plugin accepted it : callers check that pointer and nothing else.
+extern ncclProfiler_t* ncclProfiler;
+
+ncclResult_t ncclProfilerCommInit(struct ncclComm* comm);
+ncclResult_t ncclProfilerCommFinalize(struct ncclComm* comm);
+
+static inline void ncclProfilerStart(struct ncclComm* comm, void** eHandle, ncclProfilerEventDescr_t* eDescr) {
+  *eHandle = NULL;
+  if (comm->profiler->startEvent(comm->profilerContext, eHandle, eDescr) != ncclSuccess) *eHandle = NULL;
+}
+
+static inline void ncclProfilerStop(struct ncclComm* comm, void** eHandle, size_t bytes) {
+  if (*eHandle == NULL) return;
+  comm->profiler->stopEvent(*eHandle, bytes);
+  *eHandle = NULL;
+}
+
+#endif
@@ -11,41 +11,50 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include "utils.h"
 
 // Change functions behavior to match other SYS functions
-static int shm_allocate(int fd, const int shmsize) {
+static int shm_allocate(int fd, const size_t shmsize) {
   int err = posix_fallocate(fd, 0, shmsize);
   if (err) { errno = err; return -1; }
   return 0;
 }
-static int shm_map(int fd, const int shmsize, void** ptr) {
+static int shm_map(int fd, const size_t shmsize, void** ptr) {
   *ptr = mmap(NULL, shmsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
   return (*ptr == MAP_FAILED) ? -1 : 0;
 }
 
-static ncclResult_t shmSetup(const char* shmname, const int shmsize, int* fd, void** ptr, int create) {
+// The creator places the pages of the segment on NUMA node numaId (-1 : where
+// they are first touched) : the policy is set on the mapping before they are
+// allocated.
+static ncclResult_t shmSetup(const char* shmname, const size_t shmsize, int* fd, void** ptr, int create, int numaId = -1) {
   SYSCHECKVAL(shm_open(shmname, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR), "shm_open", *fd);
+  if (create && numaId != -1) {
+    SYSCHECK(ftruncate(*fd, shmsize), "ftruncate");
+    SYSCHECK(shm_map(*fd, shmsize, ptr), "mmap");
+    ncclNumaBind(*ptr, shmsize, numaId);
+  }
   if (create) SYSCHECK(shm_allocate(*fd, shmsize), "posix_fallocate");
-  SYSCHECK(shm_map(*fd, shmsize, ptr), "mmap");
+  if (*ptr == MAP_FAILED) SYSCHECK(shm_map(*fd, shmsize, ptr), "mmap");
   close(*fd);
   *fd = -1;
   if (create) memset(*ptr, 0, shmsize);
   return ncclSuccess;
 }
 
-static ncclResult_t shmOpen(const char* shmname, const int shmsize, void** shmPtr, void** devShmPtr, int create) {
+static ncclResult_t shmOpen(const char* shmname, const size_t shmsize, void** shmPtr, void** devShmPtr, int create, int numaId = -1) {
   int fd = -1;
   void* ptr = MAP_FAILED;
   ncclResult_t res = ncclSuccess;
 
-  NCCLCHECKGOTO(shmSetup(shmname, shmsize, &fd, &ptr, create), res, sysError);
+  NCCLCHECKGOTO(shmSetup(shmname, shmsize, &fd, &ptr, create, numaId), res, sysError);
   CUDACHECKGOTO(cudaHostRegister(ptr, shmsize, cudaHostRegisterMapped), res, cudaError);
   CUDACHECKGOTO(cudaHostGetDevicePointer(devShmPtr, ptr, 0), res, cudaError);
 
   *shmPtr = ptr;
   return ncclSuccess;
 sysError:
-  WARN("Error while %s shared memory segment %s (size %d)\n", create ? "creating" : "attaching to", shmname, shmsize);
+  WARN("Error while %s shared memory segment %s (size %zu)\n", create ? "creating" : "attaching to", shmname, shmsize);
 cudaError:
   if (fd != -1) close(fd);
   if (create) shm_unlink(shmname);
@@ -59,7 +68,7 @@ static ncclResult_t shmUnlink(const char* shmname) {
   return ncclSuccess;
 }
 
-static ncclResult_t shmClose(void* shmPtr, void* devShmPtr, const int shmsize) {
+static ncclResult_t shmClose(void* shmPtr, void* devShmPtr, const size_t shmsize) {
   CUDACHECK(cudaHostUnregister(shmPtr));
   if (munmap(shmPtr, shmsize) != 0) {
     WARN("munmap of shared memory failed");
@@ -0,0 +1,82 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_TIMELINE_H_
+#define NCCL_TIMELINE_H_
+
+#include "core.h"
+#include <time.h>
+
+// Timeline profiler (NCCL_TIMELINE_FILE) : events are recorded into a ring
+// buffer of NCCL_TIMELINE_EVENTS entries and written as a Chrome trace when
+// the communicator is destroyed. Recording is lock-free, and is skipped
+// altogether when comm->timeline is NULL.
+enum ncclTimelineType {
+  ncclTimelineEnqueue, // Host time spent in the NCCL call, arg : ncclColl_t
+  ncclTimelineKernel,  // Operation run by a block, arg : funcIndex
+  ncclTimelineNetSend, // Send posted to completed, arg : peer
+  ncclTimelineNetRecv, // Receive posted to completed, arg : peer
+  ncclTimelineNetFlush,// GDR flush posted to completed, arg : peer
+  ncclTimelineNumTypes
+};
+
+struct ncclTimelineEvent {
+  uint64_t start; // ns, CLOCK_REALTIME (GPU events use %globaltimer)
+  uint64_t end;
+  uint64_t opCount;
+  int64_t bytes;
+  int16_t type;
+  int16_t channel;
+  int32_t arg;
+};
+
+// Operation saved in a FIFO slot, waiting for its kernel timestamps
+struct ncclTimelineColl {
+  uint64_t opCount;
+  int funcIndex;
+  int valid;
+};
+
+struct ncclTimeline {
+  uint64_t head; // Next event, claimed with an atomic increment
+  uint64_t nEvents;
+  struct ncclTimelineEvent* events;
+  char* file;
+  struct ncclTimelineColl* colls[MAXCHANNELS];
+};
+
+static inline uint64_t ncclTimelineClock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// Oldest events are overwritten once the ring is full
+static inline void ncclTimelineAdd(struct ncclTimeline* tl, int type, int channel, int arg, uint64_t opCount, int64_t bytes, uint64_t start, uint64_t end) {
+  uint64_t index = __atomic_fetch_add(&tl->head, 1, __ATOMIC_RELAXED);
+  struct ncclTimelineEvent* e = tl->events+(index%tl->nEvents);
+  e->start = start;
+  e->end = end;
+  e->opCount = opCount;
+  e->bytes = bytes;
+  e->type = type;
+  e->channel = channel;
+  e->arg = arg;
+}
+
+// Peer of the connector of a proxy operation
+static inline int ncclTimelinePeer(struct ncclProxyArgs* args) {
+  return ((char*)args->connector - (char*)args->channel->peers) / sizeof(struct ncclPeer);
+}
+
+ncclResult_t ncclTimelineInit(struct ncclComm* comm);
+// Record the operation saved in a FIFO slot, collecting the timestamps of
+// the one it replaces
+void ncclTimelineSaveColl(struct ncclComm* comm, struct ncclChannel* channel, int opIndex, struct ncclColl* coll);
+// Write the trace and free the timeline
+ncclResult_t ncclTimelineFree(struct ncclComm* comm);
+
+#endif
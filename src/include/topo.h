@@ -8,6 +8,7 @@
 #define NCCL_TOPO_H_
 
 #include "nccl.h"
+#include "transport.h"
 #include <limits.h>
 #include <stdlib.h>
 #include <ctype.h>
@@ -42,4 +43,26 @@ extern const char* pathDists[PATH_ARRAY_SIZE];
 
 int pciDistance(char* path1, char* path2);
 
+// Topology file (NCCL_TOPO_FILE), replacing what is probed when it is wrong,
+// e.g. in VMs and containers with virtualized PCI paths :
+// <system version="1">
+//   <gpu busid="0000:07:00.0" path="/sys/devices/pci0000:00/..." numa="0"/>
+//   <nic dev="0" path="/sys/devices/pci0000:00/..." numa="0"/>
+//   <link src="0000:07:00.0" dst="0000:08:00.0" transport="P2P" value="7"/>
+//   <link src="0000:07:00.0" dst="net" transport="NET" value="1"/>
+// </system>
+// Links set the transport and value used to build rings between two GPUs of
+// the same node, or from a GPU to any other node (dst="net"). Anything not
+// in the file is probed as usual. NCCL_TOPO_DUMP_FILE writes what rank 0
+// detected in the same format.
+ncclResult_t ncclTopoInit();
+// Set *path to NULL when the file does not give one
+ncclResult_t ncclTopoGpuPath(const char* busId, char** path);
+ncclResult_t ncclTopoNicPath(int dev, char** path);
+// The NUMA node of a device given in the topology file, or read from sysfs
+int ncclTopoNumaId(char* path);
+ncclResult_t ncclTopoGpuNumaId(int cudaDev, int* numaId);
+ncclResult_t ncclTopoGetLink(struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo, int* transport, ncclTvalue_t* value);
+ncclResult_t ncclTopoDump(struct ncclPeerInfo* peerInfo, int nranks, int rank, int* connectTransport, ncclTvalue_t* connectValue);
+
 #endif
@@ -10,9 +10,12 @@
 #include "nccl.h"
 #include "devcomm.h"
 #include <stdint.h>
+#include <sched.h>
 #include "nvmlwrap.h"
 
-#define NTRANSPORTS 3
+#define NTRANSPORTS 4
+// Transports connect pairs of peers. The collective network of the net
+// plugin connects groups of nodes instead, see collnet.h.
 
 extern struct ncclTransport ncclTransports[];
 
@@ -41,6 +44,7 @@ struct ncclConnect {
 enum ncclProxyOpState { ncclProxyOpNone, ncclProxyOpReady, ncclProxyOpProgress };
 
 struct ncclProxyArgs;
+struct ncclRegBuffer;
 typedef ncclResult_t (*proxyProgressFunc_t)(struct ncclProxyArgs*);
 
 struct ncclProxyArgs {
@@ -51,15 +55,38 @@ struct ncclProxyArgs {
   int chunkSteps;
   int nsteps;
   uint64_t opCount;
-  int llMode;
+  int opCountValid; // 0 for Send/Recv, which don't follow comm->opCount
+  int protocol; // NCCL_PROTO_*
+  int stepShift; // See CollectiveArgs.stepShift
+  // Zero-copy : user buffer the network reads from (send) or writes to (recv)
+  struct ncclRegBuffer* zcopyReg;
+  char* zcopyBuff;
+  ssize_t zcopyBytes;
   int state;   // add component before this line -- it is left out during initialization
 
   // Internal state
   uint64_t head;
   uint64_t tail;
+  uint64_t received; // Receives done, waiting for their flush (recv only)
   uint64_t end;
+  // Simple protocol : step where the previous operation stopped, when its
+  // steps had another size. Their slots overlap ours, nothing is written
+  // until the receiver consumed them all. Zero otherwise.
+  uint64_t drainStep;
+  // Several steps are posted at once with isendv/irecvv. The request sits in
+  // the slot of the first one, with the number of steps it covers, and its
+  // size once it completed (-1 before).
   void* requests[NCCL_STEPS];
+  int reqSteps[NCCL_STEPS];
+  int reqSizes[NCCL_STEPS];
+  void* zcopyMhandle;
   int idle;
+  // Timeline : time each step was posted to the network, and its size
+  uint64_t stepTimes[NCCL_STEPS];
+  int stepBytes[NCCL_STEPS];
+  // Profiler plugin : handles of the operation and of each step
+  void* profHandle;
+  void* stepProfHandles[NCCL_STEPS];
 
   // Element linking
   pthread_mutex_t mutex;
@@ -67,14 +94,60 @@ struct ncclProxyArgs {
   struct ncclProxyArgs* nextPeer;
 };
 
-struct ncclProxyPool;
-struct ncclProxyState {
+#define NCCL_PROXY_FIFO_SIZE 4096
+#define NCCL_PROXY_MAX_THREADS 8
+
+struct ncclProxyState;
+
+// One proxy thread. Each thread owns the channels c such that
+// c % nThreads == id, and progresses their operations.
+struct ncclProxyThread {
+  pthread_t thread;
+  struct ncclProxyState* shared;
+  int cudaDev;
+  cpu_set_t cpuAffinity; // Of the application, see ncclComm
+  int id;
+  // Only used to sleep when there is nothing to do
   pthread_cond_t cond;
   pthread_mutex_t mutex;
-  bool stop;
+  int sleeping;
+  // Circular list of active operations, only accessed by the proxy thread
   struct ncclProxyArgs* ops;
+  // Operations posted by the launching threads. Single consumer ring : the
+  // launching threads move the tail under postMutex (several communicators
+  // may share the thread), the proxy thread moves the head.
+  pthread_mutex_t postMutex;
+  uint64_t postedHead;
+  struct ncclProxyArgs* posted[NCCL_PROXY_FIFO_SIZE];
+  uint64_t postedTail;
+};
+
+// Proxy threads, shared by a communicator and the communicators split from
+// it. The last one to be destroyed stops the threads.
+struct ncclProxyState {
+  int refCount;
+  bool stop;
+  int nThreads;
+  struct ncclProxyThread* threads;
+  // Idle policy (NCCL_PROXY_SPIN/YIELD/SLEEP_TIME), in ns
+  uint64_t spinTime;
+  uint64_t yieldTime;
+  uint64_t sleepTime;
+  // Time spent by all threads progressing operations, or idle, in ns
+  uint64_t busyTime;
+  uint64_t idleTime;
+};
+
+// Proxy operation elements of a communicator : allocated from pool by the
+// launching thread, and returned to freed by the proxy threads.
+struct ncclProxyPool;
+struct ncclProxyOps {
   struct ncclProxyArgs* pool;
+  struct ncclProxyArgs* freed;
   struct ncclProxyPool* pools;
+  // Operations posted, and completed by the proxy threads
+  uint64_t posted;
+  uint64_t done;
 };
 
 struct ncclTransportComm {
@@ -84,6 +157,20 @@ struct ncclTransportComm {
   ncclResult_t (*proxy)(struct ncclProxyArgs*);
 };
 
+// Connector shared by a communicator and those split from it with
+// NCCL_SPLIT_SHARE=1. All their kernels keep the state of the connection in
+// devConn, and their proxy operations queue behind each other on proxyAppend.
+// The last one to release it frees the transport resources.
+struct ncclSharedConnector {
+  int refCount;
+  struct ncclConnInfo* devConn;
+  struct ncclProxyArgs* proxyAppend;
+};
+
+// Drop the reference of connector to its resources, which the caller must
+// free when last is set
+ncclResult_t ncclConnectorRelease(struct ncclConnector* connector, int* last);
+
 struct ncclTransport {
   const char name[4];
   ncclResult_t (*canConnect)(ncclTvalue_t*, struct ncclPeerInfo*, struct ncclPeerInfo*);
@@ -93,6 +180,7 @@ struct ncclTransport {
 };
 
 #include <pthread.h>
+#include <sched.h>
 
 typedef ncclResult_t (*threadFunc_t)(struct ncclProxyArgs*);
 
@@ -104,10 +192,25 @@ enum proxyMode {
 
 ncclResult_t transportAllocateProxyArgs(struct ncclComm* comm, struct ncclProxyArgs** argsptr);
 ncclResult_t transportSaveProxies(struct ncclProxyArgs* args, int pattern, int root, int nranks);
+ncclResult_t transportSaveP2pProxy(struct ncclProxyArgs* args, int peer, int send);
 ncclResult_t transportStartProxy(struct ncclComm* comm);
-ncclResult_t transportCreateProxy(struct ncclComm* comm);
+// Start the proxy threads, or share those of another communicator
+ncclResult_t transportCreateProxy(struct ncclComm* comm, struct ncclProxyState* share);
 ncclResult_t transportDestroyProxy(struct ncclComm* comm);
 
+// CPUs close to the NIC used by a channel (transport/net.cc)
+ncclResult_t netGetCpuAffinity(int cudaDev, int channelId, cpu_set_t* mask);
+
+// Record the connections of a channel to peers, with FIFOs of recvSizes and
+// sendSizes bytes (channel->buffSize if NULL), skipping connectors which are
+// already connected with that size. p2pSetup then connects all recorded
+// connectors with a single exchange per peer.
+ncclResult_t p2pPrepare(struct ncclComm* comm, struct ncclChannel* channel, int nrecv, int* peerRecv, int* recvSizes, int nsend, int* peerSend, int* sendSizes);
+ncclResult_t p2pSetup(struct ncclComm* comm);
+// Connect the trees of all channels. Called by all ranks after the first
+// operation which would have used them.
+ncclResult_t ncclTreeConnect(struct ncclComm* comm);
+
 #include <unistd.h>
 
 // Spin wait until func evaluates to true
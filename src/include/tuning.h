@@ -0,0 +1,62 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_TUNING_H_
+#define NCCL_TUNING_H_
+
+#include "core.h"
+
+// Fill the latency/bandwidth tables of the communicator, and compute the
+// tree threshold from them unless the user set it.
+ncclResult_t ncclTuningInit(struct ncclComm* comm, int nnodes);
+
+// Online auto-tuning (NCCL_AUTOTUNE=1)
+#define NCCL_AUTOTUNE_MAX_CANDIDATES 18 // algorithms x protocols x 3 channel counts
+#define NCCL_AUTOTUNE_BUCKETS 64 // log2 of the size in bytes
+
+struct ncclTuneConfig {
+  int algorithm;
+  int protocol;
+  int nChannels;
+};
+
+struct ncclTuneEntry {
+  int nTried; // Candidates already timed
+  int tuned;  // Set once ranks agreed on a winner
+  int winner;
+  float times[NCCL_AUTOTUNE_MAX_CANDIDATES];
+};
+
+struct ncclAutoTune {
+  int nCandidates;
+  struct ncclTuneConfig candidates[NCCL_AUTOTUNE_MAX_CANDIDATES];
+  cudaEvent_t start;
+  cudaEvent_t stop;
+  // Persistent cache (NCCL_AUTOTUNE_FILE), keyed by a hash of the topology
+  const char* file;
+  uint64_t topoHash;
+  struct ncclTuneEntry entries[ncclCollCount][ncclNumTypes][NCCL_AUTOTUNE_BUCKETS];
+};
+
+ncclResult_t ncclAutoTuneInit(struct ncclComm* comm);
+ncclResult_t ncclAutoTuneFree(struct ncclComm* comm);
+// Set info->config from the cached decision. If we are still tuning and
+// blocking is allowed, pick the next candidate to try and set *trial.
+ncclResult_t ncclAutoTuneStart(struct ncclInfo* info, int blocking, int* trial);
+// Time the trial and, once all candidates were tried, agree on the winner.
+ncclResult_t ncclAutoTuneEnd(struct ncclInfo* info, int trial);
+
+// Estimated time (in us) of an operation, or -1 if the algorithm/protocol
+// combination is not supported for that collective.
+static inline float ncclTuningTime(struct ncclComm* comm, ncclColl_t coll, int algo, int proto, int nChannels, size_t nBytes) {
+  if (nChannels < 1) nChannels = 1;
+  if (nChannels > MAXCHANNELS) nChannels = MAXCHANNELS;
+  float bw = comm->bandwidths[coll][algo][proto][nChannels-1];
+  if (bw == 0) return -1.0;
+  return comm->latencies[coll][algo][proto] + nBytes / bw;
+}
+
+#endif
@@ -0,0 +1,35 @@
+/*************************************************************************
+ * Copyright (c) 2016-2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#ifndef NCCL_URINGWRAP_H_
+#define NCCL_URINGWRAP_H_
+
+#include "core.h"
+#include <sys/uio.h>
+
+// Minimal io_uring ring, driven through the raw system calls so that we
+// don't depend on liburing. Each ring is used by a single thread.
+struct ncclUring;
+
+// Whether the kernel supports io_uring with the socket operations we need
+ncclResult_t ncclUringSupported(int* supported);
+
+ncclResult_t ncclUringInit(struct ncclUring** ring, int entries);
+ncclResult_t ncclUringDestroy(struct ncclUring* ring);
+
+// Queue a send (write) or receive (read) on a socket. bufIndex is the index
+// of a registered buffer containing [addr, addr+len), or -1. Returns
+// ncclInternalError if the submission queue is full.
+ncclResult_t ncclUringPrepSocket(struct ncclUring* ring, int send, int fd, void* addr, int len, int bufIndex, uint64_t userData);
+// Submit everything queued ; block until at least waitNr completions are available
+ncclResult_t ncclUringSubmit(struct ncclUring* ring, int waitNr);
+// Pop one completion. *found is 0 if there is none.
+ncclResult_t ncclUringReap(struct ncclUring* ring, int* found, uint64_t* userData, int* res);
+
+ncclResult_t ncclUringRegisterBuffers(struct ncclUring* ring, struct iovec* iovs, int nIovs);
+ncclResult_t ncclUringUnregisterBuffers(struct ncclUring* ring);
+
+#endif
@@ -11,9 +11,17 @@
 #include <stdint.h>
 
 ncclResult_t getHostName(char* hostname, int maxlen, const char delim);
+uint64_t getHash(const char* string);
 uint64_t getHostHash();
 uint64_t getPidHash();
 
+// NUMA node to place host memory close to a device of node numaId on, -1 for
+// the default placement (unknown node, or NCCL_NUMA_ALLOC=0)
+int ncclNumaAllocId(int numaId);
+// Place the pages of [ptr, ptr+size) on node numaId (-1 : do nothing). Must
+// be called before they are touched. Failures only cost locality.
+void ncclNumaBind(void* ptr, size_t size, int numaId);
+
 struct netIf {
   char prefix[64];
   int port;
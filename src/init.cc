@@ -14,6 +14,10 @@
 #include "bootstrap.h"
 #include "transport.h"
 #include "group.h"
+#include "copyengine.h"
+#include "oneshot.h"
+#include "hierarchy.h"
+#include "collnet.h"
 #include "utils.h"
 #include "net.h"
 #include "checks.h"
@@ -21,6 +25,9 @@
 #include "topo.h"
 #include "nvlink.h"
 #include "cpuset.h"
+#include "tuning.h"
+#include "timeline.h"
+#include "profiler.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
@@ -58,6 +65,7 @@ NCCL_PARAM(GroupCudaStream, "GROUP_CUDA_STREAM", NCCL_GROUP_CUDA_STREAM);
 NCCL_PARAM(CheckPointers, "CHECK_POINTERS", 0);
 
 ncclNet_t* ncclNet = NULL;
+ncclCollNet_t* ncclCollNet = NULL;
 
 // We define this as weak to let tests redefine their own
 #pragma weak ncclNvlinkGpu
@@ -96,6 +104,45 @@ ncclResult_t initNet(ncclNet_t* net) {
   return ncclSuccess;
 }
 
+static ncclResult_t initCollNet(ncclCollNet_t* collNet) {
+  int ndev;
+  if (collNet->init(ncclDebugLog) != ncclSuccess) return ncclInternalError;
+  if (collNet->devices(&ndev) != ncclSuccess) return ncclInternalError;
+  if (ndev <= 0) return ncclSystemError;
+  return ncclSuccess;
+}
+
+// Plugins implementing the v2 API only have a blocking flush
+static ncclNet_v2_t* ncclNetPluginV2;
+static ncclNet_t ncclNetPluginV2Compat;
+static ncclResult_t ncclNetPluginV2Iflush(void* recvComm, void* data, int size, void* mhandle, void** request) {
+  *request = NULL;
+  return ncclNetPluginV2->flush(recvComm, data, size, mhandle);
+}
+
+static ncclNet_t* ncclNetFromV2(ncclNet_v2_t* net) {
+  ncclNetPluginV2 = net;
+  ncclNetPluginV2Compat.name = net->name;
+  ncclNetPluginV2Compat.init = net->init;
+  ncclNetPluginV2Compat.devices = net->devices;
+  ncclNetPluginV2Compat.pciPath = net->pciPath;
+  ncclNetPluginV2Compat.ptrSupport = net->ptrSupport;
+  ncclNetPluginV2Compat.listen = net->listen;
+  ncclNetPluginV2Compat.connect = net->connect;
+  ncclNetPluginV2Compat.accept = net->accept;
+  ncclNetPluginV2Compat.regMr = net->regMr;
+  ncclNetPluginV2Compat.deregMr = net->deregMr;
+  ncclNetPluginV2Compat.isend = net->isend;
+  ncclNetPluginV2Compat.irecv = net->irecv;
+  ncclNetPluginV2Compat.iflush = ncclNetPluginV2Iflush;
+  ncclNetPluginV2Compat.test = net->test;
+  ncclNetPluginV2Compat.closeSend = net->closeSend;
+  ncclNetPluginV2Compat.closeRecv = net->closeRecv;
+  ncclNetPluginV2Compat.closeListen = net->closeListen;
+  // getProperties, isendv, irecvv and testAny are left NULL
+  return &ncclNetPluginV2Compat;
+}
+
 ncclResult_t initNetPlugin(ncclNet_t** net) {
   void* netPluginLib = dlopen("libnccl-net.so", RTLD_NOW | RTLD_LOCAL);
   if (netPluginLib == NULL) {
@@ -111,11 +158,23 @@ ncclResult_t initNetPlugin(ncclNet_t** net) {
   }
   ncclNet_t* extNet = (ncclNet_t*) dlsym(netPluginLib, STR(NCCL_PLUGIN_SYMBOL));
   if (extNet == NULL) {
-    INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Failed to find " STR(NCCL_PLUGIN_SYMBOL) " symbol.");
-    goto cleanup;
+    ncclNet_v2_t* extNetV2 = (ncclNet_v2_t*) dlsym(netPluginLib, "ncclNetPlugin_v2");
+    if (extNetV2 == NULL) {
+      INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Failed to find " STR(NCCL_PLUGIN_SYMBOL) " or ncclNetPlugin_v2 symbol.");
+      goto cleanup;
+    }
+    extNet = ncclNetFromV2(extNetV2);
   }
   if (initNet(extNet) == ncclSuccess) {
     *net = extNet;
+    // The collective network is optional, and only used with its network
+    ncclCollNet_t* extCollNet = (ncclCollNet_t*) dlsym(netPluginLib, STR(NCCL_COLLNET_PLUGIN_SYMBOL));
+    if (extCollNet == NULL) {
+      INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: No " STR(NCCL_COLLNET_PLUGIN_SYMBOL) " symbol, collective network disabled.");
+    } else if (initCollNet(extCollNet) == ncclSuccess) {
+      INFO(NCCL_INIT|NCCL_NET, "NET/Plugin: Using collective network %s", extCollNet->name);
+      ncclCollNet = extCollNet;
+    }
     return ncclSuccess;
   }
 cleanup:
@@ -123,6 +182,53 @@ cleanup:
   return ncclSuccess;
 }
 
+ncclProfiler_t* ncclProfiler = NULL;
+
+// NCCL_PROFILER_PLUGIN selects the library, libnccl-profiler.so by default
+static ncclResult_t initProfilerPlugin() {
+  const char* name = getenv("NCCL_PROFILER_PLUGIN");
+  if (name == NULL || strlen(name) == 0) name = "libnccl-profiler.so";
+  void* profilerPluginLib = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+  if (profilerPluginLib == NULL) {
+    if (errno == ENOENT) {
+      INFO(NCCL_INIT, "PROFILER/Plugin : No plugin found (%s).", name);
+    } else {
+      INFO(NCCL_INIT, "PROFILER/Plugin : Plugin load returned %d : %s.", errno, dlerror());
+    }
+    return ncclSuccess;
+  }
+  ncclProfiler_t* extProfiler = (ncclProfiler_t*) dlsym(profilerPluginLib, STR(NCCL_PROFILER_PLUGIN_SYMBOL));
+  if (extProfiler == NULL || extProfiler->init == NULL || extProfiler->startEvent == NULL || extProfiler->stopEvent == NULL) {
+    INFO(NCCL_INIT, "PROFILER/Plugin : Failed to find a valid " STR(NCCL_PROFILER_PLUGIN_SYMBOL) " symbol.");
+    dlclose(profilerPluginLib);
+    return ncclSuccess;
+  }
+  INFO(NCCL_INIT, "PROFILER/Plugin : Using %s", extProfiler->name);
+  ncclProfiler = extProfiler;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclProfilerCommInit(struct ncclComm* comm) {
+  if (ncclProfiler == NULL) return ncclSuccess;
+  // A failing plugin only disables profiling for this communicator
+  if (ncclProfiler->init(&comm->profilerContext, comm->rank, comm->nRanks, comm->cudaDev, ncclDebugLog) != ncclSuccess) {
+    INFO(NCCL_INIT, "PROFILER/Plugin : %s init failed, rank %d will not be profiled", ncclProfiler->name, comm->rank);
+    comm->profilerContext = NULL;
+    return ncclSuccess;
+  }
+  comm->profiler = ncclProfiler;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclProfilerCommFinalize(struct ncclComm* comm) {
+  ncclProfiler_t* profiler = comm->profiler;
+  if (profiler == NULL) return ncclSuccess;
+  comm->profiler = NULL;
+  if (profiler->finalize) profiler->finalize(comm->profilerContext);
+  comm->profilerContext = NULL;
+  return ncclSuccess;
+}
+
 ncclResult_t initNet() {
   // Always initialize bootstrap network
   NCCLCHECK(bootstrapNetInit());
@@ -141,6 +247,32 @@ ncclResult_t initNet() {
 NCCL_PARAM(LlThreshold, "LL_THRESHOLD", -2);
 NCCL_PARAM(ThreadThreshold, "THREAD_THRESHOLD", -2);
 NCCL_PARAM(TreeThreshold, "TREE_THRESHOLD", -2);
+NCCL_PARAM(NetZcopyThreshold, "NET_ZCOPY_THRESHOLD", 64*1024*1024);
+NCCL_PARAM(FusionThreshold, "FUSION_THRESHOLD", 0);
+NCCL_PARAM(FusionBuffSize, "FUSION_BUFFSIZE", 4*1024*1024);
+NCCL_PARAM(AllReduceCompress, "ALLREDUCE_COMPRESS", NCCL_COMPRESS_NONE);
+NCCL_PARAM(MaxCtas, "MAX_CTAS", 0);
+NCCL_PARAM(CeThreshold, "CE_THRESHOLD", 0);
+NCCL_PARAM(HierAllReduce, "HIER_ALLREDUCE", 0);
+NCCL_PARAM(CollNetEnable, "COLLNET_ENABLE", 0);
+NCCL_PARAM(Ll128Enable, "LL128_ENABLE", -2);
+NCCL_PARAM(LlWarpPoll, "LL_WARP_POLL", 1);
+
+// LL128 needs the 128 bytes written by a warp to land at once : only allow it
+// on rings going through P2P (index 0 of ncclTransports) and the network, and
+// by default only on Volta and later with NVLink. NCCL_LL128_ENABLE=1 skips
+// the hardware check, 0 disables it.
+static int ncclLl128Enable(int nranks, int nrings, int* next, int* connectTransport, int minCompCap, int nvlink) {
+  int enable = ncclParamLl128Enable();
+  if (enable == 0) return 0;
+  for (int r=0; r<nrings; r++) {
+    for (int i=0; i<nranks; i++) {
+      int t = connectTransport[i*nranks+next[r*nranks+i]];
+      if (t != 0 && t != NTRANSPORTS-1) return 0;
+    }
+  }
+  return enable == 1 || (minCompCap >= 7 && nvlink);
+}
 
 int ncclThreadThreshold(int minCompCap, int multiNode) {
   int threshold = ncclParamThreadThreshold();
@@ -163,6 +295,8 @@ static ncclResult_t ncclInit() {
     initEnv();
     initDebug();
     initNet();
+    initProfilerPlugin();
+    ncclTopoInit();
     initialized = true;
   }
   pthread_mutex_unlock(&initLock);
@@ -188,17 +322,80 @@ void __attribute__((optimize("O0"))) commPoison(ncclComm_t comm) {
   comm->rank = comm->cudaDev = comm->nvmlDev = comm->nRanks = -1;
 }
 
+static ncclResult_t regBufferFree(struct ncclRegBuffer* reg) {
+  while (reg->netHandles) {
+    struct ncclRegNetHandle* next = reg->netHandles->next;
+    NCCLCHECK(ncclNetDeregMr(reg->netHandles->netComm, reg->netHandles->mhandle));
+    free(reg->netHandles);
+    reg->netHandles = next;
+  }
+  pthread_mutex_destroy(&reg->mutex);
+  free(reg);
+  return ncclSuccess;
+}
+
+static ncclResult_t freeRetiredConnectors(struct ncclComm* comm) {
+  while (comm->retiredConnectors) {
+    struct ncclRetiredConnector* retired = comm->retiredConnectors;
+    comm->retiredConnectors = retired->next;
+    ncclResult_t ret = retired->transportComm->free(retired->transportResources);
+    free(retired);
+    NCCLCHECK(ret);
+  }
+  return ncclSuccess;
+}
+
 static ncclResult_t commFree(ncclComm_t comm) {
   if (comm == NULL)
     return ncclSuccess;
 
+  NCCLCHECK(ncclLauncherDestroy(comm));
+
+  // Internal communicators split from this one
+  NCCLCHECK(ncclHierFree(comm));
+  NCCLCHECK(ncclCollNetFree(comm));
+  NCCLCHECK(ncclTimelineFree(comm));
+  NCCLCHECK(ncclProfilerCommFinalize(comm));
+
   free(comm->peerInfo);
+  free(comm->connectTransport);
+  free(comm->connectValue);
+  free(comm->connectSend);
+  free(comm->connectRecv);
+  NCCLCHECK(ncclAutoTuneFree(comm));
+
+  ncclP2pFree(comm);
+  NCCLCHECK(freeRetiredConnectors(comm));
+  free(comm->p2pSends);
+  free(comm->p2pRecvs);
+
+  free(comm->fusionOps);
+  if (comm->fusionBuff) {
+    CUDACHECK(cudaFree(comm->fusionBuff));
+    CUDACHECK(cudaEventDestroy(comm->fusionEvent));
+    CUDACHECK(cudaEventDestroy(comm->fusionStreamsEvent));
+  }
+
+  NCCLCHECK(ncclCopyEngineFree(comm));
+  NCCLCHECK(ncclOneShotFree(comm));
+
+  // Network registrations must be released before the connections are closed
+  while (comm->regBuffers) {
+    struct ncclRegBuffer* next = comm->regBuffers->next;
+    NCCLCHECK(regBufferFree(comm->regBuffers));
+    comm->regBuffers = next;
+  }
 
   if (comm->bootstrap)
     NCCLCHECK(bootstrapClose(comm->bootstrap));
 
-  CUDACHECK(cudaFree(comm->hostDevComm.channels));
-  CUDACHECK(cudaFree(comm->devComm));
+  NCCLCHECK(ncclMemPoolFree(comm->hostDevComm.channels));
+  NCCLCHECK(ncclMemPoolFree(comm->hostDevComm.redOpScalars));
+  NCCLCHECK(ncclMemPoolFree(comm->hostDevComm.readyFlags));
+  NCCLCHECK(ncclMemPoolFree(comm->hostDevComm.vLayouts));
+  NCCLCHECK(ncclMemPoolFree(comm->vLayouts));
+  NCCLCHECK(ncclMemPoolFree((void *)comm->vBusy));
+  NCCLCHECK(ncclMemPoolFree(comm->devComm));
 
   for (int channel=0; channel<comm->nChannels; channel++)
     NCCLCHECK(freeChannel(comm->channels+channel, comm->nRanks));
@@ -206,9 +403,7 @@ static ncclResult_t commFree(ncclComm_t comm) {
   if (comm->doneEvent != NULL)
     CUDACHECK(cudaEventDestroy(comm->doneEvent));
 
-  if (comm->launchMode == ncclComm::GROUP) {
-    CUDACHECK(cudaStreamDestroy(comm->groupStream));
-  }
+  CUDACHECK(cudaStreamDestroy(comm->groupStream));
 
   // Last rank frees shared resources between threads
   int isLast;
@@ -220,8 +415,10 @@ static ncclResult_t commFree(ncclComm_t comm) {
     free(comm->intraCGMode);
     free(comm->intraCC);
   }
-  CUDACHECK(cudaFreeHost((void *)comm->abortFlag));
-  CUDACHECK(cudaFreeHost((void *)comm->fatalDevError));
+  NCCLCHECK(ncclMemPoolFree((void *)comm->abortFlag));
+  NCCLCHECK(ncclMemPoolFree((void *)comm->fatalDevError));
+  NCCLCHECK(ncclMemPoolFree(comm->doorbells));
+  NCCLCHECK(ncclMemPoolDestroy(&comm->memPool));
 
   // Poison comm to try and catch a double free
   commPoison(comm);
@@ -230,7 +427,7 @@ static ncclResult_t commFree(ncclComm_t comm) {
   return ncclSuccess;
 }
 
-static ncclResult_t commAlloc(ncclComm_t* comret, int ndev, int rank) {
+static ncclResult_t commAlloc(struct ncclComm* comm, int ndev, int rank) {
   if (ndev < 1) {
     WARN("invalid device count (%d) requested", ndev);
     return ncclInvalidArgument;
@@ -245,9 +442,6 @@ static ncclResult_t commAlloc(ncclComm_t* comret, int ndev, int rank) {
   cudaEvent_t doneEvent;
   CUDACHECK(cudaEventCreateWithFlags(&doneEvent, cudaEventDisableTiming));
 
-  struct ncclComm* comm;
-  NCCLCHECK(ncclCalloc(&comm, 1));
-
   comm->rank = comm->hostDevComm.rank =rank;
   comm->nRanks = comm->hostDevComm.nRanks = ndev;
   cudaGetDevice(&comm->cudaDev);
@@ -256,7 +450,9 @@ static ncclResult_t commAlloc(ncclComm_t* comret, int ndev, int rank) {
 
   comm->doneEvent = doneEvent;
   comm->llThreshold = ncclParamLlThreshold();
+  comm->hostDevComm.llWarpPoll = ncclParamLlWarpPoll();
   comm->treeThreshold = ncclParamTreeThreshold();
+  comm->netZcopyThreshold = ncclParamNetZcopyThreshold();
   comm->checkPointers = ncclParamCheckPointers() == 1 ? true : false;
 #if CUDART_VERSION >= 9020
   comm->groupCudaStream = ncclParamGroupCudaStream();
@@ -266,21 +462,56 @@ static ncclResult_t commAlloc(ncclComm_t* comret, int ndev, int rank) {
 #endif
   comm->fatalError = ncclSuccess;
 
-  NCCLCHECK(ncclCudaHostAlloc((void**) &comm->fatalDevError, (void**) &comm->hostDevComm.fatalDevError, sizeof(ncclDevError_t)));
+  NCCLCHECK(ncclPoolHostAlloc(&comm->memPool, (void**) &comm->fatalDevError, (void**) &comm->hostDevComm.fatalDevError, sizeof(ncclDevError_t)));
   *comm->fatalDevError = ncclDevSuccess;
 
-  NCCLCHECK(ncclCudaHostAlloc((void**) &comm->abortFlag, (void**) &comm->hostDevComm.abortFlag, sizeof(uint32_t)));
+  NCCLCHECK(ncclPoolHostAlloc(&comm->memPool, (void**) &comm->abortFlag, (void**) &comm->hostDevComm.abortFlag, sizeof(uint32_t)));
   *comm->abortFlag = 0;
 
+  NCCLCHECK(ncclPoolHostAlloc(&comm->memPool, (void**) &comm->doorbells, (void**) &comm->devDoorbells, MAXCHANNELS*CACHE_LINE_SIZE, CACHE_LINE_SIZE));
+
   comm->argsptr = &comm->args;
 
-  *comret = comm;
+  NCCLCHECK(ncclCalloc(&comm->p2pSends, comm->nRanks));
+  NCCLCHECK(ncclCalloc(&comm->p2pRecvs, comm->nRanks));
+  NCCLCHECK(ncclCalloc(&comm->connectSend, comm->nRanks));
+  NCCLCHECK(ncclCalloc(&comm->connectRecv, comm->nRanks));
+
+  comm->maxCTAs = ncclParamMaxCtas();
+  if (comm->maxCTAs < 0) {
+    WARN("NCCL_MAX_CTAS=%d : invalid value, ignoring", comm->maxCTAs);
+    comm->maxCTAs = 0;
+  }
+
+  comm->ceThreshold = ncclParamCeThreshold();
+  comm->hierAllReduce = ncclParamHierAllReduce();
+  comm->collNetEnable = ncclParamCollNetEnable();
+
+  comm->allReduceCompress = ncclParamAllReduceCompress();
+#if !defined(__CUDA_BF16_TYPES_EXIST__)
+  if (comm->allReduceCompress == NCCL_COMPRESS_BF16) {
+    WARN("NCCL_ALLREDUCE_COMPRESS=%d : bfloat16 requires CUDA 11, disabling", NCCL_COMPRESS_BF16);
+    comm->allReduceCompress = NCCL_COMPRESS_NONE;
+  }
+#endif
+  if (comm->allReduceCompress < NCCL_COMPRESS_NONE || comm->allReduceCompress > NCCL_COMPRESS_BF16) {
+    WARN("NCCL_ALLREDUCE_COMPRESS=%d : invalid value, disabling", comm->allReduceCompress);
+    comm->allReduceCompress = NCCL_COMPRESS_NONE;
+  }
+
+  if (ncclParamFusionThreshold() > 0 && ndev > 1) {
+    comm->fusionBuffSize = ncclParamFusionBuffSize();
+    comm->fusionThreshold = std::min<ssize_t>(ncclParamFusionThreshold(), comm->fusionBuffSize);
+    NCCLCHECK(ncclCudaCalloc(&comm->fusionBuff, comm->fusionBuffSize));
+    CUDACHECK(cudaEventCreateWithFlags(&comm->fusionEvent, cudaEventDisableTiming));
+    CUDACHECK(cudaEventCreateWithFlags(&comm->fusionStreamsEvent, cudaEventDisableTiming));
+  }
   return ncclSuccess;
 }
 
 static ncclResult_t devCommSetup(ncclComm_t comm) {
   // Duplicate the channels on the device
-  NCCLCHECK(ncclCudaCalloc(&comm->hostDevComm.channels, comm->nChannels));
+  NCCLCHECK(ncclPoolCudaCalloc(&comm->memPool, &comm->hostDevComm.channels, comm->nChannels));
   NCCLCHECK(ncclCudaMemcpy(comm->hostDevComm.channels, comm->channels, comm->nChannels));
 
   // Copy userRanks and peers
@@ -289,8 +520,16 @@ static ncclResult_t devCommSetup(ncclComm_t comm) {
     NCCLCHECK(ncclCudaMemcpy(comm->channels[r].devPeers, comm->channels[r].peers, comm->nRanks));
   }
 
+  NCCLCHECK(ncclPoolCudaCalloc(&comm->memPool, &comm->hostDevComm.redOpScalars, NCCL_MAX_USER_REDOPS));
+  NCCLCHECK(ncclPoolCudaCalloc(&comm->memPool, &comm->hostDevComm.readyFlags, NCCL_MAX_READY_FLAGS));
+  NCCLCHECK(ncclPoolCudaCalloc(&comm->memPool, &comm->hostDevComm.vLayouts, NCCL_MAX_VOPS*2*comm->nRanks));
+  // Layouts are staged in host memory, then copied on the stream of the operation
+  void* vLayoutsDev;
+  NCCLCHECK(ncclPoolHostAlloc(&comm->memPool, (void**) &comm->vLayouts, &vLayoutsDev, NCCL_MAX_VOPS*2*comm->nRanks*sizeof(size_t)));
+  NCCLCHECK(ncclPoolHostAlloc(&comm->memPool, (void**) &comm->vBusy, (void**) &comm->hostDevComm.vBusy, NCCL_MAX_VOPS*MAXCHANNELS));
+
   // Duplicate the dev comm on the device
-  NCCLCHECK(ncclCudaCalloc(&comm->devComm, 1));
+  NCCLCHECK(ncclPoolCudaCalloc(&comm->memPool, &comm->devComm, 1));
   NCCLCHECK(ncclCudaMemcpy(comm->devComm, &comm->hostDevComm, 1));
   return ncclSuccess;
 }
@@ -330,13 +569,23 @@ static ncclResult_t fillInfo(struct ncclPeerInfo* info, int rank) {
 
 template <int type>
 static ncclResult_t selectTransport(struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo, struct ncclConnect* connect, struct ncclConnector* connector, int buffSize, int channelId) {
+  // The topology file, when it has this link, decides the transport
+  int topoTransport;
+  ncclTvalue_t topoValue;
+  NCCLCHECK(ncclTopoGetLink(myInfo, peerInfo, &topoTransport, &topoValue));
   for (int t=0; t<NTRANSPORTS; t++) {
     struct ncclTransport *transport = ncclTransports+t;
     struct ncclTransportComm* transportComm = type == 1 ? &transport->send : &transport->recv;
     ncclTvalue_t ret = 0;
-    NCCLCHECK(transport->canConnect(&ret, myInfo, peerInfo));
+    if (topoTransport == -1) {
+      NCCLCHECK(transport->canConnect(&ret, myInfo, peerInfo));
+    } else {
+      ret = topoTransport == t ? 1 : 0;
+    }
     if (ret > 0) {
       connector->transportComm = transportComm;
+      connector->transport = t;
+      connector->conn.buffSize = buffSize;
       NCCLCHECK(transportComm->setup(myInfo, peerInfo, connect, connector, buffSize, channelId));
       return ncclSuccess;
     }
@@ -351,36 +600,12 @@ static int log2(int n) {
  return l;
 }
 
-static ncclResult_t ncclTreeThreshold(int nnodes, int nranks, int nChannels, ssize_t *treeThreshold) {
-  int nvlink;
-  NCCLCHECK(ncclNvlinkGpu(&nvlink));
-  float ringbw = nvlink ? 5000*nChannels : 5000; // approx, in MB/s or B/us
-  float ringlatinter = 6;
-  float treelatintra = 4;
-  float treelatinter = 15;
-  float treebw;
-  if (!nvlink) {
-    treebw = ringbw * 2 / 3;
-  } else {
-    treebw = ringbw * 3 / 4;
-    if (nnodes == 2) treebw *= 2;
-  }
-  float ringlat = ringlatinter*(nranks-1);
-  float treelat = treelatinter*log2(nnodes)+treelatintra*(nranks/nnodes-1);
-  if (nnodes < 2 || ringlat <= treelat)
-    *treeThreshold = 0;
-  else if (treebw > ringbw)
-    *treeThreshold = 0x7fffffffffffffff;
-  else
-    *treeThreshold = (ssize_t)(((ringbw*treebw/(ringbw-treebw)))*(ringlat-treelat));
-  return ncclSuccess;
-}
-
-static ncclResult_t setupChannel(struct ncclComm* comm, int channelId, int rank, int nranks, int* ringRanks, int* treeMasters) {
+static ncclResult_t setupChannel(struct ncclComm* comm, int channelId, int rank, int nranks, int* ringRanks, int* treeMasters, int* connectTransport) {
   TRACE(NCCL_INIT, "rank %d nranks %d", rank, nranks);
   NCCLCHECK(initChannel(comm, channelId));
 
   struct ncclChannel* channel = comm->channels+channelId;
+  channel->buffSize = ncclChannelBuffSize(nranks, ringRanks, connectTransport);
   struct ncclRing* ring = &channel->ring;
 
   // Reorganize ranks to start with rank.
@@ -411,9 +636,6 @@ static ncclResult_t setupChannel(struct ncclComm* comm, int channelId, int rank,
     treeMasters[0] = 1;
   }
 
-  if (comm->treeThreshold == -2)
-    NCCLCHECK(ncclTreeThreshold(nMasters, comm->nRanks, comm->nChannels, &comm->treeThreshold));
-
   if (comm->treeThreshold > 0) {
     // Compute tree depth. Not an exact value but a good approximation in most
     // cases and consistent across nodes
@@ -471,7 +693,8 @@ static ncclResult_t setupChannel(struct ncclComm* comm, int channelId, int rank,
 
 static ncclResult_t fillConnect(struct ncclPeerInfo* peerInfo, int nranks, int rank, int* connectTransport, ncclTvalue_t* connectValue) {
   for (int r=0; r<nranks; r++) {
-    connectTransport[r] = -1;
+    NCCLCHECK(ncclTopoGetLink(peerInfo+rank, peerInfo+r, connectTransport+r, connectValue+r));
+    if (connectTransport[r] != -1) continue;
     for (int t=0; t<NTRANSPORTS; t++) {
       NCCLCHECK(ncclTransports[t].canConnect(connectValue+r, peerInfo+rank, peerInfo+r));
       if (connectValue[r] > 0) {
@@ -618,9 +841,11 @@ ncclResult_t ncclCommSetIntra(struct ncclComm* comm, int rank, int ranks, struct
   char* str = getenv("NCCL_LAUNCH_MODE");
   if (comm->intraRanks == 1 || (str && strcmp(str, "PARALLEL") == 0)) {
     comm->launchMode = ncclComm::PARALLEL;
+  } else if (str && strcmp(str, "PIPELINE") == 0) {
+    comm->launchMode = ncclComm::PIPELINE;
   }
+  CUDACHECK(cudaStreamCreateWithFlags(&comm->groupStream, cudaStreamNonBlocking));
   if (comm->launchMode == ncclComm::GROUP) {
-    CUDACHECK(cudaStreamCreateWithFlags(&comm->groupStream, cudaStreamNonBlocking));
 #if CUDART_VERSION >= 9000
     if (*comm->intraCC && (ncclCudaFullCompCap() == *comm->intraCC)) {
       // Check whether the GPU supports Cooperative Group Multi Device Launch
@@ -636,63 +861,352 @@ ncclResult_t ncclCommSetIntra(struct ncclComm* comm, int rank, int ranks, struct
   return ncclSuccess;
 }
 
-static ncclResult_t p2pSetup(struct ncclComm* comm, struct ncclChannel* channel, int nrecv, int* peerRecv, int nsend, int* peerSend) {
-  TRACE(NCCL_INIT, "nsend %d nrecv %d", nsend, nrecv);
-  uint32_t nSkippedSend = 0, nSkippedRecv = 0; /* for tracing */
-  struct ncclConnect connect;
-  struct ncclConnector* conn;
+static ncclResult_t commProxyWait(struct ncclComm* comm);
+
+// A connected connector needs a FIFO of a different size : keep its resources
+// until p2pSetup has talked to the peer, which then no longer uses them.
+// Kernels and proxies of comm may still hold the connector, so wait for the
+// last launch of comm, not for the whole device : kernels of other
+// communicators may be waiting for a peer which is itself reconnecting.
+// Connectors shared with other communicators are left to them.
+static ncclResult_t retireConnector(struct ncclComm* comm, struct ncclConnector* connector) {
+  CUDACHECK(cudaEventSynchronize(comm->doneEvent));
+  NCCLCHECK(commProxyWait(comm));
+  int last;
+  NCCLCHECK(ncclConnectorRelease(connector, &last));
+  if (last) {
+    struct ncclRetiredConnector* retired;
+    NCCLCHECK(ncclCalloc(&retired, 1));
+    retired->transportComm = connector->transportComm;
+    retired->transportResources = connector->transportResources;
+    retired->next = comm->retiredConnectors;
+    comm->retiredConnectors = retired;
+  }
+  ncclDoorbellRelease(comm, connector->conn.doorbell);
+  memset(connector, 0, sizeof(struct ncclConnector));
+  connector->comm = comm;
+  return ncclSuccess;
+}
+
+static ncclResult_t prepareConnector(struct ncclComm* comm, struct ncclConnector* connector, int buffSize, int coll, uint32_t* connectMask, uint32_t mask) {
+  if (connector->connected) {
+    if (connector->conn.buffSize == buffSize) {
+      connector->coll |= coll;
+      return ncclSuccess;
+    }
+    TRACE(NCCL_INIT, "Resizing connection buffer from %d to %d bytes", connector->conn.buffSize, buffSize);
+    NCCLCHECK(retireConnector(comm, connector));
+  }
+  connector->conn.buffSize = buffSize;
+  connector->coll = coll;
+  *connectMask |= mask;
+  return ncclSuccess;
+}
+
+// Sizes are those of the FIFOs, NULL for the collectives (channel->buffSize)
+ncclResult_t p2pPrepare(struct ncclComm* comm, struct ncclChannel* channel, int nrecv, int* peerRecv, int* recvSizes, int nsend, int* peerSend, int* sendSizes) {
+  TRACE(NCCL_INIT, "channel %d nsend %d nrecv %d", channel->id, nsend, nrecv);
+  uint32_t mask = 1 << channel->id;
   for (int i=0; i<nrecv; i++) {
     int peer = peerRecv[i];
     if (peer == -1) continue;
-    conn = &channel->peers[peer].recv;
-    if (conn->connected) { ++nSkippedRecv; continue; }
-    memset(&connect, 0, sizeof(connect));
-    NCCLCHECK(selectTransport<0>(comm->peerInfo+comm->rank, comm->peerInfo+peer, &connect, conn, channel->buffSize, channel->id));
-    NCCLCHECK(bootstrapSend(comm->bootstrap, peer, &connect, sizeof(struct ncclConnect)));
+    NCCLCHECK(prepareConnector(comm, &channel->peers[peer].recv, recvSizes ? recvSizes[i] : channel->buffSize, recvSizes == NULL, comm->connectRecv+peer, mask));
   }
   for (int i=0; i<nsend; i++) {
     int peer = peerSend[i];
     if (peer == -1) continue;
-    conn = &channel->peers[peer].send;
-    if (conn->connected) { ++nSkippedSend; continue; }
-    memset(&connect, 0, sizeof(connect));
-    NCCLCHECK(selectTransport<1>(comm->peerInfo+comm->rank, comm->peerInfo+peer, &connect, conn, channel->buffSize, channel->id));
-    NCCLCHECK(bootstrapSend(comm->bootstrap, peer, &connect, sizeof(struct ncclConnect)));
+    NCCLCHECK(prepareConnector(comm, &channel->peers[peer].send, sendSizes ? sendSizes[i] : channel->buffSize, sendSizes == NULL, comm->connectSend+peer, mask));
   }
-  for (int i=0; i<nsend; i++) {
-    int peer = peerSend[i];
-    if (peer == -1) continue;
-    conn = &channel->peers[peer].send;
-    if (conn->connected) {++nSkippedSend; continue; }
-    memset(&connect, 0, sizeof(connect));
-    NCCLCHECK(bootstrapRecv(comm->bootstrap, peer, &connect, sizeof(struct ncclConnect)));
-    NCCLCHECK(conn->transportComm->connect(&connect, conn));
-    conn->connected = 1;
+  return ncclSuccess;
+}
+
+// Connection information exchanged with a peer, for one channel and direction
+struct ncclConnectEntry {
+  int channel;
+  int send; // Whether the sender of the entry is the sending side
+  struct ncclConnect connect;
+};
+
+struct ncclConnectJobs {
+  struct ncclConnector** conns;
+  struct ncclConnect* connects;
+  int nJobs;
+  int next;
+  int cudaDev;
+  ncclResult_t ret;
+};
+
+static void* connectThreadMain(void* args) {
+  struct ncclConnectJobs* jobs = (struct ncclConnectJobs*)args;
+  ncclResult_t ret = ncclSuccess;
+  if (cudaSetDevice(jobs->cudaDev) != cudaSuccess) ret = ncclUnhandledCudaError;
+  int j;
+  while (ret == ncclSuccess && (j = __atomic_fetch_add(&jobs->next, 1, __ATOMIC_RELAXED)) < jobs->nJobs) {
+    ret = jobs->conns[j]->transportComm->connect(jobs->connects+j, jobs->conns[j]);
   }
-  for (int i=0; i<nrecv; i++) {
-    int peer = peerRecv[i];
-    if (peer == -1) continue;
-    conn = &channel->peers[peer].recv;
-    if (conn->connected) {++nSkippedRecv; continue; }
-    memset(&connect, 0, sizeof(connect));
-    NCCLCHECK(bootstrapRecv(comm->bootstrap, peer, &connect, sizeof(struct ncclConnect)));
-    NCCLCHECK(conn->transportComm->connect(&connect, conn));
-    conn->connected = 1;
-  }
-  TRACE(NCCL_INIT, "nsend %d nrecv %d nSkippedSend %u nSkippedRecv %u - DONE", nsend, nrecv, nSkippedSend, nSkippedRecv);
+  if (ret != ncclSuccess) jobs->ret = ret;
+  return NULL;
+}
+
+NCCL_PARAM(ConnectNThreads, "CONNECT_NTHREADS", 8);
+
+// Run transport connect calls on a pool of threads
+static ncclResult_t connectJobs(struct ncclComm* comm, struct ncclConnectJobs* jobs) {
+  if (jobs->nJobs == 0) return ncclSuccess;
+  jobs->next = 0;
+  jobs->cudaDev = comm->cudaDev;
+  jobs->ret = ncclSuccess;
+  int nThreads = std::min<int>(ncclParamConnectNThreads(), jobs->nJobs);
+  if (nThreads <= 1) {
+    connectThreadMain(jobs);
+    return jobs->ret;
+  }
+  pthread_t* threads;
+  NCCLCHECK(ncclCalloc(&threads, nThreads));
+  for (int t=0; t<nThreads; t++) pthread_create(threads+t, NULL, connectThreadMain, jobs);
+  for (int t=0; t<nThreads; t++) pthread_join(threads[t], NULL);
+  free(threads);
+  return jobs->ret;
+}
+
+ncclResult_t p2pSetup(struct ncclComm* comm) {
+  int nranks = comm->nRanks;
+  ncclResult_t ret = ncclSuccess;
+  struct ncclConnectEntry* entries = NULL;
+  struct ncclConnectJobs sends = { 0 }, recvs = { 0 };
+  int nEntries = 0, nPeers = 0;
+  for (int peer=0; peer<nranks; peer++) {
+    int n = __builtin_popcount(comm->connectSend[peer]) + __builtin_popcount(comm->connectRecv[peer]);
+    if (n) nPeers++;
+    nEntries += n;
+  }
+  if (nEntries == 0) return ncclSuccess;
+  TRACE(NCCL_INIT, "%d connections with %d peers", nEntries, nPeers);
+
+  // One message per peer, in both directions. Both sides have the same
+  // number of entries for each other, as each of our send connectors is
+  // one of its receive connectors and vice versa.
+  NCCLCHECKGOTO(ncclCalloc(&entries, 2*nEntries), ret, end);
+  NCCLCHECKGOTO(ncclCalloc(&sends.conns, nEntries), ret, end);
+  NCCLCHECKGOTO(ncclCalloc(&sends.connects, nEntries), ret, end);
+  NCCLCHECKGOTO(ncclCalloc(&recvs.conns, nEntries), ret, end);
+  NCCLCHECKGOTO(ncclCalloc(&recvs.connects, nEntries), ret, end);
+
+  {
+    // Setup all our connectors, and send their information
+    struct ncclConnectEntry* entry = entries;
+    for (int peer=0; peer<nranks; peer++) {
+      struct ncclConnectEntry* first = entry;
+      for (int c=0; c<comm->nChannels; c++) {
+        struct ncclChannel* channel = comm->channels+c;
+        if (comm->connectRecv[peer] & (1 << c)) {
+          entry->channel = c;
+          entry->send = 0;
+          NCCLCHECKGOTO(selectTransport<0>(comm->peerInfo+comm->rank, comm->peerInfo+peer, &entry->connect, &channel->peers[peer].recv, channel->peers[peer].recv.conn.buffSize, c), ret, end);
+          entry++;
+        }
+        if (comm->connectSend[peer] & (1 << c)) {
+          entry->channel = c;
+          entry->send = 1;
+          NCCLCHECKGOTO(selectTransport<1>(comm->peerInfo+comm->rank, comm->peerInfo+peer, &entry->connect, &channel->peers[peer].send, channel->peers[peer].send.conn.buffSize, c), ret, end);
+          entry++;
+        }
+      }
+      if (entry != first) NCCLCHECKGOTO(bootstrapSend(comm->bootstrap, peer, first, (entry-first)*sizeof(struct ncclConnectEntry)), ret, end);
+    }
+
+    // Receive the information of the peers, and match it with our connectors
+    for (int peer=0; peer<nranks; peer++) {
+      int n = __builtin_popcount(comm->connectSend[peer]) + __builtin_popcount(comm->connectRecv[peer]);
+      if (n == 0) continue;
+      NCCLCHECKGOTO(bootstrapRecv(comm->bootstrap, peer, entry, n*sizeof(struct ncclConnectEntry)), ret, end);
+      for (int i=0; i<n; i++, entry++) {
+        int c = entry->channel;
+        uint32_t* mask = entry->send ? comm->connectRecv+peer : comm->connectSend+peer;
+        if (c < 0 || c >= comm->nChannels || (*mask & (1 << c)) == 0) {
+          WARN("Unexpected connection from peer %d on channel %d", peer, c);
+          ret = ncclInternalError;
+          goto end;
+        }
+        struct ncclConnectJobs* jobs = entry->send ? &recvs : &sends;
+        jobs->conns[jobs->nJobs] = entry->send ? &comm->channels[c].peers[peer].recv : &comm->channels[c].peers[peer].send;
+        memcpy(jobs->connects+jobs->nJobs, &entry->connect, sizeof(struct ncclConnect));
+        jobs->nJobs++;
+      }
+    }
+  }
+
+  // Senders first : receivers wait for the remote sender to connect
+  NCCLCHECKGOTO(connectJobs(comm, &sends), ret, end);
+  NCCLCHECKGOTO(connectJobs(comm, &recvs), ret, end);
+  for (int j=0; j<sends.nJobs; j++) sends.conns[j]->connected = 1;
+  for (int j=0; j<recvs.nJobs; j++) recvs.conns[j]->connected = 1;
+  TRACE(NCCL_INIT, "%d connections with %d peers - DONE", nEntries, nPeers);
+  // Peers have quiesced before sending us their information
+  NCCLCHECKGOTO(freeRetiredConnectors(comm), ret, end);
+end:
+  for (int peer=0; peer<nranks; peer++) comm->connectSend[peer] = comm->connectRecv[peer] = 0;
+  free(entries);
+  free(sends.conns);
+  free(sends.connects);
+  free(recvs.conns);
+  free(recvs.connects);
+  return ret;
+}
+
+// Communicator created by ncclCommSplit or ncclCommShrink : the bootstrap
+// is already set up, and peer information and transports are taken from
+// the parent. ncclCommGrow only has a parent on the ranks it already had, and
+// no bootstrap : everything else is discovered again.
+struct ncclSplitInfo {
+  struct ncclComm* parent;
+  int* parentRanks; // Rank in the parent of each new rank, -1 for new ranks
+  void* bootstrap;
+  int reuse; // Take over the connectors of the parent
+  int share; // Share the ring connectors of the parent (ncclCommSplit)
+};
+
+// Move the connected connectors of the parent on channel c to the peers
+// that are still there. Both sides of a connection make the same decision,
+// as the parent connected them together and the channels are the same.
+static ncclResult_t reuseConnectors(struct ncclComm* comm, struct ncclSplitInfo* split, int c) {
+  struct ncclComm* parent = split->parent;
+  if (c >= parent->nChannels) return ncclSuccess;
+  struct ncclChannel* pchannel = parent->channels+c;
+  struct ncclChannel* channel = comm->channels+c;
+  // The GPU keeps the current step in its copy of the connectors
+  struct ncclPeer* devPeers;
+  NCCLCHECK(ncclCalloc(&devPeers, parent->nRanks));
+  CUDACHECK(cudaMemcpy(devPeers, pchannel->devPeers, parent->nRanks*sizeof(struct ncclPeer), cudaMemcpyDeviceToHost));
+  int nReused = 0;
+  for (int p=0; p<comm->nRanks; p++) {
+    int pp = split->parentRanks[p];
+    if (pp == -1) continue;
+    struct ncclConnector* olds[2] = { &pchannel->peers[pp].send, &pchannel->peers[pp].recv };
+    struct ncclConnector* news[2] = { &channel->peers[p].send, &channel->peers[p].recv };
+    struct ncclConnInfo* devConns[2] = { &devPeers[pp].send.conn, &devPeers[pp].recv.conn };
+    for (int d=0; d<2; d++) {
+      if (olds[d]->connected == 0) continue;
+      memcpy(news[d], olds[d], sizeof(struct ncclConnector));
+      news[d]->conn.step = devConns[d]->step;
+      news[d]->conn.llLastCleaning = devConns[d]->llLastCleaning;
+      news[d]->proxyAppend = NULL;
+      news[d]->comm = comm;
+      // Doorbells belong to the parent, which may be destroyed first
+      ncclDoorbellRelease(parent, news[d]->conn.doorbell);
+      news[d]->conn.doorbell = NULL;
+      memset(olds[d], 0, sizeof(struct ncclConnector));
+      nReused++;
+    }
+  }
+  free(devPeers);
+  TRACE(NCCL_INIT, "channel %d : reused %d connectors", c, nReused);
+  return ncclSuccess;
+}
+
+// Move the state of a connector of comm to one that other communicators can
+// share. The kernels of comm use it from now on.
+static ncclResult_t shareConnector(struct ncclComm* comm, struct ncclConnector* connector, struct ncclConnector* devConnector) {
+  struct ncclSharedConnector* shared;
+  NCCLCHECK(ncclCalloc(&shared, 1));
+  // Doorbells belong to comm, which may be destroyed first
+  ncclDoorbellRelease(comm, connector->conn.doorbell);
+  connector->conn.doorbell = NULL;
+  // The GPU keeps the current step in its copy of the connector
+  struct ncclConnInfo conn;
+  NCCLCHECK(ncclCudaMemcpy(&conn, &devConnector->conn, 1));
+  conn.doorbell = NULL;
+  // Each communicator counts its operations : the remote count can be ahead
+  // of ours without any mismatch.
+  conn.opCountRem = NULL;
+  NCCLCHECK(ncclCudaCalloc(&shared->devConn, 1));
+  NCCLCHECK(ncclCudaMemcpy(shared->devConn, &conn, 1));
+  connector->conn.sharedConn = shared->devConn;
+  NCCLCHECK(ncclCudaMemcpy(&devConnector->conn.sharedConn, &shared->devConn, 1));
+  shared->refCount = 1;
+  connector->shared = shared;
+  return ncclSuccess;
+}
+
+// Let the ring of channel c use the connectors of the parent to the same
+// peers, when they have the size of the channel. Both sides of a connection
+// make the same decision. The parent is idle, and afterwards shares the
+// connections : operations of the two must not run at the same time.
+static ncclResult_t shareConnectors(struct ncclComm* comm, struct ncclSplitInfo* split, int c) {
+  struct ncclComm* parent = split->parent;
+  if (c >= parent->nChannels) return ncclSuccess;
+  struct ncclChannel* pchannel = parent->channels+c;
+  struct ncclChannel* channel = comm->channels+c;
+  int peers[2] = { channel->ring.next, channel->ring.prev };
+  int nShared = 0;
+  for (int d=0; d<2; d++) {
+    int peer = peers[d];
+    int pp = split->parentRanks[peer];
+    if (peer == comm->rank || pp == -1) continue;
+    struct ncclConnector* old = d == 0 ? &pchannel->peers[pp].send : &pchannel->peers[pp].recv;
+    struct ncclConnector* connector = d == 0 ? &channel->peers[peer].send : &channel->peers[peer].recv;
+    if (old->connected == 0 || old->conn.buffSize != channel->buffSize) continue;
+    if (old->shared == NULL) {
+      NCCLCHECK(shareConnector(parent, old, d == 0 ? &pchannel->devPeers[pp].send : &pchannel->devPeers[pp].recv));
+    }
+    memcpy(connector, old, sizeof(struct ncclConnector));
+    connector->proxyAppend = NULL;
+    connector->comm = comm;
+    __atomic_add_fetch(&old->shared->refCount, 1, __ATOMIC_RELAXED);
+    nShared++;
+  }
+  TRACE(NCCL_INIT, "channel %d : sharing %d connectors with the parent", c, nShared);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTreeConnect(struct ncclComm* comm) {
+  comm->treeRequested = false;
+  if (comm->treeConnected || comm->bootstrap == NULL) return ncclSuccess;
+  for (int c=0; c<comm->nChannels; c++) {
+    struct ncclChannel* channel = comm->channels+c;
+    NCCLCHECK(p2pPrepare(comm, channel, NCCL_MAX_TREE_ARITY, channel->tree.down, NULL, 1, &channel->tree.up, NULL));
+    NCCLCHECK(p2pPrepare(comm, channel, 1, &channel->tree.up, NULL, NCCL_MAX_TREE_ARITY, channel->tree.down, NULL));
+  }
+  NCCLCHECK(p2pSetup(comm));
+
+  // Gather the parents of all ranks for rooted collectives
+  int* ups;
+  NCCLCHECK(ncclCalloc(&ups, comm->nRanks*MAXCHANNELS));
+  for (int c=0; c<comm->nChannels; c++) ups[comm->rank*MAXCHANNELS+c] = comm->channels[c].tree.up;
+  NCCLCHECK(bootstrapAllGather(comm->bootstrap, ups, MAXCHANNELS*sizeof(int)));
+  for (int c=0; c<comm->nChannels; c++) {
+    struct ncclChannel* channel = comm->channels+c;
+    NCCLCHECK(ncclCalloc(&channel->treeUps, comm->nRanks));
+    for (int r=0; r<comm->nRanks; r++) channel->treeUps[r] = ups[r*MAXCHANNELS+c];
+    NCCLCHECK(ncclPoolCudaCalloc(&comm->memPool, &channel->devTreeUps, comm->nRanks));
+    NCCLCHECK(ncclCudaMemcpy(channel->devTreeUps, channel->treeUps, comm->nRanks));
+    NCCLCHECK(ncclCudaMemcpy(channel->devPeers, channel->peers, comm->nRanks));
+    // Only update that field, the GPU owns the operation FIFO state
+    NCCLCHECK(ncclCudaMemcpy(&comm->hostDevComm.channels[c].devTreeUps, &channel->devTreeUps, 1));
+  }
+  free(ups);
+  comm->treeConnected = true;
+  INFO(NCCL_INIT, "Connected trees on %d channels", comm->nChannels);
   return ncclSuccess;
 }
 
-static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* commId) {
+static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* commId, struct ncclSplitInfo* split) {
   // We use 3 AllGathers
   // 1. { peerInfo, comm }
   // 2. ConnectTransport[nranks], ConnectValue[nranks]
   // 3. { nThreads, nrings, compCap, prev[MAXCHANNELS], next[MAXCHANNELS] }
+  // When split from a parent, only the comm pointers of 1. and 3. are needed.
 
   int rank = comm->rank;
   int nranks = comm->nRanks;
   TRACE(NCCL_INIT, "rank %d nranks %d - BEGIN", rank, nranks);
-  NCCLCHECK(bootstrapInit(commId, rank, nranks, &comm->bootstrap));
+  // Ranks are all known to the parent : skip the discovery
+  bool fromParent = split && split->bootstrap;
+  if (fromParent) {
+    comm->bootstrap = split->bootstrap;
+  } else {
+    NCCLCHECK(bootstrapInit(commId, rank, nranks, &comm->bootstrap));
+  }
 
   // AllGather1 - begin
   struct {
@@ -701,9 +1215,22 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   } *allGather1Data;
 
   NCCLCHECK(ncclCalloc(&allGather1Data, nranks));
-  allGather1Data[rank].comm = comm;
-  NCCLCHECK(fillInfo(&allGather1Data[rank].peerInfo, rank));
-  NCCLCHECK(bootstrapAllGather(comm->bootstrap, allGather1Data, sizeof(*allGather1Data)));
+  if (fromParent) {
+    struct ncclComm** comms;
+    NCCLCHECK(ncclCalloc(&comms, nranks));
+    comms[rank] = comm;
+    NCCLCHECK(bootstrapAllGather(comm->bootstrap, comms, sizeof(struct ncclComm*)));
+    for (int i = 0; i < nranks; i++) {
+      allGather1Data[i].comm = comms[i];
+      memcpy(&allGather1Data[i].peerInfo, split->parent->peerInfo+split->parentRanks[i], sizeof(struct ncclPeerInfo));
+      allGather1Data[i].peerInfo.rank = i;
+    }
+    free(comms);
+  } else {
+    allGather1Data[rank].comm = comm;
+    NCCLCHECK(fillInfo(&allGather1Data[rank].peerInfo, rank));
+    NCCLCHECK(bootstrapAllGather(comm->bootstrap, allGather1Data, sizeof(*allGather1Data)));
+  }
 
   NCCLCHECK(ncclCalloc(&comm->peerInfo, nranks));
   for (int i = 0; i < nranks; i++) {
@@ -713,26 +1240,36 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   // AllGather1 - end
 
   // AllGather2 - begin
+  int* connectTransport;
+  ncclTvalue_t* connectValue;
+  NCCLCHECK(ncclCalloc(&connectTransport, nranks*nranks));
+  NCCLCHECK(ncclCalloc(&connectValue, nranks*nranks));
   size_t allGather2DataRowSize = sizeof(int)*nranks + sizeof(ncclTvalue_t)*nranks;
   void *allGather2Data;
   NCCLCHECK(ncclCalloc((char **)&allGather2Data, allGather2DataRowSize*nranks));
   int *myTransportRow = (int *)((char *)allGather2Data + allGather2DataRowSize*rank);
   ncclTvalue_t *myValueRow = (ncclTvalue_t *)(myTransportRow + nranks);
 
-  NCCLCHECK(fillConnect(comm->peerInfo, nranks, rank, myTransportRow, myValueRow));
+  if (fromParent) {
+    // The parent only kept its own row : take ours from it
+    for (int j = 0; j < nranks; j++) {
+      myTransportRow[j] = split->parent->connectTransport[split->parentRanks[j]];
+      myValueRow[j] = split->parent->connectValue[split->parentRanks[j]];
+    }
+  } else {
+    NCCLCHECK(fillConnect(comm->peerInfo, nranks, rank, myTransportRow, myValueRow));
+  }
   NCCLCHECK(bootstrapAllGather(comm->bootstrap, allGather2Data, allGather2DataRowSize));
 
-  int* connectTransport;
-  ncclTvalue_t* connectValue;
-  NCCLCHECK(ncclCalloc(&connectTransport, nranks*nranks));
-  NCCLCHECK(ncclCalloc(&connectValue, nranks*nranks));
   for (int i = 0; i < nranks; i++) {
     memcpy(connectTransport + i*nranks, (char *)allGather2Data + i*allGather2DataRowSize, sizeof(int)*nranks);
     memcpy(connectValue + i*nranks, (char *)allGather2Data + i*allGather2DataRowSize + nranks*sizeof(int), sizeof(ncclTvalue_t)*nranks);
   }
   free(allGather2Data);
   // AllGather2 - end
+  NCCLCHECK(ncclOneShotInit(comm, connectTransport, connectValue));
 
+  if (rank == 0) NCCLCHECK(ncclTopoDump(comm->peerInfo, nranks, rank, connectTransport, connectValue));
   //if (rank == 0) dumpMatrix(connectTransport, nranks);
   //if (rank == 0) dumpMatrixTvalue(connectValue, nranks);
 
@@ -747,22 +1284,24 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   NCCLCHECK(ncclGetRings(&nrings, &comm->nThreads, rank, nranks, connectTransport, connectValue, prev, next, treeIn, treeOut));
   TRACE(NCCL_INIT, "rank %d nranks %d - BUILD %d RINGS", rank, nranks, nrings);
   assert(nrings <= MAXCHANNELS);
-  free(connectTransport);
-  free(connectValue);
 
   // AllGather3 - begin
   struct {
     int nThreads;
     int nrings;
     int cudaCompCap;
+    int nvlink;
+    uint64_t opCount;
     int prev[MAXCHANNELS];
     int next[MAXCHANNELS];
   } *allGather3Data;
 
   NCCLCHECK(ncclCalloc(&allGather3Data, nranks));
   allGather3Data[rank].nThreads = comm->nThreads;
+  allGather3Data[rank].opCount = split && split->parent ? split->parent->opCount : 0;
   allGather3Data[rank].nrings = nrings;
   allGather3Data[rank].cudaCompCap = ncclCudaCompCap();
+  NCCLCHECK(ncclNvlinkGpu(&allGather3Data[rank].nvlink));
   for (int r=0; r<nrings; r++) {
     allGather3Data[rank].prev[r] = *(prev+r*nranks+rank);
     allGather3Data[rank].next[r] = *(next+r*nranks+rank);
@@ -773,11 +1312,19 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   for (int i=0; i<nranks; i++)
     comm->nThreads = std::max(allGather3Data[i].nThreads, comm->nThreads);
 
+  // Connectors taken from parents have seen their opCount : continue after
+  // the highest one, so that the GPU does not see the remote side ahead.
+  for (int i=0; i<nranks; i++)
+    comm->opCount = std::max(allGather3Data[i].opCount, comm->opCount);
+
   // Determine the minimum CUDA Compute capability of all GPUs
   int myCompCap = allGather3Data[rank].cudaCompCap;
   int minCompCap = myCompCap;
-  for (int i = 0; i < nranks; i++)
+  int nvlink = 1;
+  for (int i = 0; i < nranks; i++) {
     minCompCap = std::min(allGather3Data[i].cudaCompCap, minCompCap);
+    nvlink = std::min(allGather3Data[i].nvlink, nvlink);
+  }
 
   // Determine thread threshold across all GPUs
   int nnodes = 0;
@@ -799,6 +1346,11 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   free(allGather3Data);
   // AllGather3 - end
 
+  comm->ll128 = ncclLl128Enable(nranks, nrings, next, connectTransport, minCompCap, nvlink);
+
+  // Build the latency/bandwidth model now that we know our channels
+  NCCLCHECK(ncclTuningInit(comm, nnodes));
+
   int *rings;
   NCCLCHECK(ncclCalloc(&rings, nranks*MAXCHANNELS));
   NCCLCHECK(buildRings(nrings, rings, rank, nranks, prev, next));
@@ -811,11 +1363,13 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   NCCLCHECK(ncclCalloc(&connect, 2));
   for (int r=0; r<nrings; r++) {
     struct ncclChannel* channel = comm->channels+r;
-    NCCLCHECK(setupChannel(comm, r, rank, nranks, rings+r*nranks, treeIn+r*nranks));
-    NCCLCHECK(p2pSetup(comm, channel, 1, &channel->ring.prev, 1, &channel->ring.next));
-    NCCLCHECK(p2pSetup(comm, channel, NCCL_MAX_TREE_ARITY, channel->tree.down, 1, &channel->tree.up));
-    NCCLCHECK(p2pSetup(comm, channel, 1, &channel->tree.up, NCCL_MAX_TREE_ARITY, channel->tree.down));
+    NCCLCHECK(setupChannel(comm, r, rank, nranks, rings+r*nranks, treeIn+r*nranks, connectTransport));
+    if (split && split->reuse) NCCLCHECK(reuseConnectors(comm, split, r));
+    if (split && split->share) NCCLCHECK(shareConnectors(comm, split, r));
+    // Trees are connected on first use (see ncclTreeConnect)
+    NCCLCHECK(p2pPrepare(comm, channel, 1, &channel->ring.prev, NULL, 1, &channel->ring.next, NULL));
   }
+  NCCLCHECK(p2pSetup(comm));
   if (comm->treeThreshold > 0) {
     char line[1024];
     line[0]='\0';
@@ -842,6 +1396,14 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   free(treeIn);
   free(treeOut);
 
+  // Only keep our own row, for send/recv and communicators split from this one
+  NCCLCHECK(ncclCalloc(&comm->connectTransport, nranks));
+  NCCLCHECK(ncclCalloc(&comm->connectValue, nranks));
+  memcpy(comm->connectTransport, connectTransport+rank*nranks, sizeof(int)*nranks);
+  memcpy(comm->connectValue, connectValue+rank*nranks, sizeof(ncclTvalue_t)*nranks);
+  free(connectTransport);
+  free(connectValue);
+
   // Compute intra ranks (using AllGather1 data)
   int intraRank0 = -1, intraRank = -1, intraRanks = 0;
   for (int i = 0; i < nranks; i++) {
@@ -864,7 +1426,17 @@ static ncclResult_t initTransportsRank(struct ncclComm* comm, ncclUniqueId* comm
   // Done with AllGather1 data
   free(allGather1Data);
 
-  if (nnodes) NCCLCHECK(transportCreateProxy(comm));
+  // Proxy threads drive the network, and intra-node transports with a proxy
+  bool needProxy = nnodes > 0;
+  for (int r=0; r<nranks; r++) {
+    int t = comm->connectTransport[r];
+    if (t >= 0 && ncclTransports[t].send.proxy) needProxy = true;
+  }
+  if (needProxy) NCCLCHECK(transportCreateProxy(comm, split && split->parent ? split->parent->proxyState : NULL));
+
+  NCCLCHECK(ncclAutoTuneInit(comm));
+  NCCLCHECK(ncclTimelineInit(comm));
+  NCCLCHECK(ncclProfilerCommInit(comm));
 
   TRACE(NCCL_INIT, "rank %d nranks %d - DONE", rank, nranks);
   return ncclSuccess;
@@ -936,7 +1508,8 @@ static ncclResult_t setCpuAffinity(int cudaDev) {
   return ncclSuccess;
 }
 
-ncclResult_t ncclCommInitRankSync(ncclComm_t* newcomm, int nranks, ncclUniqueId commId, int myrank) {
+// Initialize comm, allocated and zeroed by the caller
+static ncclResult_t commInit(struct ncclComm* comm, int nranks, ncclUniqueId commId, int myrank, struct ncclSplitInfo* split) {
   cpu_set_t affinitySave;
   sched_getaffinity(0, sizeof(cpu_set_t), &affinitySave);
 
@@ -949,22 +1522,35 @@ ncclResult_t ncclCommInitRankSync(ncclComm_t* newcomm, int nranks, ncclUniqueId
   NCCLCHECK(setCpuAffinity(cudaDev));
   ncclResult_t res;
 
-  NCCLCHECKGOTO(commAlloc(newcomm, nranks, myrank), res, cleanup);
-  NCCLCHECKGOTO(initTransportsRank(*newcomm, &commId), res, cleanup);
-  NCCLCHECKGOTO(devCommSetup(*newcomm), res, cleanup);
+  NCCLCHECKGOTO(commAlloc(comm, nranks, myrank), res, cleanup);
+  comm->cpuAffinity = affinitySave;
+  NCCLCHECKGOTO(initTransportsRank(comm, &commId, split), res, cleanup);
+  NCCLCHECKGOTO(devCommSetup(comm), res, cleanup);
 
   sched_setaffinity(0, sizeof(cpu_set_t), &affinitySave);
   NCCLCHECKGOTO(wrapNvmlShutdown(), res, cleanup);
 
-  INFO(NCCL_INIT,"comm %p rank %d nranks %d cudaDev %d nvmlDev %d - Init COMPLETE", *newcomm, myrank, nranks, (*newcomm)->cudaDev, (*newcomm)->nvmlDev);
+  INFO(NCCL_INIT,"comm %p rank %d nranks %d cudaDev %d nvmlDev %d - Init COMPLETE", comm, myrank, nranks, comm->cudaDev, comm->nvmlDev);
 
   return ncclSuccess;
 cleanup:
-  *newcomm = NULL;
   sched_setaffinity(0, sizeof(cpu_set_t), &affinitySave);
   return res;
 }
 
+static ncclResult_t commInitRank(ncclComm_t* newcomm, int nranks, ncclUniqueId commId, int myrank, struct ncclSplitInfo* split) {
+  struct ncclComm* comm;
+  *newcomm = NULL;
+  NCCLCHECK(ncclCalloc(&comm, 1));
+  NCCLCHECK(commInit(comm, nranks, commId, myrank, split));
+  *newcomm = comm;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclCommInitRankSync(ncclComm_t* newcomm, int nranks, ncclUniqueId commId, int myrank) {
+  return commInitRank(newcomm, nranks, commId, myrank, NULL);
+}
+
 NCCL_API(ncclResult_t, ncclCommInitRank, ncclComm_t* newcomm, int nranks, ncclUniqueId commId, int myrank);
 ncclResult_t ncclCommInitRank(ncclComm_t* newcomm, int nranks, ncclUniqueId commId, int myrank) {
   char* env = getenv("NCCL_COMM_ID");
@@ -993,6 +1579,75 @@ ncclResult_t ncclCommInitRank(ncclComm_t* newcomm, int nranks, ncclUniqueId comm
   }
 }
 
+struct ncclAsyncInitArgs {
+  struct ncclComm* comm;
+  int nranks;
+  ncclUniqueId commId;
+  int myrank;
+  int cudaDev;
+};
+
+static void* commInitThreadMain(void* args_) {
+  struct ncclAsyncInitArgs* args = (struct ncclAsyncInitArgs*)args_;
+  struct ncclComm* comm = args->comm;
+  ncclResult_t res = ncclSuccess;
+  // Creating the CUDA context is part of what we do in the background
+  if (cudaSetDevice(args->cudaDev) != cudaSuccess || cudaFree(NULL) != cudaSuccess) res = ncclUnhandledCudaError;
+  if (res == ncclSuccess) res = commInit(comm, args->nranks, args->commId, args->myrank, NULL);
+  if (res != ncclSuccess) WARN("Initialization of comm %p rank %d failed : %s", comm, args->myrank, ncclGetErrorString(res));
+  free(args);
+  __atomic_store_n(&comm->initState, res, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+NCCL_API(ncclResult_t, ncclCommInitRankAsync, ncclComm_t* newcomm, int nranks, ncclUniqueId commId, int myrank);
+ncclResult_t ncclCommInitRankAsync(ncclComm_t* newcomm, int nranks, ncclUniqueId commId, int myrank) {
+  char* env = getenv("NCCL_COMM_ID");
+  if (env && myrank == 0) {
+    NCCLCHECK(bootstrapCreateRoot(&commId, true));
+  }
+
+  NCCLCHECK(ncclInit());
+  if (myrank == 0) showVersion();
+
+  NCCLCHECK(PtrCheck(newcomm, "CommInitRankAsync", "newcomm"));
+  if (nranks < 1 || myrank < 0 || myrank >= nranks) {
+    WARN("Invalid rank requested : %d/%d", myrank, nranks);
+    return ncclInvalidArgument;
+  }
+
+  struct ncclAsyncInitArgs* args;
+  struct ncclComm* comm;
+  NCCLCHECK(ncclCalloc(&args, 1));
+  NCCLCHECK(ncclCalloc(&comm, 1));
+  args->comm = comm;
+  args->nranks = nranks;
+  memcpy(&args->commId, &commId, sizeof(commId));
+  args->myrank = myrank;
+  CUDACHECK(cudaGetDevice(&args->cudaDev));
+  comm->initState = ncclInProgress;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, commInitThreadMain, args) != 0) {
+    WARN("Failed to create the initialization thread : %s", strerror(errno));
+    free(args);
+    free(comm);
+    return ncclSystemError;
+  }
+  pthread_detach(thread);
+  *newcomm = comm;
+  return ncclSuccess;
+}
+
+// Wait for the initialization of a communicator created by
+// ncclCommInitRankAsync. Returns false if it failed : comm can then only be
+// freed.
+static bool commWaitInit(struct ncclComm* comm) {
+  ncclResult_t state;
+  while ((state = __atomic_load_n(&comm->initState, __ATOMIC_ACQUIRE)) == ncclInProgress) usleep(1000);
+  return state == ncclSuccess;
+}
+
 static ncclResult_t initTransportsAll(struct ncclComm** comms, const int* devs, int nranks) {
   struct ncclPeerInfo* allInfo;
   NCCLCHECK(ncclCalloc(&allInfo, nranks));
@@ -1007,6 +1662,7 @@ static ncclResult_t initTransportsAll(struct ncclComm** comms, const int* devs,
   NCCLCHECK(ncclCalloc(&connectValue, nranks*nranks));
   for (int rank=0; rank<nranks; rank++)
     NCCLCHECK(fillConnect(allInfo, nranks, rank, connectTransport+nranks*rank, connectValue+nranks*rank));
+  NCCLCHECK(ncclTopoDump(allInfo, nranks, 0, connectTransport, connectValue));
 
   int* prev, *prevFinal, *next, *nextFinal, *treeIn, *treeOut;
   NCCLCHECK(ncclCalloc(&prev, nranks*MAXCHANNELS));
@@ -1019,11 +1675,15 @@ static ncclResult_t initTransportsAll(struct ncclComm** comms, const int* devs,
   int nthreads=0;
   int myCompCap = ncclCudaCompCap();
   int minCompCap = myCompCap;
+  int nvlink = 1;
   for (int rank=0; rank<nranks; rank++) {
     CUDACHECK(cudaSetDevice(devs[rank]));
     int nringsRank;
     int nthreadsRank = getDefaultThreads();
     myCompCap = ncclCudaCompCap();
+    int nvlinkRank;
+    NCCLCHECK(ncclNvlinkGpu(&nvlinkRank));
+    nvlink = std::min(nvlink, nvlinkRank);
     NCCLCHECK(ncclGetRings(&nringsRank, &nthreadsRank, rank, nranks, connectTransport, connectValue, prev, next, treeIn, treeOut));
     nrings = std::min(nrings, nringsRank);
     nthreads = std::max(nthreads, nthreadsRank);
@@ -1034,7 +1694,6 @@ static ncclResult_t initTransportsAll(struct ncclComm** comms, const int* devs,
       nextFinal[index] = next[index];
     }
   }
-  free(connectTransport);
   free(connectValue);
   free(prev);
   free(next);
@@ -1044,6 +1703,7 @@ static ncclResult_t initTransportsAll(struct ncclComm** comms, const int* devs,
   int* rings;
   NCCLCHECK(ncclCalloc(&rings, nranks*MAXCHANNELS));
   NCCLCHECK(buildRings(nrings, rings, 0, nranks, prevFinal, nextFinal));
+  int ll128 = ncclLl128Enable(nranks, nrings, nextFinal, connectTransport, minCompCap, nvlink);
   free(prevFinal);
   free(nextFinal);
 
@@ -1051,9 +1711,14 @@ static ncclResult_t initTransportsAll(struct ncclComm** comms, const int* devs,
   int threadThreshold = ncclThreadThreshold(minCompCap, 0);
 
   for (int rank=0; rank<nranks; rank++) {
+    CUDACHECK(cudaSetDevice(devs[rank]));
     comms[rank]->nChannels = nrings;
     comms[rank]->nThreads = nthreads;
     comms[rank]->threadThreshold = threadThreshold;
+    comms[rank]->ll128 = ll128;
+    // Make sure we don't use trees, we cannot use them with initAll
+    comms[rank]->treeThreshold = 0;
+    NCCLCHECK(ncclTuningInit(comms[rank], 1));
   }
 
   struct ncclConnect* connect;
@@ -1064,9 +1729,7 @@ static ncclResult_t initTransportsAll(struct ncclComm** comms, const int* devs,
       CUDACHECK(cudaSetDevice(devs[rank]));
       struct ncclChannel* channel = comms[rank]->channels+r;
       struct ncclRing *ring = &channel->ring;
-      NCCLCHECK(setupChannel(comms[rank], r, rank, nranks, ringRanks, treeIn));
-      // Make sure we don't use trees, we cannot use them with initAll
-      comms[rank]->treeThreshold = 0;
+      NCCLCHECK(setupChannel(comms[rank], r, rank, nranks, ringRanks, treeIn, connectTransport));
       int prev = channel->ring.prev = ring->userRanks[nranks-1];
       int next = channel->ring.next = ring->userRanks[1];
       struct ncclConnector* recv = &channel->peers[prev].recv;
@@ -1084,7 +1747,13 @@ static ncclResult_t initTransportsAll(struct ncclComm** comms, const int* devs,
       NCCLCHECK(send->transportComm->connect(connect+ring->next*2+0, send));
     }
   }
+  for (int rank=0; rank<nranks; rank++) {
+    CUDACHECK(cudaSetDevice(devs[rank]));
+    NCCLCHECK(ncclTimelineInit(comms[rank]));
+    NCCLCHECK(ncclProfilerCommInit(comms[rank]));
+  }
   free(connect);
+  free(connectTransport);
   free(allInfo);
   free(rings);
   free(treeIn);
@@ -1132,7 +1801,12 @@ ncclResult_t ncclCommInitAll(ncclComm_t* comms, int ndev, const int* devlist) {
 
     NCCLCHECK(setCpuAffinity(cudaDev));
 
-    NCCLCHECKGOTO(commAlloc(&comm, ndev, rank), res, cleanup);
+    NCCLCHECKGOTO(ncclCalloc(&comm, 1), res, cleanup);
+    if ((res = commAlloc(comm, ndev, rank)) != ncclSuccess) {
+      free(comm);
+      goto cleanup;
+    }
+    comm->cpuAffinity = affinitySave;
     comms[rank] = comm;
 
     NCCLCHECKGOTO(ncclCommSetIntra(comm, rank, ndev, comms[0]), res, cleanup);
@@ -1198,6 +1872,10 @@ NCCL_API(ncclResult_t, ncclCommDestroy, ncclComm_t comm);
 ncclResult_t ncclCommDestroy(ncclComm_t comm) {
   if (comm == NULL)
     return ncclSuccess;
+  if (!commWaitInit(comm)) {
+    free(comm);
+    return ncclSuccess;
+  }
 
   TRACE(NCCL_INIT, "comm %p rank %d nRanks %d cudaDev %d nvmlDev %d", comm, comm->rank, comm->nRanks, comm->cudaDev, comm->nvmlDev);
 
@@ -1210,10 +1888,200 @@ ncclResult_t ncclCommDestroy(ncclComm_t comm) {
   return commDestroy(comm);
 }
 
+NCCL_PARAM(SplitShare, "SPLIT_SHARE", 0);
+
+NCCL_API(ncclResult_t, ncclCommSplit, ncclComm_t comm, int color, int key, ncclComm_t* newcomm);
+ncclResult_t ncclCommSplit(ncclComm_t comm, int color, int key, ncclComm_t* newcomm) {
+  NCCLCHECK(PtrCheck(comm, "CommSplit", "comm"));
+  NCCLCHECK(ncclCommCheckReady(comm));
+  NCCLCHECK(PtrCheck(newcomm, "CommSplit", "newcomm"));
+  if (color < 0 && color != NCCL_SPLIT_NOCOLOR) {
+    WARN("CommSplit : invalid color %d", color);
+    return ncclInvalidArgument;
+  }
+  if (comm->bootstrap == NULL) {
+    WARN("CommSplit : communicators created with ncclCommInitAll can't be split");
+    return ncclInvalidUsage;
+  }
+  if (ncclAsyncMode()) {
+    // We talk to the other ranks of the parent before returning
+    WARN("CommSplit : can't be called within a group");
+    return ncclInvalidUsage;
+  }
+
+  int savedDev;
+  CUDACHECK(cudaGetDevice(&savedDev));
+  ncclResult_t ret = ncclSuccess;
+  int nranks = comm->nRanks;
+  struct {
+    int color;
+    int key;
+    ncclNetHandle_t handle;
+  } *allGather;
+  struct ncclSplitInfo split = { comm, NULL, NULL, 0, ncclParamSplitShare() ? 1 : 0 };
+  void* listenComm = NULL;
+  int myRank = 0, nRanks = 0;
+  ncclUniqueId commId;
+  ncclNetHandle_t* handles = NULL;
+  *newcomm = NULL;
+  memset(&commId, 0, sizeof(commId));
+  NCCLCHECK(ncclCalloc(&allGather, nranks));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, end);
+
+  // Get colors, keys and the bootstrap handles of the new communicators in a
+  // single AllGather of the parent.
+  allGather[comm->rank].color = color;
+  allGather[comm->rank].key = key;
+  if (color != NCCL_SPLIT_NOCOLOR) NCCLCHECKGOTO(bootstrapSplitListen(comm->bootstrap, allGather[comm->rank].handle, &listenComm), ret, end);
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, allGather, sizeof(*allGather)), ret, end);
+  if (color == NCCL_SPLIT_NOCOLOR) goto end;
+
+  // Ranks are ordered by key, then by rank in the parent
+  for (int r=0; r<nranks; r++) nRanks += allGather[r].color == color ? 1 : 0;
+  NCCLCHECKGOTO(ncclCalloc(&split.parentRanks, nRanks), ret, end);
+  NCCLCHECKGOTO(ncclCalloc(&handles, nRanks), ret, end);
+  for (int r=0; r<nranks; r++) {
+    if (allGather[r].color != color) continue;
+    int index = 0;
+    for (int s=0; s<nranks; s++) {
+      if (allGather[s].color != color) continue;
+      if (allGather[s].key < allGather[r].key || (allGather[s].key == allGather[r].key && s < r)) index++;
+    }
+    split.parentRanks[index] = r;
+    memcpy(handles+index, allGather[r].handle, sizeof(ncclNetHandle_t));
+    if (r == comm->rank) myRank = index;
+  }
+  TRACE(NCCL_INIT, "comm %p rank %d color %d key %d -> rank %d/%d", comm, comm->rank, color, key, myRank, nRanks);
+
+  NCCLCHECKGOTO(bootstrapSplitInit(comm->bootstrap, listenComm, myRank, nRanks, handles, &split.bootstrap), ret, end);
+  listenComm = NULL; // Owned by the new bootstrap
+  if (split.share) {
+    // Connectors can only change hands while nothing uses them
+    CUDACHECKGOTO(cudaEventSynchronize(comm->doneEvent), ret, end);
+    NCCLCHECKGOTO(commProxyWait(comm), ret, end);
+  }
+  NCCLCHECKGOTO(commInitRank(newcomm, nRanks, commId, myRank, &split), ret, end);
+end:
+  if (listenComm) bootstrapSplitCloseListen(listenComm);
+  free(allGather);
+  free(handles);
+  free(split.parentRanks);
+  CUDACHECK(cudaSetDevice(savedDev));
+  return ret;
+}
+
+// Wait for everything running on comm to complete. With abort, ask it to
+// quit first : the connectors are then left in an unknown state.
+static ncclResult_t commProxyWait(struct ncclComm* comm) {
+  while (__atomic_load_n(&comm->proxyOps.done, __ATOMIC_ACQUIRE) != comm->proxyOps.posted) {
+    if (comm->fatalError != ncclSuccess) return comm->fatalError;
+    sched_yield();
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t commQuiesce(struct ncclComm* comm, int abort) {
+  if (abort) *comm->abortFlag = 1;
+  CUDACHECK(cudaDeviceSynchronize());
+  NCCLCHECK(commProxyWait(comm));
+  return ncclSuccess;
+}
+
+static ncclResult_t resizeCheck(ncclComm_t comm, ncclComm_t* newcomm, const char* name) {
+  NCCLCHECK(PtrCheck(comm, name, "comm"));
+  NCCLCHECK(ncclCommCheckReady(comm));
+  NCCLCHECK(PtrCheck(newcomm, name, "newcomm"));
+  if (comm->bootstrap == NULL) {
+    WARN("%s : communicators created with ncclCommInitAll can't be resized", name);
+    return ncclInvalidUsage;
+  }
+  if (ncclAsyncMode()) {
+    WARN("%s : can't be called within a group", name);
+    return ncclInvalidUsage;
+  }
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclCommShrink, ncclComm_t comm, const int* excludeRanks, int excludeCount, ncclComm_t* newcomm, int flags);
+ncclResult_t ncclCommShrink(ncclComm_t comm, const int* excludeRanks, int excludeCount, ncclComm_t* newcomm, int flags) {
+  NCCLCHECK(resizeCheck(comm, newcomm, "CommShrink"));
+  if (excludeCount < 0 || excludeCount >= comm->nRanks || (excludeCount > 0 && excludeRanks == NULL)) {
+    WARN("CommShrink : invalid number of excluded ranks %d", excludeCount);
+    return ncclInvalidArgument;
+  }
+  for (int i=0; i<excludeCount; i++) {
+    if (excludeRanks[i] < 0 || excludeRanks[i] >= comm->nRanks) {
+      WARN("CommShrink : invalid excluded rank %d", excludeRanks[i]);
+      return ncclInvalidArgument;
+    }
+  }
+
+  int savedDev;
+  CUDACHECK(cudaGetDevice(&savedDev));
+  ncclResult_t ret = ncclSuccess;
+  int abort = flags & NCCL_SHRINK_ABORT ? 1 : 0;
+  struct ncclSplitInfo split = { comm, NULL, NULL, !abort };
+  int myRank = -1, nRanks = 0;
+  ncclUniqueId commId;
+  *newcomm = NULL;
+  memset(&commId, 0, sizeof(commId));
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, end);
+  NCCLCHECKGOTO(commQuiesce(comm, abort), ret, end);
+
+  // Remaining ranks keep their order
+  NCCLCHECKGOTO(ncclCalloc(&split.parentRanks, comm->nRanks), ret, end);
+  for (int r=0; r<comm->nRanks; r++) {
+    bool excluded = false;
+    for (int i=0; i<excludeCount; i++) excluded |= excludeRanks[i] == r;
+    if (excluded) continue;
+    if (r == comm->rank) myRank = nRanks;
+    split.parentRanks[nRanks++] = r;
+  }
+  if (myRank == -1) goto end;
+  TRACE(NCCL_INIT, "comm %p rank %d -> rank %d/%d%s", comm, comm->rank, myRank, nRanks, abort ? " (abort)" : "");
+
+  NCCLCHECKGOTO(bootstrapShrinkInit(comm->bootstrap, myRank, nRanks, split.parentRanks, &split.bootstrap), ret, end);
+  NCCLCHECKGOTO(commInitRank(newcomm, nRanks, commId, myRank, &split), ret, end);
+end:
+  free(split.parentRanks);
+  CUDACHECK(cudaSetDevice(savedDev));
+  return ret;
+}
+
+NCCL_API(ncclResult_t, ncclCommGrow, ncclComm_t comm, int nranks, ncclUniqueId commId, ncclComm_t* newcomm);
+ncclResult_t ncclCommGrow(ncclComm_t comm, int nranks, ncclUniqueId commId, ncclComm_t* newcomm) {
+  NCCLCHECK(resizeCheck(comm, newcomm, "CommGrow"));
+  if (nranks < comm->nRanks) {
+    WARN("CommGrow : can't grow from %d to %d ranks", comm->nRanks, nranks);
+    return ncclInvalidArgument;
+  }
+
+  int savedDev;
+  CUDACHECK(cudaGetDevice(&savedDev));
+  ncclResult_t ret = ncclSuccess;
+  // New ranks join with ncclCommInitRank, and have no parent
+  struct ncclSplitInfo split = { comm, NULL, NULL, 1 };
+  *newcomm = NULL;
+  CUDACHECKGOTO(cudaSetDevice(comm->cudaDev), ret, end);
+  NCCLCHECKGOTO(commQuiesce(comm, 0), ret, end);
+  NCCLCHECKGOTO(ncclCalloc(&split.parentRanks, nranks), ret, end);
+  for (int r=0; r<nranks; r++) split.parentRanks[r] = r < comm->nRanks ? r : -1;
+  NCCLCHECKGOTO(commInitRank(newcomm, nranks, commId, comm->rank, &split), ret, end);
+end:
+  free(split.parentRanks);
+  CUDACHECK(cudaSetDevice(savedDev));
+  return ret;
+}
+
 NCCL_API(ncclResult_t, ncclCommAbort, ncclComm_t comm);
 ncclResult_t ncclCommAbort(ncclComm_t comm) {
   if (comm == NULL)
     return ncclSuccess;
+  // The bootstrap can't be interrupted : wait for initialization to end
+  if (!commWaitInit(comm)) {
+    free(comm);
+    return ncclSuccess;
+  }
 
   // Ask anything that might still be running on the device to quit
   *comm->abortFlag = 1;
@@ -1230,6 +2098,7 @@ const char* ncclGetErrorString(ncclResult_t code) {
     case ncclInternalError          : return "internal error";
     case ncclInvalidArgument        : return "invalid argument";
     case ncclInvalidUsage           : return "invalid usage";
+    case ncclInProgress             : return "operation in progress";
     default                         : return "unknown result code";
   }
 }
@@ -1239,6 +2108,13 @@ ncclResult_t ncclCommGetAsyncError(ncclComm_t comm, ncclResult_t *asyncError) {
   NCCLCHECK(PtrCheck(comm, "ncclGetAsyncError", "comm"));
   NCCLCHECK(PtrCheck(asyncError, "ncclGetAsyncError", "asyncError"));
 
+  // Initialization in progress (ncclCommInitRankAsync) or failed
+  ncclResult_t initState = __atomic_load_n(&comm->initState, __ATOMIC_ACQUIRE);
+  if (initState != ncclSuccess) {
+    *asyncError = initState;
+    return ncclSuccess;
+  }
+
   // Check device reported error
   static ncclDevError_t printedDevErr = ncclDevSuccess;
   switch(*comm->fatalDevError) {
@@ -1270,6 +2146,7 @@ ncclResult_t ncclCommGetAsyncError(ncclComm_t comm, ncclResult_t *asyncError) {
 NCCL_API(ncclResult_t, ncclCommCount, const ncclComm_t comm, int* count);
 ncclResult_t ncclCommCount(const ncclComm_t comm, int* count) {
   NCCLCHECK(PtrCheck(comm, "CommCount", "comm"));
+  NCCLCHECK(ncclCommCheckReady(comm));
   NCCLCHECK(PtrCheck(count, "CommCount", "count"));
   *count = comm->nRanks;
   return ncclSuccess;
@@ -1278,6 +2155,7 @@ ncclResult_t ncclCommCount(const ncclComm_t comm, int* count) {
 NCCL_API(ncclResult_t, ncclCommCuDevice, const ncclComm_t comm, int* devid);
 ncclResult_t ncclCommCuDevice(const ncclComm_t comm, int* devid) {
   NCCLCHECK(PtrCheck(comm, "CommCuDevice", "comm"));
+  NCCLCHECK(ncclCommCheckReady(comm));
   NCCLCHECK(PtrCheck(devid, "CommCuDevice", "devid"));
   *devid = comm->cudaDev;
   return ncclSuccess;
@@ -1286,7 +2164,160 @@ ncclResult_t ncclCommCuDevice(const ncclComm_t comm, int* devid) {
 NCCL_API(ncclResult_t, ncclCommUserRank, const ncclComm_t comm, int* rank);
 ncclResult_t ncclCommUserRank(const ncclComm_t comm, int* rank) {
   NCCLCHECK(PtrCheck(comm, "CommUserRank", "comm"));
+  NCCLCHECK(ncclCommCheckReady(comm));
   NCCLCHECK(PtrCheck(rank, "CommUserRank", "rank"));
   *rank = comm->rank;
   return ncclSuccess;
 }
+
+NCCL_API(ncclResult_t, ncclCommGetStats, const ncclComm_t comm, ncclStats_t* stats);
+ncclResult_t ncclCommGetStats(const ncclComm_t comm, ncclStats_t* stats) {
+  NCCLCHECK(PtrCheck(comm, "CommGetStats", "comm"));
+  NCCLCHECK(ncclCommCheckReady(comm));
+  NCCLCHECK(PtrCheck(stats, "CommGetStats", "stats"));
+  // All counters are 64-bit : read them one by one so that none is torn
+  unsigned long long* src = (unsigned long long*)&comm->stats;
+  unsigned long long* dst = (unsigned long long*)stats;
+  for (int i=0; i<sizeof(ncclStats_t)/sizeof(unsigned long long); i++) dst[i] = __atomic_load_n(src+i, __ATOMIC_RELAXED);
+  struct ncclProxyState* proxyState = comm->proxyState;
+  if (proxyState) {
+    stats->proxyBusyNs = __atomic_load_n(&proxyState->busyTime, __ATOMIC_RELAXED);
+    stats->proxyIdleNs = __atomic_load_n(&proxyState->idleTime, __ATOMIC_RELAXED);
+  }
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclCommSetMaxCTAs, ncclComm_t comm, int maxCTAs);
+ncclResult_t ncclCommSetMaxCTAs(ncclComm_t comm, int maxCTAs) {
+  NCCLCHECK(PtrCheck(comm, "CommSetMaxCTAs", "comm"));
+  NCCLCHECK(ncclCommCheckReady(comm));
+  if (maxCTAs < 0) {
+    WARN("CommSetMaxCTAs : invalid maxCTAs %d", maxCTAs);
+    return ncclInvalidArgument;
+  }
+  comm->maxCTAs = maxCTAs;
+  INFO(NCCL_INIT, "comm %p rank %d collectives limited to %d CTAs", comm, comm->rank, maxCTAs ? std::min(maxCTAs, comm->nChannels) : comm->nChannels);
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclCommRegister, const ncclComm_t comm, void* buff, size_t size, void** handle);
+ncclResult_t ncclCommRegister(const ncclComm_t comm, void* buff, size_t size, void** handle) {
+  NCCLCHECK(PtrCheck(comm, "CommRegister", "comm"));
+  NCCLCHECK(ncclCommCheckReady(comm));
+  NCCLCHECK(PtrCheck(buff, "CommRegister", "buff"));
+  NCCLCHECK(PtrCheck(handle, "CommRegister", "handle"));
+  if (size == 0) {
+    WARN("CommRegister : invalid size 0");
+    return ncclInvalidArgument;
+  }
+  struct ncclRegBuffer* reg;
+  NCCLCHECK(ncclCalloc(&reg, 1));
+  reg->buff = buff;
+  reg->size = size;
+  pthread_mutex_init(&reg->mutex, NULL);
+  reg->next = comm->regBuffers;
+  comm->regBuffers = reg;
+  INFO(NCCL_INIT, "Registered buffer %p size %ld", buff, size);
+  *handle = reg;
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclCommDeregister, const ncclComm_t comm, void* handle);
+ncclResult_t ncclCommDeregister(const ncclComm_t comm, void* handle) {
+  NCCLCHECK(PtrCheck(comm, "CommDeregister", "comm"));
+  NCCLCHECK(ncclCommCheckReady(comm));
+  struct ncclRegBuffer** reg = &comm->regBuffers;
+  while (*reg && *reg != handle) reg = &(*reg)->next;
+  if (*reg == NULL) {
+    WARN("CommDeregister : unknown handle %p", handle);
+    return ncclInvalidArgument;
+  }
+  struct ncclRegBuffer* found = *reg;
+  *reg = found->next;
+  NCCLCHECK(regBufferFree(found));
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclRedOpCreatePreMulSum, ncclRedOp_t* op, void* scalar, ncclDataType_t datatype, ncclComm_t comm);
+ncclResult_t ncclRedOpCreatePreMulSum(ncclRedOp_t* op, void* scalar, ncclDataType_t datatype, ncclComm_t comm) {
+  NCCLCHECK(PtrCheck(comm, "RedOpCreatePreMulSum", "comm"));
+  NCCLCHECK(ncclCommCheckReady(comm));
+  NCCLCHECK(PtrCheck(op, "RedOpCreatePreMulSum", "op"));
+  NCCLCHECK(PtrCheck(scalar, "RedOpCreatePreMulSum", "scalar"));
+  if (datatype < 0 || datatype >= ncclNumTypes) {
+    WARN("RedOpCreatePreMulSum : invalid type %d", datatype);
+    return ncclInvalidArgument;
+  }
+  uint64_t used = comm->userRedOps | comm->userRedOpsDestroyed;
+  int slot = 0;
+  while (slot < NCCL_MAX_USER_REDOPS && (used & (1ULL<<slot))) slot++;
+  if (slot == NCCL_MAX_USER_REDOPS && comm->userRedOpsDestroyed) {
+    // Only destroyed slots are left : wait for the kernels which may use them
+    CUDACHECK(cudaEventSynchronize(comm->doneEvent));
+    comm->userRedOpsDestroyed = 0;
+    slot = 0;
+    while (slot < NCCL_MAX_USER_REDOPS && (comm->userRedOps & (1ULL<<slot))) slot++;
+  }
+  if (slot == NCCL_MAX_USER_REDOPS) {
+    WARN("RedOpCreatePreMulSum : too many operations (%d) on the communicator", NCCL_MAX_USER_REDOPS);
+    return ncclInvalidUsage;
+  }
+  uint64_t value = 0;
+  memcpy(&value, scalar, ncclTypeSize(datatype));
+  NCCLCHECK(ncclCudaMemcpy(comm->hostDevComm.redOpScalars+slot, &value, 1));
+  comm->userRedOps |= 1ULL<<slot;
+  comm->userRedOpTypes[slot] = datatype;
+  *op = (ncclRedOp_t)(ncclNumOps+slot);
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclRedOpDestroy, ncclRedOp_t op, ncclComm_t comm);
+ncclResult_t ncclRedOpDestroy(ncclRedOp_t op, ncclComm_t comm) {
+  NCCLCHECK(PtrCheck(comm, "RedOpDestroy", "comm"));
+  NCCLCHECK(ncclCommCheckReady(comm));
+  int slot = op - ncclNumOps;
+  if (op < ncclNumOps || slot >= NCCL_MAX_USER_REDOPS || (comm->userRedOps & (1ULL<<slot)) == 0) {
+    WARN("RedOpDestroy : %d was not created by ncclRedOpCreatePreMulSum on this communicator", op);
+    return ncclInvalidArgument;
+  }
+  comm->userRedOps &= ~(1ULL<<slot);
+  comm->userRedOpsDestroyed |= 1ULL<<slot;
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclReadyFlagsCreate, ncclReadyFlags_t* handle, unsigned int* flags, size_t chunkCount, ncclComm_t comm);
+ncclResult_t ncclReadyFlagsCreate(ncclReadyFlags_t* handle, unsigned int* flags, size_t chunkCount, ncclComm_t comm) {
+  NCCLCHECK(PtrCheck(comm, "ReadyFlagsCreate", "comm"));
+  NCCLCHECK(ncclCommCheckReady(comm));
+  NCCLCHECK(PtrCheck(handle, "ReadyFlagsCreate", "handle"));
+  NCCLCHECK(PtrCheck(flags, "ReadyFlagsCreate", "flags"));
+  if (chunkCount == 0) {
+    WARN("ReadyFlagsCreate : chunkCount must be at least 1");
+    return ncclInvalidArgument;
+  }
+  int slot = 0;
+  while (slot < NCCL_MAX_READY_FLAGS && (comm->userReadyFlags & (1U<<slot))) slot++;
+  if (slot == NCCL_MAX_READY_FLAGS) {
+    WARN("ReadyFlagsCreate : too many flag arrays (%d) on the communicator", NCCL_MAX_READY_FLAGS);
+    return ncclInvalidUsage;
+  }
+  struct ncclReadyFlags* ready = comm->readyFlags+slot;
+  ready->flags = flags;
+  ready->chunkCount = chunkCount;
+  NCCLCHECK(ncclCudaMemcpy(comm->hostDevComm.readyFlags+slot, ready, 1));
+  comm->userReadyFlags |= 1U<<slot;
+  *handle = slot;
+  return ncclSuccess;
+}
+
+NCCL_API(ncclResult_t, ncclReadyFlagsDestroy, ncclReadyFlags_t handle, ncclComm_t comm);
+ncclResult_t ncclReadyFlagsDestroy(ncclReadyFlags_t handle, ncclComm_t comm) {
+  NCCLCHECK(PtrCheck(comm, "ReadyFlagsDestroy", "comm"));
+  NCCLCHECK(ncclCommCheckReady(comm));
+  if (handle < 0 || handle >= NCCL_MAX_READY_FLAGS || (comm->userReadyFlags & (1U<<handle)) == 0) {
+    WARN("ReadyFlagsDestroy : %d was not created by ncclReadyFlagsCreate on this communicator", handle);
+    return ncclInvalidArgument;
+  }
+  comm->userReadyFlags &= ~(1U<<handle);
+  return ncclSuccess;
+}
@@ -7,6 +7,11 @@
 #include "argcheck.h"
 
 static ncclResult_t CudaPtrCheck(const void* pointer, struct ncclComm* comm, const char* ptrname, const char* opname) {
+  // Applications reuse the same buffers, avoid querying CUDA every time
+  if (pointer != NULL) {
+    for (int i=0; i<NCCL_VALID_PTRS; i++) if (comm->validPtrs[i] == pointer) return ncclSuccess;
+  }
+
   cudaPointerAttributes attr;
   cudaError_t err = cudaPointerGetAttributes(&attr, pointer);
   if (err != cudaSuccess || attr.devicePointer == NULL) {
@@ -21,6 +26,8 @@ static ncclResult_t CudaPtrCheck(const void* pointer, struct ncclComm* comm, con
     WARN("%s : %s allocated on device %d mismatchs with NCCL device %d", opname, ptrname, attr.device, comm->cudaDev);
     return ncclInvalidArgument;
   }
+  comm->validPtrs[comm->validPtrsNext] = pointer;
+  comm->validPtrsNext = (comm->validPtrsNext+1)%NCCL_VALID_PTRS;
   return ncclSuccess;
 }
 
@@ -36,28 +43,50 @@ ncclResult_t ArgsCheck(struct ncclInfo* info) {
   NCCLCHECK(PtrCheck(info->comm, info->opName, "comm"));
   // First, the easy ones
   if (info->root < 0 || info->root >= info->comm->nRanks) {
-    WARN("%s : invalid root %d (root should be in the 0..%d range)", info->opName, info->root, info->comm->nRanks);
+    WARN("%s : invalid %s %d (%s should be in the 0..%d range)", info->opName, info->coll == ncclCollSendRecv ? "peer" : "root", info->root,
+        info->coll == ncclCollSendRecv ? "peer" : "root", info->comm->nRanks);
     return ncclInvalidArgument;
   }
   if (info->datatype < 0 || info->datatype >= ncclNumTypes) {
     WARN("%s : invalid type %d", info->opName, info->datatype);
     return ncclInvalidArgument;
   }
-  // Type is OK, compute nbytes. Convert Allgather/Broadcast calls to chars.
+  // Type is OK, compute nbytes. Convert Allgather/Broadcast/SendRecv calls to chars.
   info->nBytes = info->count * ncclTypeSize(info->datatype);
-  if (info->coll == ncclCollAllGather || info->coll == ncclCollBroadcast) {
+  if (info->coll == ncclCollAllGather || info->coll == ncclCollBroadcast || info->coll == ncclCollSendRecv) {
     info->count = info->nBytes;
     info->datatype = ncclInt8;
   }
   if (info->coll == ncclCollAllGather || info->coll == ncclCollReduceScatter) info->nBytes *= info->comm->nRanks; // count is per rank
 
   if (info->op < 0 || info->op >= ncclNumOps) {
-    WARN("%s : invalid reduction operation %d", info->opName, info->op);
-    return ncclInvalidArgument;
+    // Operations created by ncclRedOpCreatePreMulSum
+    int slot = info->op - ncclNumOps;
+    if (info->op < 0 || slot >= NCCL_MAX_USER_REDOPS || (info->comm->userRedOps & (1ULL<<slot)) == 0) {
+      WARN("%s : invalid reduction operation %d", info->opName, info->op);
+      return ncclInvalidArgument;
+    }
+    if (info->comm->userRedOpTypes[slot] != info->datatype) {
+      WARN("%s : reduction operation %d was created for type %d, not %d", info->opName, info->op, info->comm->userRedOpTypes[slot], info->datatype);
+      return ncclInvalidArgument;
+    }
+    if (info->comm->nRanks == 1) {
+      // There is no kernel to apply the scalar with a single rank
+      WARN("%s : PreMulSum operations are not supported on single-rank communicators", info->opName);
+      return ncclInvalidUsage;
+    }
   }
 
   if (info->comm->checkPointers) {
     // Check CUDA device pointers
+    if (info->coll == ncclCollSendRecv) {
+      if (info->p2pSend) {
+        NCCLCHECK(CudaPtrCheck(info->sendbuff, info->comm, "sendbuff", info->opName));
+      } else {
+        NCCLCHECK(CudaPtrCheck(info->recvbuff, info->comm, "recvbuff", info->opName));
+      }
+      return ncclSuccess;
+    }
     if (info->coll != ncclCollBroadcast || info->comm->rank == info->root) {
       NCCLCHECK(CudaPtrCheck(info->sendbuff, info->comm, "sendbuff", info->opName));
     }
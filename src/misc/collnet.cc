@@ -0,0 +1,256 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "collnet.h"
+#include "transport.h"
+#include "bootstrap.h"
+#include "net.h"
+#include "param.h"
+
+NCCL_PARAM(CollNetBuffSize, "COLLNET_BUFFSIZE", 1<<22);
+
+struct collNetInfo {
+  int ok;
+  char handle[NCCL_NET_HANDLE_MAXSIZE];
+};
+
+// All ranks must agree, a failure on any leader disables the collective
+// network everywhere
+static ncclResult_t collNetAllOk(struct ncclComm* comm, struct collNetInfo* infos, int* ok) {
+  NCCLCHECK(bootstrapAllGather(comm->bootstrap, infos, sizeof(struct collNetInfo)));
+  *ok = 1;
+  for (int r=0; r<comm->nRanks; r++) *ok &= infos[r].ok;
+  return ncclSuccess;
+}
+
+static ncclResult_t collNetLeaderAlloc(struct ncclComm* comm, struct ncclCollNetComm* collNet) {
+  NCCLCHECK(ncclPoolHostAlloc(&comm->memPool, (void**)&collNet->hostBuff, (void**)&collNet->devBuff, 2*collNet->buffSize));
+  CUDACHECK(cudaStreamCreateWithFlags(&collNet->stream, cudaStreamNonBlocking));
+  for (int s=0; s<2; s++) {
+    CUDACHECK(cudaEventCreateWithFlags(collNet->reduced+s, cudaEventDisableTiming));
+    CUDACHECK(cudaEventCreateWithFlags(collNet->netDone+s, cudaEventDisableTiming));
+  }
+  CUDACHECK(cudaEventCreateWithFlags(&collNet->doneEvent, cudaEventDisableTiming));
+  return ncclSuccess;
+}
+
+static ncclResult_t collNetConnect(struct ncclComm* comm, struct ncclCollNetComm* collNet, int* nodes, int nNodes, int myNode) {
+  struct collNetInfo* infos;
+  NCCLCHECK(ncclCalloc(&infos, comm->nRanks));
+  struct collNetInfo* myInfo = infos+comm->rank;
+  void* listenComm = NULL;
+  void** handles = NULL;
+  ncclResult_t ret = ncclSuccess;
+  int ok;
+
+  myInfo->ok = ncclCollNet != NULL;
+  if (collNet->leader && myInfo->ok) {
+    // Leaders are the first rank of their node, which uses the first device
+    collNet->buffSize = ncclParamCollNetBuffSize();
+    myInfo->ok =
+      ncclCollNetListen(0, myInfo->handle, &listenComm) == ncclSuccess &&
+      collNetLeaderAlloc(comm, collNet) == ncclSuccess;
+  }
+  NCCLCHECKGOTO(collNetAllOk(comm, infos, &ok), ret, exit);
+  if (ok == 0) goto exit;
+
+  if (collNet->leader) {
+    NCCLCHECKGOTO(ncclCalloc(&handles, nNodes), ret, exit);
+    for (int n=0; n<nNodes; n++) handles[n] = infos[nodes[n]].handle;
+    myInfo->ok =
+      ncclCollNetConnect(handles, nNodes, myNode, listenComm, &collNet->collComm) == ncclSuccess &&
+      ncclCollNetRegMr(collNet->collComm, collNet->hostBuff, 2*collNet->buffSize, NCCL_PTR_HOST, &collNet->mhandle) == ncclSuccess;
+  }
+  NCCLCHECKGOTO(collNetAllOk(comm, infos, &ok), ret, exit);
+  collNet->enabled = ok;
+
+exit:
+  if (listenComm) ncclCollNetCloseListen(listenComm);
+  free(handles);
+  free(infos);
+  return ret;
+}
+
+// The leader of each node is its first rank, hence rank 0 of the node comm
+static ncclResult_t collNetSetup(struct ncclComm* comm) {
+  struct ncclCollNetComm* collNet;
+  NCCLCHECK(ncclCalloc(&collNet, 1));
+  collNet->comm = comm;
+  comm->collNet = collNet;
+
+  int* nodes;
+  NCCLCHECK(ncclCalloc(&nodes, comm->nRanks));
+  int nNodes = 0, myNode = -1;
+  for (int r=0; r<comm->nRanks; r++) {
+    int n;
+    for (n=0; n<nNodes; n++) {
+      if (comm->peerInfo[nodes[n]].hostHash == comm->peerInfo[r].hostHash) break;
+    }
+    if (n == nNodes) nodes[nNodes++] = r;
+    if (r == comm->rank) myNode = n;
+  }
+  collNet->leader = nodes[myNode] == comm->rank;
+
+  ncclResult_t ret = ncclSuccess;
+  if (nNodes == 1) {
+    INFO(NCCL_INIT, "Collective network disabled : single node");
+    goto exit;
+  }
+  NCCLCHECKGOTO(collNetConnect(comm, collNet, nodes, nNodes, myNode), ret, exit);
+  if (collNet->enabled == 0) {
+    INFO(NCCL_INIT, "Collective network disabled : not available on all nodes");
+    NCCLCHECKGOTO(ncclCollNetFree(comm), ret, exit);
+    // Keep the decision, not the resources
+    NCCLCHECKGOTO(ncclCalloc(&comm->collNet, 1), ret, exit);
+    goto exit;
+  }
+  NCCLCHECKGOTO(ncclCommSplit(comm, myNode, comm->rank, &collNet->nodeComm), ret, exit);
+  INFO(NCCL_INIT, "Collective network %s enabled : %d nodes, %ld bytes per step", ncclCollNet->name, nNodes, collNet->buffSize);
+exit:
+  free(nodes);
+  return ret;
+}
+
+ncclResult_t ncclCollNetCheck(struct ncclInfo* info, bool capturing, bool* use) {
+  struct ncclComm* comm = info->comm;
+  *use = false;
+  if (comm->collNetEnable == 0 || comm->bootstrap == NULL || info->coll != ncclCollAllReduce) return ncclSuccess;
+  // The average would be divided by the number of ranks of each node, and
+  // user operations are bound to this communicator. Host reductions are not
+  // part of graphs either, since they free their arguments.
+  if (info->op >= ncclAvg || capturing || info->count == 0) return ncclSuccess;
+  if (comm->collNet == NULL) NCCLCHECK(collNetSetup(comm));
+  if (comm->collNet->enabled == 0) return ncclSuccess;
+  int supported;
+  NCCLCHECK(ncclCollNetReduceSupport(info->datatype, info->op, &supported));
+  *use = supported == 1;
+  return ncclSuccess;
+}
+
+struct collNetStep {
+  struct ncclCollNetComm* collNet;
+  int slot;
+  int count;
+  ncclDataType_t datatype;
+  ncclRedOp_t op;
+};
+
+static ncclResult_t collNetStepRun(struct collNetStep* step) {
+  struct ncclCollNetComm* collNet = step->collNet;
+  volatile uint32_t* abortFlag = collNet->comm->abortFlag;
+  char* buff = collNet->hostBuff + step->slot*collNet->buffSize;
+  void* request = NULL;
+  while (request == NULL) {
+    NCCLCHECK(ncclCollNetIallreduce(collNet->collComm, buff, buff, step->count, step->datatype, step->op,
+          collNet->mhandle, collNet->mhandle, &request));
+    if (*abortFlag) return ncclSystemError;
+  }
+  int done = 0;
+  while (done == 0) {
+    NCCLCHECK(ncclCollNetTest(request, &done, NULL));
+    if (*abortFlag) return ncclSystemError;
+  }
+  return ncclSuccess;
+}
+
+// Runs on the CUDA callback thread, between the reduce and the broadcast of
+// the node. Errors are reported as asynchronous errors of the communicator.
+#if CUDART_VERSION >= 10000
+static void CUDART_CB collNetHostAllReduce(void* data) {
+#else
+static void CUDART_CB collNetHostAllReduce(cudaStream_t stream, cudaError_t status, void* data) {
+#endif
+  struct collNetStep* step = (struct collNetStep*)data;
+  struct ncclComm* comm = step->collNet->comm;
+  if (comm->fatalError == ncclSuccess) {
+    ncclResult_t ret = collNetStepRun(step);
+    if (ret != ncclSuccess) {
+      WARN("Collective network allreduce of %d elements failed : %d", step->count, ret);
+      comm->fatalError = ret;
+    }
+  }
+  free(step);
+}
+
+// Step s of info is reduced into slot s%2 of the leader, which then hands it
+// to the network on the collective network stream
+static ncclResult_t collNetReduceStep(struct ncclInfo* info, size_t s, size_t stepCount) {
+  struct ncclCollNetComm* collNet = info->comm->collNet;
+  size_t typeSize = ncclTypeSize(info->datatype);
+  size_t offset = s*stepCount;
+  size_t count = std::min(stepCount, info->count-offset);
+  int slot = s%2;
+  // recvbuff is only used by the root of the reduce
+  char* recvbuff = collNet->leader ? collNet->devBuff + slot*collNet->buffSize : (char*)info->recvbuff + offset*typeSize;
+  NCCLCHECK(ncclReduce((const char*)info->sendbuff + offset*typeSize, recvbuff, count, info->datatype, info->op, 0, collNet->nodeComm, info->stream));
+  if (collNet->leader == 0) return ncclSuccess;
+
+  CUDACHECK(cudaEventRecord(collNet->reduced[slot], info->stream));
+  CUDACHECK(cudaStreamWaitEvent(collNet->stream, collNet->reduced[slot], 0));
+  struct collNetStep* step;
+  NCCLCHECK(ncclCalloc(&step, 1));
+  step->collNet = collNet;
+  step->slot = slot;
+  step->count = count;
+  step->datatype = info->datatype;
+  step->op = info->op;
+#if CUDART_VERSION >= 10000
+  CUDACHECK(cudaLaunchHostFunc(collNet->stream, collNetHostAllReduce, step));
+#else
+  CUDACHECK(cudaStreamAddCallback(collNet->stream, collNetHostAllReduce, step, 0));
+#endif
+  CUDACHECK(cudaEventRecord(collNet->netDone[slot], collNet->stream));
+  return ncclSuccess;
+}
+
+static ncclResult_t collNetBroadcastStep(struct ncclInfo* info, size_t s, size_t stepCount) {
+  struct ncclCollNetComm* collNet = info->comm->collNet;
+  size_t typeSize = ncclTypeSize(info->datatype);
+  size_t offset = s*stepCount;
+  size_t count = std::min(stepCount, info->count-offset);
+  int slot = s%2;
+  char* recvbuff = (char*)info->recvbuff + offset*typeSize;
+  // sendbuff is only used by the root of the broadcast
+  if (collNet->leader) CUDACHECK(cudaStreamWaitEvent(info->stream, collNet->netDone[slot], 0));
+  NCCLCHECK(ncclBroadcast(collNet->leader ? collNet->devBuff + slot*collNet->buffSize : recvbuff, recvbuff, count, info->datatype, 0, collNet->nodeComm, info->stream));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclCollNetAllReduce(struct ncclInfo* info) {
+  struct ncclCollNetComm* collNet = info->comm->collNet;
+  size_t stepCount = collNet->buffSize / ncclTypeSize(info->datatype);
+  size_t nSteps = DIVUP(info->count, stepCount);
+  if (collNet->leader) CUDACHECK(cudaStreamWaitEvent(info->stream, collNet->doneEvent, 0));
+  TRACE(NCCL_COLL, "Collective network allreduce : %ld elements in %ld steps of %ld", info->count, nSteps, stepCount);
+  // All ranks issue the node operations in the same order : the reduce of
+  // step s is enqueued before the broadcast of step s-1, so that it runs
+  // while the leader's network step s-1 is in flight. Slot s%2 is reused by
+  // step s+2 only after the broadcast of step s.
+  for (size_t s=0; s<=nSteps; s++) {
+    if (s < nSteps) NCCLCHECK(collNetReduceStep(info, s, stepCount));
+    if (s > 0) NCCLCHECK(collNetBroadcastStep(info, s-1, stepCount));
+  }
+  if (collNet->leader) CUDACHECK(cudaEventRecord(collNet->doneEvent, info->stream));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclCollNetFree(struct ncclComm* comm) {
+  struct ncclCollNetComm* collNet = comm->collNet;
+  if (collNet == NULL) return ncclSuccess;
+  if (collNet->nodeComm) NCCLCHECK(ncclCommDestroy(collNet->nodeComm));
+  if (collNet->mhandle) NCCLCHECK(ncclCollNetDeregMr(collNet->collComm, collNet->mhandle));
+  if (collNet->collComm) NCCLCHECK(ncclCollNetCloseColl(collNet->collComm));
+  for (int s=0; s<2; s++) {
+    if (collNet->reduced[s]) CUDACHECK(cudaEventDestroy(collNet->reduced[s]));
+    if (collNet->netDone[s]) CUDACHECK(cudaEventDestroy(collNet->netDone[s]));
+  }
+  if (collNet->doneEvent) CUDACHECK(cudaEventDestroy(collNet->doneEvent));
+  if (collNet->stream) CUDACHECK(cudaStreamDestroy(collNet->stream));
+  NCCLCHECK(ncclMemPoolFree(collNet->hostBuff));
+  free(collNet);
+  comm->collNet = NULL;
+  return ncclSuccess;
+}
@@ -0,0 +1,223 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "copyengine.h"
+#include "bootstrap.h"
+#include "transport.h"
+#include "param.h"
+
+NCCL_PARAM(CeBuffSize, "CE_BUFFSIZE", 16*1024*1024);
+
+extern struct ncclTransport p2pTransport;
+
+struct ncclCopyEngineInfo {
+  int canUse;
+  uint64_t pidHash;
+  cudaIpcMemHandle_t buffIpc;
+  cudaIpcEventHandle_t readyIpc;
+  cudaIpcEventHandle_t doneIpc;
+};
+
+// Mapping buffers and events requires one rank per process, on one node,
+// with P2P access to all other GPUs.
+static ncclResult_t localSetup(struct ncclComm* comm, struct ncclCopyEngine* ce, struct ncclCopyEngineInfo* info) {
+  struct ncclPeerInfo* myInfo = comm->peerInfo+comm->rank;
+  for (int r=0; r<comm->nRanks; r++) {
+    if (r == comm->rank) continue;
+    struct ncclPeerInfo* peerInfo = comm->peerInfo+r;
+    if (peerInfo->hostHash != myInfo->hostHash || peerInfo->pidHash == myInfo->pidHash) return ncclSuccess;
+    ncclTvalue_t p2p;
+    NCCLCHECK(p2pTransport.canConnect(&p2p, myInfo, peerInfo));
+    if (p2p == 0) return ncclSuccess;
+  }
+
+  ce->buffSize = ncclParamCeBuffSize();
+  NCCLCHECK(ncclCudaCalloc(&ce->buff, ce->buffSize));
+  CUDACHECK(cudaIpcGetMemHandle(&info->buffIpc, ce->buff));
+  CUDACHECK(cudaEventCreateWithFlags(&ce->readyEvent, cudaEventDisableTiming | cudaEventInterprocess));
+  CUDACHECK(cudaIpcGetEventHandle(&info->readyIpc, ce->readyEvent));
+  CUDACHECK(cudaEventCreateWithFlags(&ce->doneEvent, cudaEventDisableTiming | cudaEventInterprocess));
+  CUDACHECK(cudaIpcGetEventHandle(&info->doneIpc, ce->doneEvent));
+  info->canUse = 1;
+  return ncclSuccess;
+}
+
+static ncclResult_t openPeers(struct ncclComm* comm, struct ncclCopyEngine* ce, struct ncclCopyEngineInfo* allInfo) {
+  for (int r=0; r<comm->nRanks; r++) {
+    if (r == comm->rank) continue;
+    CUDACHECK(cudaIpcOpenMemHandle((void**)ce->peerBuffs+r, allInfo[r].buffIpc, cudaIpcMemLazyEnablePeerAccess));
+    CUDACHECK(cudaIpcOpenEventHandle(ce->peerReadyEvents+r, allInfo[r].readyIpc));
+    CUDACHECK(cudaIpcOpenEventHandle(ce->peerDoneEvents+r, allInfo[r].doneIpc));
+  }
+  ce->peerBuffs[comm->rank] = ce->buff;
+  ce->peerReadyEvents[comm->rank] = ce->readyEvent;
+  ce->peerDoneEvents[comm->rank] = ce->doneEvent;
+  return ncclSuccess;
+}
+
+static ncclResult_t release(struct ncclComm* comm, struct ncclCopyEngine* ce) {
+  for (int r=0; r<comm->nRanks; r++) {
+    if (r == comm->rank) continue;
+    if (ce->peerBuffs[r]) CUDACHECK(cudaIpcCloseMemHandle(ce->peerBuffs[r]));
+    if (ce->peerReadyEvents[r]) CUDACHECK(cudaEventDestroy(ce->peerReadyEvents[r]));
+    if (ce->peerDoneEvents[r]) CUDACHECK(cudaEventDestroy(ce->peerDoneEvents[r]));
+    ce->peerBuffs[r] = NULL;
+    ce->peerReadyEvents[r] = ce->peerDoneEvents[r] = NULL;
+  }
+  if (ce->buff) CUDACHECK(cudaFree(ce->buff));
+  if (ce->readyEvent) CUDACHECK(cudaEventDestroy(ce->readyEvent));
+  if (ce->doneEvent) CUDACHECK(cudaEventDestroy(ce->doneEvent));
+  ce->buff = NULL;
+  ce->readyEvent = ce->doneEvent = NULL;
+  return ncclSuccess;
+}
+
+static ncclResult_t barrier(struct ncclComm* comm) {
+  return bootstrapAllGather(comm->bootstrap, comm->copyEngine->barrier, sizeof(int));
+}
+
+// All ranks must agree on using the copy engines, so local failures only
+// disable the path, and are combined through the bootstrap.
+static ncclResult_t copyEngineSetup(struct ncclComm* comm) {
+  int nranks = comm->nRanks;
+  struct ncclCopyEngine* ce;
+  NCCLCHECK(ncclCalloc(&ce, 1));
+  comm->copyEngine = ce;
+  NCCLCHECK(ncclCalloc(&ce->peerBuffs, nranks));
+  NCCLCHECK(ncclCalloc(&ce->peerReadyEvents, nranks));
+  NCCLCHECK(ncclCalloc(&ce->peerDoneEvents, nranks));
+  NCCLCHECK(ncclCalloc(&ce->barrier, nranks));
+
+  ncclResult_t ret = ncclSuccess;
+  struct ncclCopyEngineInfo* allInfo;
+  NCCLCHECK(ncclCalloc(&allInfo, nranks));
+  if (localSetup(comm, ce, allInfo+comm->rank) != ncclSuccess) {
+    INFO(NCCL_INIT, "Copy engine setup failed, using kernels for AllGather/Broadcast");
+    allInfo[comm->rank].canUse = 0;
+  }
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, allInfo, sizeof(struct ncclCopyEngineInfo)), ret, end);
+
+  ce->enabled = 1;
+  for (int r=0; r<nranks; r++) ce->enabled &= allInfo[r].canUse;
+  ce->barrier[comm->rank] = ce->enabled && openPeers(comm, ce, allInfo) == ncclSuccess;
+  NCCLCHECKGOTO(barrier(comm), ret, end);
+  for (int r=0; r<nranks; r++) ce->enabled &= ce->barrier[r];
+
+  if (ce->enabled) {
+    INFO(NCCL_INIT, "Using copy engines for AllGather/Broadcast of %ld bytes and more", comm->ceThreshold);
+  } else {
+    NCCLCHECKGOTO(release(comm, ce), ret, end);
+  }
+end:
+  free(allInfo);
+  return ret;
+}
+
+ncclResult_t ncclCopyEngineCheck(struct ncclInfo* info, bool* use) {
+  struct ncclComm* comm = info->comm;
+  *use = false;
+  if (comm->ceThreshold <= 0 || comm->bootstrap == NULL || comm->nRanks == 1) return ncclSuccess;
+  if (info->coll != ncclCollAllGather && info->coll != ncclCollBroadcast) return ncclSuccess;
+  // Peers are read at uniform offsets
+  if (info->counts) return ncclSuccess;
+  // AllGather sizes are the whole output, compare what each rank contributes
+  size_t nBytes = info->coll == ncclCollAllGather ? info->nBytes/comm->nRanks : info->nBytes;
+  if (nBytes < comm->ceThreshold) return ncclSuccess;
+  if (comm->copyEngine == NULL) NCCLCHECK(copyEngineSetup(comm));
+  *use = comm->copyEngine->enabled;
+  return ncclSuccess;
+}
+
+static ncclResult_t waitPeers(struct ncclComm* comm, cudaEvent_t* events, cudaStream_t stream) {
+  for (int r=0; r<comm->nRanks; r++) {
+    if (r != comm->rank) CUDACHECK(cudaStreamWaitEvent(stream, events[r], 0));
+  }
+  return ncclSuccess;
+}
+
+// Each rank stages a chunk of its data, then pulls the chunks of all other
+// ranks. The staging buffer is reused once all peers are done reading it.
+static ncclResult_t ceAllGather(struct ncclInfo* info) {
+  struct ncclComm* comm = info->comm;
+  struct ncclCopyEngine* ce = comm->copyEngine;
+  int rank = comm->rank;
+  int nranks = comm->nRanks;
+  const char* sendbuff = (const char*)info->sendbuff;
+  char* recvbuff = (char*)info->recvbuff;
+  // Bytes sent by each rank
+  size_t nBytes = info->nBytes/nranks;
+  cudaStream_t stream = info->stream;
+
+  for (size_t offset=0; offset<nBytes; offset+=ce->buffSize) {
+    size_t size = std::min(ce->buffSize, nBytes-offset);
+    CUDACHECK(cudaMemcpyAsync(ce->buff, sendbuff+offset, size, cudaMemcpyDeviceToDevice, stream));
+    CUDACHECK(cudaEventRecord(ce->readyEvent, stream));
+    NCCLCHECK(barrier(comm));
+    for (int i=1; i<nranks; i++) {
+      // Start with the next rank so that staging buffers are not all read at once
+      int peer = (rank+i)%nranks;
+      CUDACHECK(cudaStreamWaitEvent(stream, ce->peerReadyEvents[peer], 0));
+      CUDACHECK(cudaMemcpyAsync(recvbuff+peer*nBytes+offset, ce->peerBuffs[peer], size, cudaMemcpyDeviceToDevice, stream));
+    }
+    CUDACHECK(cudaEventRecord(ce->doneEvent, stream));
+    NCCLCHECK(barrier(comm));
+    NCCLCHECK(waitPeers(comm, ce->peerDoneEvents, stream));
+  }
+  if (sendbuff != recvbuff+rank*nBytes) {
+    CUDACHECK(cudaMemcpyAsync(recvbuff+rank*nBytes, sendbuff, nBytes, cudaMemcpyDeviceToDevice, stream));
+  }
+  return ncclSuccess;
+}
+
+static ncclResult_t ceBroadcast(struct ncclInfo* info) {
+  struct ncclComm* comm = info->comm;
+  struct ncclCopyEngine* ce = comm->copyEngine;
+  int root = info->root;
+  bool isRoot = comm->rank == root;
+  const char* sendbuff = (const char*)info->sendbuff;
+  char* recvbuff = (char*)info->recvbuff;
+  size_t nBytes = info->nBytes;
+  cudaStream_t stream = info->stream;
+
+  if (isRoot && sendbuff != recvbuff) {
+    CUDACHECK(cudaMemcpyAsync(recvbuff, sendbuff, nBytes, cudaMemcpyDeviceToDevice, stream));
+  }
+  for (size_t offset=0; offset<nBytes; offset+=ce->buffSize) {
+    size_t size = std::min(ce->buffSize, nBytes-offset);
+    if (isRoot) {
+      CUDACHECK(cudaMemcpyAsync(ce->buff, sendbuff+offset, size, cudaMemcpyDeviceToDevice, stream));
+      CUDACHECK(cudaEventRecord(ce->readyEvent, stream));
+    }
+    NCCLCHECK(barrier(comm));
+    if (!isRoot) {
+      CUDACHECK(cudaStreamWaitEvent(stream, ce->peerReadyEvents[root], 0));
+      CUDACHECK(cudaMemcpyAsync(recvbuff+offset, ce->peerBuffs[root], size, cudaMemcpyDeviceToDevice, stream));
+      CUDACHECK(cudaEventRecord(ce->doneEvent, stream));
+    }
+    NCCLCHECK(barrier(comm));
+    if (isRoot) NCCLCHECK(waitPeers(comm, ce->peerDoneEvents, stream));
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclCopyEngineColl(struct ncclInfo* info) {
+  TRACE(NCCL_COLL, "%s of %ld bytes on copy engines", info->opName, info->nBytes);
+  if (info->coll == ncclCollAllGather) return ceAllGather(info);
+  return ceBroadcast(info);
+}
+
+ncclResult_t ncclCopyEngineFree(struct ncclComm* comm) {
+  struct ncclCopyEngine* ce = comm->copyEngine;
+  if (ce == NULL) return ncclSuccess;
+  NCCLCHECK(release(comm, ce));
+  free(ce->peerBuffs);
+  free(ce->peerReadyEvents);
+  free(ce->peerDoneEvents);
+  free(ce->barrier);
+  free(ce);
+  comm->copyEngine = NULL;
+  return ncclSuccess;
+}
@@ -70,6 +70,13 @@ void* ncclAsyncThreadMain(void* args_) {
   return args;
 }
 
+void* ncclAsyncThreadP2pConnect(void* args_) {
+  struct ncclAsyncArgs* args = (struct ncclAsyncArgs*)args_;
+  CHECK(ncclSetDevice(args->coll.comm->cudaDev));
+  CHECK(ncclP2pConnect(args->coll.comm));
+  return args;
+}
+
 ncclResult_t ncclAsyncInit(ncclInitFunc_t func, int cudaDev, ncclComm_t* newcomm, int ndev, ncclUniqueId commId, int myrank) {
   if (ncclGroupIndex >= MAX_ASYNC_OPS) {
     WARN("Too many async operations in progress, max is %d", MAX_ASYNC_OPS);
@@ -119,11 +126,77 @@ ncclResult_t ncclGroupEnd() {
   CUDACHECK(cudaGetDevice(&savedDev));
   int done = ncclGroupIndex;
   int doneArray[MAX_ASYNC_OPS];
-  for (int i=0; i<ncclGroupIndex; i++) doneArray[i] = 0;
+  int connectArray[MAX_ASYNC_OPS];
+  int launchArray[MAX_ASYNC_OPS];
+  for (int i=0; i<ncclGroupIndex; i++) doneArray[i] = connectArray[i] = launchArray[i] = 0;
+  int nColls = 0;
 
   ncclResult_t ret = ncclGroupError;
+  int p2pThreads = 0;
   if (ret != ncclSuccess) goto group_cleanup;
 
+  /* Send/Recv operations may need to connect to new peers first, and
+   * collectives to the trees. This talks to other ranks, so we need one thread
+   * per communicator if there are several of them in the group. Once
+   * connected, save the operations.
+   */
+  for (int i=0; i<ncclGroupIndex; i++) {
+    struct ncclAsyncArgs* args = ncclGroupArgs+i;
+    if (args->funcType == ASYNC_FUNC_COLL && (args->coll.comm->p2pCount || args->coll.comm->treeRequested)) {
+      if (ncclGroupIndex == 1) {
+        CUDACHECKGOTO(cudaSetDevice(args->coll.comm->cudaDev), ret, group_cleanup);
+        NCCLCHECKGOTO(ncclP2pConnect(args->coll.comm), ret, group_cleanup);
+      } else {
+        args->ret = ncclSuccess;
+        pthread_create(ncclGroupThreads+i, NULL, ncclAsyncThreadP2pConnect, args);
+        connectArray[i] = 1;
+        p2pThreads++;
+      }
+    }
+  }
+  if (p2pThreads) {
+    for (int i=0; i<ncclGroupIndex; i++) {
+      struct ncclAsyncArgs* args = ncclGroupArgs+i;
+      if (connectArray[i]) {
+        if (pthread_join(ncclGroupThreads[i], NULL) != 0) {
+          WARN("Error waiting for the Send/Recv connection thread");
+          ret = ncclSystemError;
+        } else if (args->ret != ncclSuccess) {
+          ret = args->ret;
+        }
+      }
+    }
+    if (ret != ncclSuccess) goto group_cleanup;
+  }
+  for (int i=0; i<ncclGroupIndex; i++) {
+    struct ncclAsyncArgs* args = ncclGroupArgs+i;
+    if (args->funcType == ASYNC_FUNC_COLL && args->coll.comm->p2pCount) {
+      CUDACHECKGOTO(cudaSetDevice(args->coll.comm->cudaDev), ret, group_cleanup);
+      NCCLCHECKGOTO(ncclSaveP2pKernels(args->coll.comm), ret, group_cleanup);
+    }
+  }
+  for (int i=0; i<ncclGroupIndex; i++) {
+    struct ncclAsyncArgs* args = ncclGroupArgs+i;
+    if (args->funcType == ASYNC_FUNC_COLL && args->coll.comm->nFusionOps) {
+      CUDACHECKGOTO(cudaSetDevice(args->coll.comm->cudaDev), ret, group_cleanup);
+      NCCLCHECKGOTO(ncclSaveFusedColls(args->coll.comm), ret, group_cleanup);
+    }
+  }
+
+  /* NCCL_LAUNCH_MODE=PIPELINE : when the group has several communicators,
+   * their launcher threads launch on all devices in parallel, each going
+   * through the three steps below (and the CPU barrier between them) on its
+   * own. All posted launches must be waited for, even if another one failed.
+   */
+  for (int i=0; i<ncclGroupIndex; i++) nColls += ncclGroupArgs[i].funcType == ASYNC_FUNC_COLL;
+  for (int i=0; i<ncclGroupIndex && nColls > 1; i++) {
+    struct ncclAsyncArgs* args = ncclGroupArgs+i;
+    if (args->funcType == ASYNC_FUNC_COLL && ncclLaunchPipelined(args->coll.comm)) {
+      if ((ret = ncclLaunchPost(args->coll.comm)) != ncclSuccess) goto launch_wait;
+      launchArray[i] = 1;
+    }
+  }
+
   /* Collectives are done in three steps :
    * 1. Barrier Check In. Only the last call may call cudaLaunchKernel[cooperative]
    * 2. Barrier Wait. No CUDA call is permitted
@@ -135,29 +208,44 @@ ncclResult_t ncclGroupEnd() {
    */
   for (int i=0; i<ncclGroupIndex; i++) {
     struct ncclAsyncArgs* args = ncclGroupArgs+i;
-    if (args->funcType == ASYNC_FUNC_COLL) {
+    if (args->funcType == ASYNC_FUNC_COLL && launchArray[i] == 0) {
       if (args->coll.comm->userStream == NULL)
-        CUDACHECKGOTO(cudaSetDevice(args->coll.comm->cudaDev), ret, end);
-      NCCLCHECKGOTO(ncclBarrierEnqueue(args->coll.comm), ret, end);
+        CUDACHECKGOTO(cudaSetDevice(args->coll.comm->cudaDev), ret, launch_wait);
+      NCCLCHECKGOTO(ncclBarrierEnqueue(args->coll.comm), ret, launch_wait);
     }
   }
   for (int i=0; i<ncclGroupIndex; i++) {
     struct ncclAsyncArgs* args = ncclGroupArgs+i;
-    if (args->funcType == ASYNC_FUNC_COLL) {
-      CUDACHECKGOTO(cudaSetDevice(args->coll.comm->cudaDev), ret, end);
-      NCCLCHECKGOTO(ncclBarrierEnqueueWait(args->coll.comm), ret, end);
+    if (args->funcType == ASYNC_FUNC_COLL && launchArray[i] == 0) {
+      CUDACHECKGOTO(cudaSetDevice(args->coll.comm->cudaDev), ret, launch_wait);
+      NCCLCHECKGOTO(ncclBarrierEnqueueWait(args->coll.comm), ret, launch_wait);
     }
   }
   for (int i=0; i<ncclGroupIndex; i++) {
     struct ncclAsyncArgs* args = ncclGroupArgs+i;
-    if (args->funcType == ASYNC_FUNC_COLL) {
+    if (args->funcType == ASYNC_FUNC_COLL && launchArray[i] == 0) {
       if (args->coll.comm->userStream == NULL)
-        CUDACHECKGOTO(cudaSetDevice(args->coll.comm->cudaDev), ret, end);
-      NCCLCHECKGOTO(ncclEnqueueEvents(args->coll.comm), ret, end);
+        CUDACHECKGOTO(cudaSetDevice(args->coll.comm->cudaDev), ret, launch_wait);
+      NCCLCHECKGOTO(ncclEnqueueEvents(args->coll.comm), ret, launch_wait);
+      if (args->coll.comm->nFusionOps) {
+        CUDACHECKGOTO(cudaSetDevice(args->coll.comm->cudaDev), ret, launch_wait);
+        NCCLCHECKGOTO(ncclFusionCopyOut(args->coll.comm), ret, launch_wait);
+      }
+      doneArray[i] = 1;
+      done--;
+    }
+  }
+
+launch_wait:
+  for (int i=0; i<ncclGroupIndex; i++) {
+    if (launchArray[i]) {
+      ncclResult_t launchRet = ncclLaunchWait(ncclGroupArgs[i].coll.comm);
+      if (ret == ncclSuccess) ret = launchRet;
       doneArray[i] = 1;
       done--;
     }
   }
+  if (ret != ncclSuccess) goto end;
 
   /* For init, since we use threads, we just wait for threads to complete */
   while (done) {
@@ -189,6 +277,10 @@ group_cleanup:
     }
     comm->myParams->gridDim.x = comm->myParams->blockDim.x = 0;
     comm->userStreamSet = false;
+    comm->userStreamCapturing = false;
+    ncclP2pFree(comm);
+    comm->nFusionOps = 0;
+    ncclVLayoutsCancel(comm);
   }
 end:
   ncclGroupError = ncclSuccess;
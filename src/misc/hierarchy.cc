@@ -0,0 +1,89 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "hierarchy.h"
+#include "transport.h"
+
+// Nodes are the sets of ranks sharing a host, and must all have the same
+// number of ranks. All ranks see the same peer information, hence make the
+// same decision.
+static ncclResult_t hierSetup(struct ncclComm* comm) {
+  struct ncclHier* hier;
+  NCCLCHECK(ncclCalloc(&hier, 1));
+  comm->hier = hier;
+
+  int nranks = comm->nRanks;
+  int* nodes;
+  int* localRanks;
+  NCCLCHECK(ncclCalloc(&nodes, nranks));
+  NCCLCHECK(ncclCalloc(&localRanks, nranks));
+  int nNodes = 0, myNode = -1;
+  for (int r=0; r<nranks; r++) {
+    int n;
+    for (n=0; n<nNodes; n++) {
+      if (comm->peerInfo[nodes[n]].hostHash == comm->peerInfo[r].hostHash) break;
+    }
+    if (n == nNodes) nodes[nNodes++] = r;
+    if (r == comm->rank) {
+      myNode = n;
+      hier->localRank = localRanks[n];
+    }
+    localRanks[n]++;
+  }
+  hier->localRanks = localRanks[0];
+  int balanced = 1;
+  for (int n=0; n<nNodes; n++) balanced &= localRanks[n] == hier->localRanks;
+  free(nodes);
+  free(localRanks);
+
+  if (nNodes == 1 || hier->localRanks == 1 || balanced == 0) {
+    INFO(NCCL_INIT, "Hierarchical allreduce disabled : %d nodes, %d ranks on node 0%s",
+        nNodes, hier->localRanks, balanced ? "" : ", unbalanced");
+    return ncclSuccess;
+  }
+  NCCLCHECK(ncclCommSplit(comm, myNode, comm->rank, &hier->nodeComm));
+  NCCLCHECK(ncclCommSplit(comm, hier->localRank, comm->rank, &hier->railComm));
+  hier->enabled = 1;
+  INFO(NCCL_INIT, "Hierarchical allreduce enabled : %d nodes of %d ranks", nNodes, hier->localRanks);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclHierCheck(struct ncclInfo* info, bool capturing, bool* use) {
+  struct ncclComm* comm = info->comm;
+  *use = false;
+  if (comm->hierAllReduce == 0 || comm->bootstrap == NULL || info->coll != ncclCollAllReduce) return ncclSuccess;
+  // Trees or LL handle small sizes better, and user operations are bound to
+  // this communicator
+  if (info->nBytes <= comm->treeThreshold || info->op >= ncclNumOps) return ncclSuccess;
+  if (comm->hier == NULL) {
+    // Splitting allocates memory, which can't be done while capturing
+    if (capturing) return ncclSuccess;
+    NCCLCHECK(hierSetup(comm));
+  }
+  *use = comm->hier->enabled && info->count % comm->hier->localRanks == 0;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclHierAllReduce(struct ncclInfo* info) {
+  struct ncclHier* hier = info->comm->hier;
+  size_t count = info->count / hier->localRanks;
+  char* chunk = (char*)info->recvbuff + hier->localRank*count*ncclTypeSize(info->datatype);
+  TRACE(NCCL_COLL, "Hierarchical allreduce : %ld elements across %d nodes", count, hier->railComm->nRanks);
+  NCCLCHECK(ncclReduceScatter(info->sendbuff, chunk, count, info->datatype, info->op, hier->nodeComm, info->stream));
+  NCCLCHECK(ncclAllReduce(chunk, chunk, count, info->datatype, info->op, hier->railComm, info->stream));
+  NCCLCHECK(ncclAllGather(chunk, info->recvbuff, count, info->datatype, hier->nodeComm, info->stream));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclHierFree(struct ncclComm* comm) {
+  struct ncclHier* hier = comm->hier;
+  if (hier == NULL) return ncclSuccess;
+  if (hier->nodeComm) NCCLCHECK(ncclCommDestroy(hier->nodeComm));
+  if (hier->railComm) NCCLCHECK(ncclCommDestroy(hier->railComm));
+  free(hier);
+  comm->hier = NULL;
+  return ncclSuccess;
+}
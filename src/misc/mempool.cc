@@ -0,0 +1,255 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "core.h"
+#include "mempool.h"
+#include "param.h"
+#include "utils.h"
+#include <sys/mman.h>
+
+NCCL_PARAM(MemPool, "MEM_POOL", 1);
+NCCL_PARAM(MemPoolBlockSize, "MEM_POOL_BLOCK_SIZE", 32LL << 20);
+
+struct ncclMemPoolBlock {
+  int type;
+  int numaId; // Host blocks : mmap'ed on that node and registered, or -1
+  size_t size;
+  size_t used;
+  int refCount; // Pieces, plus one while it is the current block of a pool
+  char* ptr;
+  char* devPtr;
+  int hasIpc;
+  cudaIpcMemHandle_t ipc;
+  struct ncclMemPoolBlock* next;
+};
+
+// Blocks of other processes opened with ncclMemPoolIpcOpen. Each device
+// opens its own mapping : peer access is enabled for the current device only.
+struct ncclMemPoolMapped {
+  cudaIpcMemHandle_t ipc;
+  int cudaDev;
+  char* ptr;
+  size_t size;
+  int refCount;
+  struct ncclMemPoolMapped* next;
+};
+
+// Pieces are freed without their pool, hence process-wide block lists
+static pthread_mutex_t memPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static struct ncclMemPoolBlock* memPoolBlocks = NULL;
+static struct ncclMemPoolMapped* memPoolMapped = NULL;
+
+static ncclResult_t memPoolBlockCreate(int type, size_t size, int numaId, struct ncclMemPoolBlock** blockPtr) {
+  struct ncclMemPoolBlock* block;
+  NCCLCHECK(ncclCalloc(&block, 1));
+  block->type = type;
+  block->size = size;
+  block->numaId = numaId;
+  cudaError_t err;
+  if (type == ncclMemPoolDevice) {
+    err = cudaMalloc((void**)&block->ptr, size);
+    if (err == cudaSuccess) err = cudaMemset(block->ptr, 0, size);
+    block->devPtr = block->ptr;
+  } else if (numaId != -1) {
+    // cudaHostAlloc places pages wherever it touches them : map our own,
+    // placed on the node before we zero them, and register them.
+    void* ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+      WARN("Failed to map %ld bytes of host memory : %s", size, strerror(errno));
+      free(block);
+      return ncclSystemError;
+    }
+    ncclNumaBind(ptr, size, numaId);
+    memset(ptr, 0, size);
+    block->ptr = (char*)ptr;
+    err = cudaHostRegister(ptr, size, cudaHostRegisterMapped);
+    if (err == cudaSuccess) {
+      err = cudaHostGetDevicePointer((void**)&block->devPtr, ptr, 0);
+      if (err != cudaSuccess) cudaHostUnregister(ptr);
+    }
+    if (err != cudaSuccess) {
+      munmap(ptr, size);
+      block->ptr = NULL;
+    }
+  } else {
+    err = cudaHostAlloc((void**)&block->ptr, size, cudaHostAllocMapped);
+    if (err == cudaSuccess) memset(block->ptr, 0, size);
+    block->devPtr = block->ptr;
+  }
+  if (err != cudaSuccess) {
+    WARN("Cuda failure '%s' allocating %ld bytes of %s memory", cudaGetErrorString(err), size, type == ncclMemPoolDevice ? "device" : "host");
+    if (block->ptr && type == ncclMemPoolDevice) cudaFree(block->ptr);
+    if (block->ptr && type == ncclMemPoolHost) cudaFreeHost(block->ptr);
+    free(block);
+    return ncclUnhandledCudaError;
+  }
+  TRACE(NCCL_INIT, "Allocated %s memory pool block %p of %ld bytes, NUMA node %d", type == ncclMemPoolDevice ? "device" : "host", block->ptr, size, numaId);
+  block->next = memPoolBlocks;
+  memPoolBlocks = block;
+  *blockPtr = block;
+  return ncclSuccess;
+}
+
+static ncclResult_t memPoolBlockRelease(struct ncclMemPoolBlock* block) {
+  if (--block->refCount > 0) return ncclSuccess;
+  struct ncclMemPoolBlock** list = &memPoolBlocks;
+  while (*list != block) list = &(*list)->next;
+  *list = block->next;
+  if (block->type == ncclMemPoolDevice) {
+    CUDACHECK(cudaFree(block->ptr));
+  } else if (block->numaId == -1) {
+    CUDACHECK(cudaFreeHost(block->ptr));
+  } else {
+    CUDACHECK(cudaHostUnregister(block->ptr));
+    SYSCHECK(munmap(block->ptr, block->size), "munmap");
+  }
+  free(block);
+  return ncclSuccess;
+}
+
+static struct ncclMemPoolBlock* memPoolBlockFind(void* ptr) {
+  struct ncclMemPoolBlock* block = memPoolBlocks;
+  while (block && ((char*)ptr < block->ptr || (char*)ptr >= block->ptr+block->size)) block = block->next;
+  return block;
+}
+
+ncclResult_t ncclMemPoolAlloc(struct ncclMemPool* pool, int type, size_t size, size_t align, void** ptr, void** devPtr, int numaId) {
+  ncclResult_t ret = ncclSuccess;
+  size_t blockSize = ncclParamMemPoolBlockSize();
+  if (type != ncclMemPoolHost || numaId >= NCCL_MEM_POOL_MAX_NUMA) numaId = -1;
+  pthread_mutex_lock(&memPoolLock);
+  struct ncclMemPoolBlock** current = numaId == -1 ? pool->current+type : pool->numaCurrent+numaId;
+  struct ncclMemPoolBlock* block = *current;
+  size_t offset = 0;
+  if (ncclParamMemPool() == 0 || size > blockSize/2) {
+    // Large pieces get their own block, the current one stays open
+    ALIGN_SIZE(size, MEM_ALIGN);
+    NCCLCHECKGOTO(memPoolBlockCreate(type, size, numaId, &block), ret, exit);
+  } else {
+    if (block) offset = ((uintptr_t)(block->ptr+block->used)+align-1)/align*align - (uintptr_t)block->ptr;
+    if (block == NULL || offset+size > block->size) {
+      if (block) NCCLCHECKGOTO(memPoolBlockRelease(block), ret, exit);
+      *current = NULL;
+      NCCLCHECKGOTO(memPoolBlockCreate(type, blockSize, numaId, &block), ret, exit);
+      block->refCount = 1;
+      *current = block;
+      offset = 0;
+    }
+  }
+  block->used = offset+size;
+  block->refCount++;
+  *ptr = block->ptr+offset;
+  *devPtr = block->devPtr+offset;
+exit:
+  pthread_mutex_unlock(&memPoolLock);
+  return ret;
+}
+
+ncclResult_t ncclMemPoolFree(void* ptr) {
+  if (ptr == NULL) return ncclSuccess;
+  ncclResult_t ret = ncclSuccess;
+  pthread_mutex_lock(&memPoolLock);
+  struct ncclMemPoolBlock* block = memPoolBlockFind(ptr);
+  if (block == NULL) {
+    WARN("Freeing %p which is not in a memory pool", ptr);
+    ret = ncclInternalError;
+  } else {
+    ret = memPoolBlockRelease(block);
+  }
+  pthread_mutex_unlock(&memPoolLock);
+  return ret;
+}
+
+ncclResult_t ncclMemPoolDestroy(struct ncclMemPool* pool) {
+  ncclResult_t ret = ncclSuccess;
+  pthread_mutex_lock(&memPoolLock);
+  for (int t=0; t<ncclMemPoolTypes; t++) {
+    if (pool->current[t]) NCCLCHECKGOTO(memPoolBlockRelease(pool->current[t]), ret, exit);
+    pool->current[t] = NULL;
+  }
+  for (int n=0; n<NCCL_MEM_POOL_MAX_NUMA; n++) {
+    if (pool->numaCurrent[n]) NCCLCHECKGOTO(memPoolBlockRelease(pool->numaCurrent[n]), ret, exit);
+    pool->numaCurrent[n] = NULL;
+  }
+exit:
+  pthread_mutex_unlock(&memPoolLock);
+  return ret;
+}
+
+ncclResult_t ncclMemPoolIpcGet(void* ptr, cudaIpcMemHandle_t* handle, size_t* offset, size_t* blockSize) {
+  ncclResult_t ret = ncclSuccess;
+  pthread_mutex_lock(&memPoolLock);
+  struct ncclMemPoolBlock* block = memPoolBlockFind(ptr);
+  if (block == NULL || block->type != ncclMemPoolDevice) {
+    WARN("Cannot export %p which is not in a device memory pool", ptr);
+    ret = ncclInternalError;
+    goto exit;
+  }
+  if (block->hasIpc == 0) {
+    CUDACHECKGOTO(cudaIpcGetMemHandle(&block->ipc, block->ptr), ret, exit);
+    block->hasIpc = 1;
+  }
+  *handle = block->ipc;
+  *offset = (char*)ptr - block->ptr;
+  *blockSize = block->size;
+exit:
+  pthread_mutex_unlock(&memPoolLock);
+  return ret;
+}
+
+ncclResult_t ncclMemPoolIpcOpen(cudaIpcMemHandle_t* handle, size_t offset, size_t blockSize, void** ptr) {
+  ncclResult_t ret = ncclSuccess;
+  int cudaDev;
+  CUDACHECK(cudaGetDevice(&cudaDev));
+  pthread_mutex_lock(&memPoolLock);
+  struct ncclMemPoolMapped* mapped = memPoolMapped;
+  while (mapped && (mapped->cudaDev != cudaDev || memcmp(&mapped->ipc, handle, sizeof(cudaIpcMemHandle_t)) != 0)) mapped = mapped->next;
+  if (mapped == NULL) {
+    NCCLCHECKGOTO(ncclCalloc(&mapped, 1), ret, exit);
+    cudaError_t err = cudaIpcOpenMemHandle((void**)&mapped->ptr, *handle, cudaIpcMemLazyEnablePeerAccess);
+    if (err != cudaSuccess) {
+      WARN("failed to open CUDA IPC handle : %d %s", err, cudaGetErrorString(err));
+      free(mapped);
+      ret = ncclUnhandledCudaError;
+      goto exit;
+    }
+    mapped->ipc = *handle;
+    mapped->cudaDev = cudaDev;
+    mapped->size = blockSize;
+    mapped->next = memPoolMapped;
+    memPoolMapped = mapped;
+  }
+  mapped->refCount++;
+  *ptr = mapped->ptr+offset;
+exit:
+  pthread_mutex_unlock(&memPoolLock);
+  return ret;
+}
+
+ncclResult_t ncclMemPoolIpcClose(void* ptr) {
+  if (ptr == NULL) return ncclSuccess;
+  ncclResult_t ret = ncclSuccess;
+  pthread_mutex_lock(&memPoolLock);
+  struct ncclMemPoolMapped** list = &memPoolMapped;
+  while (*list && ((char*)ptr < (*list)->ptr || (char*)ptr >= (*list)->ptr+(*list)->size)) list = &(*list)->next;
+  struct ncclMemPoolMapped* mapped = *list;
+  if (mapped == NULL) {
+    WARN("Closing %p which was not opened with ncclMemPoolIpcOpen", ptr);
+    ret = ncclInternalError;
+  } else if (--mapped->refCount == 0) {
+    *list = mapped->next;
+    int savedDev;
+    CUDACHECKGOTO(cudaGetDevice(&savedDev), ret, exit);
+    CUDACHECKGOTO(cudaSetDevice(mapped->cudaDev), ret, exit);
+    cudaError_t err = cudaIpcCloseMemHandle(mapped->ptr);
+    free(mapped);
+    CUDACHECKGOTO(cudaSetDevice(savedDev), ret, exit);
+    CUDACHECKGOTO(err, ret, exit);
+  }
+exit:
+  pthread_mutex_unlock(&memPoolLock);
+  return ret;
+}
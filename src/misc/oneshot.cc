@@ -0,0 +1,180 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "oneshot.h"
+#include "bootstrap.h"
+#include "transport.h"
+#include "nvlink.h"
+#include "param.h"
+#include "collectives/collectives.h"
+
+NCCL_PARAM(OneShotThreshold, "ONESHOT_THRESHOLD", -2);
+
+ncclResult_t ncclOneShotInit(struct ncclComm* comm, int* connectTransport, ncclTvalue_t* connectValue) {
+  int nranks = comm->nRanks;
+  int p2p = 1, nvswitch = 1;
+  for (int i=0; i<nranks; i++) {
+    for (int j=0; j<nranks; j++) {
+      if (i == j) continue;
+      // P2P is the first transport
+      p2p &= connectTransport[i*nranks+j] == 0;
+      nvswitch &= connectValue[i*nranks+j] >= CONNECT_NVSWITCH;
+    }
+  }
+  comm->oneShotThreshold = 0;
+  if (nranks == 1 || p2p == 0) return ncclSuccess;
+  comm->oneShotThreshold = ncclParamOneShotThreshold();
+  if (comm->oneShotThreshold == -2) comm->oneShotThreshold = nvswitch ? NCCL_ONESHOT_THRESHOLD : 0;
+  return ncclSuccess;
+}
+
+struct ncclOneShotInfo {
+  int canUse;
+  uint64_t pidHash;
+  union ncclLLFifoLine* buff;
+  cudaIpcMemHandle_t buffIpc;
+};
+
+static ncclResult_t localSetup(struct ncclComm* comm, struct ncclOneShot* os, struct ncclOneShotInfo* info) {
+  // Two halves of one slot per rank, each slot holding oneShotThreshold bytes
+  // as LL lines of 8 bytes of data
+  os->slotLines = DIVUP(comm->oneShotThreshold, sizeof(uint64_t));
+  NCCLCHECK(ncclCudaCalloc(&os->buff, 2*comm->nRanks*os->slotLines));
+  NCCLCHECK(ncclCudaCalloc(&os->counter, 2));
+  CUDACHECK(cudaIpcGetMemHandle(&info->buffIpc, os->buff));
+  info->buff = os->buff;
+  info->canUse = 1;
+  return ncclSuccess;
+}
+
+static ncclResult_t openPeers(struct ncclComm* comm, struct ncclOneShot* os, struct ncclOneShotInfo* allInfo) {
+  struct ncclOneShotInfo* myInfo = allInfo+comm->rank;
+  for (int r=0; r<comm->nRanks; r++) {
+    if (r == comm->rank) continue;
+    if (allInfo[r].pidHash == myInfo->pidHash) {
+      // Enable P2P access
+      cudaError_t err = cudaDeviceEnablePeerAccess(comm->peerInfo[r].cudaDev, 0);
+      if (err == cudaErrorPeerAccessAlreadyEnabled) {
+        cudaGetLastError();
+      } else if (err != cudaSuccess) {
+        WARN("failed to peer with device %d(=%d): %d %s",
+             comm->peerInfo[r].cudaDev, comm->peerInfo[r].nvmlDev, err, cudaGetErrorString(err));
+        return ncclInternalError;
+      }
+      os->peerBuffs[r] = allInfo[r].buff;
+    } else {
+      CUDACHECK(cudaIpcOpenMemHandle((void**)os->peerBuffs+r, allInfo[r].buffIpc, cudaIpcMemLazyEnablePeerAccess));
+    }
+  }
+  os->peerBuffs[comm->rank] = os->buff;
+  NCCLCHECK(ncclCudaCalloc(&os->devPeerBuffs, comm->nRanks));
+  NCCLCHECK(ncclCudaMemcpy(os->devPeerBuffs, os->peerBuffs, comm->nRanks));
+  return ncclSuccess;
+}
+
+static ncclResult_t release(struct ncclComm* comm, struct ncclOneShot* os) {
+  uint64_t myPidHash = comm->peerInfo[comm->rank].pidHash;
+  for (int r=0; r<comm->nRanks; r++) {
+    if (r == comm->rank || os->peerBuffs[r] == NULL) continue;
+    if (comm->peerInfo[r].pidHash != myPidHash) CUDACHECK(cudaIpcCloseMemHandle(os->peerBuffs[r]));
+    os->peerBuffs[r] = NULL;
+  }
+  if (os->devPeerBuffs) CUDACHECK(cudaFree(os->devPeerBuffs));
+  if (os->buff) CUDACHECK(cudaFree(os->buff));
+  if (os->counter) CUDACHECK(cudaFree(os->counter));
+  os->devPeerBuffs = NULL;
+  os->buff = NULL;
+  os->counter = NULL;
+  return ncclSuccess;
+}
+
+// All ranks must agree on the algorithm, so local failures only disable it,
+// and are combined through the bootstrap.
+static ncclResult_t oneShotSetup(struct ncclComm* comm) {
+  int nranks = comm->nRanks;
+  struct ncclOneShot* os;
+  NCCLCHECK(ncclCalloc(&os, 1));
+  comm->oneShot = os;
+  NCCLCHECK(ncclCalloc(&os->peerBuffs, nranks));
+
+  ncclResult_t ret = ncclSuccess;
+  struct ncclOneShotInfo* allInfo;
+  NCCLCHECK(ncclCalloc(&allInfo, nranks));
+  allInfo[comm->rank].pidHash = comm->peerInfo[comm->rank].pidHash;
+  if (localSetup(comm, os, allInfo+comm->rank) != ncclSuccess) {
+    INFO(NCCL_INIT, "Single-hop allreduce setup failed, using rings");
+    allInfo[comm->rank].canUse = 0;
+  }
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, allInfo, sizeof(struct ncclOneShotInfo)), ret, end);
+
+  os->enabled = 1;
+  for (int r=0; r<nranks; r++) os->enabled &= allInfo[r].canUse;
+  allInfo[comm->rank].canUse = os->enabled && openPeers(comm, os, allInfo) == ncclSuccess;
+  NCCLCHECKGOTO(bootstrapAllGather(comm->bootstrap, allInfo, sizeof(struct ncclOneShotInfo)), ret, end);
+  for (int r=0; r<nranks; r++) os->enabled &= allInfo[r].canUse;
+
+  if (os->enabled) {
+    INFO(NCCL_INIT, "Using single-hop allreduce up to %ld bytes", comm->oneShotThreshold);
+  } else {
+    NCCLCHECKGOTO(release(comm, os), ret, end);
+  }
+end:
+  free(allInfo);
+  return ret;
+}
+
+ncclResult_t ncclOneShotCheck(struct ncclInfo* info, bool capturing, bool* use) {
+  struct ncclComm* comm = info->comm;
+  *use = false;
+  if (comm->oneShotThreshold <= 0 || comm->bootstrap == NULL) return ncclSuccess;
+  if (info->coll != ncclCollAllReduce || info->nBytes > comm->oneShotThreshold) return ncclSuccess;
+  if (comm->oneShot == NULL) {
+    // Setting up allocates, opens IPC handles and talks to the peers, which
+    // can't be done while capturing
+    if (capturing) return ncclSuccess;
+    NCCLCHECK(oneShotSetup(comm));
+  }
+  *use = comm->oneShot->enabled;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclOneShotColl(struct ncclInfo* info) {
+  struct ncclComm* comm = info->comm;
+  struct ncclOneShot* os = comm->oneShot;
+  struct ncclOneShotArgs args;
+  args.comm = comm->devComm;
+  args.sendbuff = info->sendbuff;
+  args.recvbuff = info->recvbuff;
+  args.nBytes = info->nBytes;
+  args.buffs = os->devPeerBuffs;
+  args.counter = os->counter;
+  args.rank = comm->rank;
+  args.nRanks = comm->nRanks;
+  args.slotLines = os->slotLines;
+  int devOp = info->op < ncclNumOps ? info->op : NCCL_DEVOP_PREMULSUM;
+  args.redOpSlot = info->op < ncclNumOps ? 0 : info->op - ncclNumOps;
+
+  // One 8-byte line per thread, within the CTA limit of the communicator
+  int nBlocks = DIVUP(DIVUP(info->nBytes, sizeof(uint64_t)), NCCL_ONESHOT_NTHREADS);
+  int maxBlocks = comm->maxCTAs > 0 ? std::min(comm->maxCTAs, comm->nChannels) : comm->nChannels;
+  nBlocks = std::max(1, std::min(nBlocks, maxBlocks));
+  TRACE(NCCL_COLL, "%s of %ld bytes in a single hop, %d blocks", info->opName, info->nBytes, nBlocks);
+
+  void* argsPtr = &args;
+  CUDACHECK(cudaLaunchKernel(ncclOneShotKerns[devOp*ncclNumTypes+info->datatype],
+        dim3(nBlocks), dim3(NCCL_ONESHOT_NTHREADS), &argsPtr, 0, info->stream));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclOneShotFree(struct ncclComm* comm) {
+  struct ncclOneShot* os = comm->oneShot;
+  if (os == NULL) return ncclSuccess;
+  NCCLCHECK(release(comm, os));
+  free(os->peerBuffs);
+  free(os);
+  comm->oneShot = NULL;
+  return ncclSuccess;
+}
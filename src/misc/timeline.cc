@@ -0,0 +1,151 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "timeline.h"
+#include "param.h"
+#include "../collectives/collectives.h"
+
+NCCL_PARAM(TimelineEvents, "TIMELINE_EVENTS", 1<<18);
+
+// Chrome trace threads : one for the NCCL calls, then one per channel for
+// the kernels, the sends and the receives.
+#define TL_TID_KERNEL 100
+#define TL_TID_SEND 200
+#define TL_TID_RECV 300
+
+static const char* collNames[ncclCollCount] = { "Broadcast", "Reduce", "AllGather", "ReduceScatter", "AllReduce", "SendRecv" };
+
+// NCCL_TIMELINE_FILE may contain %r (rank) and %p (pid)
+static ncclResult_t timelineFileName(const char* format, int rank, char** name) {
+  NCCLCHECK(ncclCalloc(name, strlen(format)+64));
+  char* out = *name;
+  for (const char* c=format; *c; c++) {
+    if (c[0] == '%' && c[1] == 'r') {
+      out += sprintf(out, "%d", rank);
+      c++;
+    } else if (c[0] == '%' && c[1] == 'p') {
+      out += sprintf(out, "%d", getpid());
+      c++;
+    } else {
+      *out++ = *c;
+    }
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTimelineInit(struct ncclComm* comm) {
+  const char* file = getenv("NCCL_TIMELINE_FILE");
+  if (file == NULL || strlen(file) == 0) return ncclSuccess;
+  int64_t nEvents = ncclParamTimelineEvents();
+  if (nEvents <= 0) return ncclSuccess;
+
+  struct ncclTimeline* tl;
+  NCCLCHECK(ncclCalloc(&tl, 1));
+  tl->nEvents = nEvents;
+  NCCLCHECK(ncclCalloc(&tl->events, nEvents));
+  NCCLCHECK(timelineFileName(file, comm->rank, &tl->file));
+  for (int c=0; c<comm->nChannels; c++) {
+    struct ncclChannel* channel = comm->channels+c;
+    NCCLCHECK(ncclCalloc(tl->colls+c, NCCL_MAX_OPS));
+    // Start and end of the operation of each FIFO slot, written by the GPU
+    NCCLCHECK(ncclCudaHostAlloc((void**)&channel->timestamps, (void**)&channel->devTimestamps, 2*NCCL_MAX_OPS*sizeof(uint64_t)));
+  }
+  comm->timeline = tl;
+  INFO(NCCL_INIT, "Recording up to %ld timeline events into %s", nEvents, tl->file);
+  return ncclSuccess;
+}
+
+static void timelineCollectColl(struct ncclTimeline* tl, struct ncclChannel* channel, int opIndex) {
+  struct ncclTimelineColl* coll = tl->colls[channel->id]+opIndex;
+  if (coll->valid == 0) return;
+  volatile uint64_t* ts = channel->timestamps+2*opIndex;
+  uint64_t start = ts[0], end = ts[1];
+  // Graph launches and operations still running have no (valid) timestamps
+  if (start != 0 && end >= start) ncclTimelineAdd(tl, ncclTimelineKernel, channel->id, coll->funcIndex, coll->opCount, 0, start, end);
+  ts[0] = ts[1] = 0;
+  coll->valid = 0;
+}
+
+void ncclTimelineSaveColl(struct ncclComm* comm, struct ncclChannel* channel, int opIndex, struct ncclColl* c) {
+  struct ncclTimeline* tl = comm->timeline;
+  timelineCollectColl(tl, channel, opIndex);
+  struct ncclTimelineColl* coll = tl->colls[channel->id]+opIndex;
+  coll->opCount = c->args.opCount;
+  coll->funcIndex = c->funcIndex;
+  coll->valid = 1;
+}
+
+static const char* funcCollName(int funcIndex) {
+  int coll = funcIndex / (NCCL_NUM_DEVOPS*ncclNumTypes*2*NCCL_NUM_PROTOCOLS);
+  return coll < ncclCollCount ? collNames[coll] : "Unknown";
+}
+
+static void writeThreadName(FILE* f, int rank, int tid, const char* name, int channel) {
+  fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"", rank, tid);
+  fprintf(f, name, channel);
+  fprintf(f, "\"}},\n");
+}
+
+static ncclResult_t timelineWrite(struct ncclComm* comm, struct ncclTimeline* tl) {
+  FILE* f = fopen(tl->file, "w");
+  if (f == NULL) {
+    WARN("Could not open timeline file %s : %s", tl->file, strerror(errno));
+    return ncclSystemError;
+  }
+  int rank = comm->rank;
+  fprintf(f, "{\"traceEvents\":[\n");
+  fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"Rank %d (GPU %d)\"}},\n", rank, rank, comm->nvmlDev);
+  writeThreadName(f, rank, 0, "NCCL calls", 0);
+  for (int c=0; c<comm->nChannels; c++) {
+    writeThreadName(f, rank, TL_TID_KERNEL+c, "Kernel channel %d", c);
+    writeThreadName(f, rank, TL_TID_SEND+c, "Proxy send channel %d", c);
+    writeThreadName(f, rank, TL_TID_RECV+c, "Proxy recv channel %d", c);
+  }
+  uint64_t head = tl->head;
+  uint64_t first = head > tl->nEvents ? head - tl->nEvents : 0;
+  int sep = 0;
+  for (uint64_t i=first; i<head; i++) {
+    struct ncclTimelineEvent* e = tl->events+(i%tl->nEvents);
+    const char* name = "Unknown";
+    const char* cat = "proxy";
+    int tid = 0;
+    switch (e->type) {
+      case ncclTimelineEnqueue: name = e->arg < ncclCollCount ? collNames[e->arg] : "Unknown"; cat = "enqueue"; break;
+      case ncclTimelineKernel: name = funcCollName(e->arg); cat = "kernel"; tid = TL_TID_KERNEL+e->channel; break;
+      case ncclTimelineNetSend: name = "Send"; tid = TL_TID_SEND+e->channel; break;
+      case ncclTimelineNetRecv: name = "Recv"; tid = TL_TID_RECV+e->channel; break;
+      case ncclTimelineNetFlush: name = "Flush"; tid = TL_TID_RECV+e->channel; break;
+    }
+    fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+        "\"args\":{\"opCount\":%lu,\"bytes\":%ld,\"arg\":%d}}", sep ? ",\n" : "", name, cat, rank, tid,
+        e->start/1000.0, (e->end-e->start)/1000.0, e->opCount, e->bytes, e->arg);
+    sep = 1;
+  }
+  fprintf(f, "\n]}\n");
+  fclose(f);
+  INFO(NCCL_INIT, "Wrote %ld timeline events to %s", head-first, tl->file);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTimelineFree(struct ncclComm* comm) {
+  struct ncclTimeline* tl = comm->timeline;
+  if (tl == NULL) return ncclSuccess;
+  comm->timeline = NULL;
+  for (int c=0; c<comm->nChannels; c++) {
+    struct ncclChannel* channel = comm->channels+c;
+    for (int i=0; i<NCCL_MAX_OPS; i++) timelineCollectColl(tl, channel, i);
+  }
+  ncclResult_t ret = timelineWrite(comm, tl);
+  for (int c=0; c<comm->nChannels; c++) {
+    free(tl->colls[c]);
+    NCCLCHECK(ncclCudaHostFree(comm->channels[c].timestamps));
+    comm->channels[c].timestamps = NULL;
+  }
+  free(tl->events);
+  free(tl->file);
+  free(tl);
+  return ret;
+}
@@ -6,14 +6,13 @@
 
 #include "core.h"
 #include "topo.h"
+#include "net.h"
+#include <errno.h>
 
 #define BUSID_SIZE (sizeof("0000:00:00.0"))
 #define BUSID_REDUCED_SIZE (sizeof("0000:00"))
 
-ncclResult_t getCudaPath(int cudaDev, char** path) {
-  char busId[BUSID_SIZE];
-  CUDACHECK(cudaDeviceGetPCIBusId(busId, BUSID_SIZE, cudaDev));
-  for (int i=0; i<BUSID_SIZE; i++) busId[i] = tolower(busId[i]);
+static ncclResult_t busIdPath(char* busId, char** path) {
   char busPath[] = "/sys/class/pci_bus/0000:00/../../0000:00:00.0";
   memcpy(busPath+sizeof("/sys/class/pci_bus/")-1, busId, BUSID_REDUCED_SIZE-1);
   memcpy(busPath+sizeof("/sys/class/pci_bus/0000:00/../../")-1, busId, BUSID_SIZE-1);
@@ -25,6 +24,321 @@ ncclResult_t getCudaPath(int cudaDev, char** path) {
   return ncclSuccess;
 }
 
+ncclResult_t getCudaPath(int cudaDev, char** path) {
+  char busId[BUSID_SIZE];
+  CUDACHECK(cudaDeviceGetPCIBusId(busId, BUSID_SIZE, cudaDev));
+  for (int i=0; i<BUSID_SIZE; i++) busId[i] = tolower(busId[i]);
+  NCCLCHECK(ncclTopoGpuPath(busId, path));
+  if (*path) return ncclSuccess;
+  return busIdPath(busId, path);
+}
+
+// Topology file
+struct ncclTopoDev {
+  char busId[BUSID_SIZE];
+  int dev;
+  char* path;
+  int numa;
+};
+
+struct ncclTopoLink {
+  char src[BUSID_SIZE];
+  char dst[BUSID_SIZE]; // "net" for other nodes
+  int transport;
+  ncclTvalue_t value;
+};
+
+struct ncclTopoFile {
+  int nGpus, nNics, nLinks;
+  struct ncclTopoDev* gpus;
+  struct ncclTopoDev* nics;
+  struct ncclTopoLink* links;
+};
+
+static struct ncclTopoFile* topoFile = NULL;
+
+// NVML bus IDs have a 32-bit domain (00000000:07:00.0), CUDA ones a 16-bit
+// domain (0000:07:00.0). Keep the last part, lower case.
+static void topoBusId(const char* in, char* out) {
+  int len = strlen(in);
+  const char* start = len > BUSID_SIZE-1 ? in+len-(BUSID_SIZE-1) : in;
+  int i;
+  for (i=0; i<BUSID_SIZE-1 && start[i]; i++) out[i] = tolower(start[i]);
+  out[i] = '\0';
+}
+
+#define TOPO_MAX_ATTRS 8
+#define TOPO_MAX_STR 256
+
+struct ncclTopoNode {
+  char name[TOPO_MAX_STR];
+  int nAttrs;
+  char keys[TOPO_MAX_ATTRS][TOPO_MAX_STR];
+  char values[TOPO_MAX_ATTRS][TOPO_MAX_STR];
+};
+
+static const char* topoAttr(struct ncclTopoNode* node, const char* key) {
+  for (int a=0; a<node->nAttrs; a++) if (strcmp(node->keys[a], key) == 0) return node->values[a];
+  return NULL;
+}
+
+static int topoSkipSpaces(FILE* file) {
+  int c;
+  while ((c = fgetc(file)) != EOF && isspace(c));
+  return c;
+}
+
+// Read the next element. Only needs to handle what ncclTopoDump writes :
+// elements with double quoted attributes, no text content. Closing tags,
+// comments and the XML declaration are returned with an empty name.
+static ncclResult_t topoReadNode(FILE* file, struct ncclTopoNode* node, int* eof) {
+  node->name[0] = '\0';
+  node->nAttrs = 0;
+  int c = topoSkipSpaces(file);
+  *eof = c == EOF;
+  if (*eof) return ncclSuccess;
+  if (c != '<') {
+    WARN("Topology file : expected '<', got '%c'", c);
+    return ncclInvalidUsage;
+  }
+  c = fgetc(file);
+  if (c == '/' || c == '?' || c == '!') {
+    while ((c = fgetc(file)) != EOF && c != '>');
+    return ncclSuccess;
+  }
+  int len = 0;
+  while (c != EOF && !isspace(c) && c != '/' && c != '>') {
+    if (len < TOPO_MAX_STR-1) node->name[len++] = c;
+    c = fgetc(file);
+  }
+  node->name[len] = '\0';
+  while (1) {
+    if (isspace(c)) c = topoSkipSpaces(file);
+    if (c == '/' || c == '>') {
+      if (c == '/') c = fgetc(file);
+      if (c != '>') break;
+      return ncclSuccess;
+    }
+    if (c == EOF || node->nAttrs == TOPO_MAX_ATTRS) break;
+    char* key = node->keys[node->nAttrs];
+    char* value = node->values[node->nAttrs];
+    len = 0;
+    while (c != EOF && c != '=' && !isspace(c)) {
+      if (len < TOPO_MAX_STR-1) key[len++] = c;
+      c = fgetc(file);
+    }
+    key[len] = '\0';
+    if (c != '=' || fgetc(file) != '"') break;
+    len = 0;
+    while ((c = fgetc(file)) != EOF && c != '"') {
+      if (len < TOPO_MAX_STR-1) value[len++] = c;
+    }
+    value[len] = '\0';
+    if (c != '"') break;
+    node->nAttrs++;
+    c = fgetc(file);
+  }
+  WARN("Topology file : could not parse element <%s>", node->name);
+  return ncclInvalidUsage;
+}
+
+static int topoTransport(const char* name) {
+  for (int t=0; t<NTRANSPORTS; t++) if (strcasecmp(ncclTransports[t].name, name) == 0) return t;
+  return -1;
+}
+
+template <typename T>
+static ncclResult_t topoGrow(T** ptr, int* n) {
+  T* p = (T*)realloc(*ptr, (*n+1)*sizeof(T));
+  if (p == NULL) {
+    WARN("Failed to allocate topology entry");
+    return ncclSystemError;
+  }
+  memset(p+*n, 0, sizeof(T));
+  *ptr = p;
+  (*n)++;
+  return ncclSuccess;
+}
+
+static ncclResult_t topoAddDev(struct ncclTopoDev** devs, int* n, struct ncclTopoNode* node) {
+  NCCLCHECK(topoGrow(devs, n));
+  struct ncclTopoDev* dev = *devs+*n-1;
+  const char* str;
+  if ((str = topoAttr(node, "busid"))) topoBusId(str, dev->busId);
+  dev->dev = (str = topoAttr(node, "dev")) ? atoi(str) : -1;
+  dev->path = (str = topoAttr(node, "path")) ? strdup(str) : NULL;
+  dev->numa = (str = topoAttr(node, "numa")) ? atoi(str) : -1;
+  return ncclSuccess;
+}
+
+static ncclResult_t topoAddLink(struct ncclTopoFile* topo, struct ncclTopoNode* node) {
+  const char* src = topoAttr(node, "src");
+  const char* dst = topoAttr(node, "dst");
+  const char* transport = topoAttr(node, "transport");
+  const char* value = topoAttr(node, "value");
+  if (src == NULL || dst == NULL || transport == NULL || value == NULL || topoTransport(transport) == -1) {
+    WARN("Topology file : link needs src, dst, transport (P2P, CE, SHM or NET) and value");
+    return ncclInvalidUsage;
+  }
+  NCCLCHECK(topoGrow(&topo->links, &topo->nLinks));
+  struct ncclTopoLink* link = topo->links+topo->nLinks-1;
+  topoBusId(src, link->src);
+  topoBusId(dst, link->dst);
+  link->transport = topoTransport(transport);
+  link->value = strtoll(value, NULL, 0);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTopoInit() {
+  const char* name = getenv("NCCL_TOPO_FILE");
+  if (name == NULL || strlen(name) == 0) return ncclSuccess;
+  FILE* file = fopen(name, "r");
+  if (file == NULL) {
+    WARN("Could not open topology file %s : %s", name, strerror(errno));
+    return ncclSystemError;
+  }
+  struct ncclTopoFile* topo;
+  NCCLCHECK(ncclCalloc(&topo, 1));
+  struct ncclTopoNode node;
+  ncclResult_t ret = ncclSuccess;
+  int eof = 0;
+  while (ret == ncclSuccess && (ret = topoReadNode(file, &node, &eof)) == ncclSuccess && !eof) {
+    if (strcmp(node.name, "gpu") == 0) ret = topoAddDev(&topo->gpus, &topo->nGpus, &node);
+    else if (strcmp(node.name, "nic") == 0) ret = topoAddDev(&topo->nics, &topo->nNics, &node);
+    else if (strcmp(node.name, "link") == 0) ret = topoAddLink(topo, &node);
+  }
+  fclose(file);
+  // Keep what was read : a broken file should not stop what it did not cover
+  topoFile = topo;
+  if (ret != ncclSuccess) WARN("Topology file %s : ignoring the rest of the file", name);
+  INFO(NCCL_INIT, "Loaded topology file %s : %d GPUs, %d NICs, %d links", name, topo->nGpus, topo->nNics, topo->nLinks);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTopoGpuPath(const char* busId, char** path) {
+  *path = NULL;
+  if (topoFile == NULL) return ncclSuccess;
+  char id[BUSID_SIZE];
+  topoBusId(busId, id);
+  for (int g=0; g<topoFile->nGpus; g++) {
+    struct ncclTopoDev* gpu = topoFile->gpus+g;
+    if (gpu->path && strcmp(gpu->busId, id) == 0) {
+      *path = strdup(gpu->path);
+      return ncclSuccess;
+    }
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTopoNicPath(int dev, char** path) {
+  *path = NULL;
+  if (topoFile == NULL) return ncclSuccess;
+  for (int n=0; n<topoFile->nNics; n++) {
+    if (topoFile->nics[n].path && topoFile->nics[n].dev == dev) {
+      *path = strdup(topoFile->nics[n].path);
+      return ncclSuccess;
+    }
+  }
+  return ncclSuccess;
+}
+
+int ncclTopoNumaId(char* path) {
+  if (topoFile) {
+    for (int i=0; i<topoFile->nGpus+topoFile->nNics; i++) {
+      struct ncclTopoDev* dev = i < topoFile->nGpus ? topoFile->gpus+i : topoFile->nics+i-topoFile->nGpus;
+      if (dev->numa != -1 && dev->path && strcmp(dev->path, path) == 0) return dev->numa;
+    }
+  }
+  return getNumaId(path);
+}
+
+ncclResult_t ncclTopoGpuNumaId(int cudaDev, int* numaId) {
+  char* cudaPath;
+  NCCLCHECK(getCudaPath(cudaDev, &cudaPath));
+  *numaId = ncclTopoNumaId(cudaPath);
+  free(cudaPath);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclTopoGetLink(struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo, int* transport, ncclTvalue_t* value) {
+  *transport = -1;
+  if (topoFile == NULL) return ncclSuccess;
+  char src[BUSID_SIZE], dst[BUSID_SIZE];
+  topoBusId(myInfo->busId, src);
+  if (myInfo->hostHash == peerInfo->hostHash) topoBusId(peerInfo->busId, dst);
+  else strcpy(dst, "net");
+  for (int l=0; l<topoFile->nLinks; l++) {
+    struct ncclTopoLink* link = topoFile->links+l;
+    if (strcmp(link->src, src) == 0 && strcmp(link->dst, dst) == 0) {
+      *transport = link->transport;
+      *value = link->value;
+      return ncclSuccess;
+    }
+  }
+  return ncclSuccess;
+}
+
+static void topoDumpDev(FILE* file, const char* tag, const char* key, const char* id, char* path) {
+  fprintf(file, "  <%s %s=\"%s\"", tag, key, id);
+  if (path) fprintf(file, " path=\"%s\" numa=\"%d\"", path, ncclTopoNumaId(path));
+  fprintf(file, "/>\n");
+}
+
+// Dump the GPUs on the node of rank, the NICs and the connection matrix
+ncclResult_t ncclTopoDump(struct ncclPeerInfo* peerInfo, int nranks, int rank, int* connectTransport, ncclTvalue_t* connectValue) {
+  const char* name = getenv("NCCL_TOPO_DUMP_FILE");
+  if (name == NULL || strlen(name) == 0) return ncclSuccess;
+  FILE* file = fopen(name, "w");
+  if (file == NULL) {
+    WARN("Could not open topology dump file %s : %s", name, strerror(errno));
+    return ncclSuccess;
+  }
+  fprintf(file, "<system version=\"1\">\n");
+  uint64_t hostHash = peerInfo[rank].hostHash;
+  for (int r=0; r<nranks; r++) {
+    if (peerInfo[r].hostHash != hostHash) continue;
+    char busId[BUSID_SIZE];
+    char* path = NULL;
+    topoBusId(peerInfo[r].busId, busId);
+    if (ncclTopoGpuPath(busId, &path) != ncclSuccess || (path == NULL && busIdPath(busId, &path) != ncclSuccess)) path = NULL;
+    topoDumpDev(file, "gpu", "busid", busId, path);
+    free(path);
+  }
+  int nDev = 0;
+  if (ncclNet && ncclNetDevices(&nDev) != ncclSuccess) nDev = 0;
+  for (int d=0; d<nDev; d++) {
+    char* path = NULL;
+    if (ncclTopoNicPath(d, &path) != ncclSuccess || (path == NULL && ncclNetPciPath(d, &path) != ncclSuccess)) path = NULL;
+    char dev[16];
+    snprintf(dev, 16, "%d", d);
+    topoDumpDev(file, "nic", "dev", dev, path);
+    free(path);
+  }
+  for (int i=0; i<nranks; i++) {
+    if (peerInfo[i].hostHash != hostHash) continue;
+    char src[BUSID_SIZE];
+    topoBusId(peerInfo[i].busId, src);
+    int net = 0;
+    for (int j=0; j<nranks; j++) {
+      int t = connectTransport[i*nranks+j];
+      if (i == j || t == -1) continue;
+      char dst[BUSID_SIZE];
+      if (peerInfo[j].hostHash == hostHash) {
+        topoBusId(peerInfo[j].busId, dst);
+      } else if (net++ == 0) {
+        strcpy(dst, "net");
+      } else {
+        continue;
+      }
+      fprintf(file, "  <link src=\"%s\" dst=\"%s\" transport=\"%s\" value=\"%ld\"/>\n", src, dst, ncclTransports[t].name, connectValue[i*nranks+j]);
+    }
+  }
+  fprintf(file, "</system>\n");
+  fclose(file);
+  INFO(NCCL_INIT, "Dumped topology to %s", name);
+  return ncclSuccess;
+}
+
 const char* pathDists[] = { "PIX", "PXB", "PHB", "NODE", "SYS" };
 
 int pciDistance(char* path1, char* path2) {
@@ -45,8 +359,8 @@ int pciDistance(char* path1, char* path2) {
     return PATH_NODE;
 #else
     /* Split the former PATH_SOC distance into PATH_NODE and PATH_SYS based on numaId */
-    int numaId1 = getNumaId(path1);
-    int numaId2 = getNumaId(path2);
+    int numaId1 = ncclTopoNumaId(path1);
+    int numaId2 = ncclTopoNumaId(path2);
     TRACE(NCCL_INIT, "depth %d score %d path1 %s numaId %d path2 %s numaId %d", depth, score, path1, numaId1, path2, numaId2);
     return ((numaId1 == numaId2) ? PATH_NODE : PATH_SYS);
 #endif
@@ -0,0 +1,414 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "core.h"
+#include "net.h"
+#include "param.h"
+#include "bootstrap.h"
+#include "utils.h"
+#include "tuning.h"
+
+#define NCCL_HW_NVLINK 0
+#define NCCL_HW_PCI 1
+#define NCCL_HW_NET 2
+
+// Latencies in us
+static const float baseLat [NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS] = { /* Tree (LL/Simple/LL128) */ { 4.4, 8.4, 4.4 }, /* Ring (LL/Simple/LL128) */ { 3.6, 8.4, 3.6 } };
+static const float hwLat [3][NCCL_NUM_ALGORITHMS][NCCL_NUM_PROTOCOLS] =
+{ /* NVLINK */
+  { /* Tree (LL/Simple/LL128) */ { .5, 28, 1.9 }, /* Ring (LL/Simple/LL128) */ { .4, 5.7, 2.5 } },
+  /* PCI */
+  { /* Tree (LL/Simple/LL128) */ { 1.0, 28, 1.9 }, /* Ring (LL/Simple/LL128) */ { 1.0, 5.7, 2.5 } },
+  /* NET */
+  { /* Tree (LL/Simple/LL128) */ { 5.0, 50, 7.5 }, /* Ring (LL/Simple/LL128) */ { .9, 8.0, 2.5 } }
+};
+
+// Bandwidths in MB/s (B/us)
+#define NCCL_CHANNEL_BW 10000 // What a single channel can sustain
+#define NCCL_PCI_BW 12000     // Shared by all channels
+#define NCCL_NET_BW 10000     // Per NIC, when the network does not report its speed
+
+// LL sends 8 bytes of flags with every 8 bytes of data and is limited in
+// the number of threads. This is a rough approximation.
+static const float llRatio[NCCL_NUM_ALGORITHMS] = { 1.0/3.0, 1.0/4.0 };
+// LL128 lines carry 120 bytes of data out of 128, but syncing on every line
+// still costs a bit compared to the simple protocol.
+static const float ll128Ratio[NCCL_NUM_ALGORITHMS] = { 0.8, 0.9 };
+
+static int log2i(int n) {
+  int l = 0;
+  while (n>>=1) l++;
+  return l;
+}
+
+static float bestAllReduceTime(struct ncclComm* comm, int algo, ssize_t size) {
+  float best = -1.0;
+  for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+    // Respect NCCL_LL_THRESHOLD if set
+    if (comm->llThreshold >= 0 && (p == NCCL_PROTO_LL) != (size <= comm->llThreshold)) continue;
+    float time = ncclTuningTime(comm, ncclCollAllReduce, algo, p, comm->nChannels, size);
+    if (time >= 0 && (best < 0 || time < best)) best = time;
+  }
+  return best;
+}
+
+static int treeFaster(struct ncclComm* comm, ssize_t size) {
+  float treeTime = bestAllReduceTime(comm, NCCL_ALGO_TREE, size);
+  float ringTime = bestAllReduceTime(comm, NCCL_ALGO_RING, size);
+  return treeTime >= 0 && (ringTime < 0 || treeTime < ringTime);
+}
+
+#define MAX_TREE_SIZE (1LL << 40)
+
+// Largest size for which the tree is faster than the ring
+static ssize_t computeTreeThreshold(struct ncclComm* comm) {
+  if (treeFaster(comm, 1) == 0) return 0;
+  ssize_t lo = 1, hi = 2;
+  while (treeFaster(comm, hi)) {
+    if (hi >= MAX_TREE_SIZE) return 0x7fffffffffffffff;
+    lo = hi;
+    hi <<= 1;
+  }
+  while (hi - lo > 1) {
+    ssize_t mid = lo + (hi-lo)/2;
+    if (treeFaster(comm, mid)) lo = mid; else hi = mid;
+  }
+  return lo;
+}
+
+ncclResult_t ncclTuningInit(struct ncclComm* comm, int nnodes) {
+  int nranks = comm->nRanks;
+  if (nnodes < 1) nnodes = 1;
+
+  int nvlink;
+  NCCLCHECK(ncclNvlinkGpu(&nvlink));
+  int intraHw = nvlink ? NCCL_HW_NVLINK : NCCL_HW_PCI;
+
+  float intraBw = nvlink ? NCCL_CHANNEL_BW*MAXCHANNELS : NCCL_PCI_BW;
+  float interBw = intraBw;
+  float netLat = 0;
+  if (nnodes > 1) {
+    int nNetDevs = 1;
+    if (ncclNetDevices(&nNetDevs) != ncclSuccess || nNetDevs < 1) nNetDevs = 1;
+    // Use the speed/latency reported by the network when it knows them
+    interBw = 0;
+    for (int d=0; d<nNetDevs; d++) {
+      ncclNetProperties_t props;
+      if (ncclNetGetProperties(d, &props) != ncclSuccess) props.speed = 0;
+      interBw += props.speed > 0 ? props.speed/8.0 : NCCL_NET_BW;
+      if (props.speed > 0) netLat = std::max(netLat, props.latency);
+    }
+  }
+
+  for (int coll=0; coll<ncclCollCount; coll++) {
+    // Send/Recv is a single step, which we assume goes through the network
+    // when there is one.
+    int nsteps = coll == ncclCollAllReduce ? 2*(nranks-1) : coll == ncclCollSendRecv ? 1 : nranks-1;
+    int nInterSteps = nnodes == 1 ? 0 : coll == ncclCollAllReduce ? 2*(nnodes-1) : coll == ncclCollSendRecv ? 1 : nnodes-1;
+    // Ratio between algorithm bandwidth and bus bandwidth
+    float ringRatio = (coll == ncclCollBroadcast || coll == ncclCollReduce || coll == ncclCollSendRecv || nsteps == 0) ? 1.0 : (1.0*nranks)/nsteps;
+    for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
+      // Trees are only implemented for allreduce and rooted collectives, and
+      // only make sense across nodes
+      int algoSupported = a == NCCL_ALGO_RING || ((coll == ncclCollAllReduce || coll == ncclCollBroadcast || coll == ncclCollReduce) && nnodes > 1);
+      for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+        // LL128 needs suitable links (see comm->ll128), Send/Recv does not implement it
+        int supported = algoSupported && (p != NCCL_PROTO_LL128 || (comm->ll128 && coll != ncclCollSendRecv));
+        float intraLat = hwLat[intraHw][a][p];
+        float interLat = hwLat[NCCL_HW_NET][a][p] + netLat;
+        comm->latencies[coll][a][p] = baseLat[a][p] + (a == NCCL_ALGO_TREE ?
+          2 * ((nranks/nnodes-1)*intraLat + log2i(nnodes)*interLat) :
+          (nsteps-nInterSteps)*intraLat + nInterSteps*interLat);
+        for (int c=0; c<MAXCHANNELS; c++) {
+          float busBw = std::min(std::min((float)NCCL_CHANNEL_BW*(c+1), intraBw), interBw);
+          if (a == NCCL_ALGO_TREE) {
+            busBw *= nvlink ? 3.0/4.0 : 2.0/3.0;
+            if (nnodes == 2) busBw *= 2;
+          }
+          if (p == NCCL_PROTO_LL) busBw *= llRatio[a];
+          if (p == NCCL_PROTO_LL128) busBw *= ll128Ratio[a];
+          // Allreduce data goes up then down the tree, rooted data only once
+          float ratio = a == NCCL_ALGO_TREE ? (coll == ncclCollAllReduce ? .5 : 1.0) : ringRatio;
+          comm->bandwidths[coll][a][p][c] = supported ? busBw * ratio : 0;
+        }
+      }
+    }
+  }
+
+  if (comm->treeThreshold == -2) comm->treeThreshold = computeTreeThreshold(comm);
+
+  if (comm->rank == 0) {
+    int c = comm->nChannels-1;
+    float (*lat)[NCCL_NUM_PROTOCOLS] = comm->latencies[ncclCollAllReduce];
+    float (*bw)[NCCL_NUM_PROTOCOLS][MAXCHANNELS] = comm->bandwidths[ncclCollAllReduce];
+    INFO(NCCL_INIT, "AllReduce latency/bw (us/MBps) : Tree LL %.1f/%.0f Simple %.1f/%.0f LL128 %.1f/%.0f, Ring LL %.1f/%.0f Simple %.1f/%.0f LL128 %.1f/%.0f",
+        lat[NCCL_ALGO_TREE][NCCL_PROTO_LL], bw[NCCL_ALGO_TREE][NCCL_PROTO_LL][c],
+        lat[NCCL_ALGO_TREE][NCCL_PROTO_SIMPLE], bw[NCCL_ALGO_TREE][NCCL_PROTO_SIMPLE][c],
+        lat[NCCL_ALGO_TREE][NCCL_PROTO_LL128], bw[NCCL_ALGO_TREE][NCCL_PROTO_LL128][c],
+        lat[NCCL_ALGO_RING][NCCL_PROTO_LL], bw[NCCL_ALGO_RING][NCCL_PROTO_LL][c],
+        lat[NCCL_ALGO_RING][NCCL_PROTO_SIMPLE], bw[NCCL_ALGO_RING][NCCL_PROTO_SIMPLE][c],
+        lat[NCCL_ALGO_RING][NCCL_PROTO_LL128], bw[NCCL_ALGO_RING][NCCL_PROTO_LL128][c]);
+  }
+  return ncclSuccess;
+}
+
+/*****************************************************************************/
+/*         Online auto-tuning : time candidates on the first calls           */
+/*****************************************************************************/
+
+NCCL_PARAM(AutoTune, "AUTOTUNE", 0);
+
+static const char* algoStr[NCCL_NUM_ALGORITHMS] = { "Tree", "Ring" };
+static const char* protoStr[NCCL_NUM_PROTOCOLS] = { "LL", "Simple", "LL128" };
+
+static int getBucket(size_t nBytes) {
+  int bucket = 0;
+  while (nBytes >>= 1) bucket++;
+  return std::min(bucket, NCCL_AUTOTUNE_BUCKETS-1);
+}
+
+// Hash of what decisions depend on : hosts and GPUs of all ranks, and the
+// network devices seen by each rank.
+static ncclResult_t computeTopoHash(struct ncclComm* comm, uint64_t* topoHash) {
+  char line[1024];
+  snprintf(line, sizeof(line), "%d", comm->nChannels);
+  for (int r=0; r<comm->nRanks; r++) {
+    snprintf(line+strlen(line), sizeof(line)-strlen(line), " %lx/%s", comm->peerInfo[r].hostHash, comm->peerInfo[r].busId);
+    // Avoid overflowing the line with many ranks
+    if (strlen(line) > 512) snprintf(line, sizeof(line), "%lx", getHash(line));
+  }
+  uint64_t* hashes;
+  NCCLCHECK(ncclCalloc(&hashes, comm->nRanks));
+  hashes[comm->rank] = getHash(line);
+  int ndev = 0;
+  if (ncclNet && ncclNetDevices(&ndev) == ncclSuccess) {
+    for (int d=0; d<ndev; d++) {
+      char* path;
+      if (ncclNetPciPath(d, &path) != ncclSuccess) continue;
+      snprintf(line, sizeof(line), "%lx %s", hashes[comm->rank], path);
+      hashes[comm->rank] = getHash(line);
+      free(path);
+    }
+  }
+  ncclResult_t res = bootstrapAllGather(comm->bootstrap, hashes, sizeof(uint64_t));
+  if (res == ncclSuccess) {
+    line[0] = '\0';
+    for (int r=0; r<comm->nRanks; r++) {
+      snprintf(line+strlen(line), sizeof(line)-strlen(line), "%lx ", hashes[r]);
+      if (strlen(line) > 512) snprintf(line, sizeof(line), "%lx ", getHash(line));
+    }
+    *topoHash = getHash(line);
+  }
+  free(hashes);
+  return res;
+}
+
+/* The cache file has one decision per line :
+ * <topology hash> <coll> <datatype> <size bucket> <algorithm> <protocol> <nChannels>
+ * Lines for other topologies are ignored ; the last line for a key wins.
+ */
+static ncclResult_t autoTuneLoad(struct ncclComm* comm) {
+  struct ncclAutoTune* tune = comm->autoTune;
+  NCCLCHECK(computeTopoHash(comm, &tune->topoHash));
+
+  int nLoaded = 0;
+  FILE* f = fopen(tune->file, "r");
+  if (f != NULL) {
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+      uint64_t hash;
+      int coll, type, bucket;
+      struct ncclTuneConfig config;
+      if (line[0] == '#') continue;
+      if (sscanf(line, "%lx %d %d %d %d %d %d", &hash, &coll, &type, &bucket,
+            &config.algorithm, &config.protocol, &config.nChannels) != 7) continue;
+      if (hash != tune->topoHash) continue;
+      if (coll < 0 || coll >= ncclCollCount || type < 0 || type >= ncclNumTypes || bucket < 0 || bucket >= NCCL_AUTOTUNE_BUCKETS) continue;
+      for (int c=0; c<tune->nCandidates; c++) {
+        struct ncclTuneConfig* cand = tune->candidates+c;
+        if (cand->algorithm == config.algorithm && cand->protocol == config.protocol && cand->nChannels == config.nChannels) {
+          struct ncclTuneEntry* entry = &tune->entries[coll][type][bucket];
+          entry->tuned = 1;
+          entry->winner = c;
+          nLoaded++;
+          break;
+        }
+      }
+    }
+    fclose(f);
+  }
+
+  // Ranks must agree on the decisions, otherwise they would launch
+  // different kernels. Compare a checksum and start from scratch if needed.
+  uint64_t* sums;
+  NCCLCHECK(ncclCalloc(&sums, comm->nRanks));
+  uint64_t sum = 5381;
+  for (int c=0; c<ncclCollCount; c++) for (int t=0; t<ncclNumTypes; t++) for (int b=0; b<NCCL_AUTOTUNE_BUCKETS; b++) {
+    struct ncclTuneEntry* entry = &tune->entries[c][t][b];
+    sum = sum*33 + (entry->tuned ? entry->winner+1 : 0);
+  }
+  sums[comm->rank] = sum;
+  ncclResult_t res = bootstrapAllGather(comm->bootstrap, sums, sizeof(uint64_t));
+  int match = 1;
+  for (int r=0; r<comm->nRanks; r++) if (sums[r] != sum) match = 0;
+  free(sums);
+  NCCLCHECK(res);
+  if (match == 0) {
+    INFO(NCCL_INIT, "Auto-tuning cache %s differs between ranks, ignoring it", tune->file);
+    memset(tune->entries, 0, sizeof(tune->entries));
+    nLoaded = 0;
+  }
+  if (comm->rank == 0) INFO(NCCL_INIT, "Auto-tuning loaded %d decisions from %s (topology %lx)", nLoaded, tune->file, tune->topoHash);
+  return ncclSuccess;
+}
+
+static void autoTuneSave(struct ncclComm* comm, int coll, int type, int bucket, struct ncclTuneConfig* config) {
+  struct ncclAutoTune* tune = comm->autoTune;
+  FILE* f = fopen(tune->file, "a");
+  if (f == NULL) {
+    INFO(NCCL_INIT, "Auto-tuning : could not open %s : %s", tune->file, strerror(errno));
+    return;
+  }
+  fprintf(f, "%lx %d %d %d %d %d %d\n", tune->topoHash, coll, type, bucket,
+      config->algorithm, config->protocol, config->nChannels);
+  fclose(f);
+}
+
+ncclResult_t ncclAutoTuneInit(struct ncclComm* comm) {
+  if (ncclParamAutoTune() != 1 || comm->nRanks == 1) return ncclSuccess;
+  struct ncclAutoTune* tune;
+  NCCLCHECK(ncclCalloc(&tune, 1));
+  CUDACHECK(cudaEventCreate(&tune->start));
+  CUDACHECK(cudaEventCreate(&tune->stop));
+
+  // Candidate channel counts : all, half and a quarter of the channels
+  int nc[3] = { comm->nChannels, comm->nChannels/2, comm->nChannels/4 };
+  for (int a=0; a<NCCL_NUM_ALGORITHMS; a++) {
+    // Trees are only connected when the tree threshold is not 0
+    if (a == NCCL_ALGO_TREE && comm->treeThreshold == 0) continue;
+    for (int p=0; p<NCCL_NUM_PROTOCOLS; p++) {
+      if (p == NCCL_PROTO_LL128 && comm->ll128 == 0) continue;
+      for (int c=0; c<3; c++) {
+        if (nc[c] == 0 || (c > 0 && nc[c] == nc[c-1])) continue;
+        struct ncclTuneConfig* config = tune->candidates+tune->nCandidates++;
+        config->algorithm = a;
+        config->protocol = p;
+        config->nChannels = nc[c];
+      }
+    }
+  }
+  comm->autoTune = tune;
+  INFO(NCCL_INIT, "Auto-tuning enabled with %d candidates", tune->nCandidates);
+
+  tune->file = getenv("NCCL_AUTOTUNE_FILE");
+  if (tune->file) NCCLCHECK(autoTuneLoad(comm));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclAutoTuneFree(struct ncclComm* comm) {
+  struct ncclAutoTune* tune = comm->autoTune;
+  if (tune == NULL) return ncclSuccess;
+  CUDACHECK(cudaEventDestroy(tune->start));
+  CUDACHECK(cudaEventDestroy(tune->stop));
+  free(tune);
+  comm->autoTune = NULL;
+  return ncclSuccess;
+}
+
+static struct ncclTuneEntry* getEntry(struct ncclInfo* info) {
+  return &info->comm->autoTune->entries[info->coll][info->datatype][getBucket(info->nBytes)];
+}
+
+static int candidateValid(struct ncclInfo* info, struct ncclTuneConfig* config) {
+  if (config->protocol == NCCL_PROTO_LL128 && info->coll == ncclCollSendRecv) return 0;
+  return config->algorithm == NCCL_ALGO_RING || info->coll == ncclCollAllReduce ||
+    info->coll == ncclCollBroadcast || info->coll == ncclCollReduce;
+}
+
+ncclResult_t ncclAutoTuneStart(struct ncclInfo* info, int blocking, int* trial) {
+  *trial = -1;
+  struct ncclAutoTune* tune = info->comm->autoTune;
+  if (tune == NULL || info->comm->nRanks == 1) return ncclSuccess;
+  struct ncclTuneEntry* entry = getEntry(info);
+  if (entry->tuned) {
+    info->config = tune->candidates+entry->winner;
+    return ncclSuccess;
+  }
+  // Timing requires to synchronize and to talk to other ranks; we can't do
+  // that inside a group. Use the default choice then.
+  if (blocking == 0) return ncclSuccess;
+
+  // Skip candidates which do not apply to this collective
+  while (entry->nTried < tune->nCandidates && !candidateValid(info, tune->candidates+entry->nTried)) {
+    entry->times[entry->nTried++] = -1.0;
+  }
+  if (entry->nTried == tune->nCandidates) return ncclSuccess;
+
+  *trial = entry->nTried;
+  info->config = tune->candidates+*trial;
+  CUDACHECK(cudaEventRecord(tune->start, info->stream));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclAutoTuneEnd(struct ncclInfo* info, int trial) {
+  struct ncclComm* comm = info->comm;
+  struct ncclAutoTune* tune = comm->autoTune;
+  struct ncclTuneEntry* entry = getEntry(info);
+
+  float ms;
+  CUDACHECK(cudaEventRecord(tune->stop, info->stream));
+  CUDACHECK(cudaEventSynchronize(tune->stop));
+  CUDACHECK(cudaEventElapsedTime(&ms, tune->start, tune->stop));
+  entry->times[trial] = ms*1000;
+  entry->nTried++;
+
+  while (entry->nTried < tune->nCandidates && !candidateValid(info, tune->candidates+entry->nTried)) {
+    entry->times[entry->nTried++] = -1.0;
+  }
+  if (entry->nTried < tune->nCandidates) return ncclSuccess;
+
+  // All candidates were tried. Since all ranks see the same sequence of
+  // operations, they all get here at the same time : exchange timings and
+  // pick the candidate with the best worst case across ranks.
+  float* allTimes;
+  NCCLCHECK(ncclCalloc(&allTimes, comm->nRanks*NCCL_AUTOTUNE_MAX_CANDIDATES));
+  memcpy(allTimes+comm->rank*NCCL_AUTOTUNE_MAX_CANDIDATES, entry->times, sizeof(entry->times));
+  ncclResult_t res = bootstrapAllGather(comm->bootstrap, allTimes, sizeof(entry->times));
+  if (res != ncclSuccess) {
+    free(allTimes);
+    return res;
+  }
+  int winner = -1;
+  float winnerTime = 0;
+  for (int c=0; c<tune->nCandidates; c++) {
+    float time = 0;
+    for (int r=0; r<comm->nRanks; r++) {
+      float t = allTimes[r*NCCL_AUTOTUNE_MAX_CANDIDATES+c];
+      if (t < 0) { time = -1.0; break; }
+      time = std::max(time, t);
+    }
+    if (time < 0) continue;
+    if (winner == -1 || time < winnerTime) {
+      winner = c;
+      winnerTime = time;
+    }
+  }
+  free(allTimes);
+  if (winner == -1) {
+    WARN("Auto-tuning failed to find a valid candidate for %s", info->opName);
+    return ncclInternalError;
+  }
+  entry->winner = winner;
+  entry->tuned = 1;
+  struct ncclTuneConfig* config = tune->candidates+winner;
+  if (comm->rank == 0) {
+    INFO(NCCL_COLL, "Auto-tuning %s datatype %d size %zi : %s/%s nChannels %d (%.1f us)",
+        info->opName, info->datatype, info->nBytes, algoStr[config->algorithm], protoStr[config->protocol],
+        config->nChannels, winnerTime);
+    if (tune->file) autoTuneSave(comm, info->coll, info->datatype, getBucket(info->nBytes), config);
+  }
+  return ncclSuccess;
+}
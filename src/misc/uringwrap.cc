@@ -0,0 +1,218 @@
+/*************************************************************************
+ * Copyright (c) 2016-2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "uringwrap.h"
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define NCCL_HAVE_IO_URING 1
+#endif
+#endif
+
+#if NCCL_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+struct ncclUring {
+  int fd;
+  // Submission queue
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned sqMask;
+  unsigned sqEntries;
+  unsigned* sqArray;
+  struct io_uring_sqe* sqes;
+  unsigned sqLocalTail;
+  unsigned sqSubmitted;
+  // Completion queue
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned cqMask;
+  struct io_uring_cqe* cqes;
+  // Mappings
+  void* sqRing;
+  size_t sqRingSize;
+  void* cqRing;
+  size_t cqRingSize;
+  size_t sqesSize;
+};
+
+static int uringSetup(unsigned entries, struct io_uring_params* p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+static int uringRegister(int fd, unsigned opcode, void* arg, unsigned nrArgs) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+ncclResult_t ncclUringSupported(int* supported) {
+  *supported = 0;
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = uringSetup(2, &p);
+  if (fd < 0) return ncclSuccess;
+  // IORING_OP_SEND/RECV need Linux 5.6, check through the probe interface
+  size_t probeSize = sizeof(struct io_uring_probe) + IORING_OP_LAST*sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = (struct io_uring_probe*)calloc(1, probeSize);
+  if (probe && uringRegister(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0 &&
+      probe->last_op >= IORING_OP_RECV &&
+      (probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED) &&
+      (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED) &&
+      (probe->ops[IORING_OP_WRITE_FIXED].flags & IO_URING_OP_SUPPORTED) &&
+      (probe->ops[IORING_OP_READ_FIXED].flags & IO_URING_OP_SUPPORTED)) {
+    *supported = 1;
+  }
+  free(probe);
+  close(fd);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclUringInit(struct ncclUring** ringPtr, int entries) {
+  struct ncclUring* ring;
+  NCCLCHECK(ncclCalloc(&ring, 1));
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring->fd = uringSetup(entries, &p);
+  if (ring->fd < 0) {
+    WARN("Call to io_uring_setup failed : %s", strerror(errno));
+    free(ring);
+    return ncclSystemError;
+  }
+
+  ring->sqRingSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  ring->cqRingSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->sqRingSize = ring->cqRingSize = std::max(ring->sqRingSize, ring->cqRingSize);
+  }
+  ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sqRing == MAP_FAILED) {
+    WARN("io_uring : mmap of the submission ring failed : %s", strerror(errno));
+    ring->sqRing = NULL;
+    goto fail;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cqRing = ring->sqRing;
+  } else {
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cqRing == MAP_FAILED) {
+      WARN("io_uring : mmap of the completion ring failed : %s", strerror(errno));
+      ring->cqRing = NULL;
+      goto fail;
+    }
+  }
+  ring->sqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    WARN("io_uring : mmap of the submission entries failed : %s", strerror(errno));
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  {
+    char* sq = (char*)ring->sqRing;
+    ring->sqHead = (unsigned*)(sq+p.sq_off.head);
+    ring->sqTail = (unsigned*)(sq+p.sq_off.tail);
+    ring->sqMask = *(unsigned*)(sq+p.sq_off.ring_mask);
+    ring->sqEntries = *(unsigned*)(sq+p.sq_off.ring_entries);
+    ring->sqArray = (unsigned*)(sq+p.sq_off.array);
+    ring->sqLocalTail = ring->sqSubmitted = *ring->sqTail;
+    char* cq = (char*)ring->cqRing;
+    ring->cqHead = (unsigned*)(cq+p.cq_off.head);
+    ring->cqTail = (unsigned*)(cq+p.cq_off.tail);
+    ring->cqMask = *(unsigned*)(cq+p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq+p.cq_off.cqes);
+  }
+  *ringPtr = ring;
+  return ncclSuccess;
+fail:
+  ncclUringDestroy(ring);
+  return ncclSystemError;
+}
+
+ncclResult_t ncclUringDestroy(struct ncclUring* ring) {
+  if (ring == NULL) return ncclSuccess;
+  if (ring->sqes) munmap(ring->sqes, ring->sqesSize);
+  if (ring->cqRing && ring->cqRing != ring->sqRing) munmap(ring->cqRing, ring->cqRingSize);
+  if (ring->sqRing) munmap(ring->sqRing, ring->sqRingSize);
+  close(ring->fd);
+  free(ring);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclUringPrepSocket(struct ncclUring* ring, int send, int fd, void* addr, int len, int bufIndex, uint64_t userData) {
+  unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (ring->sqLocalTail - head >= ring->sqEntries) return ncclInternalError;
+  unsigned index = ring->sqLocalTail & ring->sqMask;
+  struct io_uring_sqe* sqe = ring->sqes+index;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  if (bufIndex >= 0) {
+    sqe->opcode = send ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    sqe->buf_index = bufIndex;
+  } else {
+    sqe->opcode = send ? IORING_OP_SEND : IORING_OP_RECV;
+  }
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)addr;
+  sqe->len = len;
+  sqe->user_data = userData;
+  ring->sqArray[index] = index;
+  ring->sqLocalTail++;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclUringSubmit(struct ncclUring* ring, int waitNr) {
+  __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+  unsigned toSubmit = ring->sqLocalTail - ring->sqSubmitted;
+  if (toSubmit == 0 && waitNr == 0) return ncclSuccess;
+  int ret = uringEnter(ring->fd, toSubmit, waitNr, waitNr ? IORING_ENTER_GETEVENTS : 0);
+  if (ret < 0) {
+    if (errno == EINTR || errno == EAGAIN || errno == EBUSY) return ncclSuccess; // Retry later
+    WARN("io_uring : io_uring_enter failed : %s", strerror(errno));
+    return ncclSystemError;
+  }
+  ring->sqSubmitted += ret;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclUringReap(struct ncclUring* ring, int* found, uint64_t* userData, int* res) {
+  unsigned head = *ring->cqHead;
+  if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+    *found = 0;
+    return ncclSuccess;
+  }
+  struct io_uring_cqe* cqe = ring->cqes+(head & ring->cqMask);
+  *userData = cqe->user_data;
+  *res = cqe->res;
+  *found = 1;
+  __atomic_store_n(ring->cqHead, head+1, __ATOMIC_RELEASE);
+  return ncclSuccess;
+}
+
+ncclResult_t ncclUringRegisterBuffers(struct ncclUring* ring, struct iovec* iovs, int nIovs) {
+  SYSCHECK(uringRegister(ring->fd, IORING_REGISTER_BUFFERS, iovs, nIovs), "io_uring_register");
+  return ncclSuccess;
+}
+
+ncclResult_t ncclUringUnregisterBuffers(struct ncclUring* ring) {
+  SYSCHECK(uringRegister(ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0), "io_uring_register");
+  return ncclSuccess;
+}
+
+#else
+
+ncclResult_t ncclUringSupported(int* supported) { *supported = 0; return ncclSuccess; }
+ncclResult_t ncclUringInit(struct ncclUring** ring, int entries) { return ncclSystemError; }
+ncclResult_t ncclUringDestroy(struct ncclUring* ring) { return ncclSuccess; }
+ncclResult_t ncclUringPrepSocket(struct ncclUring* ring, int send, int fd, void* addr, int len, int bufIndex, uint64_t userData) { return ncclSystemError; }
+ncclResult_t ncclUringSubmit(struct ncclUring* ring, int waitNr) { return ncclSystemError; }
+ncclResult_t ncclUringReap(struct ncclUring* ring, int* found, uint64_t* userData, int* res) { return ncclSystemError; }
+ncclResult_t ncclUringRegisterBuffers(struct ncclUring* ring, struct iovec* iovs, int nIovs) { return ncclSystemError; }
+ncclResult_t ncclUringUnregisterBuffers(struct ncclUring* ring) { return ncclSystemError; }
+
+#endif
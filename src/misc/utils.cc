@@ -13,6 +13,13 @@
 
 #include "nvmlwrap.h"
 #include "core.h"
+#include "param.h"
+#include <sys/syscall.h>
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#define NCCL_NUMA_MAX_NODES 64
 
 // Convert a logical cudaDev index to the NVML device minor number
 ncclResult_t getNvmlDevice(int cudaDev, int *nvmlDev) {
@@ -143,6 +150,24 @@ uint64_t getPidHash(void) {
   return getHash(pname);
 }
 
+NCCL_PARAM(NumaAlloc, "NUMA_ALLOC", 1);
+
+int ncclNumaAllocId(int numaId) {
+  if (ncclParamNumaAlloc() == 0 || numaId < 0 || numaId >= NCCL_NUMA_MAX_NODES) return -1;
+  return numaId;
+}
+
+void ncclNumaBind(void* ptr, size_t size, int numaId) {
+  if (numaId < 0 || numaId >= NCCL_NUMA_MAX_NODES) return;
+  unsigned long nodeMask[NCCL_NUMA_MAX_NODES/(8*sizeof(unsigned long))];
+  memset(nodeMask, 0, sizeof(nodeMask));
+  nodeMask[numaId/(8*sizeof(unsigned long))] = 1UL << (numaId%(8*sizeof(unsigned long)));
+  // The kernel reads maxnode-1 bits
+  if (syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, nodeMask, NCCL_NUMA_MAX_NODES+1, 0) != 0) {
+    INFO(NCCL_INIT, "Could not place %ld bytes on NUMA node %d : %s", size, numaId, strerror(errno));
+  }
+}
+
 int parseStringList(const char* string, struct netIf* ifList, int maxList) {
   if (!string) return 0;
 
@@ -5,13 +5,18 @@
  ************************************************************************/
 
 #include "core.h"
+#include "param.h"
+#include "timeline.h"
+#include "profiler.h"
 
 extern struct ncclTransport p2pTransport;
+extern struct ncclTransport ceTransport;
 extern struct ncclTransport shmTransport;
 extern struct ncclTransport netTransport;
 
 struct ncclTransport ncclTransports[NTRANSPORTS] = {
   p2pTransport,
+  ceTransport,
   shmTransport,
   netTransport,
 };
@@ -42,9 +47,12 @@ struct ncclProxyPool {
 };
 
 ncclResult_t transportAllocateProxyArgs(struct ncclComm* comm, struct ncclProxyArgs** argsptr) {
-  struct ncclProxyState* state = &comm->proxyState;
+  struct ncclProxyOps* state = &comm->proxyOps;
   struct ncclProxyArgs* elem;
-  pthread_mutex_lock(&state->mutex);
+  if (state->pool == NULL) {
+    // Take back the elements the proxy thread is done with
+    state->pool = __atomic_exchange_n(&state->freed, (struct ncclProxyArgs*)NULL, __ATOMIC_ACQUIRE);
+  }
   if (state->pool == NULL) {
     // Allocate a new pool of elements
     struct ncclProxyPool* newPool;
@@ -62,17 +70,32 @@ ncclResult_t transportAllocateProxyArgs(struct ncclComm* comm, struct ncclProxyA
   }
   elem = state->pool;
   state->pool = state->pool->next;
-  pthread_mutex_unlock(&state->mutex);
   elem->next = elem->nextPeer = NULL;
   *argsptr = elem;
   return ncclSuccess;
 }
 
-static void ProxyAppend(struct ncclConnector* connector, struct ncclProxyArgs* args) {
-  struct ncclComm* comm = connector->comm;
-  struct ncclProxyState* state = &comm->proxyState;
-  pthread_mutex_lock(&state->mutex);
-  if (connector->proxyAppend == NULL) {
+// Called by the proxy threads. Several threads may push concurrently, but
+// the launching thread only ever takes the whole list, so there is no ABA.
+static void ProxyFree(struct ncclProxyArgs* args) {
+  struct ncclProxyOps* state = &args->connector->comm->proxyOps;
+  struct ncclProxyArgs* head = __atomic_load_n(&state->freed, __ATOMIC_RELAXED);
+  do {
+    args->next = head;
+  } while (!__atomic_compare_exchange_n(&state->freed, &head, args, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  // Last access to the communicator, which may be destroyed right after
+  __atomic_add_fetch(&state->done, 1, __ATOMIC_RELEASE);
+}
+
+// Operations of connectors shared between communicators queue on the same list
+static struct ncclProxyArgs** ProxyAppendPtr(struct ncclConnector* connector) {
+  return connector->shared ? &connector->shared->proxyAppend : &connector->proxyAppend;
+}
+
+// Called by the proxy thread only
+static void ProxyAppend(struct ncclProxyThread* state, struct ncclProxyArgs* args) {
+  struct ncclProxyArgs** proxyAppend = ProxyAppendPtr(args->connector);
+  if (*proxyAppend == NULL) {
     // Nothing running for that peer. Add to the circular list
     if (state->ops == NULL) {
       // Create the list
@@ -83,22 +106,61 @@ static void ProxyAppend(struct ncclConnector* connector, struct ncclProxyArgs* a
       args->next = state->ops->next;
       state->ops->next = args;
     }
-    connector->proxyAppend = args;
+    *proxyAppend = args;
   } else {
     // There is an active operation already for that peer.
     // Add it to the per-peer list
-    connector->proxyAppend->nextPeer = args;
-    connector->proxyAppend = args;
+    (*proxyAppend)->nextPeer = args;
+    *proxyAppend = args;
   }
+}
+
+// Move posted operations to the active list. Called by the proxy thread only.
+static void ProxyGetPosted(struct ncclProxyThread* state) {
+  uint64_t head = state->postedHead;
+  uint64_t tail = __atomic_load_n(&state->postedTail, __ATOMIC_ACQUIRE);
+  for (; head<tail; head++) ProxyAppend(state, state->posted[head%NCCL_PROXY_FIFO_SIZE]);
+  __atomic_store_n(&state->postedHead, head, __ATOMIC_RELEASE);
+}
+
+static void ProxyWake(struct ncclProxyThread* state) {
+  // Pairs with the sleeping flag being set before the proxy thread checks
+  // the FIFO a last time, so that one of the two sides sees the other.
+  if (__atomic_load_n(&state->sleeping, __ATOMIC_SEQ_CST) == 0) return;
+  pthread_mutex_lock(&state->mutex);
+  pthread_cond_signal(&state->cond);
   pthread_mutex_unlock(&state->mutex);
 }
 
+// Called by the launching threads
+static void ProxyPost(struct ncclProxyThread* state, struct ncclProxyArgs* args) {
+  pthread_mutex_lock(&state->postMutex);
+  uint64_t tail = state->postedTail;
+  while (tail - __atomic_load_n(&state->postedHead, __ATOMIC_ACQUIRE) == NCCL_PROXY_FIFO_SIZE) {
+    // The proxy thread may be sleeping, waiting for the launch
+    ProxyWake(state);
+    sched_yield();
+  }
+  state->posted[tail%NCCL_PROXY_FIFO_SIZE] = args;
+  __atomic_store_n(&state->postedTail, tail+1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&state->postMutex);
+}
+
 template <int type>
 static ncclResult_t SaveProxy(int peer, struct ncclProxyArgs* args) {
   if (peer < 0) return ncclSuccess;
 
   struct ncclPeer* peerComm = args->channel->peers+peer;
   struct ncclConnector* connector = type == proxyRecv ? &peerComm->recv : &peerComm->send;
+  // The network counts its bytes as they complete, other transports are
+  // accounted for here, one full step at a time.
+  if (connector->transport != NTRANSPORTS-1) {
+    ncclStats_t* stats = &connector->comm->stats;
+    uint64_t stepBytes = args->protocol == NCCL_PROTO_LL ? NCCL_LL_BUFF_SIZE/NCCL_STEPS/2 :
+                         args->protocol == NCCL_PROTO_LL128 ? NCCL_LL128_SLICE_DATA*sizeof(uint64_t) :
+                         (connector->conn.buffSize/NCCL_STEPS) >> args->stepShift;
+    ncclStatsAdd((type == proxyRecv ? stats->bytesRecv : stats->bytesSent)+connector->transport, args->nsteps*stepBytes);
+  }
   if (connector->transportComm->proxy == NULL) return ncclSuccess;
 
   struct ncclProxyArgs* op;
@@ -107,65 +169,196 @@ static ncclResult_t SaveProxy(int peer, struct ncclProxyArgs* args) {
   op->connector = connector;
   op->progress = connector->transportComm->proxy;
   op->state = ncclProxyOpReady;
-  ProxyAppend(connector, op);
+  connector->comm->proxyOps.posted++;
+  struct ncclProxyState* state = connector->comm->proxyState;
+  ProxyPost(state->threads+args->channel->id%state->nThreads, op);
   return ncclSuccess;
 }
 
+// Neighbors of rank in the tree re-rooted at root : the edges on the path
+// from root to the tree root are reversed. Must match ncclTreeReroot on the
+// GPU.
+static void treeReroot(struct ncclChannel* channel, int rank, int root, int* up, int* down) {
+  struct ncclTree* tree = &channel->tree;
+  // Find the child of rank which leads to root, if any
+  int pathChild = -2;
+  if (rank == root) pathChild = -1;
+  for (int r=root; pathChild == -2 && channel->treeUps[r] != -1; r=channel->treeUps[r]) {
+    if (channel->treeUps[r] == rank) pathChild = r;
+  }
+  int n = 0;
+  for (int i=0; i<NCCL_MAX_TREE_ARITY && tree->down[i] >= 0; i++) {
+    if (tree->down[i] != pathChild) down[n++] = tree->down[i];
+  }
+  if (pathChild == -2) {
+    *up = tree->up;
+  } else {
+    *up = pathChild;
+    if (tree->up >= 0) down[n++] = tree->up;
+  }
+  for (; n<NCCL_MAX_TREE_ARITY+1; n++) down[n] = -1;
+}
+
 ncclResult_t transportSaveProxies(struct ncclProxyArgs* args, int pattern, int root, int nranks) {
   if (pattern == ncclPatternRing || pattern == ncclPatternRingTwice || pattern == ncclPatternPipelineFrom || pattern == ncclPatternPipelineTo) {
     struct ncclRing* ring = &args->channel->ring;
     if (NeedProxy(RECV, pattern, root, ring, nranks)) NCCLCHECK(SaveProxy<proxyRecv>(ring->prev, args));
     if (NeedProxy(SEND, pattern, root, ring, nranks)) NCCLCHECK(SaveProxy<proxySend>(ring->next, args));
   }
-  if (pattern == ncclPatternTreeUp || pattern == ncclPatternTreeUpDown) {
-    // Tree up
+  if (pattern == ncclPatternTreeUp || pattern == ncclPatternTreeDown) {
+    // Rooted collectives use the tree re-rooted at their root
+    int up, down[NCCL_MAX_TREE_ARITY+1];
+    treeReroot(args->channel, args->channel->ring.userRanks[0], root, &up, down);
+    if (pattern == ncclPatternTreeUp) {
+      for (int i=0; i<NCCL_MAX_TREE_ARITY+1; i++) NCCLCHECK(SaveProxy<proxyRecv>(down[i], args));
+      NCCLCHECK(SaveProxy<proxySend>(up, args));
+    } else {
+      for (int i=0; i<NCCL_MAX_TREE_ARITY+1; i++) NCCLCHECK(SaveProxy<proxySend>(down[i], args));
+      NCCLCHECK(SaveProxy<proxyRecv>(up, args));
+    }
+  }
+  if (pattern == ncclPatternTreeUpDown) {
     struct ncclTree* tree = &args->channel->tree;
+    // Tree up
     for (int i=0; i<NCCL_MAX_TREE_ARITY; i++) NCCLCHECK(SaveProxy<proxyRecv>(tree->down[i], args));
     NCCLCHECK(SaveProxy<proxySend>(tree->up, args));
-  }
-  if (pattern == ncclPatternTreeDown || pattern == ncclPatternTreeUpDown) {
     // Tree down
-    struct ncclTree* tree = &args->channel->tree;
     for (int i=0; i< NCCL_MAX_TREE_ARITY; i++) NCCLCHECK(SaveProxy<proxySend>(tree->down[i], args));
     NCCLCHECK(SaveProxy<proxyRecv>(tree->up, args));
   }
   return ncclSuccess;
 }
 
-void* persistentThread(void *comm_) {
-  struct ncclComm* comm = (struct ncclComm*)comm_;
-  struct ncclProxyState* state = &comm->proxyState;
+ncclResult_t transportSaveP2pProxy(struct ncclProxyArgs* args, int peer, int send) {
+  return send ? SaveProxy<proxySend>(peer, args) : SaveProxy<proxyRecv>(peer, args);
+}
+
+NCCL_PARAM(ProxyNThreads, "PROXY_NTHREADS", 1);
+
+NCCL_PARAM(ProxyAffinity, "PROXY_AFFINITY", 1);
+
+// Pin the proxy thread to the CPUs close to the NIC of its first channel,
+// within those the application gave us. The thread inherits the affinity of
+// the GPU from the init, which is on the other socket when the NIC is. If
+// there are none, stay within the GPU affinity.
+static void ProxySetAffinity(struct ncclProxyThread* state) {
+  cpu_set_t mask, nicMask;
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &mask) != 0) return;
+  if (netGetCpuAffinity(state->cudaDev, state->id, &nicMask) != ncclSuccess) return;
+  cpu_set_t finalMask;
+  CPU_AND(&finalMask, &state->cpuAffinity, &nicMask);
+  if (CPU_COUNT(&finalMask) == 0) CPU_AND(&finalMask, &mask, &nicMask);
+  if (CPU_COUNT(&finalMask) == 0) return;
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &finalMask) == 0)
+    INFO(NCCL_INIT, "Proxy thread %d/%d pinned to %d CPUs close to its NIC", state->id, state->shared->nThreads, CPU_COUNT(&finalMask));
+}
+
+NCCL_PARAM(ProxySpinTime, "PROXY_SPIN_TIME", 50);
+NCCL_PARAM(ProxyYieldTime, "PROXY_YIELD_TIME", 500);
+NCCL_PARAM(ProxySleepTime, "PROXY_SLEEP_TIME", 50);
+
+static uint64_t ProxyClock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+// Nothing progressed during the last round. Busy-poll for NCCL_PROXY_SPIN_TIME
+// us, then yield the CPU until NCCL_PROXY_YIELD_TIME us more have passed, then
+// sleep until the launching thread posts new operations. While operations are
+// in flight, the sleep is bounded by NCCL_PROXY_SLEEP_TIME us so that we keep
+// polling the GPU and the network.
+// Returns true if there is nothing to do and the proxy was asked to stop.
+static bool ProxyIdle(struct ncclProxyThread* state, uint64_t* idleStart) {
+  struct ncclProxyState* shared = state->shared;
+  uint64_t now = ProxyClock();
+  if (*idleStart == 0) *idleStart = now;
+  uint64_t idleTime = now - *idleStart;
+  if (idleTime < shared->spinTime) return false;
+  if (idleTime < shared->spinTime + shared->yieldTime) {
+    sched_yield();
+    return false;
+  }
+
+  bool stop = false;
+  pthread_mutex_lock(&state->mutex);
+  __atomic_store_n(&state->sleeping, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&state->postedTail, __ATOMIC_SEQ_CST) == state->postedHead) {
+    if (state->ops != NULL) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      uint64_t ns = ts.tv_nsec + shared->sleepTime;
+      ts.tv_sec += ns / 1000000000ULL;
+      ts.tv_nsec = ns % 1000000000ULL;
+      pthread_cond_timedwait(&state->cond, &state->mutex, &ts);
+    } else if (shared->stop) {
+      stop = true;
+    } else {
+      pthread_cond_wait(&state->cond, &state->mutex);
+    }
+  }
+  __atomic_store_n(&state->sleeping, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&state->mutex);
+  // New operations were posted : spin again, more are likely to follow
+  if (__atomic_load_n(&state->postedTail, __ATOMIC_ACQUIRE) != state->postedHead) *idleStart = 0;
+  return stop;
+}
+
+static void ProxyProfileStart(struct ncclProxyArgs* op) {
+  int peer = ncclTimelinePeer(op);
+  ncclProfilerEventDescr_t eDescr = {};
+  eDescr.type = op->connector == &op->channel->peers[peer].send ? ncclProfileProxySend : ncclProfileProxyRecv;
+  eDescr.opCount = op->opCount;
+  eDescr.func = -1;
+  eDescr.channel = op->channel->id;
+  eDescr.peer = peer;
+  eDescr.nSteps = op->nsteps;
+  ncclProfilerStart(op->connector->comm, &op->profHandle, &eDescr);
+}
+
+// Account the time since *roundStart as busy or idle
+static void ProxyAccount(struct ncclProxyThread* state, int idle, uint64_t* roundStart) {
+  uint64_t now = ProxyClock();
+  __atomic_fetch_add(idle ? &state->shared->idleTime : &state->shared->busyTime, now - *roundStart, __ATOMIC_RELAXED);
+  *roundStart = now;
+}
+
+void* persistentThread(void *state_) {
+  struct ncclProxyThread* state = (struct ncclProxyThread*)state_;
+  if (ncclParamProxyAffinity()) ProxySetAffinity(state);
   struct ncclProxyArgs* op = NULL;
   ncclResult_t ret = ncclSuccess;
   int idle = 1;
-  int idleSpin = 0;
+  uint64_t idleStart = 0;
+  uint64_t roundStart = ProxyClock();
   while (1) {
-    do {
-      if (*comm->abortFlag) return NULL;
-      if (op == NULL) {
-        pthread_mutex_lock(&state->mutex);
+    if (op == NULL) {
+      do {
+        ProxyGetPosted(state);
         op = state->ops;
-        if (op == NULL) {
-          if (state->stop) {
-            // No more commands to process and proxy has been requested to stop
-            pthread_mutex_unlock(&state->mutex);
-            return NULL;
-          }
-          pthread_cond_wait(&state->cond, &state->mutex);
-        }
-        pthread_mutex_unlock(&state->mutex);
-      }
-    } while (op == NULL);
+        // No more commands to process and proxy has been requested to stop
+        if (op == NULL && ProxyIdle(state, &idleStart)) return NULL;
+      } while (op == NULL);
+      ProxyAccount(state, 1, &roundStart);
+    }
     op->idle = 0;
-    if (op->state != ncclProxyOpNone) ret = op->progress(op);
-    if (ret != ncclSuccess) {
-      comm->fatalError = ret;
-      INFO(NCCL_ALL,"%s:%d -> %d [Proxy Thread]", __FILE__, __LINE__, ret);
-      return NULL;
+    if (op->state != ncclProxyOpNone) {
+      // Drop the operations of aborted or failed communicators ; others may
+      // still use this thread.
+      struct ncclComm* comm = op->connector->comm;
+      if (comm->profiler && op->state == ncclProxyOpReady) ProxyProfileStart(op);
+      if (*comm->abortFlag || comm->fatalError != ncclSuccess) op->state = ncclProxyOpNone;
+      else ret = op->progress(op);
+      if (ret != ncclSuccess) {
+        // Only report the error to the communicator the operation belongs to
+        INFO(NCCL_ALL,"%s:%d -> %d [Proxy Thread]", __FILE__, __LINE__, ret);
+        comm->fatalError = ret;
+        op->state = ncclProxyOpNone;
+        ret = ncclSuccess;
+      }
+      if (comm->profiler && op->state == ncclProxyOpNone) ncclProfilerStop(comm, &op->profHandle, 0);
     }
     idle &= op->idle;
-    pthread_mutex_lock(&state->mutex);
-    if (!idle) idleSpin = 0;
     struct ncclProxyArgs *next = op->next;
     if (next->state == ncclProxyOpNone) {
       struct ncclProxyArgs *freeOp = next;
@@ -180,7 +373,7 @@ void* persistentThread(void *comm_) {
         }
       } else {
         // Remove next from circular list
-        next->connector->proxyAppend = NULL;
+        *ProxyAppendPtr(next->connector) = NULL;
         if (op != freeOp) {
           next = next->next;
           op->next = next;
@@ -189,60 +382,114 @@ void* persistentThread(void *comm_) {
         }
       }
       if (freeOp == state->ops) state->ops = next;
-      freeOp->next = state->pool;
-      state->pool = freeOp;
+      ProxyFree(freeOp);
     }
     op = next;
     if (op == state->ops) {
+      // New round : pick up operations posted in the meantime
+      ProxyGetPosted(state);
       if (idle == 1) {
-        if (++idleSpin == 10) {
-          sched_yield();
-          idleSpin = 0;
-        }
+        ProxyIdle(state, &idleStart);
+      } else {
+        idleStart = 0;
       }
+      ProxyAccount(state, idle, &roundStart);
       idle = 1;
     }
-    pthread_mutex_unlock(&state->mutex);
   }
 }
 
 ncclResult_t transportStartProxy(struct ncclComm* comm) {
-  pthread_mutex_lock(&comm->proxyState.mutex);
-  if (comm->proxyState.ops != NULL)
-    pthread_cond_signal(&comm->proxyState.cond);
-  pthread_mutex_unlock(&comm->proxyState.mutex);
+  struct ncclProxyState* state = comm->proxyState;
+  if (state == NULL) return ncclSuccess;
+  for (int t=0; t<state->nThreads; t++) ProxyWake(state->threads+t);
   return ncclSuccess;
 }
 
-ncclResult_t transportCreateProxy(struct ncclComm* comm) {
-  if (!comm->proxyThread) {
-    comm->proxyState.cond = PTHREAD_COND_INITIALIZER;
-    comm->proxyState.mutex = PTHREAD_MUTEX_INITIALIZER;
-    comm->proxyState.ops = NULL;
-    pthread_create(&comm->proxyThread, NULL, persistentThread, comm);
+ncclResult_t transportCreateProxy(struct ncclComm* comm, struct ncclProxyState* share) {
+  if (comm->proxyState) return ncclSuccess;
+  if (share) {
+    __atomic_add_fetch(&share->refCount, 1, __ATOMIC_RELAXED);
+    comm->proxyState = share;
+    INFO(NCCL_INIT, "Sharing %d proxy threads with the parent communicator", share->nThreads);
+    return ncclSuccess;
   }
+  int nThreads = ncclParamProxyNThreads();
+  if (nThreads > NCCL_PROXY_MAX_THREADS) nThreads = NCCL_PROXY_MAX_THREADS;
+  if (nThreads > comm->nChannels) nThreads = comm->nChannels;
+  if (nThreads < 1) nThreads = 1;
+  struct ncclProxyState* state;
+  NCCLCHECK(ncclCalloc(&state, 1));
+  NCCLCHECK(ncclCalloc(&state->threads, nThreads));
+  state->refCount = 1;
+  state->nThreads = nThreads;
+  state->spinTime = ncclParamProxySpinTime()*1000;
+  state->yieldTime = ncclParamProxyYieldTime()*1000;
+  state->sleepTime = ncclParamProxySleepTime()*1000;
+  for (int t=0; t<nThreads; t++) {
+    struct ncclProxyThread* thread = state->threads+t;
+    thread->shared = state;
+    thread->cudaDev = comm->cudaDev;
+    thread->cpuAffinity = comm->cpuAffinity;
+    thread->id = t;
+    thread->cond = PTHREAD_COND_INITIALIZER;
+    thread->mutex = PTHREAD_MUTEX_INITIALIZER;
+    thread->postMutex = PTHREAD_MUTEX_INITIALIZER;
+    thread->ops = NULL;
+    pthread_create(&thread->thread, NULL, persistentThread, thread);
+  }
+  comm->proxyState = state;
+  if (nThreads > 1) INFO(NCCL_INIT, "Using %d proxy threads for %d channels", nThreads, comm->nChannels);
   return ncclSuccess;
 }
 
 ncclResult_t transportDestroyProxy(struct ncclComm* comm) {
-  struct ncclProxyState* state = &comm->proxyState;
+  struct ncclProxyState* state = comm->proxyState;
+  if (state == NULL) return ncclSuccess;
+  comm->proxyState = NULL;
 
-  // Request the proxy to stop and then wake it
-  pthread_mutex_lock(&state->mutex);
-  state->stop = true;
-  pthread_cond_signal(&state->cond);
-  pthread_mutex_unlock(&state->mutex);
-  if (comm->proxyThread) pthread_join(comm->proxyThread, NULL);
+  if (__atomic_sub_fetch(&state->refCount, 1, __ATOMIC_ACQ_REL) > 0) {
+    // Other communicators still use the threads. Wait for them to be done
+    // with our operations (dropped if we are aborting or have failed), as
+    // they access the communicator until then.
+    for (int t=0; t<state->nThreads; t++) ProxyWake(state->threads+t);
+    while (__atomic_load_n(&comm->proxyOps.done, __ATOMIC_ACQUIRE) != comm->proxyOps.posted) sched_yield();
+  } else {
+    // Request the proxies to stop and then wake them
+    state->stop = true;
+    for (int t=0; t<state->nThreads; t++) {
+      struct ncclProxyThread* thread = state->threads+t;
+      pthread_mutex_lock(&thread->mutex);
+      pthread_cond_signal(&thread->cond);
+      pthread_mutex_unlock(&thread->mutex);
+    }
+    for (int t=0; t<state->nThreads; t++) pthread_join(state->threads[t].thread, NULL);
+    free(state->threads);
+    free(state);
+  }
 
   // Free off any memory allocated for the proxy arg pools
-  pthread_mutex_lock(&state->mutex);
-  struct ncclProxyState* proxyState = &comm->proxyState;
-  while (proxyState->pools != NULL) {
-    struct ncclProxyPool *next = proxyState->pools->next;
-    free(proxyState->pools);
-    proxyState->pools = next;
+  struct ncclProxyOps* ops = &comm->proxyOps;
+  while (ops->pools != NULL) {
+    struct ncclProxyPool *next = ops->pools->next;
+    free(ops->pools);
+    ops->pools = next;
   }
-  pthread_mutex_unlock(&state->mutex);
 
   return ncclSuccess;
 }
+
+ncclResult_t ncclConnectorRelease(struct ncclConnector* connector, int* last) {
+  struct ncclSharedConnector* shared = connector->shared;
+  *last = 1;
+  if (shared == NULL) return ncclSuccess;
+  connector->shared = NULL;
+  // Communicators sharing a connector may be destroyed by different threads
+  if (__atomic_sub_fetch(&shared->refCount, 1, __ATOMIC_ACQ_REL) > 0) {
+    *last = 0;
+    return ncclSuccess;
+  }
+  CUDACHECK(cudaFree(shared->devConn));
+  free(shared);
+  return ncclSuccess;
+}
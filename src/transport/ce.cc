@@ -0,0 +1,270 @@
+/*************************************************************************
+ * Copyright (c) 2019, NVIDIA CORPORATION. All rights reserved.
+ *
+ * See LICENSE.txt for license information
+ ************************************************************************/
+
+#include "core.h"
+#include "utils.h"
+#include "transport.h"
+#include "param.h"
+#include "shm.h"
+#include <unistd.h>
+#include <cuda_runtime.h>
+
+/* Copy engine transport, for GPUs of different processes on the same node
+ * which cannot use P2P (NCCL_P2P_LEVEL, PCI topology). The sender's kernel
+ * writes into a local FIFO as it would for the network, and the proxy thread
+ * copies each step into the receiver's FIFO, mapped through CUDA IPC, with
+ * cudaMemcpyAsync. Data therefore crosses PCI once instead of twice through
+ * host memory with SHM.
+ * The receiver returns its head and opCount through a small shared memory
+ * segment, which both kernels and the sender's proxy can access. */
+
+struct ceConnectInfo {
+  // Memory pool block holding the receiver's FIFO
+  cudaIpcMemHandle_t devIpc;
+  size_t offset;
+  size_t blockSize;
+  uint64_t pidHash;
+  int id;
+  int sendRank;
+  int recvRank;
+};
+
+struct ceSendResources {
+  int cudaDev;
+  // Local FIFO : data on the GPU, LL lines, tail and sizes on the host
+  struct ncclRecvMem* devRecvMem;
+  struct ncclRecvMem* hostRecvMem;
+  struct ncclRecvMem* devHostRecvMem;
+  struct ncclSendMem* hostSendMem;
+  struct ncclSendMem* devHostSendMem;
+  // Remote FIFO, and the head/opCount of the receiver
+  struct ncclRecvMem* remDevMem;
+  struct ncclSendMem* remHostMem;
+  struct ncclSendMem* devRemHostMem;
+  int buffSize;
+  cudaStream_t stream;
+  cudaEvent_t events[NCCL_STEPS];
+  // Tail values copied after the data of each step
+  uint64_t* tails;
+  uint64_t step;
+  int stepShift; // Of the last simple operation
+};
+
+struct ceRecvResources {
+  struct ncclRecvMem* devMem;
+  struct ncclSendMem* hostMem;
+  struct ncclSendMem* devHostMem;
+};
+
+NCCL_PARAM(P2pCe, "P2P_CE", 0);
+
+#define MAX_SHM_NAME_LEN 1024
+
+static void ceShmName(char* shmName, uint64_t pidHash, int id, int sendRank, int recvRank) {
+  sprintf(shmName, "nccl-ce-%lx-%d-%d-%d", pidHash, id, sendRank, recvRank);
+}
+
+/* Determine if we can communicate with the peer */
+ncclResult_t ceCanConnect(ncclTvalue_t* ret, struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo) {
+  *ret = 0;
+  if (ncclParamP2pCe() != 1) return ncclSuccess;
+  // P2P is used within a process
+  if (myInfo->hostHash != peerInfo->hostHash || myInfo->pidHash == peerInfo->pidHash) return ncclSuccess;
+  *ret = 1;
+  return ncclSuccess;
+}
+
+// Rings only need to chain the P2P groups, as SHM does
+extern ncclResult_t shmGetRings(int nranks, int* groups, int* subgroups, ncclTvalue_t* values, int* nringsRet, int* prev, int* next, int minScore, int* nthreads);
+
+ncclResult_t ceSendSetup(struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo, struct ncclConnect* connectInfo, struct ncclConnector* send, int buffSize, int channelId) {
+  struct ceSendResources* resources;
+  NCCLCHECK(ncclCalloc(&resources, 1));
+  send->transportResources = resources;
+
+  CUDACHECK(cudaGetDevice(&resources->cudaDev));
+  resources->buffSize = buffSize;
+  struct ncclMemPool* pool = &send->comm->memPool;
+  NCCLCHECK(ncclPoolCudaCalloc(pool, (char**)&resources->devRecvMem, offsetof(struct ncclRecvMem, buff)+buffSize, MEM_ALIGN));
+  NCCLCHECK(ncclPoolHostAlloc(pool, (void**)&resources->hostRecvMem, (void**)&resources->devHostRecvMem, offsetof(struct ncclRecvMem, buff), MEM_ALIGN));
+  NCCLCHECK(ncclPoolHostAlloc(pool, (void**)&resources->hostSendMem, (void**)&resources->devHostSendMem, sizeof(struct ncclSendMem), MEM_ALIGN));
+  uint64_t* devTails;
+  NCCLCHECK(ncclPoolHostAlloc(pool, (void**)&resources->tails, (void**)&devTails, NCCL_STEPS*sizeof(uint64_t)));
+  CUDACHECK(cudaStreamCreateWithFlags(&resources->stream, cudaStreamNonBlocking));
+  for (int i=0; i<NCCL_STEPS; i++) CUDACHECK(cudaEventCreateWithFlags(resources->events+i, cudaEventDisableTiming));
+
+  INFO(NCCL_INIT|NCCL_P2P,"Ring %02d : %d[%d] -> %d[%d] via P2P/CE", channelId, myInfo->rank, myInfo->nvmlDev, peerInfo->rank, peerInfo->nvmlDev);
+  return ncclSuccess;
+}
+
+ncclResult_t ceRecvSetup(struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo, struct ncclConnect* connectInfo, struct ncclConnector* recv, int buffSize, int channelId) {
+  struct ceRecvResources* resources;
+  NCCLCHECK(ncclCalloc(&resources, 1));
+  recv->transportResources = resources;
+
+  NCCLCHECK(ncclPoolCudaCalloc(&recv->comm->memPool, (char**)&resources->devMem, offsetof(struct ncclRecvMem, buff)+buffSize, MEM_ALIGN));
+
+  struct ceConnectInfo info;
+  if (ncclMemPoolIpcGet(resources->devMem, &info.devIpc, &info.offset, &info.blockSize) != ncclSuccess) {
+    WARN("rank %d failed to get CUDA IPC handle", myInfo->rank);
+    return ncclInternalError;
+  }
+  info.pidHash = myInfo->pidHash;
+  info.id = channelId;
+  info.sendRank = peerInfo->rank;
+  info.recvRank = myInfo->rank;
+
+  char shmName[MAX_SHM_NAME_LEN];
+  ceShmName(shmName, info.pidHash, info.id, info.sendRank, info.recvRank);
+  TRACE(NCCL_SHM,"Open shmName %s shmSize %ld", shmName, sizeof(struct ncclSendMem));
+  NCCLCHECK(shmOpen(shmName, sizeof(struct ncclSendMem), (void**)&resources->hostMem, (void**)&resources->devHostMem, 1));
+
+  static_assert(sizeof(struct ceConnectInfo) <= sizeof(struct ncclConnect), "CE Connect Info is too big");
+  memcpy(connectInfo, &info, sizeof(struct ceConnectInfo));
+  return ncclSuccess;
+}
+
+ncclResult_t ceSendConnect(struct ncclConnect* connectInfo, struct ncclConnector* send) {
+  struct ceSendResources* resources = (struct ceSendResources*)send->transportResources;
+  struct ceConnectInfo* info = (struct ceConnectInfo*)connectInfo;
+
+  NCCLCHECK(ncclMemPoolIpcOpen(&info->devIpc, info->offset, info->blockSize, (void**)&resources->remDevMem));
+  char shmName[MAX_SHM_NAME_LEN];
+  ceShmName(shmName, info->pidHash, info->id, info->sendRank, info->recvRank);
+  TRACE(NCCL_SHM,"Open shmName %s shmSize %ld", shmName, sizeof(struct ncclSendMem));
+  NCCLCHECK(shmOpen(shmName, sizeof(struct ncclSendMem), (void**)&resources->remHostMem, (void**)&resources->devRemHostMem, 0));
+  // Remove the file to ensure proper clean-up
+  NCCLCHECK(shmUnlink(shmName));
+
+  send->conn.buff = resources->devRecvMem->buff;
+  send->conn.llBuff = resources->devHostRecvMem->llBuff;
+  send->conn.tail = &resources->devHostRecvMem->tail;
+  send->conn.fifo = resources->devHostRecvMem->sizesFifo;
+  send->conn.opCountRem = &resources->devHostRecvMem->opCount;
+  send->conn.head = &resources->devHostSendMem->head;
+  send->conn.opCountLoc = &resources->devRemHostMem->opCount;
+  for (int i=0; i<NCCL_STEPS; i++) send->conn.fifo[i] = -1;
+  return ncclSuccess;
+}
+
+ncclResult_t ceRecvConnect(struct ncclConnect* connectInfo, struct ncclConnector* recv) {
+  struct ceRecvResources* resources = (struct ceRecvResources*)recv->transportResources;
+  recv->conn.buff = resources->devMem->buff;
+  recv->conn.llBuff = resources->devMem->llBuff;
+  recv->conn.tail = &resources->devMem->tail;
+  recv->conn.opCountLoc = &resources->devMem->opCount;
+  recv->conn.head = &resources->devHostMem->head;
+  recv->conn.opCountRem = &resources->devHostMem->opCount;
+  return ncclSuccess;
+}
+
+ncclResult_t ceSendFree(void* transportResources) {
+  struct ceSendResources* resources = (struct ceSendResources*)transportResources;
+  CUDACHECK(cudaStreamSynchronize(resources->stream));
+  for (int i=0; i<NCCL_STEPS; i++) CUDACHECK(cudaEventDestroy(resources->events[i]));
+  CUDACHECK(cudaStreamDestroy(resources->stream));
+  NCCLCHECK(ncclMemPoolIpcClose(resources->remDevMem));
+  if (resources->remHostMem) NCCLCHECK(shmClose(resources->remHostMem, resources->devRemHostMem, sizeof(struct ncclSendMem)));
+  NCCLCHECK(ncclMemPoolFree(resources->tails));
+  NCCLCHECK(ncclMemPoolFree(resources->hostSendMem));
+  NCCLCHECK(ncclMemPoolFree(resources->hostRecvMem));
+  NCCLCHECK(ncclMemPoolFree(resources->devRecvMem));
+  free(resources);
+  return ncclSuccess;
+}
+
+ncclResult_t ceRecvFree(void* transportResources) {
+  struct ceRecvResources* resources = (struct ceRecvResources*)transportResources;
+  NCCLCHECK(shmClose(resources->hostMem, resources->devHostMem, sizeof(struct ncclSendMem)));
+  NCCLCHECK(ncclMemPoolFree(resources->devMem));
+  free(resources);
+  return ncclSuccess;
+}
+
+// Copy a step into the receiver's FIFO. It can only be overwritten once the
+// receiver is done with it, so we wait for both its head and our tail.
+ncclResult_t ceSendProxy(struct ncclProxyArgs* args) {
+  struct ceSendResources* resources = (struct ceSendResources*) (args->connector->transportResources);
+  if (args->state == ncclProxyOpReady) {
+    // Proxy threads only serve communicators of the same device
+    CUDACHECK(cudaSetDevice(resources->cudaDev));
+    if (args->opCountValid) resources->hostRecvMem->opCount = args->opCount;
+    args->drainStep = 0;
+    if (args->protocol == NCCL_PROTO_SIMPLE) {
+      if (args->stepShift != resources->stepShift) args->drainStep = resources->step;
+      resources->stepShift = args->stepShift;
+    }
+    resources->step = ROUNDUP(resources->step, args->chunkSteps);
+    args->head = resources->step;
+    args->tail = resources->step;
+    args->end = args->head + args->nsteps;
+    args->state = ncclProxyOpProgress;
+  }
+  if (args->state == ncclProxyOpProgress) {
+    args->idle = 1;
+    volatile int* sizesFifo = resources->hostRecvMem->sizesFifo;
+    volatile uint64_t* remHead = &resources->remHostMem->head;
+    while (args->tail < args->end && args->tail < args->head + NCCL_STEPS && args->tail < *remHead + NCCL_STEPS &&
+        *remHead >= args->drainStep) {
+      int buffSlot = args->tail%NCCL_STEPS;
+      int size = sizesFifo[buffSlot];
+      if (args->protocol == NCCL_PROTO_LL) {
+        if (size == -1) break;
+        uint32_t flag = NCCL_LL_FLAG(args->tail + 1);
+        int nFifoLines = DIVUP(size, sizeof(union ncclLLFifoLine));
+        union ncclLLFifoLine* lines = resources->hostRecvMem->llBuff+buffSlot*NCCL_LL_SLICE_LINES;
+        int ready = 1;
+        for (int i=0; i<nFifoLines; i++) {
+          volatile uint32_t *f1 = &lines[i].flag1;
+          volatile uint32_t *f2 = &lines[i].flag2;
+          if (f1[0] != flag || f2[0] != flag) { ready = 0; break; }
+        }
+        if (!ready) break;
+        // Flags come with their data, the receiver polls them
+        CUDACHECK(cudaMemcpyAsync(resources->remDevMem->llBuff+buffSlot*NCCL_LL_SLICE_LINES, lines,
+              nFifoLines*sizeof(union ncclLLFifoLine), cudaMemcpyHostToDevice, resources->stream));
+      } else {
+        if (args->tail >= *(volatile uint64_t*)&resources->hostRecvMem->tail) break;
+        int stepSize = (args->connector->conn.buffSize/NCCL_STEPS) >> args->stepShift;
+        CUDACHECK(cudaMemcpyAsync(resources->remDevMem->buff+buffSlot*stepSize, resources->devRecvMem->buff+buffSlot*stepSize,
+              size, cudaMemcpyDeviceToDevice, resources->stream));
+        // Copies of a stream complete in order : the tail lands after the data
+        resources->tails[buffSlot] = args->tail + args->sliceSteps;
+        CUDACHECK(cudaMemcpyAsync(&resources->remDevMem->tail, resources->tails+buffSlot,
+              sizeof(uint64_t), cudaMemcpyHostToDevice, resources->stream));
+      }
+      CUDACHECK(cudaEventRecord(resources->events[buffSlot], resources->stream));
+      sizesFifo[buffSlot] = -1;
+      // Make sure size is reset before we update the head.
+      __sync_synchronize();
+      args->tail += args->sliceSteps;
+      args->idle = 0;
+    }
+    while (args->head < args->tail) {
+      int buffSlot = args->head%NCCL_STEPS;
+      cudaError_t err = cudaEventQuery(resources->events[buffSlot]);
+      if (err == cudaErrorNotReady) break;
+      CUDACHECK(err);
+      args->head += args->sliceSteps;
+      resources->hostSendMem->head = args->head;
+      args->idle = 0;
+    }
+    if (args->head == args->end) {
+      resources->step = args->end;
+      args->idle = 0;
+      args->state = ncclProxyOpNone;
+    }
+  }
+  return ncclSuccess;
+}
+
+struct ncclTransport ceTransport = {
+  "CE",
+  ceCanConnect,
+  shmGetRings,
+  { ceSendSetup, ceSendConnect, ceSendFree, ceSendProxy },
+  { ceRecvSetup, ceRecvConnect, ceRecvFree, NULL }
+};
@@ -9,9 +9,15 @@
 #include "nvmlwrap.h"
 #include "net.h"
 #include "param.h"
+#include "utils.h"
 #include "topo.h"
+#include "cpuset.h"
+#include "timeline.h"
+#include "profiler.h"
 #include <cuda_runtime.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define NET_MAX_IFS 16
 #define NET_MAX_GPUS 32
@@ -53,9 +59,12 @@ struct netSendResources {
   int buffSize;
   void* mhandle;
   void* llMhandle;
+  void* ll128Mhandle;
   struct ncclRecvMem* devRecvMem;
   uint64_t step;
   uint64_t llLastCleaning;
+  volatile uint64_t* doorbell;
+  uint64_t* devDoorbell;
 };
 
 struct netRecvResources {
@@ -70,8 +79,10 @@ struct netRecvResources {
   int buffSize;
   void* mhandle;
   void* llMhandle;
+  void* ll128Mhandle;
   struct ncclRecvMem* devRecvMem;
   uint64_t step;
+  int stepShift; // Of the last simple operation
   uint64_t llLastCleaning;
 };
 
@@ -80,13 +91,25 @@ static ncclResult_t netDistance(int cudaDev, int dev, short* distance) {
   char* nicPath = NULL;
   ncclResult_t err;
   NCCLCHECK(getCudaPath(cudaDev, &cudaPath));
-  err = ncclNetPciPath(dev, &nicPath);
+  NCCLCHECK(ncclTopoNicPath(dev, &nicPath));
+  err = nicPath ? ncclSuccess : ncclNetPciPath(dev, &nicPath);
   *distance = (err != ncclSuccess || nicPath == NULL || cudaPath == NULL) ? PATH_SYS : pciDistance(nicPath, cudaPath);
   if (nicPath) free(nicPath);
   if (cudaPath) free(cudaPath);
   return ncclSuccess;
 }
 
+// Where to place the host buffers of a connection through NIC dev
+static int netNumaId(int dev) {
+  char* nicPath = NULL;
+  if (ncclTopoNicPath(dev, &nicPath) != ncclSuccess) return -1;
+  if (nicPath == NULL && ncclNetPciPath(dev, &nicPath) != ncclSuccess) return -1;
+  if (nicPath == NULL) return -1;
+  int numaId = ncclTopoNumaId(nicPath);
+  free(nicPath);
+  return ncclNumaAllocId(numaId);
+}
+
 static ncclResult_t netDevices(int* ndev, short** distances) {
   NCCLCHECK(ncclNetDevices(ndev));
   if (*ndev == 0) {
@@ -224,7 +247,7 @@ done:
   return ncclSuccess;
 }
 
-int getDev(int cudaDev, int ringId) {
+static int getDevRoundRobin(int cudaDev, int ringId) {
   ncclTvalue_t tvalues = ncclNetTvalues[cudaDev];
 
   int dev = 0;
@@ -243,8 +266,74 @@ end:
   return dev;
 }
 
+// Channel to NIC assignment for every GPU visible to the process. Each GPU
+// spreads its channels over all the NICs sharing its PCI switch (PIX/PXB),
+// falling back to the closest NICs when there are none. GPUs sharing the same
+// NICs start on different ones, so that channel 0 of every GPU does not end
+// up on the same NIC.
+static int ncclNetChannelDevs[NET_MAX_GPUS][MAXCHANNELS];
+static int ncclNetChannelDevsState = 0; // 0 : not computed, 1 : computed, -1 : failed
+static pthread_mutex_t ncclNetChannelDevsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static ncclResult_t netComputeChannelDevs() {
+  if (ncclNetNDev == 0) return ncclInternalError;
+  int nGpus;
+  CUDACHECK(cudaGetDeviceCount(&nGpus));
+  if (nGpus > NET_MAX_GPUS) nGpus = NET_MAX_GPUS;
+  int nicLoad[NET_MAX_IFS] = { 0 };
+  for (int g=0; g<nGpus; g++) {
+    short distances[NET_MAX_IFS];
+    short minDistance = PATH_SYS;
+    for (int d=0; d<ncclNetNDev; d++) {
+      NCCLCHECK(netDistance(g, d, distances+d));
+      if (distances[d] < minDistance) minDistance = distances[d];
+    }
+    short maxDistance = minDistance > PATH_PXB ? minDistance : PATH_PXB;
+    int close[NET_MAX_IFS];
+    int nClose = 0;
+    for (int d=0; d<ncclNetNDev; d++) if (distances[d] <= maxDistance) close[nClose++] = d;
+
+    // Start on the least loaded NIC
+    int start = 0;
+    for (int i=1; i<nClose; i++) if (nicLoad[close[i]] < nicLoad[close[start]]) start = i;
+    nicLoad[close[start]]++;
+
+    char line[1024];
+    sprintf(line, "CUDA Dev %d, %s channel to NIC map :", g, ncclNetName());
+    for (int c=0; c<MAXCHANNELS; c++) {
+      ncclNetChannelDevs[g][c] = close[(start+c)%nClose];
+      if (c < 2*nClose) sprintf(line+strlen(line), " %d->%d", c, ncclNetChannelDevs[g][c]);
+    }
+    INFO(NCCL_INIT|NCCL_NET, "%s%s", line, MAXCHANNELS > 2*nClose ? " ..." : "");
+  }
+  return ncclSuccess;
+}
+
+int getDev(int cudaDev, int ringId) {
+  pthread_mutex_lock(&ncclNetChannelDevsLock);
+  if (ncclNetChannelDevsState == 0) {
+    ncclNetChannelDevsState = netComputeChannelDevs() == ncclSuccess ? 1 : -1;
+    if (ncclNetChannelDevsState == -1) INFO(NCCL_INIT|NCCL_NET, "NET/%s : could not compute channel to NIC map, using round-robin", ncclNetName());
+  }
+  int state = ncclNetChannelDevsState;
+  pthread_mutex_unlock(&ncclNetChannelDevsLock);
+  if (state == 1 && cudaDev < NET_MAX_GPUS) return ncclNetChannelDevs[cudaDev][ringId%MAXCHANNELS];
+  return getDevRoundRobin(cudaDev, ringId);
+}
+
+ncclResult_t netGetCpuAffinity(int cudaDev, int channelId, cpu_set_t* mask) {
+  CPU_ZERO_S(sizeof(cpu_set_t), mask);
+  char* nicPath = NULL;
+  NCCLCHECK(ncclNetPciPath(getDev(cudaDev, channelId), &nicPath));
+  if (nicPath == NULL) return ncclInternalError;
+  ncclResult_t res = ncclPciCpuset(nicPath, mask);
+  free(nicPath);
+  return res;
+}
+
 NCCL_PARAM(NetGdrRead, "NET_GDR_READ", -2);
 NCCL_PARAM(NetGdrLevel, "NET_GDR_LEVEL", PATH_PHB);
+NCCL_PARAM(NetDoorbell, "NET_DOORBELL", 1);
 
 static ncclResult_t netGetGdrSupport(int dev, int read, int* useGdr) {
   *useGdr = 0;
@@ -292,17 +381,38 @@ ncclResult_t netSendSetup(struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peer
   CUDACHECK(cudaGetDevice(&cudaDev));
   resources->netDev = getDev(cudaDev, channelId);
   NCCLCHECK(netGetGdrSupport(resources->netDev, 1, &resources->useGdr));
+  send->zcopy = resources->useGdr;
 
+  int numaId = netNumaId(resources->netDev);
   int sendSize = sizeof(struct ncclSendMem);
-  NCCLCHECK(ncclCudaHostAlloc((void**)&resources->hostSendMem, (void**)&resources->devHostSendMem, sendSize));
+  NCCLCHECK(ncclPoolHostAlloc(&send->comm->memPool, (void**)&resources->hostSendMem, (void**)&resources->devHostSendMem, sendSize, MEM_ALIGN, numaId));
 
   int recvSize = offsetof(struct ncclRecvMem, buff)+buffSize;
   if (resources->useGdr) {
     NCCLCHECK(ncclCudaCalloc((char**)(&resources->devRecvMem), recvSize));
   }
-  NCCLCHECK(ncclCudaHostAlloc((void**)&resources->hostRecvMem, (void**)&resources->devHostRecvMem, recvSize));
+  NCCLCHECK(ncclPoolHostAlloc(&send->comm->memPool, (void**)&resources->hostRecvMem, (void**)&resources->devHostRecvMem, recvSize, MEM_ALIGN, numaId));
   resources->buffSize = buffSize;
 
+  // LL/LL128 kernels tell us which steps are ready in a doorbell slot shared
+  // with the other sends of the channel, instead of us checking their flags.
+  // Connections set up once the line is full check the flags.
+  // Slots are given back when the connector is retired (see
+  // ncclDoorbellRelease).
+  struct ncclComm* comm = send->comm;
+  uint32_t* mask = comm->doorbellMask+channelId;
+  uint32_t used = __atomic_load_n(mask, __ATOMIC_RELAXED);
+  int slot;
+  do {
+    slot = 0;
+    while (slot < NCCL_DOORBELLS_PER_CHANNEL && (used & (1U<<slot))) slot++;
+  } while (ncclParamNetDoorbell() && slot < NCCL_DOORBELLS_PER_CHANNEL &&
+      !__atomic_compare_exchange_n(mask, &used, used | (1U<<slot), true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  if (ncclParamNetDoorbell() && slot < NCCL_DOORBELLS_PER_CHANNEL) {
+    resources->doorbell = comm->doorbells+channelId*NCCL_DOORBELLS_PER_CHANNEL+slot;
+    resources->devDoorbell = comm->devDoorbells+channelId*NCCL_DOORBELLS_PER_CHANNEL+slot;
+  }
+
   INFO(NCCL_INIT|NCCL_NET,"Ring %02d : %d -> %d [send] via NET/%s/%d%s", channelId, myInfo->rank, peerInfo->rank, ncclNetName(), resources->netDev,
       resources->useGdr ? "/GDRDMA" : "");
   return ncclSuccess;
@@ -317,15 +427,17 @@ ncclResult_t netRecvSetup(struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peer
   CUDACHECK(cudaGetDevice(&cudaDev));
   resources->netDev = getDev(cudaDev, channelId);
   NCCLCHECK(netGetGdrSupport(resources->netDev, 0, &resources->useGdr));
+  recv->zcopy = resources->useGdr;
 
+  int numaId = netNumaId(resources->netDev);
   int sendSize = sizeof(struct ncclSendMem);
-  NCCLCHECK(ncclCudaHostAlloc((void**)&resources->hostSendMem, (void**)&resources->devHostSendMem, sendSize));
+  NCCLCHECK(ncclPoolHostAlloc(&recv->comm->memPool, (void**)&resources->hostSendMem, (void**)&resources->devHostSendMem, sendSize, MEM_ALIGN, numaId));
 
   int recvSize = offsetof(struct ncclRecvMem, buff)+buffSize;
   if (resources->useGdr) {
     NCCLCHECK(ncclCudaCalloc((char**)(&resources->devRecvMem), recvSize));
   }
-  NCCLCHECK(ncclCudaHostAlloc((void**)&resources->hostRecvMem, (void**)&resources->devHostRecvMem, recvSize));
+  NCCLCHECK(ncclPoolHostAlloc(&recv->comm->memPool, (void**)&resources->hostRecvMem, (void**)&resources->devHostRecvMem, recvSize, MEM_ALIGN, numaId));
   resources->buffSize = buffSize;
 
   INFO(NCCL_INIT|NCCL_NET,"Ring %02d : %d -> %d [receive] via NET/%s/%d%s", channelId, peerInfo->rank, myInfo->rank, ncclNetName(), resources->netDev,
@@ -343,6 +455,7 @@ ncclResult_t netSendConnect(struct ncclConnect* connectInfo, struct ncclConnecto
   struct ncclRecvMem* recvMem = resources->useGdr ? resources->devRecvMem : resources->devHostRecvMem;
   send->conn.buff = recvMem->buff;
   send->conn.llBuff = resources->devHostRecvMem->llBuff;
+  send->conn.ll128Buff = resources->devHostRecvMem->ll128Buff;
 
   // Head/Tail/Opcount/Fifos are always on host
   send->conn.tail = &resources->devHostRecvMem->tail;
@@ -351,6 +464,10 @@ ncclResult_t netSendConnect(struct ncclConnect* connectInfo, struct ncclConnecto
   send->conn.head = &resources->devHostSendMem->head;
   send->conn.opCountLoc = &resources->devHostSendMem->opCount;
   for (int i=0; i<NCCL_STEPS; i++) send->conn.fifo[i] = -1;
+  if (resources->doorbell) {
+    *resources->doorbell = 0;
+    send->conn.doorbell = resources->devDoorbell;
+  }
 
   // Connect to remote peer
   struct netConnectInfo* info = (struct netConnectInfo*)connectInfo;
@@ -360,6 +477,8 @@ ncclResult_t netSendConnect(struct ncclConnect* connectInfo, struct ncclConnecto
         resources->useGdr ? NCCL_PTR_CUDA : NCCL_PTR_HOST, &resources->mhandle));
   NCCLCHECK(ncclNetRegMr(resources->netSendComm, resources->devHostRecvMem->llBuff,
         NCCL_LL_BUFF_SIZE, NCCL_PTR_HOST, &resources->llMhandle));
+  NCCLCHECK(ncclNetRegMr(resources->netSendComm, resources->devHostRecvMem->ll128Buff,
+        NCCL_LL128_BUFF_SIZE, NCCL_PTR_HOST, &resources->ll128Mhandle));
 
   return ncclSuccess;
 }
@@ -373,6 +492,8 @@ ncclResult_t netRecvConnect(struct ncclConnect* connectInfo, struct ncclConnecto
   struct ncclRecvMem* recvMem = resources->useGdr ? resources->devRecvMem : resources->devHostRecvMem;
   recv->conn.buff = recvMem->buff;
   recv->conn.llBuff = recvMem->llBuff;
+  recv->conn.ll128Buff = recvMem->ll128Buff;
+  recv->conn.llHostMem = resources->useGdr ? 0 : 1;
 
   // Head/Tail/Opcount are always on host
   recv->conn.tail = &resources->devHostRecvMem->tail;
@@ -388,16 +509,19 @@ ncclResult_t netRecvConnect(struct ncclConnect* connectInfo, struct ncclConnecto
         resources->useGdr ? NCCL_PTR_CUDA : NCCL_PTR_HOST, &resources->mhandle));
   NCCLCHECK(ncclNetRegMr(resources->netRecvComm, recvMem->llBuff, NCCL_LL_BUFF_SIZE,
         resources->useGdr ? NCCL_PTR_CUDA : NCCL_PTR_HOST, &resources->llMhandle));
+  NCCLCHECK(ncclNetRegMr(resources->netRecvComm, recvMem->ll128Buff, NCCL_LL128_BUFF_SIZE,
+        resources->useGdr ? NCCL_PTR_CUDA : NCCL_PTR_HOST, &resources->ll128Mhandle));
 
   return ncclSuccess;
 }
 
 ncclResult_t netSendFree(void* transportResources) {
   struct netSendResources* resources = (struct netSendResources*)transportResources;
-  NCCLCHECK(ncclCudaHostFree(resources->hostSendMem));
+  NCCLCHECK(ncclMemPoolFree(resources->hostSendMem));
   NCCLCHECK(ncclNetDeregMr(resources->netSendComm, resources->mhandle));
   NCCLCHECK(ncclNetDeregMr(resources->netSendComm, resources->llMhandle));
-  NCCLCHECK(ncclCudaHostFree(resources->hostRecvMem));
+  NCCLCHECK(ncclNetDeregMr(resources->netSendComm, resources->ll128Mhandle));
+  NCCLCHECK(ncclMemPoolFree(resources->hostRecvMem));
   if (resources->useGdr)
     CUDACHECK(cudaFree(resources->devRecvMem));
   NCCLCHECK(ncclNetCloseSend(resources->netSendComm));
@@ -407,10 +531,11 @@ ncclResult_t netSendFree(void* transportResources) {
 
 ncclResult_t netRecvFree(void* transportResources) {
   struct netRecvResources* resources = (struct netRecvResources*)transportResources;
-  NCCLCHECK(ncclCudaHostFree(resources->hostSendMem));
+  NCCLCHECK(ncclMemPoolFree(resources->hostSendMem));
   NCCLCHECK(ncclNetDeregMr(resources->netRecvComm, resources->mhandle));
   NCCLCHECK(ncclNetDeregMr(resources->netRecvComm, resources->llMhandle));
-  NCCLCHECK(ncclCudaHostFree(resources->hostRecvMem));
+  NCCLCHECK(ncclNetDeregMr(resources->netRecvComm, resources->ll128Mhandle));
+  NCCLCHECK(ncclMemPoolFree(resources->hostRecvMem));
   if (resources->useGdr)
     CUDACHECK(cudaFree(resources->devRecvMem));
   NCCLCHECK(ncclNetCloseRecv(resources->netRecvComm));
@@ -418,71 +543,209 @@ ncclResult_t netRecvFree(void* transportResources) {
   return ncclSuccess;
 }
 
+// Get the registration of a user buffer for a network connection,
+// registering it the first time it is used on that connection.
+static ncclResult_t netRegBuffer(struct ncclRegBuffer* reg, void* netComm, void** mhandle) {
+  ncclResult_t ret = ncclSuccess;
+  pthread_mutex_lock(&reg->mutex);
+  struct ncclRegNetHandle* handle = reg->netHandles;
+  while (handle && handle->netComm != netComm) handle = handle->next;
+  if (handle == NULL) {
+    NCCLCHECKGOTO(ncclCalloc(&handle, 1), ret, end);
+    ret = ncclNetRegMr(netComm, reg->buff, reg->size, NCCL_PTR_CUDA, &handle->mhandle);
+    if (ret != ncclSuccess) {
+      free(handle);
+      goto end;
+    }
+    handle->netComm = netComm;
+    handle->next = reg->netHandles;
+    reg->netHandles = handle;
+  }
+  *mhandle = handle->mhandle;
+end:
+  pthread_mutex_unlock(&reg->mutex);
+  return ret;
+}
+
+// Zero-copy : each slice maps to the same range of the user buffer the
+// kernel would have copied through the slot.
+static char* netZcopyPtr(struct ncclProxyArgs* args, uint64_t step, int stepSize, int* size) {
+  ssize_t sliceSize = (ssize_t)stepSize*args->sliceSteps;
+  ssize_t offset = (step - (args->end - args->nsteps)) / args->sliceSteps * sliceSize;
+  if (offset > args->zcopyBytes) offset = args->zcopyBytes;
+  *size = std::min(sliceSize, args->zcopyBytes-offset);
+  return args->zcopyBuff+offset;
+}
+
+// Stats, timeline and profiler plugin : remember when a step was handed to
+// the network ...
+static inline void netStepPost(struct ncclProxyArgs* args, int type, int buffSlot, int bytes) {
+  struct ncclComm* comm = args->connector->comm;
+  args->stepBytes[buffSlot] = bytes;
+  if (comm->timeline) args->stepTimes[buffSlot] = ncclTimelineClock();
+  if (comm->profiler) {
+    ncclProfilerEventDescr_t eDescr = {};
+    eDescr.type = type == ncclTimelineNetSend ? ncclProfileNetSend :
+                  type == ncclTimelineNetRecv ? ncclProfileNetRecv : ncclProfileNetFlush;
+    eDescr.opCount = args->opCount;
+    eDescr.func = -1;
+    eDescr.channel = args->channel->id;
+    eDescr.peer = ncclTimelinePeer(args);
+    eDescr.bytes = bytes;
+    ncclProfilerStart(comm, args->stepProfHandles+buffSlot, &eDescr);
+  }
+}
+
+// ... and record it once it completed.
+static inline void netStepDone(struct ncclProxyArgs* args, int type, int buffSlot, int bytes, int netDev) {
+  struct ncclComm* comm = args->connector->comm;
+  if (type != ncclTimelineNetFlush) {
+    int send = type == ncclTimelineNetSend;
+    ncclStatsAdd((send ? comm->stats.bytesSent : comm->stats.bytesRecv)+args->connector->transport, bytes);
+    if (netDev < NCCL_STATS_MAX_NICS) ncclStatsAdd((send ? comm->stats.nicBytesSent : comm->stats.nicBytesRecv)+netDev, bytes);
+  }
+  if (comm->timeline) {
+    ncclTimelineAdd(comm->timeline, type, args->channel->id, ncclTimelinePeer(args), args->opCount, bytes,
+        args->stepTimes[buffSlot], ncclTimelineClock());
+  }
+  if (comm->profiler) ncclProfilerStop(comm, args->stepProfHandles+buffSlot, bytes);
+}
+
+// Whether the kernel wrote the step at tail, in which case iov is filled with
+// what to send for it.
+static int netSendStepReady(struct ncclProxyArgs* args, struct netSendResources* resources, uint64_t tail, ncclNetIov_t* iov) {
+  volatile int* sizesFifo = resources->hostRecvMem->sizesFifo;
+  int buffSlot = tail%NCCL_STEPS;
+  if (args->protocol == NCCL_PROTO_LL128) {
+    int size = sizesFifo[buffSlot];
+    if (size == -1) return 0;
+    uint64_t* lines = resources->hostRecvMem->ll128Buff+buffSlot*NCCL_LL128_SLICE_ELEMS;
+    if (args->connector->conn.doorbell) {
+      if (*resources->doorbell <= tail) return 0;
+    } else {
+      // The last element of each line carries the flag
+      uint64_t flag = tail + 1;
+      int nLines = DIVUP(size, NCCL_LL128_LINESIZE);
+      for (int i=0; i<nLines; i++) {
+        volatile uint64_t* f = lines+i*NCCL_LL128_LINEELEMS+NCCL_LL128_DATAELEMS;
+        if (f[0] != flag) return 0;
+      }
+    }
+    iov->data = lines;
+    iov->size = size;
+    iov->mhandle = resources->ll128Mhandle;
+  } else if (args->protocol == NCCL_PROTO_LL) {
+    int size = sizesFifo[buffSlot];
+    if (size == -1) return 0;
+    uint32_t flag = NCCL_LL_FLAG(tail + 1);
+    int nFifoLines = DIVUP(size, sizeof(union ncclLLFifoLine));
+    union ncclLLFifoLine* lines = resources->hostRecvMem->llBuff+buffSlot*NCCL_LL_SLICE_LINES;
+    if (args->connector->conn.doorbell) {
+      if (*resources->doorbell <= tail) return 0;
+    } else {
+      for (int i=0; i<nFifoLines; i++) {
+        volatile uint32_t *f1 = &lines[i].flag1;
+        volatile uint32_t *f2 = &lines[i].flag2;
+        if (f1[0] != flag || f2[0] != flag) return 0;
+      }
+    }
+    iov->data = lines;
+    iov->size = nFifoLines * sizeof(union ncclLLFifoLine);
+    iov->mhandle = resources->llMhandle;
+  } else {
+    volatile uint64_t* recvTail = &resources->hostRecvMem->tail;
+    if (tail >= *recvTail) return 0;
+    int stepSize = (args->connector->conn.buffSize/NCCL_STEPS) >> args->stepShift;
+    if (args->zcopyBuff) {
+      // The kernel did not copy anything, send from the user buffer
+      iov->data = netZcopyPtr(args, tail, stepSize, &iov->size);
+      iov->mhandle = args->zcopyMhandle;
+    } else {
+      struct ncclRecvMem* localMem = resources->useGdr ? resources->devRecvMem : resources->hostRecvMem;
+      iov->data = localMem->buff+buffSlot*stepSize;
+      iov->size = sizesFifo[buffSlot];
+      iov->mhandle = resources->mhandle;
+    }
+  }
+  return 1;
+}
+
+// Poll the requests in flight between steps from and to at once, they may
+// complete in any order. The one that did is marked with its size.
+static ncclResult_t netTestRequests(struct ncclProxyArgs* args, uint64_t from, uint64_t to) {
+  void* requests[NCCL_STEPS];
+  int slots[NCCL_STEPS];
+  int n = 0;
+  for (uint64_t step=from; step<to; step+=args->reqSteps[step%NCCL_STEPS]) {
+    int buffSlot = step%NCCL_STEPS;
+    if (args->reqSizes[buffSlot] != -1) continue;
+    slots[n] = buffSlot;
+    requests[n++] = args->requests[buffSlot];
+  }
+  if (n == 0) return ncclSuccess;
+  int index, size = 0;
+  NCCLCHECK(ncclNetTestAny(n, requests, &index, &size));
+  if (index >= 0) {
+    args->requests[slots[index]] = NULL;
+    args->reqSizes[slots[index]] = size;
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t netSendProxy(struct ncclProxyArgs* args) {
   struct netSendResources* resources = (struct netSendResources*) (args->connector->transportResources);
   if (args->state == ncclProxyOpReady) {
     // Update opCount
-    resources->hostRecvMem->opCount = args->opCount;
+    if (args->opCountValid) resources->hostRecvMem->opCount = args->opCount;
 
     // Round to next multiple of sliceSteps
     resources->step = ROUNDUP(resources->step, args->chunkSteps);
     args->head = resources->step;
     args->tail = resources->step;
     args->end = args->head + args->nsteps;
+    if (args->zcopyBuff) NCCLCHECK(netRegBuffer(args->zcopyReg, resources->netSendComm, &args->zcopyMhandle));
     args->state = ncclProxyOpProgress;
   }
   if (args->state == ncclProxyOpProgress) {
     args->idle = 1;
     if (args->head < args->end) {
-      if (args->tail < args->end && args->tail < args->head + NCCL_STEPS) {
-        volatile int* sizesFifo = resources->hostRecvMem->sizesFifo;
-        volatile uint64_t* recvTail = &resources->hostRecvMem->tail;
-        if (args->llMode) {
-          int buffSlot = args->tail%NCCL_STEPS;
-          int size = sizesFifo[buffSlot];
-          if (size != -1) {
-            uint32_t flag = NCCL_LL_FLAG(args->tail + 1);
-            int nFifoLines = DIVUP(size, sizeof(union ncclLLFifoLine));
-            size = nFifoLines * sizeof(union ncclLLFifoLine);
-            union ncclLLFifoLine* lines = resources->hostRecvMem->llBuff+buffSlot*NCCL_LL_SLICE_LINES;
-            int ready = 1;
-            for (int i=0; i<nFifoLines; i++) {
-              volatile uint32_t *f1 = &lines[i].flag1;
-              volatile uint32_t *f2 = &lines[i].flag2;
-              if (f1[0] != flag || f2[0] != flag) { ready = 0; break; }
-            }
-            if (ready) {
-              NCCLCHECK(ncclNetIsend(resources->netSendComm, lines, size, resources->llMhandle, args->requests+buffSlot));
-              if (args->requests[buffSlot] != NULL) {
-                sizesFifo[buffSlot] = -1;
-                // Make sure size is reset to zero before we update the head.
-                __sync_synchronize();
-                args->tail += args->sliceSteps;
-                args->idle = 0;
-              }
-            }
-          }
-        } else if (args->tail < *recvTail) {
-          struct ncclRecvMem* localMem = resources->useGdr ? resources->devRecvMem : resources->hostRecvMem;
-          int stepSize = args->channel->buffSize/NCCL_STEPS;
-          // Send through network
-          int buffSlot = args->tail%NCCL_STEPS;
-          NCCLCHECK(ncclNetIsend(resources->netSendComm, localMem->buff+buffSlot*stepSize, sizesFifo[buffSlot], resources->mhandle, args->requests+buffSlot));
-          if (args->requests[buffSlot] != NULL) {
-            sizesFifo[buffSlot] = -1;
-            // Make sure size is reset to zero before we update the head.
-            __sync_synchronize();
+      // Hand all the ready steps to the network in a single call
+      ncclNetIov_t iovs[NCCL_NET_MAX_IOVS];
+      int niov = 0;
+      int maxIovs = ncclNetMaxIovs();
+      uint64_t tail = args->tail;
+      while (niov < maxIovs && tail < args->end && tail < args->head + NCCL_STEPS) {
+        if (netSendStepReady(args, resources, tail, iovs+niov) == 0) break;
+        niov++;
+        tail += args->sliceSteps;
+      }
+      if (niov) {
+        int buffSlot = args->tail%NCCL_STEPS;
+        NCCLCHECK(ncclNetIsendv(resources->netSendComm, iovs, niov, args->requests+buffSlot));
+        if (args->requests[buffSlot] != NULL) {
+          args->reqSteps[buffSlot] = niov*args->sliceSteps;
+          args->reqSizes[buffSlot] = -1;
+          volatile int* sizesFifo = resources->hostRecvMem->sizesFifo;
+          for (int i=0; i<niov; i++) {
+            int slot = args->tail%NCCL_STEPS;
+            netStepPost(args, ncclTimelineNetSend, slot, iovs[i].size);
+            sizesFifo[slot] = -1;
             args->tail += args->sliceSteps;
-            args->idle = 0;
           }
+          // Make sure sizes are reset to zero before we update the head.
+          __sync_synchronize();
+          args->idle = 0;
         }
       }
       if (args->head < args->tail) {
-        int done;
-        int buffSlot = args->head%NCCL_STEPS;
-        NCCLCHECK(ncclNetTest(args->requests[buffSlot], &done, NULL));
-        if (done) {
-          args->head += args->sliceSteps;
+        NCCLCHECK(netTestRequests(args, args->head, args->tail));
+        while (args->head < args->tail && args->reqSizes[args->head%NCCL_STEPS] != -1) {
+          int steps = args->reqSteps[args->head%NCCL_STEPS];
+          for (int s=0; s<steps; s+=args->sliceSteps) {
+            int buffSlot = (args->head+s)%NCCL_STEPS;
+            netStepDone(args, ncclTimelineNetSend, buffSlot, args->stepBytes[buffSlot], resources->netDev);
+          }
+          args->head += steps;
           resources->hostSendMem->head = args->head;
           args->idle = 0;
         }
@@ -501,40 +764,106 @@ ncclResult_t netRecvProxy(struct ncclProxyArgs* args) {
   struct netRecvResources* resources = (struct netRecvResources*) (args->connector->transportResources);
   if (args->state == ncclProxyOpReady) {
     // Update opCount
-    resources->hostSendMem->opCount = args->opCount;
+    if (args->opCountValid) resources->hostSendMem->opCount = args->opCount;
 
+    args->drainStep = 0;
+    if (args->protocol == NCCL_PROTO_SIMPLE) {
+      if (args->stepShift != resources->stepShift) args->drainStep = resources->step;
+      resources->stepShift = args->stepShift;
+    }
     // Round to next multiple of sliceSteps
     resources->step = ROUNDUP(resources->step, args->chunkSteps);
     args->head = resources->step;
     args->tail = resources->step;
+    args->received = resources->step;
     args->end = args->head + args->nsteps;
+    if (args->zcopyBuff) NCCLCHECK(netRegBuffer(args->zcopyReg, resources->netRecvComm, &args->zcopyMhandle));
     args->state = ncclProxyOpProgress;
   }
   if (args->state == ncclProxyOpProgress) {
     args->idle = 1;
-    int stepSize = ( args->llMode ? NCCL_LL_BUFF_SIZE : args->channel->buffSize ) / NCCL_STEPS;
+    int stepSize = args->protocol == NCCL_PROTO_LL ? NCCL_LL_BUFF_SIZE/NCCL_STEPS :
+                   args->protocol == NCCL_PROTO_LL128 ? NCCL_LL128_SLICE_ELEMS*sizeof(uint64_t) :
+                   (args->connector->conn.buffSize/NCCL_STEPS) >> args->stepShift;
+    int sliceSize = stepSize * args->sliceSteps;
     if (args->head < args->end) {
       struct ncclRecvMem* localMem = resources->useGdr ? resources->devRecvMem : resources->hostRecvMem;
-      char* localBuff = args->llMode ? (char*)localMem->llBuff : localMem->buff;
-      void* mhandle = args->llMode ? resources->llMhandle : resources->mhandle;
+      char* localBuff = args->protocol == NCCL_PROTO_LL ? (char*)localMem->llBuff :
+                        args->protocol == NCCL_PROTO_LL128 ? (char*)localMem->ll128Buff : localMem->buff;
+      void* mhandle = args->protocol == NCCL_PROTO_LL ? resources->llMhandle :
+                      args->protocol == NCCL_PROTO_LL128 ? resources->ll128Mhandle : resources->mhandle;
       volatile uint64_t* sendHead = &resources->hostSendMem->head;
-      if ((args->tail < args->head + NCCL_STEPS) && (args->tail < *sendHead + NCCL_STEPS) && (args->tail < args->end)) {
+      // Post receives for all the free slots in a single call
+      ncclNetIov_t iovs[NCCL_NET_MAX_IOVS];
+      int niov = 0;
+      int maxIovs = ncclNetMaxIovs();
+      uint64_t tail = args->tail;
+      while (niov < maxIovs && (tail < args->head + NCCL_STEPS) && (tail < *sendHead + NCCL_STEPS) && (tail < args->end) &&
+          *sendHead >= args->drainStep) {
+        ncclNetIov_t* iov = iovs+niov++;
+        iov->size = sliceSize;
+        if (args->zcopyBuff) {
+          // Receive in place, the kernel will not copy anything. The sender
+          // never writes more than what is left in the buffer.
+          int size;
+          iov->data = netZcopyPtr(args, tail, stepSize, &size);
+          iov->mhandle = args->zcopyMhandle;
+        } else {
+          iov->data = localBuff+(tail%NCCL_STEPS)*stepSize;
+          iov->mhandle = mhandle;
+        }
+        tail += args->sliceSteps;
+      }
+      if (niov) {
         int buffSlot = args->tail%NCCL_STEPS;
-        int sliceSize = stepSize * args->sliceSteps;
-        NCCLCHECK(ncclNetIrecv(resources->netRecvComm, localBuff+buffSlot*stepSize, sliceSize, mhandle, args->requests+buffSlot));
+        NCCLCHECK(ncclNetIrecvv(resources->netRecvComm, iovs, niov, args->requests+buffSlot));
         if (args->requests[buffSlot] != NULL) {
-          args->tail += args->sliceSteps;
+          args->reqSteps[buffSlot] = niov*args->sliceSteps;
+          args->reqSizes[buffSlot] = -1;
+          for (int i=0; i<niov; i++) {
+            netStepPost(args, ncclTimelineNetRecv, args->tail%NCCL_STEPS, 0);
+            args->tail += args->sliceSteps;
+          }
+          args->idle = 0;
+        }
+      }
+      if (args->tail > args->received) {
+        NCCLCHECK(netTestRequests(args, args->received, args->tail));
+        while (args->received < args->tail && args->reqSizes[args->received%NCCL_STEPS] != -1) {
+          int steps = args->reqSteps[args->received%NCCL_STEPS];
+          // Only the total size is known ; all the steps of an operation but
+          // the last are full.
+          int left = args->reqSizes[args->received%NCCL_STEPS];
+          for (int s=0; s<steps; s+=args->sliceSteps) {
+            int buffSlot = args->received%NCCL_STEPS;
+            int size = std::min(left, sliceSize);
+            left -= size;
+            netStepDone(args, ncclTimelineNetRecv, buffSlot, size, resources->netDev);
+            // Start the flush and move on, it completes while we progress other steps
+            args->requests[buffSlot] = NULL;
+            if (args->zcopyBuff) {
+              int maxSize;
+              char* data = netZcopyPtr(args, args->received, stepSize, &maxSize);
+              NCCLCHECK(ncclNetIflush(resources->netRecvComm, data, size, args->zcopyMhandle, args->requests+buffSlot));
+            } else if (args->protocol == NCCL_PROTO_SIMPLE && resources->useGdr) {
+              NCCLCHECK(ncclNetIflush(resources->netRecvComm, localBuff+buffSlot*stepSize, size, mhandle, args->requests+buffSlot));
+            }
+            if (args->requests[buffSlot] != NULL) netStepPost(args, ncclTimelineNetFlush, buffSlot, size);
+            args->received += args->sliceSteps;
+          }
           args->idle = 0;
         }
       }
-      if (args->tail > args->head) {
+      if (args->received > args->head) {
         int buffSlot = args->head%NCCL_STEPS;
-        int done, size;
-        NCCLCHECK(ncclNetTest(args->requests[buffSlot], &done, &size));
+        int done = 1;
+        int flushed = args->requests[buffSlot] != NULL;
+        if (flushed) NCCLCHECK(ncclNetTest(args->requests[buffSlot], &done, NULL));
         if (done) {
+          if (flushed) netStepDone(args, ncclTimelineNetFlush, buffSlot, args->stepBytes[buffSlot], resources->netDev);
           args->head += args->sliceSteps;
-          if (args->llMode == 0) {
-            if (resources->useGdr) ncclNetFlush(resources->netRecvComm, localBuff+buffSlot*stepSize, size, mhandle);
+          // LL and LL128 carry their own flags
+          if (args->protocol == NCCL_PROTO_SIMPLE) {
             resources->hostRecvMem->tail = args->head;
           }
           args->idle = 0;
@@ -53,6 +53,9 @@ NCCL_PARAM(IbTimeout, "IB_TIMEOUT", 14);
 NCCL_PARAM(IbRetryCnt, "IB_RETRY_CNT", 7);
 NCCL_PARAM(IbSl, "IB_SL", 0);
 NCCL_PARAM(IbTc, "IB_TC", 0);
+NCCL_PARAM(IbQpsPerConn, "IB_QPS_PER_CONNECTION", 1);
+NCCL_PARAM(IbAdaptiveRouting, "IB_ADAPTIVE_ROUTING", 0);
+NCCL_PARAM(IbPostBatch, "IB_POST_BATCH", 8);
 
 // Allocate memory to be potentially ibv_reg_mr'd. This needs to be
 // allocated on separate pages as those pages will be marked DONTFORK
@@ -236,11 +239,19 @@ static ncclResult_t GetSocketAddr(union socketAddress* addr) {
 }
 
 #define MAX_REQUESTS 128
+// Several QPs per connection let RoCE/ECMP fabrics hash each connection on
+// several paths. Every message is striped across all the QPs.
+#define NCCL_IB_MAX_QPS 16
+#define NCCL_IB_STRIPE_ALIGN 128
+// Sends are queued and posted in chains of up to this many messages per QP,
+// with only the last work request of each chain signaled.
+#define NCCL_IB_MAX_POST_BATCH 16
 
 struct ncclIbQpInfo {
   uint32_t lid;
   uint8_t ib_port;
-  uint32_t qpn;
+  int nqps;
+  uint32_t qpn[NCCL_IB_MAX_QPS];
 
   // For RoCE
   uint64_t spn;
@@ -256,18 +267,40 @@ struct ncclIbHandle {
   union socketAddress connectAddr;
 };
 
+// Registration cache. Registrations are page-aligned, so buffers sharing
+// pages, or registered several times, reuse the same memory region.
+struct ncclIbMrCache {
+  uint64_t addr;
+  uint64_t size;
+  int refs;
+  struct ibv_mr* mr;
+};
+
 struct ncclIbVerbs {
   struct ibv_pd* pd;
+  int nqps;
   struct ibv_cq* cq;
+  // User buffers can be deregistered by the application thread while the
+  // proxy registers others
+  pthread_mutex_t mrLock;
+  struct ncclIbMrCache* mrCache;
+  int nMrCache;
+  int maxMrCache;
 };
 
+struct ncclIbSendComm;
+
 struct ncclIbRequest {
   int used;
   int type;
   struct ncclIbVerbs* verbs;
-  int done;
+  int events; // Completions still expected, one per QP for receives
   int size;
   int free;
+  // Sends are not all signaled. A send is complete once every QP completed
+  // a signaled work request posted after it.
+  struct ncclIbSendComm* sendComm;
+  uint64_t seq;
 };
 
 struct ncclIbListenComm {
@@ -283,15 +316,29 @@ struct ncclIbSendFifo {
   uint32_t ready;
 };
 
+struct ncclIbSendQueue {
+  // Two work requests per message with adaptive routing
+  struct ibv_send_wr wrs[2*NCCL_IB_MAX_POST_BATCH];
+  struct ibv_sge sges[NCCL_IB_MAX_POST_BATCH];
+  int nWrs;
+  int nSges;
+  uint64_t doneSeq; // Sends with a lower seq have completed on this QP
+};
+
 struct ncclIbSendComm {
   struct ncclIbVerbs verbs;
+  int adaptiveRouting;
   struct ncclIbSendFifo fifo[MAX_REQUESTS];
   struct ncclIbRequest reqs[MAX_REQUESTS];
   uint32_t fifoHead;
   int fd;
   int ready;
-  struct ibv_qp* qp;
+  struct ibv_qp* qps[NCCL_IB_MAX_QPS];
   struct ibv_mr* fifoMr;
+  int postBatch;
+  int nQueued;
+  uint64_t sendSeq;
+  struct ncclIbSendQueue queues[NCCL_IB_MAX_QPS];
 };
 
 struct ncclIbGpuFlush {
@@ -318,17 +365,23 @@ struct ncclIbRecvComm {
   struct ncclIbRequest reqs[MAX_REQUESTS];
   int fd;
   int ready;
-  struct ibv_qp* qp;
+  struct ibv_qp* qps[NCCL_IB_MAX_QPS];
   struct ncclIbGpuFlush gpuFlush;
 };
 
-ncclResult_t ncclIbInitVerbs(ibv_context* ctx, struct ncclIbVerbs* verbs) {
+ncclResult_t ncclIbInitVerbs(ibv_context* ctx, int nqps, struct ncclIbVerbs* verbs) {
   NCCLCHECK(wrap_ibv_alloc_pd(&verbs->pd, ctx));
-  NCCLCHECK(wrap_ibv_create_cq(&verbs->cq, ctx, MAX_REQUESTS, NULL, NULL, 0));
+  pthread_mutex_init(&verbs->mrLock, NULL);
+  verbs->nqps = nqps;
+  // Each request can generate one completion per QP
+  NCCLCHECK(wrap_ibv_create_cq(&verbs->cq, ctx, MAX_REQUESTS*nqps, NULL, NULL, 0));
   return ncclSuccess;
 }
 
 ncclResult_t ncclIbDestroyVerbs(struct ncclIbVerbs* verbs) {
+  for (int i=0; i<verbs->nMrCache; i++) NCCLCHECK(wrap_ibv_dereg_mr(verbs->mrCache[i].mr));
+  free(verbs->mrCache);
+  pthread_mutex_destroy(&verbs->mrLock);
   NCCLCHECK(wrap_ibv_destroy_cq(verbs->cq));
   NCCLCHECK(wrap_ibv_dealloc_pd(verbs->pd));
   return ncclSuccess;
@@ -340,7 +393,7 @@ ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbVerbs* verbs, int acce
   qpInitAttr.send_cq = verbs->cq;
   qpInitAttr.recv_cq = verbs->cq;
   qpInitAttr.qp_type = IBV_QPT_RC;
-  qpInitAttr.cap.max_send_wr = MAX_REQUESTS;
+  qpInitAttr.cap.max_send_wr = 2*MAX_REQUESTS; // Data write + completion write with adaptive routing
   qpInitAttr.cap.max_recv_wr = MAX_REQUESTS;
   qpInitAttr.cap.max_send_sge = 1;
   qpInitAttr.cap.max_recv_sge = 1;
@@ -356,12 +409,12 @@ ncclResult_t ncclIbCreateQp(uint8_t ib_port, struct ncclIbVerbs* verbs, int acce
   return ncclSuccess;
 }
 
-ncclResult_t ncclIbRtrQp(ibv_qp* qp, struct ncclIbQpInfo* info) {
+ncclResult_t ncclIbRtrQp(ibv_qp* qp, uint32_t qpn, struct ncclIbQpInfo* info) {
   struct ibv_qp_attr qpAttr;
   memset(&qpAttr, 0, sizeof(struct ibv_qp_attr));
   qpAttr.qp_state = IBV_QPS_RTR;
   qpAttr.path_mtu = info->mtu;
-  qpAttr.dest_qp_num = info->qpn;
+  qpAttr.dest_qp_num = qpn;
   qpAttr.rq_psn = 0;
   qpAttr.max_dest_rd_atomic = 1;
   qpAttr.min_rnr_timer = 12;
@@ -419,18 +472,34 @@ ncclResult_t ncclIbConnect(int dev, void* opaqueHandle, void** sendComm) {
   *sendComm = comm;
 
   // IB Setup
+  int nqps = ncclParamIbQpsPerConn();
+  if (nqps < 1 || nqps > NCCL_IB_MAX_QPS) {
+    WARN("NET/IB : NCCL_IB_QPS_PER_CONNECTION=%d out of range [1, %d], using %d", nqps, NCCL_IB_MAX_QPS, nqps < 1 ? 1 : NCCL_IB_MAX_QPS);
+    nqps = nqps < 1 ? 1 : NCCL_IB_MAX_QPS;
+  }
+#if USE_RDMA_WRITE == 0
+  // Striping relies on RDMA writes at the receiver's offsets
+  nqps = 1;
+#endif
   ibv_context* ctx = ncclIbDevs[dev].context;
-  NCCLCHECK(ncclIbInitVerbs(ctx, &comm->verbs));
+  NCCLCHECK(ncclIbInitVerbs(ctx, nqps, &comm->verbs));
   uint8_t ib_port = ncclIbDevs[dev].port;
-  NCCLCHECK(ncclIbCreateQp(ib_port, &comm->verbs, IBV_ACCESS_REMOTE_WRITE, &comm->qp));
+  for (int q=0; q<nqps; q++) {
+    NCCLCHECK(ncclIbCreateQp(ib_port, &comm->verbs, IBV_ACCESS_REMOTE_WRITE, comm->qps+q));
+  }
 
   // Send my QP Info to receiver through the socket. Hope this won't block.
   struct ibv_port_attr portAttr;
   NCCLCHECK(wrap_ibv_query_port(ctx, ib_port, &portAttr));
   struct ncclIbQpInfo qpInfo;
   qpInfo.ib_port = ib_port;
-  qpInfo.qpn = comm->qp->qp_num;
+  qpInfo.nqps = nqps;
+  for (int q=0; q<nqps; q++) qpInfo.qpn[q] = comm->qps[q]->qp_num;
   qpInfo.mtu = portAttr.active_mtu;
+#if USE_RDMA_WRITE
+  comm->adaptiveRouting = ncclParamIbAdaptiveRouting() ? 1 : 0;
+#endif
+  comm->postBatch = std::max(1, std::min((int)ncclParamIbPostBatch(), NCCL_IB_MAX_POST_BATCH));
 
   // Prepare my fifo
   NCCLCHECK(wrap_ibv_reg_mr(&comm->fifoMr, comm->verbs.pd, comm->fifo, sizeof(struct ncclIbSendFifo)*MAX_REQUESTS, IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ));
@@ -440,13 +509,13 @@ ncclResult_t ncclIbConnect(int dev, void* opaqueHandle, void** sendComm) {
   // RoCE support
   qpInfo.lid = portAttr.lid;
   if (qpInfo.lid) { // IB
-    INFO(NCCL_NET,"NET/IB: Dev %d Port %d qpn %d mtu %d LID %d", dev, ib_port, qpInfo.qpn, qpInfo.mtu, qpInfo.lid);
+    INFO(NCCL_NET,"NET/IB: Dev %d Port %d qpn %d (x%d) mtu %d LID %d", dev, ib_port, qpInfo.qpn[0], nqps, qpInfo.mtu, qpInfo.lid);
   } else { // RoCE
     union ibv_gid gid;
     NCCLCHECK(wrap_ibv_query_gid(ctx, ib_port, ncclParamIbGidIndex(), &gid));
     qpInfo.spn = gid.global.subnet_prefix;
     qpInfo.iid = gid.global.interface_id;
-    INFO(NCCL_NET,"NET/IB: Dev %d Port %d qpn %d mtu %d GID %ld (%lX/%lX)", dev, ib_port, qpInfo.qpn, qpInfo.mtu, ncclParamIbGidIndex(), qpInfo.spn, qpInfo.iid);
+    INFO(NCCL_NET,"NET/IB: Dev %d Port %d qpn %d (x%d) mtu %d GID %ld (%lX/%lX)", dev, ib_port, qpInfo.qpn[0], nqps, qpInfo.mtu, ncclParamIbGidIndex(), qpInfo.spn, qpInfo.iid);
   }
 
   NCCLCHECK(socketSend(comm->fd, &qpInfo, sizeof(qpInfo)));
@@ -474,17 +543,26 @@ ncclResult_t ncclIbAccept(void* listenComm, void** recvComm) {
   union ibv_gid gid;
   NCCLCHECK(wrap_ibv_query_gid(ctx, ib_port, ncclParamIbGidIndex(), &gid));
 
-  // QP Creation
-  NCCLCHECK(ncclIbInitVerbs(ctx, &rComm->verbs));
-  NCCLCHECK(ncclIbCreateQp(ib_port, &rComm->verbs, IBV_ACCESS_REMOTE_WRITE, &rComm->qp));
+  // QP Creation. The sender decides how many QPs we use.
+  int nqps = remQpInfo.nqps;
+  if (nqps < 1 || nqps > NCCL_IB_MAX_QPS) {
+    WARN("NET/IB : invalid number of QPs %d received from peer", nqps);
+    return ncclInternalError;
+  }
+  NCCLCHECK(ncclIbInitVerbs(ctx, nqps, &rComm->verbs));
+  for (int q=0; q<nqps; q++) {
+    NCCLCHECK(ncclIbCreateQp(ib_port, &rComm->verbs, IBV_ACCESS_REMOTE_WRITE, rComm->qps+q));
+  }
 
   // Adjust the MTU
   remQpInfo.mtu = (enum ibv_mtu)std::min(remQpInfo.mtu, portAttr.active_mtu);
 
-  // Setup QP
-  struct ibv_qp* qp = rComm->qp;
-  NCCLCHECK(ncclIbRtrQp(qp, &remQpInfo));
-  NCCLCHECK(ncclIbRtsQp(qp));
+  // Setup QPs
+  for (int q=0; q<nqps; q++) {
+    NCCLCHECK(ncclIbRtrQp(rComm->qps[q], remQpInfo.qpn[q], &remQpInfo));
+    NCCLCHECK(ncclIbRtsQp(rComm->qps[q]));
+  }
+  struct ibv_qp* qp = rComm->qps[0];
 
   // Retain remote fifo info and prepare my RDMA ops
   rComm->remFifo.rkey = remQpInfo.fifoRkey;
@@ -509,27 +587,27 @@ ncclResult_t ncclIbAccept(void* listenComm, void** recvComm) {
     rComm->gpuFlush.sge.length = 1;
     rComm->gpuFlush.sge.lkey = rComm->gpuFlush.hostMr->lkey;
     NCCLCHECK(ncclIbCreateQp(ib_port, &rComm->verbs, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ, &rComm->gpuFlush.qp));
-    struct ncclIbQpInfo localQpInfo = {
-      .lid=portAttr.lid,
-      .ib_port=ib_port,
-      .qpn=rComm->gpuFlush.qp->qp_num,
-      .spn=gid.global.subnet_prefix,
-      .iid=gid.global.interface_id,
-      .mtu=portAttr.active_mtu
-    };
-    NCCLCHECK(ncclIbRtrQp(rComm->gpuFlush.qp, &localQpInfo));
+    struct ncclIbQpInfo localQpInfo;
+    memset(&localQpInfo, 0, sizeof(struct ncclIbQpInfo));
+    localQpInfo.lid = portAttr.lid;
+    localQpInfo.ib_port = ib_port;
+    localQpInfo.spn = gid.global.subnet_prefix;
+    localQpInfo.iid = gid.global.interface_id;
+    localQpInfo.mtu = portAttr.active_mtu;
+    NCCLCHECK(ncclIbRtrQp(rComm->gpuFlush.qp, rComm->gpuFlush.qp->qp_num, &localQpInfo));
     NCCLCHECK(ncclIbRtsQp(rComm->gpuFlush.qp));
   }
 
   // Fill Handle
-  struct ncclIbQpInfo qpInfo = {
-    .lid=portAttr.lid,
-    .ib_port=ib_port,
-    .qpn=qp->qp_num,
-    .spn=gid.global.subnet_prefix,
-    .iid=gid.global.interface_id,
-    .mtu=remQpInfo.mtu
-  };
+  struct ncclIbQpInfo qpInfo;
+  memset(&qpInfo, 0, sizeof(struct ncclIbQpInfo));
+  qpInfo.lid = portAttr.lid;
+  qpInfo.ib_port = ib_port;
+  qpInfo.nqps = nqps;
+  for (int q=0; q<nqps; q++) qpInfo.qpn[q] = rComm->qps[q]->qp_num;
+  qpInfo.spn = gid.global.subnet_prefix;
+  qpInfo.iid = gid.global.interface_id;
+  qpInfo.mtu = remQpInfo.mtu;
 
   NCCLCHECK(socketSend(rComm->fd, &qpInfo, sizeof(qpInfo)));
   *recvComm = rComm;
@@ -543,9 +621,11 @@ ncclResult_t ncclIbGetRequest(struct ncclIbRequest* reqs, struct ncclIbRequest**
       r->used = 1;
       r->type = 0;
       r->verbs = NULL;
-      r->done = 0;
+      r->events = 1;
       r->size = -1;
       r->free = 0;
+      r->sendComm = NULL;
+      r->seq = 0;
       *req = r;
       return ncclSuccess;
     }
@@ -557,7 +637,6 @@ ncclResult_t ncclIbGetRequest(struct ncclIbRequest* reqs, struct ncclIbRequest**
 
 ncclResult_t ncclSendCheck(struct ncclIbSendComm* comm) {
   struct ncclIbQpInfo remQpInfo;
-  struct ibv_qp* qp = comm->qp;
 
   // Do not block on this receive, return if not ready.
   int bytes = 0;
@@ -565,8 +644,10 @@ ncclResult_t ncclSendCheck(struct ncclIbSendComm* comm) {
   if (bytes == 0) return ncclSuccess; // Try again later
   NCCLCHECK(socketWait(NCCL_SOCKET_RECV, comm->fd, &remQpInfo, sizeof(remQpInfo), &bytes));
 
-  NCCLCHECK(ncclIbRtrQp(qp, &remQpInfo));
-  NCCLCHECK(ncclIbRtsQp(qp));
+  for (int q=0; q<comm->verbs.nqps; q++) {
+    NCCLCHECK(ncclIbRtrQp(comm->qps[q], remQpInfo.qpn[q], &remQpInfo));
+    NCCLCHECK(ncclIbRtsQp(comm->qps[q]));
+  }
   comm->ready = 1;
 
   // Block until this is done. It *should* not block indefinitely.
@@ -588,8 +669,7 @@ ncclResult_t ncclIbTest(void* request, int* done, int* size);
 
 #define REG_ALIGN (4096)
 
-ncclResult_t ncclIbRegMr(void* comm, void* data, int size, int type, void** mhandle) {
-  struct ncclIbVerbs* verbs = (struct ncclIbVerbs*)comm;
+static ncclResult_t ncclIbRegMrLocked(struct ncclIbVerbs* verbs, void* data, int size, void** mhandle) {
   uint64_t addr = (uint64_t)data;
   assert(size > 0);
 
@@ -597,79 +677,199 @@ ncclResult_t ncclIbRegMr(void* comm, void* data, int size, int type, void** mhan
   uint64_t regAddr = addr & (~(REG_ALIGN-1));
   uint64_t regSize = addr+size - regAddr;
   regSize = ((regSize + REG_ALIGN-1) / REG_ALIGN ) * REG_ALIGN;
+
+  // Look for an existing registration covering the range
+  for (int i=0; i<verbs->nMrCache; i++) {
+    struct ncclIbMrCache* cache = verbs->mrCache+i;
+    if (cache->addr <= regAddr && regAddr+regSize <= cache->addr+cache->size) {
+      cache->refs++;
+      *mhandle = (void*)cache->mr;
+      return ncclSuccess;
+    }
+  }
+
+  if (verbs->nMrCache == verbs->maxMrCache) {
+    int maxMrCache = verbs->maxMrCache ? verbs->maxMrCache*2 : 16;
+    struct ncclIbMrCache* mrCache = (struct ncclIbMrCache*)realloc(verbs->mrCache, maxMrCache*sizeof(struct ncclIbMrCache));
+    if (mrCache == NULL) {
+      WARN("Failed to grow the IB registration cache to %d entries", maxMrCache);
+      return ncclSystemError;
+    }
+    verbs->mrCache = mrCache;
+    verbs->maxMrCache = maxMrCache;
+  }
   struct ibv_mr* mr;
   NCCLCHECK(wrap_ibv_reg_mr(&mr, verbs->pd, (void*)regAddr, regSize, IBV_ACCESS_LOCAL_WRITE|IBV_ACCESS_REMOTE_WRITE|IBV_ACCESS_REMOTE_READ));
+  struct ncclIbMrCache* cache = verbs->mrCache+verbs->nMrCache++;
+  cache->addr = regAddr;
+  cache->size = regSize;
+  cache->refs = 1;
+  cache->mr = mr;
   *mhandle = (void*)mr;
   TRACE(NCCL_INIT,"regAddr %lx size %ld rkey %x", regAddr, regSize, mr->rkey);
   return ncclSuccess;
 }
 
+static ncclResult_t ncclIbDeregMrLocked(struct ncclIbVerbs* verbs, void* mhandle) {
+  for (int i=0; i<verbs->nMrCache; i++) {
+    struct ncclIbMrCache* cache = verbs->mrCache+i;
+    if (cache->mr != (struct ibv_mr*)mhandle) continue;
+    if (--cache->refs > 0) return ncclSuccess;
+    // Last user : release the region, the memory may be freed after this
+    NCCLCHECK(wrap_ibv_dereg_mr(cache->mr));
+    *cache = verbs->mrCache[--verbs->nMrCache];
+    return ncclSuccess;
+  }
+  WARN("NET/IB : deregistering unknown memory region %p", mhandle);
+  return ncclInternalError;
+}
+
+ncclResult_t ncclIbRegMr(void* comm, void* data, int size, int type, void** mhandle) {
+  struct ncclIbVerbs* verbs = (struct ncclIbVerbs*)comm;
+  pthread_mutex_lock(&verbs->mrLock);
+  ncclResult_t ret = ncclIbRegMrLocked(verbs, data, size, mhandle);
+  pthread_mutex_unlock(&verbs->mrLock);
+  return ret;
+}
+
 ncclResult_t ncclIbDeregMr(void* comm, void* mhandle) {
-  NCCLCHECK(wrap_ibv_dereg_mr((struct ibv_mr*)mhandle));
+  struct ncclIbVerbs* verbs = (struct ncclIbVerbs*)comm;
+  pthread_mutex_lock(&verbs->mrLock);
+  ncclResult_t ret = ncclIbDeregMrLocked(verbs, mhandle);
+  pthread_mutex_unlock(&verbs->mrLock);
+  return ret;
+}
+
+// Post the queued sends, one chain (a single doorbell) per QP. Only the last
+// work request is signaled; RC QPs complete in order, so its completion
+// covers all the sends before it.
+static ncclResult_t ncclIbPostQueued(struct ncclIbSendComm* comm) {
+  if (comm->nQueued == 0) return ncclSuccess;
+  for (int q=0; q<comm->verbs.nqps; q++) {
+    struct ncclIbSendQueue* queue = comm->queues+q;
+    for (int w=0; w<queue->nWrs; w++) {
+      queue->wrs[w].send_flags = 0;
+      queue->wrs[w].next = w+1 < queue->nWrs ? queue->wrs+w+1 : NULL;
+    }
+    queue->wrs[queue->nWrs-1].send_flags = IBV_SEND_SIGNALED;
+    struct ibv_send_wr* bad_wr;
+    NCCLCHECK(wrap_ibv_post_send(comm->qps[q], queue->wrs, &bad_wr));
+    queue->nWrs = queue->nSges = 0;
+  }
+  comm->nQueued = 0;
   return ncclSuccess;
 }
 
-ncclResult_t ncclIbIsend(void* sendComm, void* data, int size, void* mhandle, void** request) {
+ncclResult_t ncclIbIsendv(void* sendComm, ncclNetIov_t* iovs, int niov, void** request) {
   struct ncclIbSendComm* comm = (struct ncclIbSendComm*)sendComm;
   if (comm->ready == 0) NCCLCHECK(ncclSendCheck(comm));
   if (comm->ready == 0) { *request = NULL; return ncclSuccess; }
+  if (niov > NCCL_NET_MAX_IOVS) {
+    WARN("NET/IB : too many buffers (%d) in a single send", niov);
+    return ncclInternalError;
+  }
 
-  struct ibv_mr* mr = (struct ibv_mr*)mhandle;
-
-  // Wait for the receiver to have posted the corresponding receive
-  volatile struct ncclIbSendFifo* slot = comm->fifo + (comm->fifoHead%MAX_REQUESTS);
-  volatile uint32_t * readyPtr = &slot->ready;
-  if (*readyPtr == 0) { *request = NULL; return ncclSuccess; }
+  // Wait for the receiver to have posted all the corresponding receives
+  for (int i=0; i<niov; i++) {
+    volatile uint32_t * readyPtr = &comm->fifo[(comm->fifoHead+i)%MAX_REQUESTS].ready;
+    if (*readyPtr == 0) { *request = NULL; return ncclSuccess; }
+  }
 
   struct ncclIbRequest* req;
   NCCLCHECK(ncclIbGetRequest(comm->reqs, &req));
   req->verbs = &comm->verbs;
-  req->size = size;
-
-  struct ibv_send_wr wr;
-  memset(&wr, 0, sizeof(wr));
-  wr.wr_id = (uint64_t)req;
-
-  struct ibv_sge sge;
-  if (size == 0) {
-    wr.sg_list = NULL;
-    wr.num_sge = 0;
-  } else {
-    sge.addr=(uintptr_t)data; sge.length=(unsigned int)size; sge.lkey=mr->lkey;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
-  }
-  wr.opcode = IBV_WR_SEND;
-  wr.send_flags = IBV_SEND_SIGNALED;
+  req->size = 0;
+
+  // All the messages go in the same chain, so that the completion of its last
+  // work request covers them all.
+  static_assert(NCCL_NET_MAX_IOVS <= NCCL_IB_MAX_POST_BATCH, "IB send queues too small for a scatter-gather send");
+  if (comm->nQueued + niov > comm->postBatch) NCCLCHECK(ncclIbPostQueued(comm));
+  req->sendComm = comm;
+  req->seq = comm->sendSeq++;
+
+  for (int i=0; i<niov; i++) {
+    void* data = iovs[i].data;
+    int size = iovs[i].size;
+    struct ibv_mr* mr = (struct ibv_mr*)iovs[i].mhandle;
+    volatile struct ncclIbSendFifo* slot = comm->fifo + (comm->fifoHead%MAX_REQUESTS);
+    req->size += size;
 
 #if USE_RDMA_WRITE
-  __sync_synchronize(); // order the readyPtr load against rkey load below
-  // Sanity checks to catch user collective call count/size mismatches
-  // plus any potential programming errors
-  if (size > slot->size || slot->size <= 0 || slot->addr == 0 || slot->rkey == 0 || slot->seq != comm->fifoHead) {
-    WARN("NET/IB : collective mismatch error local size %d remote %d addr %lx rkey %x seq %x/%x",
-        size, slot->size, slot->addr, slot->rkey, slot->seq, comm->fifoHead);
-    return ncclInternalError;
-  }
-  wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
-  wr.wr.rdma.remote_addr = slot->addr;
-  wr.wr.rdma.rkey = slot->rkey;
-  wr.imm_data = size; // Send the message size via imm_data
-  __sync_synchronize();
+    __sync_synchronize(); // order the readyPtr load against rkey load below
+    // Sanity checks to catch user collective call count/size mismatches
+    // plus any potential programming errors
+    if (size > slot->size || slot->size <= 0 || slot->addr == 0 || slot->rkey == 0 || slot->seq != comm->fifoHead) {
+      WARN("NET/IB : collective mismatch error local size %d remote %d addr %lx rkey %x seq %x/%x",
+          size, slot->size, slot->addr, slot->rkey, slot->seq, comm->fifoHead);
+      return ncclInternalError;
+    }
+    uint64_t remoteAddr = slot->addr;
+    uint32_t remoteRkey = slot->rkey;
+    __sync_synchronize();
 #endif
-  // We must clear slot->ready, but reset other fields to aid
-  // debugging and sanity checks
-  slot->ready = 0;
-  slot->addr = 0ULL;
-  slot->rkey = slot->size = slot->seq = 0;
-  comm->fifoHead++;
+    // We must clear slot->ready, but reset other fields to aid
+    // debugging and sanity checks
+    slot->ready = 0;
+    slot->addr = 0ULL;
+    slot->rkey = slot->size = slot->seq = 0;
+    comm->fifoHead++;
+
+    // Stripe the message across all QPs. The receiver posted one receive per QP
+    // and adds up the sizes carried in imm_data; empty stripes are still posted.
+    // With adaptive routing, packets of a write may land out of order, so the
+    // data goes in a plain RDMA write and a separate empty write with imm,
+    // ordered after it on the QP, signals the receiver.
+    int nqps = comm->verbs.nqps;
+    int stripeSize = DIVUP(DIVUP(size, nqps), NCCL_IB_STRIPE_ALIGN)*NCCL_IB_STRIPE_ALIGN;
+    for (int q=0; q<nqps; q++) {
+      int offset = std::min(q*stripeSize, size);
+      int length = std::min(stripeSize, size-offset);
+      struct ncclIbSendQueue* queue = comm->queues+q;
+
+      struct ibv_send_wr* wr = queue->wrs+queue->nWrs++;
+      memset(wr, 0, sizeof(struct ibv_send_wr));
+      wr->wr_id = (uint64_t)req;
+
+      if (length == 0) {
+        wr->sg_list = NULL;
+        wr->num_sge = 0;
+      } else {
+        struct ibv_sge* sge = queue->sges+queue->nSges++;
+        sge->addr=(uintptr_t)data+offset; sge->length=(unsigned int)length; sge->lkey=mr->lkey;
+        wr->sg_list = sge;
+        wr->num_sge = 1;
+      }
+      wr->opcode = IBV_WR_SEND;
 
-  struct ibv_send_wr* bad_wr;
-  NCCLCHECK(wrap_ibv_post_send(comm->qp, &wr, &bad_wr));
+#if USE_RDMA_WRITE
+      wr->opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+      wr->wr.rdma.remote_addr = remoteAddr+offset;
+      wr->wr.rdma.rkey = remoteRkey;
+      wr->imm_data = length; // Send the stripe size via imm_data
+
+      if (comm->adaptiveRouting && length > 0) {
+        struct ibv_send_wr* immWr = queue->wrs+queue->nWrs++;
+        *immWr = *wr;
+        immWr->sg_list = NULL;
+        immWr->num_sge = 0;
+        wr->opcode = IBV_WR_RDMA_WRITE;
+        wr->imm_data = 0;
+      }
+#endif
+    }
+    comm->nQueued++;
+  }
+  if (comm->nQueued >= comm->postBatch) NCCLCHECK(ncclIbPostQueued(comm));
   *request = req;
   return ncclSuccess;
 }
 
+ncclResult_t ncclIbIsend(void* sendComm, void* data, int size, void* mhandle, void** request) {
+  ncclNetIov_t iov = { data, size, mhandle };
+  NCCLCHECK(ncclIbIsendv(sendComm, &iov, 1, request));
+  return ncclSuccess;
+}
+
 ncclResult_t ncclIbPostFifo(struct ncclIbRecvComm* comm, uint32_t rkey, uint64_t addr, int size) {
   struct ibv_send_wr wr;
   memset(&wr, 0, sizeof(wr));
@@ -694,49 +894,72 @@ ncclResult_t ncclIbPostFifo(struct ncclIbRecvComm* comm, uint32_t rkey, uint64_t
   wr.send_flags = IBV_SEND_SIGNALED | comm->remFifo.flags; // IBV_SEND_INLINE
 
   struct ibv_send_wr* bad_wr;
-  NCCLCHECK(wrap_ibv_post_send(comm->qp, &wr, &bad_wr));
+  NCCLCHECK(wrap_ibv_post_send(comm->qps[0], &wr, &bad_wr));
   comm->remFifo.tail++;
 
   return ncclSuccess;
 }
 
-ncclResult_t ncclIbIrecv(void* recvComm, void* data, int size, void* mhandle, void** request) {
+ncclResult_t ncclIbIrecvv(void* recvComm, ncclNetIov_t* iovs, int niov, void** request) {
   struct ncclIbRecvComm* comm = (struct ncclIbRecvComm*)recvComm;
   if (comm->ready == 0) NCCLCHECK(ncclRecvCheck(comm));
   if (comm->ready == 0) { *request = NULL; return ncclSuccess; }
-
-  struct ibv_mr* mr = (struct ibv_mr*)mhandle;
+  if (niov > NCCL_NET_MAX_IOVS) {
+    WARN("NET/IB : too many buffers (%d) in a single receive", niov);
+    return ncclInternalError;
+  }
 
   struct ncclIbRequest* req;
   NCCLCHECK(ncclIbGetRequest(comm->reqs, &req));
   req->verbs = &comm->verbs;
-  req->size = size;
-
-  struct ibv_recv_wr wr;
-  memset(&wr, 0, sizeof(wr));
-  wr.wr_id = (uint64_t)req;
-
-  struct ibv_sge sge;
-  if (size == 0) {
-    wr.sg_list = NULL;
-    wr.num_sge = 0;
-  } else {
-    sge.addr=(uintptr_t)data; sge.length=(unsigned int)size; sge.lkey=mr->lkey;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
+  req->size = 0; // Sum of the stripe sizes, filled upon completion
+
+  // One receive per QP and message, chained on each QP. Receives are consumed
+  // in order on each QP and the sender posts stripes in FIFO order, so
+  // completions may arrive in any order across QPs and requests: each one is
+  // matched to its request through wr_id and counted down in ncclIbTest. Only
+  // the first QP carries data in send mode, where there is a single QP anyway.
+  int nqps = comm->verbs.nqps;
+  req->events = nqps*niov;
+  struct ibv_recv_wr wrs[NCCL_NET_MAX_IOVS];
+  struct ibv_sge sges[NCCL_NET_MAX_IOVS];
+  memset(wrs, 0, sizeof(wrs));
+  for (int i=0; i<niov; i++) {
+    struct ibv_mr* mr = (struct ibv_mr*)iovs[i].mhandle;
+    wrs[i].wr_id = (uint64_t)req;
+    wrs[i].next = i+1 < niov ? wrs+i+1 : NULL;
+    if (iovs[i].size == 0) {
+      wrs[i].sg_list = NULL;
+      wrs[i].num_sge = 0;
+    } else {
+      sges[i].addr=(uintptr_t)iovs[i].data; sges[i].length=(unsigned int)iovs[i].size; sges[i].lkey=mr->lkey;
+      wrs[i].sg_list = sges+i;
+      wrs[i].num_sge = 1;
+    }
+  }
+  for (int q=0; q<nqps; q++) {
+    struct ibv_recv_wr* bad_wr;
+    NCCLCHECK(wrap_ibv_post_recv(comm->qps[q], wrs, &bad_wr));
   }
-
-  struct ibv_recv_wr* bad_wr;
-  NCCLCHECK(wrap_ibv_post_recv(comm->qp, &wr, &bad_wr));
   *request = req;
 
   // Post to FIFO to notify sender
-  NCCLCHECK(ncclIbPostFifo(comm, mr->rkey, (uint64_t)data, size));
+  for (int i=0; i<niov; i++) {
+    struct ibv_mr* mr = (struct ibv_mr*)iovs[i].mhandle;
+    NCCLCHECK(ncclIbPostFifo(comm, mr->rkey, (uint64_t)iovs[i].data, iovs[i].size));
+  }
   return ncclSuccess;
 }
 
-ncclResult_t ncclIbFlush(void* recvComm, void* data, int size, void* mhandle) {
+ncclResult_t ncclIbIrecv(void* recvComm, void* data, int size, void* mhandle, void** request) {
+  ncclNetIov_t iov = { data, size, mhandle };
+  NCCLCHECK(ncclIbIrecvv(recvComm, &iov, 1, request));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclIbIflush(void* recvComm, void* data, int size, void* mhandle, void** request) {
   struct ncclIbRecvComm* comm = (struct ncclIbRecvComm*)recvComm;
+  *request = NULL;
   if (comm->gpuFlush.enabled == 0 || size == 0) return ncclSuccess;
 
   struct ncclIbRequest* req;
@@ -757,63 +980,107 @@ ncclResult_t ncclIbFlush(void* recvComm, void* data, int size, void* mhandle) {
 
   struct ibv_send_wr* bad_wr;
   NCCLCHECK(wrap_ibv_post_send(comm->gpuFlush.qp, &wr, &bad_wr));
+  *request = req;
+  return ncclSuccess;
+}
 
-  int done = 0;
-  while (done == 0) {
-    NCCLCHECK((ncclResult_t)ncclIbTest(req, &done, NULL));
+// Check whether a request completed, with the completions seen so far
+static ncclResult_t ncclIbRequestDone(struct ncclIbRequest* r, int* done, int* size) {
+  *done = 0;
+  if (r->sendComm) {
+    // Sends queued behind this one in the last chain must be posted for
+    // the request to ever complete
+    NCCLCHECK(ncclIbPostQueued(r->sendComm));
+    r->events = 0;
+    for (int q=0; q<r->verbs->nqps; q++) if (r->sendComm->queues[q].doneSeq <= r->seq) r->events++;
+  }
+  if (r->events == 0) {
+    *done = 1;
+    if (size) *size = r->size;
+    r->used = 0;
   }
-
   return ncclSuccess;
 }
 
-ncclResult_t ncclIbTest(void* request, int* done, int* size) {
-  struct ncclIbRequest *r = (struct ncclIbRequest*)request;
-  *done = 0;
+// Account for the completions of a CQ, attributing them to their requests
+static ncclResult_t ncclIbPollCq(struct ncclIbVerbs* verbs, int* wrDone) {
+  struct ibv_wc wcs[16];
+  NCCLCHECK(wrap_ibv_poll_cq(verbs->cq, 16, wcs, wrDone));
 
-  while (1) {
-    if (r->done == 1) {
-      *done = 1;
-      if (size) *size = r->size;
-      r->used = 0;
-      return ncclSuccess;
+  for (int w=0; w<*wrDone; w++) {
+    struct ibv_wc *wc = wcs+w;
+    if (wc->status != IBV_WC_SUCCESS) {
+      WARN("NET/IB : Got completion with error %d, opcode %d, len %d, vendor err %d", wc->status, wc->opcode, wc->byte_len, wc->vendor_err);
+      return ncclSystemError;
     }
 
-    int wrDone = 0;
-    struct ibv_wc wcs[4];
-    NCCLCHECK(wrap_ibv_poll_cq(r->verbs->cq, 4, wcs, &wrDone));
-    if (wrDone == 0) return ncclSuccess;
-
-    for (int w=0; w<wrDone; w++) {
-      struct ibv_wc *wc = wcs+w;
-      if (wc->status != IBV_WC_SUCCESS) {
-        WARN("NET/IB : Got completion with error %d, opcode %d, len %d, vendor err %d", wc->status, wc->opcode, wc->byte_len, wc->vendor_err);
-        return ncclSystemError;
+    struct ncclIbRequest* doneReq = (struct ncclIbRequest*)wc->wr_id;
+    if (doneReq && doneReq->sendComm) {
+      struct ncclIbSendComm* comm = doneReq->sendComm;
+      for (int q=0; q<comm->verbs.nqps; q++) {
+        if (comm->qps[q]->qp_num == wc->qp_num) comm->queues[q].doneSeq = doneReq->seq+1;
       }
-
-      struct ncclIbRequest* doneReq = (struct ncclIbRequest*)wc->wr_id;
-      if (doneReq) {
-        if (wc->opcode == IBV_WC_RECV) {
-          doneReq->size = wc->byte_len;
+    } else if (doneReq) {
+      if (wc->opcode == IBV_WC_RECV) {
+        doneReq->size += wc->byte_len;
 #if USE_RDMA_WRITE
-        } else if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
-          doneReq->size = wc->imm_data;
+      } else if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+        doneReq->size += wc->imm_data;
 #endif
-        }
-        doneReq->done = 1;
-        if (doneReq->free == 1) {
-          // This is an internal (FIFO post) req. Free it immediately.
-          doneReq->used = 0;
-        }
+      }
+      doneReq->events--;
+      if (doneReq->free == 1) {
+        // This is an internal (FIFO post) req. Free it immediately.
+        doneReq->used = 0;
       }
     }
   }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclIbTest(void* request, int* done, int* size) {
+  struct ncclIbRequest *r = (struct ncclIbRequest*)request;
+  while (1) {
+    NCCLCHECK(ncclIbRequestDone(r, done, size));
+    if (*done) return ncclSuccess;
+    int wrDone = 0;
+    NCCLCHECK(ncclIbPollCq(r->verbs, &wrDone));
+    if (wrDone == 0) return ncclSuccess;
+  }
+}
+
+ncclResult_t ncclIbTestAny(int n, void** requests, int* index, int* size) {
+  *index = -1;
+  while (1) {
+    for (int i=0; i<n; i++) {
+      if (requests[i] == NULL) continue;
+      int done;
+      NCCLCHECK(ncclIbRequestDone((struct ncclIbRequest*)requests[i], &done, size));
+      if (done) { *index = i; return ncclSuccess; }
+    }
+    // Poll each CQ once for all the requests using it
+    int wrDone = 0;
+    for (int i=0; i<n; i++) {
+      if (requests[i] == NULL) continue;
+      struct ncclIbVerbs* verbs = ((struct ncclIbRequest*)requests[i])->verbs;
+      int seen = 0;
+      for (int j=0; j<i; j++) if (requests[j] && ((struct ncclIbRequest*)requests[j])->verbs == verbs) seen = 1;
+      if (seen) continue;
+      int polled = 0;
+      NCCLCHECK(ncclIbPollCq(verbs, &polled));
+      wrDone += polled;
+    }
+    if (wrDone == 0) return ncclSuccess;
+  }
 }
 
 ncclResult_t ncclIbCloseSend(void* sendComm) {
   struct ncclIbSendComm* comm = (struct ncclIbSendComm*)sendComm;
   if (comm) {
     close(comm->fd);
-    if (comm->qp != NULL) NCCLCHECK(wrap_ibv_destroy_qp(comm->qp));
+    for (int q=0; q<comm->verbs.nqps; q++) {
+      if (comm->qps[q] != NULL) NCCLCHECK(wrap_ibv_destroy_qp(comm->qps[q]));
+    }
     if (comm->fifoMr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(comm->fifoMr));
     NCCLCHECK(ncclIbDestroyVerbs(&comm->verbs));
     free(comm);
@@ -825,7 +1092,9 @@ ncclResult_t ncclIbCloseRecv(void* recvComm) {
   struct ncclIbRecvComm* comm = (struct ncclIbRecvComm*)recvComm;
   if (comm) {
     close(comm->fd);
-    if (comm->qp != NULL) NCCLCHECK(wrap_ibv_destroy_qp(comm->qp));
+    for (int q=0; q<comm->verbs.nqps; q++) {
+      if (comm->qps[q] != NULL) NCCLCHECK(wrap_ibv_destroy_qp(comm->qps[q]));
+    }
     if (comm->gpuFlush.enabled) {
       if (comm->gpuFlush.qp != NULL) NCCLCHECK(wrap_ibv_destroy_qp(comm->gpuFlush.qp));
       if (comm->gpuFlush.hostMr != NULL) NCCLCHECK(wrap_ibv_dereg_mr(comm->gpuFlush.hostMr));
@@ -846,6 +1115,40 @@ ncclResult_t ncclIbCloseListen(void* listenComm) {
   return ncclSuccess;
 }
 
+static int ncclIbSpeed(int speed) {
+  // Per lane speed in Mbps of the ibv_port_attr active_speed values
+  switch (speed) {
+    case 1: return 2500;   // SDR
+    case 2: return 5000;   // DDR
+    case 4: return 10000;  // QDR
+    case 8: return 10000;  // FDR10
+    case 16: return 14000; // FDR
+    case 32: return 25000; // EDR
+    case 64: return 50000; // HDR
+    case 128: return 100000; // NDR
+    default: return 0;
+  }
+}
+static int ncclIbWidth(int width) {
+  // Number of lanes of the ibv_port_attr active_width values
+  switch (width) {
+    case 1: return 1;
+    case 2: return 4;
+    case 4: return 8;
+    case 8: return 12;
+    default: return 0;
+  }
+}
+
+ncclResult_t ncclIbGetProperties(int dev, ncclNetProperties_t* props) {
+  struct ibv_port_attr portAttr;
+  NCCLCHECK(wrap_ibv_query_port(ncclIbDevs[dev].context, ncclIbDevs[dev].port, &portAttr));
+  props->speed = ncclIbSpeed(portAttr.active_speed) * ncclIbWidth(portAttr.active_width);
+  props->latency = 0;
+  props->maxRequests = MAX_REQUESTS;
+  return ncclSuccess;
+}
+
 ncclNet_t ncclNetIb = {
   "IB",
   ncclIbInit,
@@ -859,10 +1162,14 @@ ncclNet_t ncclNetIb = {
   ncclIbDeregMr,
   ncclIbIsend,
   ncclIbIrecv,
-  ncclIbFlush,
+  ncclIbIflush,
   ncclIbTest,
   ncclIbCloseSend,
   ncclIbCloseRecv,
-  ncclIbCloseListen
+  ncclIbCloseListen,
+  ncclIbGetProperties,
+  ncclIbIsendv,
+  ncclIbIrecvv,
+  ncclIbTestAny
 };
 
@@ -9,6 +9,8 @@
 #include "socket.h"
 #include "net.h"
 #include "param.h"
+#include "uringwrap.h"
+#include "cpuset.h"
 
 #include <assert.h>
 #include <pthread.h>
@@ -17,11 +19,25 @@
 #include <poll.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <linux/errqueue.h>
+
+// Zero-copy sends need Linux 4.14 ; define what older headers may lack
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
 
 /* Init functions */
 static char ncclNetIfNames[MAX_IF_NAME_SIZE*MAX_IFS];
 static union socketAddress ncclNetIfAddrs[MAX_IFS];
 static int ncclNetIfs = -1;
+static int ncclSocketUring = 0; // NCCL_SOCKET_BACKEND=io_uring
 pthread_mutex_t ncclSocketLock = PTHREAD_MUTEX_INITIALIZER;
 
 ncclResult_t ncclSocketInit(ncclDebugLogger_t logFunction) {
@@ -43,6 +59,14 @@ ncclResult_t ncclSocketInit(ncclDebugLogger_t logFunction) {
         line[1023] = '\0';
         INFO(NCCL_INIT|NCCL_NET,"NET/Socket : Using%s", line);
       }
+      char* backend = getenv("NCCL_SOCKET_BACKEND");
+      if (backend && strcmp(backend, "io_uring") == 0) {
+        NCCLCHECK(ncclUringSupported(&ncclSocketUring));
+        if (ncclSocketUring) INFO(NCCL_INIT|NCCL_NET, "NET/Socket : Using io_uring backend");
+        else INFO(NCCL_INIT|NCCL_NET, "NET/Socket : io_uring not supported by the kernel, using epoll");
+      } else if (backend && strcmp(backend, "epoll") != 0) {
+        WARN("NET/Socket : unknown NCCL_SOCKET_BACKEND %s, using epoll", backend);
+      }
     }
     pthread_mutex_unlock(&ncclSocketLock);
   }
@@ -83,9 +107,15 @@ ncclResult_t GetSocketAddr(int dev, union socketAddress* addr) {
 #define MAX_REQUESTS 128
 #define MAX_QUEUE_LEN MAX_REQUESTS
 #define MIN_CHUNKSIZE (64*1024)
+#define MAX_SOCKET_MRS 64
 
 NCCL_PARAM(SocketNsocksPerThread, "NSOCKS_PERTHREAD", -2);
 NCCL_PARAM(SocketNthreads, "SOCKET_NTHREADS", -2);
+NCCL_PARAM(SocketBuffSize, "SOCKET_BUFFSIZE", 0);
+NCCL_PARAM(SocketZcopy, "SOCKET_ZEROCOPY", 0);
+
+// Below this size, pinning pages for a zero-copy send costs more than the copy
+#define ZCOPY_MIN_SEND (16*1024)
 
 struct ncclSocketHandle {
   union socketAddress connectAddr;
@@ -98,9 +128,14 @@ struct ncclSocketTask {
   void* data;
   int size;
   int fd;
+  int sock;
   int offset;
   int used;
   ncclResult_t result;
+  // Zero-copy sends : the data may only be reused once the kernel notified
+  // completion of all the send calls up to zcLast
+  uint32_t zcLast;
+  int inflight; // io_uring operation submitted
 };
 
 struct ncclSocketRequest {
@@ -108,10 +143,11 @@ struct ncclSocketRequest {
   void* data;
   int size;
   int ctrlFd;
-  int used;
+  int used; // 1 : exchanging the size, 2 : transferring, 3 : done, waiting for the other messages
   struct ncclSocketComm* comm;
   struct ncclSocketTask* tasks[MAX_SOCKETS];
   int nSubs;
+  struct ncclSocketRequest* next; // Next message of a scatter-gather request
 };
 
 struct ncclSocketTaskQueue {
@@ -125,30 +161,119 @@ struct ncclSocketThreadResources {
   struct ncclSocketTaskQueue threadTaskQueue;
   enum threadState state;
   struct ncclSocketComm* comm;
+  int epollFd; // Edge-triggered readiness of the sockets this thread serves
+  // io_uring backend : this thread's ring and its copy of the registrations
+  struct ncclUring* ring;
+  volatile int ringGen;
+  struct iovec ringIovs[MAX_SOCKET_MRS];
+  int nRingIovs;
+  volatile int exited; // Thread stopped serving its queue (stop or error)
   pthread_mutex_t threadLock;
   pthread_cond_t  threadCond;
+  pthread_cond_t  syncCond; // Signaled when ringGen or exited change
 };
 
 struct ncclSocketListenComm {
   int fd;
+  int dev;
   int nSocks;
   int nThreads;
 };
 
 struct ncclSocketComm {
+  int dev;
   int ctrlFd;
   int fds[MAX_SOCKETS];
   int nSocks;
   int nThreads;
   int nextFd;
+  int zcopy;
+  // Per socket count of zero-copy send calls issued / notified complete
+  uint32_t zcSent[MAX_SOCKETS];
+  volatile uint32_t zcDone[MAX_SOCKETS];
+  // Buffers registered through regMr, used as io_uring fixed buffers
+  pthread_mutex_t mrLock;
+  struct iovec mrs[MAX_SOCKET_MRS];
+  int mrRefs[MAX_SOCKET_MRS];
+  int nMrs;
+  volatile int mrGen;
   struct ncclSocketRequest requests[MAX_REQUESTS];
   pthread_t helperThread[MAX_THREADS];
   struct ncclSocketThreadResources threadResources[MAX_THREADS];
 };
 
+static ncclResult_t socketProgressZcopy(struct ncclSocketComm* comm, struct ncclSocketTask* r) {
+  char* data = (char*)r->data;
+  while (r->offset < r->size) {
+    int flags = MSG_DONTWAIT;
+    if (r->size-r->offset >= ZCOPY_MIN_SEND) flags |= MSG_ZEROCOPY;
+    int bytes = send(r->fd, data+r->offset, r->size-r->offset, flags);
+    if (bytes == -1) {
+      if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+        // Out of locked memory for pinning pages, copy this one
+        bytes = send(r->fd, data+r->offset, r->size-r->offset, MSG_DONTWAIT);
+        flags = MSG_DONTWAIT;
+      }
+      if (bytes == -1) {
+        if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) return ncclSuccess;
+        WARN("Call to send failed : %s", strerror(errno));
+        return ncclSystemError;
+      }
+    }
+    if (flags & MSG_ZEROCOPY) r->zcLast = ++comm->zcSent[r->sock];
+    r->offset += bytes;
+  }
+  return ncclSuccess;
+}
+
+// Read zero-copy completion notifications from the socket error queue
+static ncclResult_t socketReapZcopy(struct ncclSocketComm* comm, int sock) {
+  while (1) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(comm->fds[sock], &msg, MSG_ERRQUEUE|MSG_DONTWAIT) == -1) {
+      if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN) return ncclSuccess;
+      WARN("NET/Socket : reading zero-copy notifications failed : %s", strerror(errno));
+      return ncclSystemError;
+    }
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      struct sock_extended_err* err = (struct sock_extended_err*)CMSG_DATA(cm);
+      if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+      // Notifications cover the range of send calls [ee_info, ee_data]
+      if (err->ee_data+1 > comm->zcDone[sock]) comm->zcDone[sock] = err->ee_data+1;
+    }
+  }
+}
+
+static int socketTaskPending(struct ncclSocketComm* comm, struct ncclSocketTask* r) {
+  return r->offset < r->size || (r->zcLast && (int32_t)(comm->zcDone[r->sock] - r->zcLast) < 0);
+}
+
+// Run helper threads on the CPUs close to their interface. They are created
+// by the proxy thread, which may be pinned to another NIC : take them among
+// the CPUs of the main thread, which has the application's affinity outside
+// of the init.
+static void socketSetAffinity(int dev) {
+  char* pciPath;
+  if (ncclSocketPciPath(dev, &pciPath) != ncclSuccess) return;
+  cpu_set_t nicMask, mask;
+  ncclResult_t res = ncclPciCpuset(pciPath, &nicMask);
+  free(pciPath);
+  if (res != ncclSuccess) return;
+  if (sched_getaffinity(getpid(), sizeof(cpu_set_t), &mask) != 0) return;
+  CPU_AND(&mask, &mask, &nicMask);
+  if (CPU_COUNT(&mask) == 0) return;
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &mask) == 0)
+    TRACE(NCCL_NET, "NET/Socket : helper thread of %s pinned to %d CPUs", ncclNetIfNames+dev*MAX_IF_NAME_SIZE, CPU_COUNT(&mask));
+}
+
 void* persistentSocketThread(void *args_) {
   struct ncclSocketThreadResources* resource = (struct ncclSocketThreadResources*)args_;
   struct ncclSocketComm* comm = resource->comm;
+  socketSetAffinity(comm->dev);
   volatile enum threadState* state = &resource->state;
   struct ncclSocketTaskQueue* myQueue = &resource->threadTaskQueue;
   int nSocksPerThread = comm->nSocks / comm->nThreads;
@@ -161,14 +286,28 @@ void* persistentSocketThread(void *args_) {
         repeat = 0;
         for (int j=0; j<nSocksPerThread; j++) {
           struct ncclSocketTask* r = myQueue->tasks+i+j;
-          if (r != NULL && r->used == 1 && r->offset < r->size) {
-            r->result = socketProgress(r->op, r->fd, r->data, r->size, &r->offset);
+          if (r != NULL && r->used == 1 && socketTaskPending(comm, r)) {
+            if (r->op == NCCL_SOCKET_SEND && comm->zcopy) {
+              r->result = socketProgressZcopy(comm, r);
+              if (r->result == ncclSuccess && r->zcLast) r->result = socketReapZcopy(comm, r->sock);
+            } else {
+              r->result = socketProgress(r->op, r->fd, r->data, r->size, &r->offset);
+            }
             if (r->result != ncclSuccess) {
               WARN("NET/Socket : socket progress error");
               return NULL;
             }
             idle = 0;
-            if (r->offset < r->size) repeat = 1;
+            if (socketTaskPending(comm, r)) repeat = 1;
+          }
+        }
+        if (repeat) {
+          // All pending sockets returned EAGAIN : sleep until one of them is
+          // ready (or has zero-copy notifications, signaled as EPOLLERR).
+          struct epoll_event events[MAX_SOCKETS];
+          if (epoll_wait(resource->epollFd, events, MAX_SOCKETS, 10) == -1 && errno != EINTR) {
+            WARN("NET/Socket : epoll_wait failed : %s", strerror(errno));
+            return NULL;
           }
         }
       } while (repeat);
@@ -184,6 +323,131 @@ void* persistentSocketThread(void *args_) {
   }
 }
 
+// Refresh the registered buffers of the ring with the comm's registrations.
+// Only called when the thread has no operation in flight.
+static ncclResult_t socketUringSyncBuffers(struct ncclSocketThreadResources* resource) {
+  struct ncclSocketComm* comm = resource->comm;
+  if (resource->ringGen == comm->mrGen) return ncclSuccess;
+  if (resource->nRingIovs) NCCLCHECK(ncclUringUnregisterBuffers(resource->ring));
+  pthread_mutex_lock(&comm->mrLock);
+  resource->nRingIovs = comm->nMrs;
+  memcpy(resource->ringIovs, comm->mrs, comm->nMrs*sizeof(struct iovec));
+  resource->ringGen = comm->mrGen;
+  pthread_mutex_unlock(&comm->mrLock);
+  if (resource->nRingIovs && ncclUringRegisterBuffers(resource->ring, resource->ringIovs, resource->nRingIovs) != ncclSuccess) {
+    // Typically RLIMIT_MEMLOCK ; keep going with unregistered buffers
+    INFO(NCCL_NET, "NET/Socket : could not register %d buffers with io_uring", resource->nRingIovs);
+    resource->nRingIovs = 0;
+  }
+  return ncclSuccess;
+}
+
+static int socketUringBufIndex(struct ncclSocketThreadResources* resource, char* data, int size) {
+  for (int b=0; b<resource->nRingIovs; b++) {
+    char* base = (char*)resource->ringIovs[b].iov_base;
+    if (base <= data && data+size <= base+resource->ringIovs[b].iov_len) return b;
+  }
+  return -1;
+}
+
+// Submit all the tasks of a group in one io_uring_enter and wait for at least
+// one of them to make progress
+static ncclResult_t socketUringProgress(struct ncclSocketThreadResources* resource, struct ncclSocketTask** tasks, int nTasks) {
+  int inflight = 0;
+  for (int t=0; t<nTasks; t++) {
+    struct ncclSocketTask* r = tasks[t];
+    if (r->inflight == 0 && r->offset < r->size) {
+      char* data = (char*)r->data+r->offset;
+      int len = r->size-r->offset;
+      NCCLCHECK(ncclUringPrepSocket(resource->ring, r->op == NCCL_SOCKET_SEND, r->fd, data, len, socketUringBufIndex(resource, data, len), (uint64_t)r));
+      r->inflight = 1;
+    }
+    inflight += r->inflight;
+  }
+  if (inflight == 0) return ncclSuccess;
+  if (ncclUringSubmit(resource->ring, 1) != ncclSuccess) {
+    // Nothing will complete the tasks we just prepared : fail them
+    for (int t=0; t<nTasks; t++) {
+      if (tasks[t]->inflight == 0) continue;
+      tasks[t]->inflight = 0;
+      tasks[t]->result = ncclSystemError;
+    }
+    return ncclSystemError;
+  }
+  while (1) {
+    int found, bytes;
+    uint64_t userData;
+    NCCLCHECK(ncclUringReap(resource->ring, &found, &userData, &bytes));
+    if (found == 0) return ncclSuccess;
+    struct ncclSocketTask* r = (struct ncclSocketTask*)userData;
+    r->inflight = 0;
+    if (r->op == NCCL_SOCKET_RECV && bytes == 0) {
+      WARN("Net : Connection closed by remote peer");
+      return r->result = ncclSystemError;
+    }
+    if (bytes < 0 && bytes != -EAGAIN && bytes != -EINTR) {
+      WARN("NET/Socket : io_uring %s failed : %s", r->op == NCCL_SOCKET_SEND ? "send" : "recv", strerror(-bytes));
+      return r->result = ncclSystemError;
+    }
+    if (bytes > 0) r->offset += bytes;
+  }
+}
+
+void* persistentSocketThreadUring(void *args_) {
+  struct ncclSocketThreadResources* resource = (struct ncclSocketThreadResources*)args_;
+  struct ncclSocketComm* comm = resource->comm;
+  socketSetAffinity(comm->dev);
+  volatile enum threadState* state = &resource->state;
+  struct ncclSocketTaskQueue* myQueue = &resource->threadTaskQueue;
+  int nSocksPerThread = comm->nSocks / comm->nThreads;
+  while (1) {
+    int idle = 1;
+    int mark = myQueue->next; // mark newest task seen
+    int ringGen = resource->ringGen;
+    if (socketUringSyncBuffers(resource) != ncclSuccess) goto done;
+    if (resource->ringGen != ringGen) {
+      // Let ncclSocketDeregMr know the old registrations are gone
+      pthread_mutex_lock(&resource->threadLock);
+      pthread_cond_broadcast(&resource->syncCond);
+      pthread_mutex_unlock(&resource->threadLock);
+    }
+    for (int i=0; i<MAX_QUEUE_LEN; i+=nSocksPerThread) {
+      // Tasks of a group are on different sockets and can all be in flight
+      struct ncclSocketTask* group[MAX_SOCKETS];
+      int nTasks = 0;
+      for (int j=0; j<nSocksPerThread; j++) {
+        struct ncclSocketTask* r = myQueue->tasks+i+j;
+        if (r->used == 1 && r->offset < r->size) group[nTasks++] = r;
+      }
+      while (nTasks) {
+        idle = 0;
+        if (socketUringProgress(resource, group, nTasks) != ncclSuccess) {
+          WARN("NET/Socket : socket progress error");
+          goto done;
+        }
+        int n = 0;
+        for (int t=0; t<nTasks; t++) if (group[t]->inflight || group[t]->offset < group[t]->size) group[n++] = group[t];
+        nTasks = n;
+      }
+    }
+    if (idle) {
+      pthread_mutex_lock(&resource->threadLock);
+      // no new tasks and no registration change, wait
+      while (mark == myQueue->next && *state != stop && resource->ringGen == comm->mrGen) {
+        pthread_cond_wait(&resource->threadCond, &resource->threadLock);
+      }
+      pthread_mutex_unlock(&resource->threadLock);
+    }
+    if (*state == stop) goto done;
+  }
+done:
+  pthread_mutex_lock(&resource->threadLock);
+  resource->exited = 1;
+  pthread_cond_broadcast(&resource->syncCond);
+  pthread_mutex_unlock(&resource->threadLock);
+  return NULL;
+}
+
 ncclResult_t ncclSocketGetNsockNthread(int dev, int* ns, int* nt) {
   int nSocksPerThread = ncclParamSocketNsocksPerThread();
   int nThreads = ncclParamSocketNthreads();
@@ -243,6 +507,7 @@ ncclResult_t ncclSocketNewComm(struct ncclSocketComm** comm) {
     (*comm)->fds[i] = -1;
   }
   (*comm)->nextFd = 0;
+  pthread_mutex_init(&(*comm)->mrLock, NULL);
   return ncclSuccess;
 }
 
@@ -254,6 +519,7 @@ ncclResult_t ncclSocketListen(int dev, void* opaqueHandle, void** listenComm) {
   static_assert(sizeof(struct ncclSocketHandle) < NCCL_NET_HANDLE_MAXSIZE, "ncclSocketHandle size too large");
   struct ncclSocketListenComm* comm;
   NCCLCHECK(ncclSocketNewListenComm(&comm));
+  comm->dev = dev;
   NCCLCHECK(GetSocketAddr(dev, &handle->connectAddr));
   NCCLCHECK(createListenSocket(&comm->fd, &handle->connectAddr));
   NCCLCHECK(ncclSocketGetNsockNthread(dev, &comm->nSocks, &comm->nThreads));
@@ -263,6 +529,15 @@ ncclResult_t ncclSocketListen(int dev, void* opaqueHandle, void** listenComm) {
   return ncclSuccess;
 }
 
+static ncclResult_t ncclSocketSetOpts(int fd) {
+  int bufSize = ncclParamSocketBuffSize();
+  if (bufSize > 0) {
+    SYSCHECK(setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufSize, sizeof(int)), "setsockopt");
+    SYSCHECK(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufSize, sizeof(int)), "setsockopt");
+  }
+  return ncclSuccess;
+}
+
 ncclResult_t ncclSocketConnect(int dev, void* opaqueHandle, void** sendComm) {
   if (dev < 0) { // data transfer socket is based on specified dev
     return ncclInternalError;
@@ -270,6 +545,7 @@ ncclResult_t ncclSocketConnect(int dev, void* opaqueHandle, void** sendComm) {
   struct ncclSocketComm* comm;
   NCCLCHECK(ncclSocketNewComm(&comm));
   struct ncclSocketHandle* handle = (struct ncclSocketHandle*) opaqueHandle;
+  comm->dev = dev;
   comm->nSocks = handle->nSocks;
   comm->nThreads = handle->nThreads;
   for (int i=0; i<comm->nSocks+1; i++) {
@@ -277,7 +553,18 @@ ncclResult_t ncclSocketConnect(int dev, void* opaqueHandle, void** sendComm) {
     NCCLCHECK(connectAddress(&tmpFd, &handle->connectAddr));
     NCCLCHECK(socketWait(NCCL_SOCKET_SEND, tmpFd, &i, sizeof(int), &offset));
     if (i == comm->nSocks) comm->ctrlFd = tmpFd;
-    else comm->fds[i] = tmpFd;
+    else {
+      comm->fds[i] = tmpFd;
+      NCCLCHECK(ncclSocketSetOpts(tmpFd));
+    }
+  }
+  comm->zcopy = ncclParamSocketZcopy() ? 1 : 0;
+  for (int i=0; i<comm->nSocks && comm->zcopy; i++) {
+    int one = 1;
+    if (setsockopt(comm->fds[i], SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(int)) != 0) {
+      INFO(NCCL_INIT|NCCL_NET, "NET/Socket : MSG_ZEROCOPY not supported (%s), disabling zero-copy sends", strerror(errno));
+      comm->zcopy = 0;
+    }
   }
   *sendComm = comm;
   return ncclSuccess;
@@ -287,6 +574,7 @@ ncclResult_t ncclSocketAccept(void* listenComm, void** recvComm) {
   struct ncclSocketListenComm* lComm = (struct ncclSocketListenComm*)listenComm;
   struct ncclSocketComm* rComm;
   NCCLCHECK(ncclSocketNewComm(&rComm));
+  rComm->dev = lComm->dev;
   rComm->nSocks = lComm->nSocks;
   rComm->nThreads = lComm->nThreads;
   for (int i=0; i<rComm->nSocks+1; i++) {
@@ -296,7 +584,10 @@ ncclResult_t ncclSocketAccept(void* listenComm, void** recvComm) {
     SYSCHECKVAL(accept(lComm->fd, (struct sockaddr*)&sockaddr, &socklen), "accept", tmpFd);
     NCCLCHECK(socketWait(NCCL_SOCKET_RECV, tmpFd, &sendSockIdx, sizeof(int), &offset));
     if (sendSockIdx == rComm->nSocks) rComm->ctrlFd = tmpFd;
-    else rComm->fds[sendSockIdx] = tmpFd;
+    else {
+      rComm->fds[sendSockIdx] = tmpFd;
+      NCCLCHECK(ncclSocketSetOpts(tmpFd));
+    }
   }
   *recvComm = rComm;
   return ncclSuccess;
@@ -313,6 +604,7 @@ ncclResult_t ncclSocketGetRequest(struct ncclSocketComm* comm, int op, void* dat
       r->used = 1;
       r->comm = comm;
       r->nSubs = 0;
+      r->next = NULL;
       *req = r;
       return ncclSuccess;
     }
@@ -330,9 +622,24 @@ ncclResult_t ncclSocketGetTask(struct ncclSocketComm* comm, int op, void* data,
     NCCLCHECK(ncclCalloc(&queue->tasks, MAX_QUEUE_LEN));
     queue->next = 0;
     res->comm = comm;
+    if (ncclSocketUring) {
+      struct ncclUring* ring;
+      NCCLCHECK(ncclUringInit(&ring, MAX_SOCKETS));
+      res->ring = ring;
+      res->ringGen = -1; // Pick up the registrations on start
+    } else {
+      SYSCHECKVAL(epoll_create1(0), "epoll_create1", res->epollFd);
+      for (int s=tid; s<comm->nSocks; s+=comm->nThreads) {
+        struct epoll_event ev;
+        ev.events = EPOLLET | (op == NCCL_SOCKET_SEND ? EPOLLOUT : EPOLLIN);
+        ev.data.u32 = s;
+        SYSCHECK(epoll_ctl(res->epollFd, EPOLL_CTL_ADD, comm->fds[s], &ev), "epoll_ctl");
+      }
+    }
     pthread_mutex_init(&res->threadLock, NULL);
     pthread_cond_init(&res->threadCond, NULL);
-    pthread_create(comm->helperThread+tid, NULL, persistentSocketThread, res);
+    pthread_cond_init(&res->syncCond, NULL);
+    pthread_create(comm->helperThread+tid, NULL, ncclSocketUring ? persistentSocketThreadUring : persistentSocketThread, res);
   }
   struct ncclSocketTask* r = queue->tasks+queue->next;
   if (r->used == 0) {
@@ -340,8 +647,11 @@ ncclResult_t ncclSocketGetTask(struct ncclSocketComm* comm, int op, void* data,
     r->data = data;
     r->size = size;
     r->fd = comm->fds[comm->nextFd];
+    r->sock = comm->nextFd;
     r->offset = 0;
     r->result = ncclSuccess;
+    r->zcLast = 0;
+    r->inflight = 0;
     comm->nextFd = (comm->nextFd + 1) % comm->nSocks;
     r->used = 1;
     *req = r;
@@ -356,13 +666,8 @@ ncclResult_t ncclSocketGetTask(struct ncclSocketComm* comm, int op, void* data,
   return ncclInternalError;
 }
 
-ncclResult_t ncclSocketTest(void* request, int* done, int* size) {
-  *done = 0;
-  struct ncclSocketRequest *r = (struct ncclSocketRequest*)request;
-  if (r == NULL) {
-    WARN("NET/Socket : test called with NULL request");
-    return ncclInternalError;
-  }
+// Progress one message of a request
+static ncclResult_t socketProgressMessage(struct ncclSocketRequest* r) {
   if (r->used == 1) { /* try to send/recv size */
     int data = r->size;
     int offset = 0;
@@ -395,12 +700,10 @@ ncclResult_t ncclSocketTest(void* request, int* done, int* size) {
     for (int i=0; i<r->nSubs; i++) {
       struct ncclSocketTask* sub = r->tasks[i];
       if (sub->result != ncclSuccess) return sub->result;
-      if (sub->offset == sub->size) nCompleted++;
+      if (!socketTaskPending(r->comm, sub)) nCompleted++;
     }
     if (nCompleted == r->nSubs) {
-      if (size) *size = r->size;
-      *done = 1;
-      r->used = 0;
+      r->used = 3;
       for (int i=0; i<r->nSubs; i++) {
         struct ncclSocketTask* sub = r->tasks[i];
         sub->used = 0;
@@ -410,10 +713,100 @@ ncclResult_t ncclSocketTest(void* request, int* done, int* size) {
   return ncclSuccess;
 }
 
-ncclResult_t ncclSocketRegMr(void* comm, void* data, int size, int type, void** mhandle) {
-  return (type != NCCL_PTR_HOST) ? ncclInternalError : ncclSuccess;
+// Messages exchange their size in order on the control socket : none can
+// progress past one still waiting for it, reported in blocked.
+static ncclResult_t socketTestRequest(struct ncclSocketRequest* r, int* done, int* size, int* blocked) {
+  *done = 0;
+  *blocked = 0;
+  if (r == NULL) {
+    WARN("NET/Socket : test called with NULL request");
+    return ncclInternalError;
+  }
+  int complete = 1, total = 0;
+  for (struct ncclSocketRequest* m = r; m; m = m->next) {
+    NCCLCHECK(socketProgressMessage(m));
+    if (m->used == 1) { *blocked = 1; return ncclSuccess; }
+    if (m->used != 3) complete = 0;
+    total += m->size;
+  }
+  if (complete == 0) return ncclSuccess;
+  for (struct ncclSocketRequest* m = r; m; m = m->next) m->used = 0;
+  if (size) *size = total;
+  *done = 1;
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSocketTest(void* request, int* done, int* size) {
+  int blocked;
+  NCCLCHECK(socketTestRequest((struct ncclSocketRequest*)request, done, size, &blocked));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSocketTestAny(int n, void** requests, int* index, int* size) {
+  *index = -1;
+  for (int i=0; i<n; i++) {
+    if (requests[i] == NULL) continue;
+    int done, blocked;
+    NCCLCHECK(socketTestRequest((struct ncclSocketRequest*)requests[i], &done, size, &blocked));
+    if (done) { *index = i; return ncclSuccess; }
+    if (blocked) return ncclSuccess;
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSocketRegMr(void* opaqueComm, void* data, int size, int type, void** mhandle) {
+  if (type != NCCL_PTR_HOST) return ncclInternalError;
+  *mhandle = NULL;
+  if (ncclSocketUring == 0) return ncclSuccess;
+  // Helper threads register these with their ring the next time they are idle
+  struct ncclSocketComm* comm = (struct ncclSocketComm*)opaqueComm;
+  pthread_mutex_lock(&comm->mrLock);
+  for (int m=0; m<comm->nMrs; m++) {
+    if (comm->mrs[m].iov_base == data && comm->mrs[m].iov_len == (size_t)size) {
+      comm->mrRefs[m]++;
+      *mhandle = data;
+      break;
+    }
+  }
+  if (*mhandle == NULL && comm->nMrs < MAX_SOCKET_MRS) {
+    comm->mrs[comm->nMrs].iov_base = data;
+    comm->mrs[comm->nMrs].iov_len = size;
+    comm->mrRefs[comm->nMrs++] = 1;
+    comm->mrGen++;
+    *mhandle = data;
+  }
+  pthread_mutex_unlock(&comm->mrLock);
+  return ncclSuccess;
+}
+ncclResult_t ncclSocketDeregMr(void* opaqueComm, void* mhandle) {
+  if (mhandle == NULL) return ncclSuccess;
+  struct ncclSocketComm* comm = (struct ncclSocketComm*)opaqueComm;
+  int gen = -1;
+  pthread_mutex_lock(&comm->mrLock);
+  for (int m=0; m<comm->nMrs; m++) {
+    if (comm->mrs[m].iov_base != mhandle || --comm->mrRefs[m] > 0) continue;
+    comm->nMrs--;
+    comm->mrs[m] = comm->mrs[comm->nMrs];
+    comm->mrRefs[m] = comm->mrRefs[comm->nMrs];
+    gen = ++comm->mrGen;
+    break;
+  }
+  pthread_mutex_unlock(&comm->mrLock);
+  if (gen == -1) return ncclSuccess;
+  // The caller may free the buffer as soon as we return : wait for the helper
+  // threads to drop it from their ring's fixed buffers.
+  for (int i=0; i<comm->nThreads; i++) {
+    struct ncclSocketThreadResources* res = comm->threadResources+i;
+    if (comm->helperThread[i] == 0) continue;
+    pthread_mutex_lock(&res->threadLock);
+    pthread_cond_signal(&res->threadCond);
+    while (res->ringGen < gen && res->exited == 0) {
+      pthread_cond_wait(&res->syncCond, &res->threadLock);
+    }
+    pthread_mutex_unlock(&res->threadLock);
+  }
+  return ncclSuccess;
 }
-ncclResult_t ncclSocketDeregMr(void* comm, void* mhandle) { return ncclSuccess; }
 
 ncclResult_t ncclSocketIsend(void* sendComm, void* data, int size, void* mhandle, void** request) {
   struct ncclSocketComm* comm = (struct ncclSocketComm*)sendComm;
@@ -427,7 +820,31 @@ ncclResult_t ncclSocketIrecv(void* recvComm, void* data, int size, void* mhandle
   return ncclSuccess;
 }
 
-ncclResult_t ncclSocketFlush(void* recvComm, void* data, int size, void* mhandle) {
+// Each buffer is a message of its own, chained to the first one
+static ncclResult_t socketGetRequests(struct ncclSocketComm* comm, int op, ncclNetIov_t* iovs, int niov, void** request) {
+  if (niov > NCCL_NET_MAX_IOVS) {
+    WARN("NET/Socket : too many buffers (%d) in a single request", niov);
+    return ncclInternalError;
+  }
+  struct ncclSocketRequest** next = (struct ncclSocketRequest**)request;
+  for (int i=0; i<niov; i++) {
+    NCCLCHECK(ncclSocketGetRequest(comm, op, iovs[i].data, iovs[i].size, next));
+    next = &(*next)->next;
+  }
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSocketIsendv(void* sendComm, ncclNetIov_t* iovs, int niov, void** request) {
+  NCCLCHECK(socketGetRequests((struct ncclSocketComm*)sendComm, NCCL_SOCKET_SEND, iovs, niov, request));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSocketIrecvv(void* recvComm, ncclNetIov_t* iovs, int niov, void** request) {
+  NCCLCHECK(socketGetRequests((struct ncclSocketComm*)recvComm, NCCL_SOCKET_RECV, iovs, niov, request));
+  return ncclSuccess;
+}
+
+ncclResult_t ncclSocketIflush(void* recvComm, void* data, int size, void* mhandle, void** request) {
   // We don't support CUDA pointers, so we don't need a flush operation
   return ncclInternalError;
 }
@@ -453,17 +870,42 @@ ncclResult_t ncclSocketClose(void* opaqueComm) {
         pthread_mutex_unlock(&res->threadLock);
         pthread_join(comm->helperThread[i], NULL);
       }
+      if (res->threadTaskQueue.tasks) {
+        struct ncclUring* ring = res->ring;
+        if (ring) {
+          NCCLCHECK(ncclUringDestroy(ring));
+        } else {
+          close(res->epollFd);
+        }
+      }
       free(res->threadTaskQueue.tasks);
     }
     if (comm->ctrlFd != -1) close(comm->ctrlFd);
     for (int i=0; i<comm->nSocks; i++) {
       if (comm->fds[i] != -1) close(comm->fds[i]);
     }
+    pthread_mutex_destroy(&comm->mrLock);
     free(comm);
   }
   return ncclSuccess;
 }
 
+ncclResult_t ncclSocketGetProperties(int dev, ncclNetProperties_t* props) {
+  props->speed = 0;
+  props->latency = 0;
+  props->maxRequests = MAX_REQUESTS;
+  char speedPath[PATH_MAX];
+  snprintf(speedPath, PATH_MAX, "/sys/class/net/%s/speed", ncclNetIfNames+dev*MAX_IF_NAME_SIZE);
+  FILE* file = fopen(speedPath, "r");
+  if (file) {
+    // Reading fails (or gives -1) for virtual interfaces
+    int speed;
+    if (fscanf(file, "%d", &speed) == 1 && speed > 0) props->speed = speed;
+    fclose(file);
+  }
+  return ncclSuccess;
+}
+
 ncclNet_t ncclNetSocket = {
   "Socket",
   ncclSocketInit,
@@ -477,9 +919,13 @@ ncclNet_t ncclNetSocket = {
   ncclSocketDeregMr,
   ncclSocketIsend,
   ncclSocketIrecv,
-  ncclSocketFlush,
+  ncclSocketIflush,
   ncclSocketTest,
   ncclSocketClose,
   ncclSocketClose,
-  ncclSocketCloseListen
+  ncclSocketCloseListen,
+  ncclSocketGetProperties,
+  ncclSocketIsendv,
+  ncclSocketIrecvv,
+  ncclSocketTestAny
 };
@@ -20,6 +20,9 @@ struct p2pConnectInfo {
     void* directPtr;
     cudaIpcMemHandle_t devIpc;
   };
+  // IPC : devIpc is the handle of the memory pool block holding the buffers
+  size_t offset;
+  size_t blockSize;
 };
 
 struct p2pSendResources {
@@ -125,64 +128,128 @@ ncclResult_t p2pCanConnect(ncclTvalue_t* ret, struct ncclPeerInfo* myInfo, struc
   return ncclSuccess;
 }
 
-#define MAXGPUS_NVLINKP2P 8 // 16 would take an almost infinite time anyway
 #define MAXGPUS_PCI 64
 
-static int computeRingsRec(ncclTvalue_t* matrix, int n, int *rings, int currentRing, int nRingsMax, int* inTheRing, int current, int remaining, int connect) {
-  int nrings = 0;
-  ncclTvalue_t* line = matrix+current*n;
-  inTheRing[current] = 1;
-  int currentStep = (currentRing+1)*n-remaining;
-  rings[currentStep-1] = current;
-  if (remaining == 0) {
-    int looprank = rings[currentRing*n];
-    if (line[looprank] > 0) {
-      if (currentRing+1 == nRingsMax) {
-        nrings = 1;
-      } else {
-        line[looprank]--;
-        for (int i=0; i<n; i++) inTheRing[i] = 0;
-        if (connect) {
-          // First two slots are already set and we need to respect those constraints
-          inTheRing[rings[currentStep]] = 1;
-          nrings = 1 + computeRingsRec(matrix, n, rings, currentRing+1, nRingsMax, inTheRing, rings[currentStep+1], n-2, connect);
-        } else {
-          rings[(currentRing+1)*n] = 0;
-          nrings = 1 + computeRingsRec(matrix, n, rings, currentRing+1, nRingsMax, inTheRing, 0, n-1, connect);
-        }
-        line[looprank]++;
-        for (int i=0; i<n; i++) inTheRing[i] = 1;
-      }
-    }
-  } else {
-    int ringsSave[MAXCHANNELS*MAXGPUS_NVLINKP2P];
-    int maxStep = 0;
+// NVLink ring search. Each NVLink between two GPUs can carry one ring in
+// each direction (two when oversubscribing), so the aggregate bandwidth is
+// the number of rings we can route through the remaining link capacity.
+// Rings are searched one at a time with a depth-first search that tries
+// first the links with the most capacity left (to keep scarce links for the
+// next rings), then the GPUs with the fewest ways out (which finds complete
+// rings quickly). The search is bounded by a number of steps rather than
+// exhaustive, and restarted with different tie-breaks to improve the
+// result. Everything is deterministic so that all ranks get the same rings.
+#define RING_SEARCH_STEPS 10000
+#define RING_SEARCH_ATTEMPTS 8
+
+struct ringSearch {
+  ncclTvalue_t* cap;
+  int n;
+  int* ring;
+  int* inRing;
+  int order[MAXGPUS_PCI];
+  int steps;
+};
+
+static int ringSearchRec(struct ringSearch* s, int pos) {
+  int n = s->n;
+  int cur = s->ring[pos-1];
+  if (pos == n) return s->cap[cur*n+s->ring[0]] > 0;
+  if (++s->steps > RING_SEARCH_STEPS) return 0;
+
+  int cand[MAXGPUS_PCI];
+  int64_t key[MAXGPUS_PCI];
+  int nCand = 0;
+  for (int i=0; i<n; i++) {
+    if (s->inRing[i] || s->cap[cur*n+i] <= 0) continue;
+    int onward = 0;
+    for (int j=0; j<n; j++) if (s->inRing[j] == 0 && j != i && s->cap[i*n+j] > 0) onward++;
+    // Last GPU of the ring : it must be able to close the ring
+    if (pos == n-1) onward = s->cap[i*n+s->ring[0]] > 0 ? 1 : 0;
+    if (onward == 0) continue;
+    int64_t k = (s->cap[cur*n+i]*MAXGPUS_PCI + MAXGPUS_PCI-onward)*MAXGPUS_PCI + s->order[i];
+    int c = nCand++;
+    while (c > 0 && key[c-1] < k) { cand[c] = cand[c-1]; key[c] = key[c-1]; c--; }
+    cand[c] = i;
+    key[c] = k;
+  }
+  for (int c=0; c<nCand; c++) {
+    s->inRing[cand[c]] = 1;
+    s->ring[pos] = cand[c];
+    if (ringSearchRec(s, pos+1)) return 1;
+    s->inRing[cand[c]] = 0;
+  }
+  return 0;
+}
+
+// Find up to nringsMax rings using each link of matrix at most as many times
+// as its value. With connect, the first two ranks of each ring are already
+// set (they are connected through other nodes) and that link is not used.
+int p2pComputeRingsNvLink(ncclTvalue_t* matrix, int nranks, int *rings, int nringsMax, int connect) {
+  if (nranks > MAXGPUS_PCI) {
+    WARN("NVLink ring search cannot handle more than %d GPUs", MAXGPUS_PCI);
+    return 0;
+  }
+  if (nringsMax > MAXCHANNELS) nringsMax = MAXCHANNELS;
+  int n = nranks;
+  struct ringSearch s;
+  s.n = n;
+  int* attemptRings = (int*)malloc(sizeof(int)*MAXCHANNELS*n);
+  ncclTvalue_t* cap = (ncclTvalue_t*)malloc(sizeof(ncclTvalue_t)*n*n);
+  if (attemptRings == NULL || cap == NULL) {
+    WARN("malloc of %ld bytes failed", (sizeof(int)*MAXCHANNELS+sizeof(ncclTvalue_t)*n)*n);
+    free(attemptRings);
+    free(cap);
+    return 0;
+  }
+  s.cap = cap;
+  int inRing[MAXGPUS_PCI];
+  s.inRing = inRing;
+
+  // No more rings than the capacity out of (and into) the least connected GPU
+  ncclTvalue_t bound = nringsMax;
+  for (int i=0; i<n && connect == 0; i++) {
+    ncclTvalue_t out = 0, in = 0;
+    for (int j=0; j<n; j++) { out += matrix[i*n+j]; in += matrix[j*n+i]; }
+    bound = std::min(bound, std::min(out, in));
+  }
+
+  int best = 0;
+  uint32_t seed = 1;
+  for (int attempt=0; attempt<RING_SEARCH_ATTEMPTS && best < bound; attempt++) {
     for (int i=0; i<n; i++) {
-      if (inTheRing[i] == 0 && line[i] > 0) {
-        line[i]--;
-        int nr = computeRingsRec(matrix, n, rings, currentRing, nRingsMax, inTheRing, i, remaining-1, connect);
-        if (nr > nrings) {
-          nrings = nr;
-          maxStep = (nr+currentRing)*n;
-          ringsSave[currentStep] = i;
-          // Save the rest of the rings
-          for (int r=currentStep+1; r<maxStep; r++) {
-            ringsSave[r] = rings[r];
-          }
-          if (nrings + currentRing == nRingsMax) {
-            // We found an optimal solution. Let's stop there.
-            break;
-          }
-        }
-        line[i]++;
+      seed = seed*1103515245+12345;
+      s.order[i] = attempt == 0 ? n-1-i : (seed>>16)%MAXGPUS_PCI;
+    }
+    memcpy(cap, matrix, sizeof(ncclTvalue_t)*n*n);
+    int nrings = 0;
+    for (; nrings<nringsMax; nrings++) {
+      s.ring = attemptRings+nrings*n;
+      for (int i=0; i<n; i++) inRing[i] = 0;
+      int pos;
+      if (connect) {
+        s.ring[0] = rings[nrings*n];
+        s.ring[1] = rings[nrings*n+1];
+        if (s.ring[0] == -1 || s.ring[1] == -1) break;
+        inRing[s.ring[0]] = inRing[s.ring[1]] = 1;
+        pos = 2;
+      } else {
+        s.ring[0] = 0;
+        inRing[0] = 1;
+        pos = 1;
       }
+      s.steps = 0;
+      if (ringSearchRec(&s, pos) == 0) break;
+      for (int i=connect ? 1 : 0; i<n; i++) cap[s.ring[i]*n+s.ring[(i+1)%n]]--;
     }
-    for (int r=currentStep; r<maxStep; r++) {
-      rings[r] = ringsSave[r];
+    if (nrings > best) {
+      best = nrings;
+      memcpy(rings, attemptRings, sizeof(int)*nrings*n);
     }
   }
-  inTheRing[current] = 0;
-  return nrings;
+  free(attemptRings);
+  free(cap);
+  return best;
 }
 
 static inline int copyRings(int nranks, int* rings, int nrings, int newNrings) {
@@ -197,22 +264,6 @@ static inline int copyRings(int nranks, int* rings, int nrings, int newNrings) {
   return newNrings;
 }
 
-int p2pComputeRingsNvLink(ncclTvalue_t* matrix, int nranks, int *rings, int nringsMax, int connect) {
-  int* inTheRing = (int*)malloc(sizeof(int)*nranks);
-  if (inTheRing == NULL) { WARN("malloc of %ld bytes failed", sizeof(int)*nranks); return 0; }
-  for (int i=0; i<nranks; i++) inTheRing[i] = 0;
-  int nrings;
-  if (connect) {
-    inTheRing[rings[0]] = 1;
-    nrings = computeRingsRec(matrix, nranks, rings, 0, nringsMax, inTheRing, rings[1], nranks-2, connect);
-  } else {
-    rings[0] = 0;
-    nrings = computeRingsRec(matrix, nranks, rings, 0, nringsMax, inTheRing, 0, nranks-1, connect);
-  }
-  free(inTheRing);
-  return nrings;
-}
-
 static inline int findConnect(int nranks, int* ranks) {
   for (int i = 0; i<nranks; i++) {
     if (ranks[i] != -1) return i;
@@ -425,10 +476,6 @@ ncclResult_t p2pGetRings(int nranks, int* groups, int* subgroups, ncclTvalue_t*
   }
   if (directLinks > 0) {
     // NVLink : Connect rings or create new ones
-    if (nranks > MAXGPUS_NVLINKP2P) {
-      WARN("Recursive P2P computation cannot work for >8 GPUs");
-      return ncclInternalError;
-    }
     nrings = p2pComputeRingsNvLink(values, nranks, rings, nrings, prev, next, 0, nthreads);
     goto end;
   }
@@ -469,7 +516,7 @@ ncclResult_t p2pSendSetup(struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peer
   NCCLCHECK(ncclCalloc(&resources, 1));
   send->transportResources = resources;
   const int sendSize = sizeof(struct ncclSendMem);
-  NCCLCHECK(ncclCudaCalloc((char**)&resources->devMem, sendSize));
+  NCCLCHECK(ncclPoolCudaCalloc(&send->comm->memPool, (char**)&resources->devMem, sendSize, MEM_ALIGN));
 
   struct p2pConnectInfo info;
   if (myInfo->pidHash == peerInfo->pidHash) {
@@ -495,10 +542,8 @@ ncclResult_t p2pSendSetup(struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peer
     int peerCudaDev = busIdToCudaDev(peerInfo->busId);
     info.direct = 0;
     // Map IPC and enable P2P access
-    cudaError_t err = cudaIpcGetMemHandle(&info.devIpc, (void*)resources->devMem);
-    if (err != cudaSuccess) {
-      WARN("rank %d failed to get CUDA IPC handle to device %d(=%d) : %d %s",
-           myInfo->rank, peerCudaDev, peerInfo->nvmlDev, err, cudaGetErrorString(err));
+    if (ncclMemPoolIpcGet(resources->devMem, &info.devIpc, &info.offset, &info.blockSize) != ncclSuccess) {
+      WARN("rank %d failed to get CUDA IPC handle to device %d(=%d)", myInfo->rank, peerCudaDev, peerInfo->nvmlDev);
       return ncclInternalError;
     }
     INFO(NCCL_INIT|NCCL_P2P,"Ring %02d : %d[%d] -> %d[%d] via P2P/IPC",
@@ -518,7 +563,7 @@ ncclResult_t p2pRecvSetup(struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peer
   NCCLCHECK(ncclCalloc(&resources, 1));
   recv->transportResources = resources;
   const int recvSize = offsetof(struct ncclRecvMem, buff)+buffSize;
-  NCCLCHECK(ncclCudaCalloc((char**)&resources->devMem, recvSize));
+  NCCLCHECK(ncclPoolCudaCalloc(&recv->comm->memPool, (char**)&resources->devMem, recvSize, MEM_ALIGN));
 
   struct p2pConnectInfo info;
   if (myInfo->pidHash == peerInfo->pidHash) {
@@ -543,10 +588,8 @@ ncclResult_t p2pRecvSetup(struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peer
     int peerCudaDev = busIdToCudaDev(peerInfo->busId);
     info.direct = 0;
     // Map IPC and enable P2P access
-    cudaError_t err = cudaIpcGetMemHandle(&info.devIpc, (void*)resources->devMem);
-    if (err != cudaSuccess) {
-      WARN("rank %d failed to get CUDA IPC handle to device %d(=%d) : %d %s",
-           myInfo->rank, peerCudaDev, peerInfo->nvmlDev, err, cudaGetErrorString(err));
+    if (ncclMemPoolIpcGet(resources->devMem, &info.devIpc, &info.offset, &info.blockSize) != ncclSuccess) {
+      WARN("rank %d failed to get CUDA IPC handle to device %d(=%d)", myInfo->rank, peerCudaDev, peerInfo->nvmlDev);
       return ncclInternalError;
     }
     TRACE(NCCL_INIT|NCCL_P2P,"Ring %02d : %d[%d] <- %d[%d] via P2P/IPC", channelId, myInfo->rank, myInfo->nvmlDev, peerInfo->rank, peerInfo->nvmlDev);
@@ -567,17 +610,13 @@ static ncclResult_t p2pSendConnect(struct ncclConnect* connectInfo, struct ncclC
     send->conn.direct = 1;
   } else {
     //TRACE_DUMP_IPC(&info->devIpc);
-    cudaError_t err = cudaIpcOpenMemHandle(&resources->ipcPtr, info->devIpc, cudaIpcMemLazyEnablePeerAccess);
+    NCCLCHECK(ncclMemPoolIpcOpen(&info->devIpc, info->offset, info->blockSize, &resources->ipcPtr));
     remDevMem = (struct ncclRecvMem*)resources->ipcPtr;
-    if (err != cudaSuccess) {
-      WARN("failed to open CUDA IPC handle : %d %s",
-          err, cudaGetErrorString(err));
-      return ncclUnhandledCudaError;
-    }
   }
 
   send->conn.buff = remDevMem->buff;
   send->conn.llBuff = remDevMem->llBuff;
+  send->conn.ll128Buff = remDevMem->ll128Buff;
   send->conn.tail = &remDevMem->tail;
   send->conn.opCountRem = &remDevMem->opCount;
   send->conn.head = &resources->devMem->head;
@@ -597,17 +636,13 @@ ncclResult_t p2pRecvConnect(struct ncclConnect* connectInfo, struct ncclConnecto
     recv->conn.ptrExchange = &remDevMem->ptrExchange;
   } else {
     //TRACE_DUMP_IPC(&info->devIpc);
-    cudaError_t err = cudaIpcOpenMemHandle(&resources->ipcPtr, info->devIpc, cudaIpcMemLazyEnablePeerAccess);
+    NCCLCHECK(ncclMemPoolIpcOpen(&info->devIpc, info->offset, info->blockSize, &resources->ipcPtr));
     remDevMem = (struct ncclSendMem*)resources->ipcPtr;
-    if (err != cudaSuccess) {
-      WARN("failed to open CUDA IPC handle : %d %s",
-          err, cudaGetErrorString(err));
-      return ncclUnhandledCudaError;
-    }
   }
 
   recv->conn.buff = resources->devMem->buff;
   recv->conn.llBuff = resources->devMem->llBuff;
+  recv->conn.ll128Buff = resources->devMem->ll128Buff;
   recv->conn.tail = &resources->devMem->tail;
   recv->conn.opCountLoc = &resources->devMem->opCount;
   recv->conn.head = &remDevMem->head;
@@ -617,18 +652,16 @@ ncclResult_t p2pRecvConnect(struct ncclConnect* connectInfo, struct ncclConnecto
 
 ncclResult_t p2pSendFree(void* resources) {
   struct p2pSendResources* sendRes = (struct p2pSendResources*)resources;
-  if (sendRes->ipcPtr)
-    CUDACHECK(cudaIpcCloseMemHandle(sendRes->ipcPtr));
-  CUDACHECK(cudaFree(sendRes->devMem));
+  NCCLCHECK(ncclMemPoolIpcClose(sendRes->ipcPtr));
+  NCCLCHECK(ncclMemPoolFree(sendRes->devMem));
   free(sendRes);
   return ncclSuccess;
 }
 
 ncclResult_t p2pRecvFree(void* resources) {
   struct p2pRecvResources* recvRes = (struct p2pRecvResources*)resources;
-  if (recvRes->ipcPtr)
-    CUDACHECK(cudaIpcCloseMemHandle(recvRes->ipcPtr));
-  CUDACHECK(cudaFree(recvRes->devMem));
+  NCCLCHECK(ncclMemPoolIpcClose(recvRes->ipcPtr));
+  NCCLCHECK(ncclMemPoolFree(recvRes->devMem));
   free(recvRes);
   return ncclSuccess;
 }
@@ -9,6 +9,7 @@
 #include "transport.h"
 #include "param.h"
 #include "shm.h"
+#include "topo.h"
 #include <unistd.h>
 #include <cuda_runtime.h>
 
@@ -18,8 +19,14 @@ struct shmConnectInfo {
   int sendRank;
   int recvRank;
   int shmSize;
+  // Arena mode : block of the owner's arena and offset within it
+  int arenaBlock;
+  size_t arenaBlockSize;
+  size_t arenaOffset;
 };
 
+struct shmArenaBlock;
+
 struct shmSendResources {
   int remShmSize;
   struct ncclRecvMem* remHostMem;
@@ -27,6 +34,9 @@ struct shmSendResources {
   int shmSize;
   struct ncclSendMem* hostMem;
   struct ncclSendMem* devHostMem;
+  // Arena mode : blocks holding hostMem and remHostMem
+  struct shmArenaBlock* block;
+  struct shmArenaBlock* remBlock;
 };
 
 struct shmRecvResources {
@@ -36,9 +46,13 @@ struct shmRecvResources {
   int shmSize;
   struct ncclRecvMem* hostMem;
   struct ncclRecvMem* devHostMem;
+  struct shmArenaBlock* block;
+  struct shmArenaBlock* remBlock;
 };
 
 NCCL_PARAM(ShmDisable, "SHM_DISABLE", 0);
+NCCL_PARAM(ShmArena, "SHM_ARENA", 0);
+NCCL_PARAM(ShmArenaBlockSize, "SHM_ARENA_BLOCK_SIZE", 256LL << 20);
 
 /* Determine if we can communicate with the peer */
 ncclResult_t shmCanConnect(ncclTvalue_t* ret, struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo) {
@@ -130,6 +144,156 @@ ncclResult_t shmGetRings(int nranks, int* groups, int* subgroups, ncclTvalue_t*
 
 #define MAX_SHM_NAME_LEN 1024
 
+// Segments are placed close to the GPU which creates them
+static int shmNumaId() {
+  int cudaDev, numaId;
+  if (cudaGetDevice(&cudaDev) != cudaSuccess) return -1;
+  if (ncclTopoGpuNumaId(cudaDev, &numaId) != ncclSuccess) return -1;
+  return ncclNumaAllocId(numaId);
+}
+
+/* Arena mode (NCCL_SHM_ARENA=1) : instead of one segment per connector, each
+ * process carves the memory of all its shm connectors from a few large
+ * segments (blocks of NCCL_SHM_ARENA_BLOCK_SIZE bytes), shared by all its
+ * communicators and devices. Each block is registered with CUDA once by its
+ * owner, and once by each process mapping it. Blocks are released when the
+ * last connector using them is freed. */
+struct shmArenaBlock {
+  uint64_t pidHash; // Owner
+  int id;
+  size_t size;
+  size_t used;      // Owned blocks only
+  int refCount;
+  char* hostPtr;
+  char* devPtr;
+  struct shmArenaBlock* next;
+};
+
+static pthread_mutex_t shmArenaLock = PTHREAD_MUTEX_INITIALIZER;
+static struct shmArenaBlock* shmArenaOwned = NULL;
+static struct shmArenaBlock* shmArenaMapped = NULL;
+static int shmArenaNextId = 0;
+
+static void shmArenaName(char* shmName, uint64_t pidHash, int id) {
+  sprintf(shmName, "nccl-shm-arena-%lx-%d", pidHash, id);
+}
+
+static ncclResult_t shmArenaMap(struct shmArenaBlock* block, int create) {
+  char shmName[MAX_SHM_NAME_LEN];
+  shmArenaName(shmName, block->pidHash, block->id);
+  int fd = -1;
+  void* ptr = MAP_FAILED;
+  NCCLCHECK(shmSetup(shmName, block->size, &fd, &ptr, create));
+  // Portable : the block serves the connectors of all devices
+  cudaError_t err = cudaHostRegister(ptr, block->size, cudaHostRegisterMapped|cudaHostRegisterPortable);
+  if (err == cudaSuccess) err = cudaHostGetDevicePointer((void**)&block->devPtr, ptr, 0);
+  if (err != cudaSuccess) {
+    WARN("Cuda failure '%s' registering shared memory segment %s (size %ld)", cudaGetErrorString(err), shmName, block->size);
+    munmap(ptr, block->size);
+    if (create) shm_unlink(shmName);
+    return ncclUnhandledCudaError;
+  }
+  block->hostPtr = (char*)ptr;
+  TRACE(NCCL_SHM,"%s arena block %s size %ld", create ? "Created" : "Mapped", shmName, block->size);
+  return ncclSuccess;
+}
+
+// Allocate size bytes from the arena of this process
+static ncclResult_t shmArenaAlloc(uint64_t pidHash, size_t size, struct shmArenaBlock** blockPtr, size_t* offset) {
+  ALIGN_SIZE(size, MEM_ALIGN);
+  ncclResult_t ret = ncclSuccess;
+  pthread_mutex_lock(&shmArenaLock);
+  struct shmArenaBlock* block = shmArenaOwned;
+  while (block && block->size - block->used < size) block = block->next;
+  if (block == NULL) {
+    NCCLCHECKGOTO(ncclCalloc(&block, 1), ret, exit);
+    block->pidHash = pidHash;
+    block->id = shmArenaNextId++;
+    block->size = std::max((size_t)ncclParamShmArenaBlockSize(), size);
+    ALIGN_SIZE(block->size, MEM_ALIGN);
+    if ((ret = shmArenaMap(block, 1)) != ncclSuccess) {
+      free(block);
+      goto exit;
+    }
+    INFO(NCCL_INIT|NCCL_SHM, "Allocated shared memory arena block %d of %ld bytes", block->id, block->size);
+    block->next = shmArenaOwned;
+    shmArenaOwned = block;
+  }
+  *offset = block->used;
+  block->used += size;
+  block->refCount++;
+  *blockPtr = block;
+exit:
+  pthread_mutex_unlock(&shmArenaLock);
+  return ret;
+}
+
+// Map a block of the arena of another process, once per process
+static ncclResult_t shmArenaAttach(uint64_t pidHash, int id, size_t size, struct shmArenaBlock** blockPtr) {
+  ncclResult_t ret = ncclSuccess;
+  pthread_mutex_lock(&shmArenaLock);
+  struct shmArenaBlock* block = shmArenaMapped;
+  while (block && (block->pidHash != pidHash || block->id != id)) block = block->next;
+  if (block == NULL) {
+    NCCLCHECKGOTO(ncclCalloc(&block, 1), ret, exit);
+    block->pidHash = pidHash;
+    block->id = id;
+    block->size = size;
+    if ((ret = shmArenaMap(block, 0)) != ncclSuccess) {
+      free(block);
+      goto exit;
+    }
+    block->next = shmArenaMapped;
+    shmArenaMapped = block;
+  }
+  block->refCount++;
+  *blockPtr = block;
+exit:
+  pthread_mutex_unlock(&shmArenaLock);
+  return ret;
+}
+
+static ncclResult_t shmArenaRelease(struct shmArenaBlock* block) {
+  if (block == NULL) return ncclSuccess;
+  ncclResult_t ret = ncclSuccess;
+  pthread_mutex_lock(&shmArenaLock);
+  if (--block->refCount == 0) {
+    struct shmArenaBlock** list = &shmArenaMapped;
+    while (*list && *list != block) list = &(*list)->next;
+    if (*list == NULL) {
+      list = &shmArenaOwned;
+      while (*list != block) list = &(*list)->next;
+      // Peers may not all have mapped the block before the owner is done
+      // with it, so only the owner unlinks it.
+      char shmName[MAX_SHM_NAME_LEN];
+      shmArenaName(shmName, block->pidHash, block->id);
+      shm_unlink(shmName);
+    }
+    *list = block->next;
+    ret = shmClose(block->hostPtr, block->devPtr, block->size);
+    free(block);
+  }
+  pthread_mutex_unlock(&shmArenaLock);
+  return ret;
+}
+
+// Arena counterparts of the setup and connect of a connector's segments
+static ncclResult_t shmArenaSetup(struct ncclPeerInfo* myInfo, struct shmConnectInfo* info, struct shmArenaBlock** block, void** hostMem, void** devHostMem) {
+  NCCLCHECK(shmArenaAlloc(myInfo->pidHash, info->shmSize, block, &info->arenaOffset));
+  info->arenaBlock = (*block)->id;
+  info->arenaBlockSize = (*block)->size;
+  *hostMem = (*block)->hostPtr + info->arenaOffset;
+  *devHostMem = (*block)->devPtr + info->arenaOffset;
+  return ncclSuccess;
+}
+
+static ncclResult_t shmArenaConnect(struct shmConnectInfo* info, struct shmArenaBlock** block, void** remHostMem, void** devRemHostMem) {
+  NCCLCHECK(shmArenaAttach(info->pidHash, info->arenaBlock, info->arenaBlockSize, block));
+  *remHostMem = (*block)->hostPtr + info->arenaOffset;
+  *devRemHostMem = (*block)->devPtr + info->arenaOffset;
+  return ncclSuccess;
+}
+
 /* Create and return connect structures for this peer to connect to me */
 ncclResult_t shmSendSetup(struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peerInfo, struct ncclConnect* connectInfo, struct ncclConnector* send, int buffSize, int channelId) {
 
@@ -143,11 +307,15 @@ ncclResult_t shmSendSetup(struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peer
   info.sendRank = myInfo->rank;
   info.recvRank = peerInfo->rank;
 
-  char shmName[MAX_SHM_NAME_LEN];
-  sprintf(shmName, "nccl-shm-send-%lx-%d-%d-%d", info.pidHash, info.id, info.sendRank, info.recvRank);
   info.shmSize = resources->shmSize = sizeof(struct ncclSendMem);
-  TRACE(NCCL_SHM,"Open shmName %s shmSize %d", shmName, info.shmSize);
-  NCCLCHECK(shmOpen(shmName, resources->shmSize, (void**)&resources->hostMem, (void**)&resources->devHostMem, 1));
+  if (ncclParamShmArena()) {
+    NCCLCHECK(shmArenaSetup(myInfo, &info, &resources->block, (void**)&resources->hostMem, (void**)&resources->devHostMem));
+  } else {
+    char shmName[MAX_SHM_NAME_LEN];
+    sprintf(shmName, "nccl-shm-send-%lx-%d-%d-%d", info.pidHash, info.id, info.sendRank, info.recvRank);
+    TRACE(NCCL_SHM,"Open shmName %s shmSize %d", shmName, info.shmSize);
+    NCCLCHECK(shmOpen(shmName, resources->shmSize, (void**)&resources->hostMem, (void**)&resources->devHostMem, 1, shmNumaId()));
+  }
 
   INFO(NCCL_INIT|NCCL_SHM,"Ring %02d : %d[%d] -> %d[%d] via direct shared memory", channelId, myInfo->rank, myInfo->cudaDev, peerInfo->rank, peerInfo->cudaDev);
   static_assert(sizeof(struct shmConnectInfo) <= sizeof(struct ncclConnect), "shm Connect Recv Info is too big");
@@ -166,11 +334,15 @@ ncclResult_t shmRecvSetup(struct ncclPeerInfo* myInfo, struct ncclPeerInfo* peer
   info.sendRank = peerInfo->rank;
   info.recvRank = myInfo->rank;
 
-  char shmName[MAX_SHM_NAME_LEN];
-  sprintf(shmName, "nccl-shm-recv-%lx-%d-%d-%d", info.pidHash, info.id, info.sendRank, info.recvRank);
   info.shmSize = resources->shmSize = offsetof(struct ncclRecvMem, buff)+buffSize;
-  TRACE(NCCL_SHM,"Open shmName %s shmSize %d", shmName, info.shmSize);
-  NCCLCHECK(shmOpen(shmName, resources->shmSize, (void**)&resources->hostMem, (void**)&resources->devHostMem, 1));
+  if (ncclParamShmArena()) {
+    NCCLCHECK(shmArenaSetup(myInfo, &info, &resources->block, (void**)&resources->hostMem, (void**)&resources->devHostMem));
+  } else {
+    char shmName[MAX_SHM_NAME_LEN];
+    sprintf(shmName, "nccl-shm-recv-%lx-%d-%d-%d", info.pidHash, info.id, info.sendRank, info.recvRank);
+    TRACE(NCCL_SHM,"Open shmName %s shmSize %d", shmName, info.shmSize);
+    NCCLCHECK(shmOpen(shmName, resources->shmSize, (void**)&resources->hostMem, (void**)&resources->devHostMem, 1, shmNumaId()));
+  }
 
   static_assert(sizeof(struct shmConnectInfo) <= sizeof(struct ncclConnect), "shm Connect Send Info is too big");
   memcpy(connectInfo, &info, sizeof(struct shmConnectInfo));
@@ -183,13 +355,17 @@ ncclResult_t shmSendConnect(struct ncclConnect* connectInfo, struct ncclConnecto
   struct shmConnectInfo* info = (struct shmConnectInfo*)connectInfo;
   struct shmSendResources* resources = (struct shmSendResources*)send->transportResources;
 
-  char shmName[MAX_SHM_NAME_LEN];
-  sprintf(shmName, "nccl-shm-recv-%lx-%d-%d-%d", info->pidHash, info->id, info->sendRank, info->recvRank);
   resources->remShmSize = info->shmSize;
-  TRACE(NCCL_SHM,"Open shmName %s shmSize %d", shmName, info->shmSize);
-  NCCLCHECK(shmOpen(shmName, resources->remShmSize, (void**)&resources->remHostMem, (void**)&resources->devRemHostMem, 0));
-  // Remove the file to ensure proper clean-up
-  NCCLCHECK(shmUnlink(shmName));
+  if (ncclParamShmArena()) {
+    NCCLCHECK(shmArenaConnect(info, &resources->remBlock, (void**)&resources->remHostMem, (void**)&resources->devRemHostMem));
+  } else {
+    char shmName[MAX_SHM_NAME_LEN];
+    sprintf(shmName, "nccl-shm-recv-%lx-%d-%d-%d", info->pidHash, info->id, info->sendRank, info->recvRank);
+    TRACE(NCCL_SHM,"Open shmName %s shmSize %d", shmName, info->shmSize);
+    NCCLCHECK(shmOpen(shmName, resources->remShmSize, (void**)&resources->remHostMem, (void**)&resources->devRemHostMem, 0));
+    // Remove the file to ensure proper clean-up
+    NCCLCHECK(shmUnlink(shmName));
+  }
 
   send->transportResources = resources;
   send->conn.buff = resources->devRemHostMem->buff;
@@ -207,17 +383,22 @@ ncclResult_t shmRecvConnect(struct ncclConnect* connectInfo, struct ncclConnecto
   struct shmRecvResources* resources = (struct shmRecvResources*)recv->transportResources;
   struct shmConnectInfo* info = (struct shmConnectInfo*)connectInfo;
 
-  char shmName[MAX_SHM_NAME_LEN];
-  sprintf(shmName, "nccl-shm-send-%lx-%d-%d-%d", info->pidHash, info->id, info->sendRank, info->recvRank);
   resources->remShmSize = info->shmSize;
-  TRACE(NCCL_SHM,"Open shmName %s shmSize %d", shmName, info->shmSize);
-  NCCLCHECK(shmOpen(shmName, resources->remShmSize, (void**)&resources->remHostMem, (void**)&resources->devRemHostMem, 0));
-  NCCLCHECK(shmUnlink(shmName));
+  if (ncclParamShmArena()) {
+    NCCLCHECK(shmArenaConnect(info, &resources->remBlock, (void**)&resources->remHostMem, (void**)&resources->devRemHostMem));
+  } else {
+    char shmName[MAX_SHM_NAME_LEN];
+    sprintf(shmName, "nccl-shm-send-%lx-%d-%d-%d", info->pidHash, info->id, info->sendRank, info->recvRank);
+    TRACE(NCCL_SHM,"Open shmName %s shmSize %d", shmName, info->shmSize);
+    NCCLCHECK(shmOpen(shmName, resources->remShmSize, (void**)&resources->remHostMem, (void**)&resources->devRemHostMem, 0));
+    NCCLCHECK(shmUnlink(shmName));
+  }
   recv->conn.head = &resources->devRemHostMem->head;
   recv->conn.opCountRem = &resources->devRemHostMem->opCount;
 
   recv->conn.buff = resources->devHostMem->buff;
   recv->conn.llBuff = resources->devHostMem->llBuff;
+  recv->conn.llHostMem = 1;
   recv->conn.tail = &resources->devHostMem->tail;
   recv->conn.opCountLoc = &resources->devHostMem->opCount;
   return ncclSuccess;
@@ -225,16 +406,26 @@ ncclResult_t shmRecvConnect(struct ncclConnect* connectInfo, struct ncclConnecto
 
 ncclResult_t shmSendFree(void* transportResources) {
   struct shmSendResources* resources = (struct shmSendResources*)transportResources;
-  NCCLCHECK(shmClose(resources->hostMem, resources->devHostMem, resources->shmSize));
-  NCCLCHECK(shmClose(resources->remHostMem, resources->devRemHostMem, resources->remShmSize));
+  if (resources->block) {
+    NCCLCHECK(shmArenaRelease(resources->block));
+    NCCLCHECK(shmArenaRelease(resources->remBlock));
+  } else {
+    NCCLCHECK(shmClose(resources->hostMem, resources->devHostMem, resources->shmSize));
+    NCCLCHECK(shmClose(resources->remHostMem, resources->devRemHostMem, resources->remShmSize));
+  }
   free(resources);
   return ncclSuccess;
 }
 
 ncclResult_t shmRecvFree(void* transportResources) {
   struct shmRecvResources* resources = (struct shmRecvResources*)transportResources;
-  NCCLCHECK(shmClose(resources->hostMem, resources->devHostMem, resources->shmSize));
-  NCCLCHECK(shmClose(resources->remHostMem, resources->devRemHostMem, resources->remShmSize));
+  if (resources->block) {
+    NCCLCHECK(shmArenaRelease(resources->block));
+    NCCLCHECK(shmArenaRelease(resources->remBlock));
+  } else {
+    NCCLCHECK(shmClose(resources->hostMem, resources->devHostMem, resources->shmSize));
+    NCCLCHECK(shmClose(resources->remHostMem, resources->devRemHostMem, resources->remShmSize));
+  }
   free(resources);
   return ncclSuccess;
 }